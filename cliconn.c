@@ -6,18 +6,94 @@
 #include <rpc/des_crypt.h>
 #include "vnclog.h"
 #include "sockstream.h"
+#include "encsel.h"
+#include "stats.h"
+#include "trace.h"
 #include <sys/time.h>
+#include <arpa/inet.h>
+#include <time.h>
 #include <zlib.h>
 
 
+/* Maximum time of presenting deferral when the viewer is behind the server
+ */
+enum { PRESENT_DELAY_MAX_US = 500000 };
+
+/* Cursor sizes sent by server beyond that are rejected
+ */
+enum { CURSOR_SIZE_MAX = 256 };
+
+/* Security types and VeNCrypt subtypes
+ */
+enum {
+    SECTYPE_NONE = 1,
+    SECTYPE_VNCAUTH = 2,
+    SECTYPE_VENCRYPT = 19,
+    VENCRYPT_TLSNONE = 257,
+    VENCRYPT_TLSVNC = 258,
+    VENCRYPT_X509NONE = 260,
+    VENCRYPT_X509VNC = 261
+};
+
+/* TLS settings of all connections, see cliconn_setTLS
+ */
+static int gIsTLSRequired, gIsAnonTLSAllowed;
+static const char *gTLSCaFile;
+static SockIOBackend gIOBackend = SOCK_IO_READV;
+static int gLowLatencySpinUs = -1;
+static int gIsPasswordPrompt = 1;
+static int gRecvTimeoutMs;
+
 struct ClientConnection {
     SockStream *strm;
+    char *host;                 // NULL when not connected to host
+    char passwd[8];             // kept for reconnecting
+    int hasPasswd;
     z_stream zstrm;
     int width;
     int height;
     char *name;
+    PixelFormat pixelFormat;
+    unsigned bytespp;
+    int enableHextile, enableZRLE, enableLocalCursor;
+    EncodingSelector *encsel;   // NULL when adaptive encoding is off
+    VncStats stats;
+    LatencyProbe *probe;        // NULL when latency is not measured
+    unsigned refreshIntervalUs;
+    unsigned long long lastPresentTm;
+    int isFullUpdateNeeded;
+    int isSetDesktopSizeSupported;
+    unsigned screenId, screenFlags;
+    int wantWidth, wantHeight;  // desktop size wanted by user
+    int reqWidth, reqHeight;    // last requested desktop size
+    // buffers reused by the decoders, not leaked when a read fails
+    unsigned char *comprBuf, *cursorBuf;
+    unsigned comprBufSize, cursorBufSize;
+    // trace events of the update not ended yet, ended on close then
+    int isUpdateTraced, isRectTraced;
 };
 
+static unsigned long long curTimeUs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned long long cpuTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static VncVersion exchangeVersion(CliConn *conn)
 {
     static const char VER33[] = "RFB 003.003\n";
@@ -34,18 +110,102 @@ static VncVersion exchangeVersion(CliConn *conn)
     else if( !memcmp(buf, VER38, 12) )
         vncVer = VNCVER_3_8;
     else
-        log_fatal("unsupported server version %.11s", buf);
+        sock_fail(conn->strm, "unsupported server version %.11s", buf);
     sock_write(conn->strm, buf, 12);
     sock_flush(conn->strm);
     return vncVer;
 }
 
+void cliconn_setTLS(int isRequired, int isAnonAllowed, const char *caFile)
+{
+    gIsTLSRequired = isRequired;
+    gIsAnonTLSAllowed = isAnonAllowed;
+    gTLSCaFile = caFile;
+}
+
+void cliconn_setIOBackend(SockIOBackend backend)
+{
+    gIOBackend = backend;
+}
+
+void cliconn_setLowLatency(int spinUs)
+{
+    gLowLatencySpinUs = spinUs;
+}
+
+void cliconn_setRecvTimeout(int timeoutMs)
+{
+    gRecvTimeoutMs = timeoutMs;
+}
+
+void cliconn_setPasswordPrompt(int isEnabled)
+{
+    gIsPasswordPrompt = isEnabled;
+}
+
+/* Negotiates VeNCrypt subtype and performs TLS handshake. Returns the
+ * security type to continue with inside the encrypted connection.
+ */
+static int exchangeVeNCrypt(CliConn *conn)
+{
+    // in order of preference: with server certificate first
+    static const unsigned subtypes[] = {
+        VENCRYPT_X509NONE, VENCRYPT_X509VNC, VENCRYPT_TLSNONE, VENCRYPT_TLSVNC
+    };
+    enum {
+        SUBTYPE_COUNT = sizeof(subtypes) / sizeof(subtypes[0]),
+        X509_SUBTYPE_COUNT = 2
+    };
+    int i, j, subtypeCnt, best = SUBTYPE_COUNT;
+    // anonymous TLS does not protect against man in the middle
+    int subtypeLimit = gIsTLSRequired && ! gIsAnonTLSAllowed ?
+        X509_SUBTYPE_COUNT : SUBTYPE_COUNT;
+
+    int major = sock_readU8(conn->strm);
+    int minor = sock_readU8(conn->strm);
+    if( major != 0 || minor < 2 )
+        sock_fail(conn->strm, "unsupported VeNCrypt version %d.%d", major,
+                minor);
+    sock_writeU8(conn->strm, 0);
+    sock_writeU8(conn->strm, 2);
+    sock_flush(conn->strm);
+    if( sock_readU8(conn->strm) != 0 )
+        sock_fail(conn->strm,
+                "VeNCrypt version 0.2 not accepted by server");
+    subtypeCnt = sock_readU8(conn->strm);
+    for(i = 0; i < subtypeCnt; ++i) {
+        unsigned subtype = sock_readU32(conn->strm);
+        log_debug("  VeNCrypt subtype %u", subtype);
+        for(j = 0; j < best && j < subtypeLimit; ++j) {
+            if( subtypes[j] == subtype )
+                best = j;
+        }
+    }
+    if( best == SUBTYPE_COUNT )
+        sock_fail(conn->strm, subtypeLimit < SUBTYPE_COUNT ?
+                "no VeNCrypt subtype with server certificate" :
+                "no supported VeNCrypt subtype");
+    sock_writeU32(conn->strm, subtypes[best]);
+    sock_flush(conn->strm);
+    if( sock_readU8(conn->strm) != 1 )
+        sock_fail(conn->strm, "VeNCrypt subtype not accepted by server");
+    int isAnonymous = subtypes[best] == VENCRYPT_TLSNONE ||
+        subtypes[best] == VENCRYPT_TLSVNC;
+    if( isAnonymous )
+        log_warn("anonymous TLS, the server identity is not verified");
+    // without -tls the encryption is opportunistic: an unverified server
+    // is no worse than anonymous TLS or no encryption at all
+    sock_startTLS(conn->strm, isAnonymous, gIsTLSRequired, gTLSCaFile);
+    return subtypes[best] == VENCRYPT_X509NONE ||
+        subtypes[best] == VENCRYPT_TLSNONE ? SECTYPE_NONE : SECTYPE_VNCAUTH;
+}
+
 static void exchangeAuth(CliConn *conn, const char *passwdFile,
         VncVersion vncVer)
 {
     static char pfileKey[] = "\350J\326`\304r\032\340";
     char buf[1024], pass[8];
-    int i, c, len, selectedAuthNo = 0;
+    int i, c, len, selectedAuthNo = 0, isVeNCrypt = 0;
 
     if( vncVer == VNCVER_3_3 ) {
         selectedAuthNo = sock_readU32(conn->strm);
@@ -55,9 +215,17 @@ static void exchangeAuth(CliConn *conn, const char *passwdFile,
         for( ; authCnt > 0; --authCnt ) {
             int authNo = sock_readU8(conn->strm);
             log_debug("  %d", authNo);
-            if( selectedAuthNo == 0 || authNo < selectedAuthNo )
+            if( authNo == SECTYPE_VENCRYPT )
+                isVeNCrypt = 1;
+            else if( selectedAuthNo == 0 || authNo < selectedAuthNo )
                 selectedAuthNo = authNo;
         }
+        // encryption is preferred when offered
+        if( isVeNCrypt ) {
+            sock_writeU8(conn->strm, SECTYPE_VENCRYPT);
+            sock_flush(conn->strm);
+            selectedAuthNo = exchangeVeNCrypt(conn);
+        }
     }
     if( selectedAuthNo == 0 ) {
         len = sock_readU32(conn->strm);
@@ -65,15 +233,20 @@ static void exchangeAuth(CliConn *conn, const char *passwdFile,
             len = sizeof(buf) - 1;
         sock_read(conn->strm, buf, len);
         buf[len] = '\0';
-        log_fatal("server error: %s", buf);
+        sock_fail(conn->strm, "server error: %s", buf);
     }
-    if( selectedAuthNo == 1 ) {
-        if( vncVer != VNCVER_3_3 ) {
-            sock_writeU8(conn->strm, 1);
+    if( gIsTLSRequired && ! isVeNCrypt )
+        sock_fail(conn->strm,
+                "server does not offer encryption (VeNCrypt)");
+    if( selectedAuthNo == SECTYPE_NONE ) {
+        if( vncVer != VNCVER_3_3 && ! isVeNCrypt ) {
+            sock_writeU8(conn->strm, SECTYPE_NONE);
             sock_flush(conn->strm);
         }
-    }else if( selectedAuthNo == 2 ) {
-        if( passwdFile != NULL ) {
+    }else if( selectedAuthNo == SECTYPE_VNCAUTH ) {
+        if( conn->hasPasswd )
+            memcpy(pass, conn->passwd, 8);
+        else if( passwdFile != NULL ) {
             FILE *fp = fopen(passwdFile, "r");
             if( fp == NULL )
                 log_fatal_errno("unable to open password file");
@@ -82,14 +255,18 @@ static void exchangeAuth(CliConn *conn, const char *passwdFile,
             fclose(fp);
             if(ecb_crypt(pfileKey, pass, 8, DES_DECRYPT|DES_SW) != DESERR_NONE)
                 log_fatal("ecb_crypt error");
+        }else if( ! gIsPasswordPrompt ) {
+            sock_fail(conn->strm, "password required, use -passwd option");
         }else{
             char *p = getpass("Server password: ");
             if( p == NULL )
                 exit(1);
             strncpy(pass, p, 8);
         }
-        if( vncVer != VNCVER_3_3 ) {
-            sock_writeU8(conn->strm, 2);
+        memcpy(conn->passwd, pass, 8);
+        conn->hasPasswd = 1;
+        if( vncVer != VNCVER_3_3 && ! isVeNCrypt ) {
+            sock_writeU8(conn->strm, SECTYPE_VNCAUTH);
             sock_flush(conn->strm);
         }
         sock_read(conn->strm, buf, 16);
@@ -104,15 +281,17 @@ static void exchangeAuth(CliConn *conn, const char *passwdFile,
         sock_write(conn->strm, buf, 16);
         sock_flush(conn->strm);
     }else
-        log_fatal("unsupported authentication type");
-    if( selectedAuthNo != 1 || vncVer == VNCVER_3_8 ) {
+        sock_fail(conn->strm, "unsupported authentication type");
+    // VeNCrypt sends the result also for None, unlike RFB 3.7
+    if( selectedAuthNo != SECTYPE_NONE || vncVer == VNCVER_3_8 || isVeNCrypt )
+    {
         if( sock_readU32(conn->strm) != 0 ) {     // authentication result
             if( vncVer == VNCVER_3_8 ) {
                 len = sock_readU32(conn->strm);
                 sock_read(conn->strm, buf, len);
-                log_fatal("%.*s", len, buf);
+                sock_fail(conn->strm, "%.*s", len, buf);
             }else
-                log_fatal("Authentication failed.");
+                sock_fail(conn->strm, "Authentication failed.");
         }
     }
 }
@@ -145,38 +324,208 @@ static void readPixelFormat(CliConn *conn, PixelFormat *pixelFormat)
     sock_discard(conn->strm, 3);     // padding
 }
 
-CliConn *cliconn_open(const char *vncHost, const char *passwdFile)
+/* Creates the connection with default settings
+ */
+static CliConn *createConn(SockStream *strm)
 {
-    PixelFormat pixelFormat;
-    int toRd, initRes;
+    int initRes;
 
     CliConn *conn = malloc(sizeof(CliConn));
-    conn->strm = sock_connectVNCHost(vncHost);
-
+    conn->strm = strm;
+    if( gRecvTimeoutMs > 0 )
+        sock_setRecvTimeout(strm, gRecvTimeoutMs);
+    conn->host = NULL;
+    conn->hasPasswd = 0;
+    conn->name = NULL;
     conn->zstrm.zalloc = NULL;
     conn->zstrm.zfree = NULL;
     conn->zstrm.opaque = NULL;
     if( (initRes = inflateInit(&conn->zstrm)) != Z_OK )
         log_fatal("inflateInit error=%d", initRes);
+    conn->refreshIntervalUs = 1000000 / 60;
+    conn->lastPresentTm = 0;
+    conn->isFullUpdateNeeded = 0;
+    conn->isSetDesktopSizeSupported = 0;
+    conn->screenId = conn->screenFlags = 0;
+    conn->wantWidth = conn->wantHeight = 0;
+    conn->reqWidth = conn->reqHeight = 0;
+    conn->enableHextile = conn->enableZRLE = conn->enableLocalCursor = 0;
+    conn->encsel = NULL;
+    conn->probe = NULL;
+    memset(&conn->stats, 0, sizeof(conn->stats));
+    conn->comprBuf = conn->cursorBuf = NULL;
+    conn->comprBufSize = conn->cursorBufSize = 0;
+    conn->isUpdateTraced = conn->isRectTraced = 0;
+    return conn;
+}
+
+/* Performs the handshake up to ServerInit
+ */
+static void handshake(CliConn *conn, const char *passwdFile)
+{
+    int toRd;
+
     VncVersion vncVer = exchangeVersion(conn);
     exchangeAuth(conn, passwdFile, vncVer);
     sock_writeU8(conn->strm, 0); // shared flag
     sock_flush(conn->strm);
+    sock_setIOBackend(conn->strm, gIOBackend);
+    if( gLowLatencySpinUs >= 0 )
+        sock_setLowLatency(conn->strm, gLowLatencySpinUs);
     // read ServerInit
     conn->width = sock_readU16(conn->strm);
     conn->height = sock_readU16(conn->strm);
-    readPixelFormat(conn, &pixelFormat);
+    readPixelFormat(conn, &conn->pixelFormat);
+    conn->bytespp = (conn->pixelFormat.bitsPerPixel + 7) / 8;
     log_info("desktop size: %dx%dx%d", conn->width, conn->height,
-            pixelFormat.bitsPerPixel);
+            conn->pixelFormat.bitsPerPixel);
     // name-length
     toRd = sock_readU32(conn->strm);
     conn->name = malloc(toRd+1);
     // name-string
     sock_read(conn->strm, conn->name, toRd);
     conn->name[toRd] = '\0';
+}
+
+CliConn *cliconn_open(const char *vncHost, const char *passwdFile)
+{
+    CliConn *conn = createConn(sock_connectVNCHost(vncHost));
+
+    conn->host = strdup(vncHost);
+    handshake(conn, passwdFile);
+    return conn;
+}
+
+/* Performs the handshake. Returns NULL and closes the connection on error.
+ */
+static CliConn *tryHandshake(CliConn *conn, const char *passwdFile)
+{
+    jmp_buf errorJump;
+
+    if( setjmp(errorJump) != 0 ) {
+        cliconn_close(conn);
+        return NULL;
+    }
+    sock_setErrorJump(conn->strm, &errorJump);
+    handshake(conn, passwdFile);
+    sock_setErrorJump(conn->strm, NULL);
+    return conn;
+}
+
+CliConn *cliconn_tryOpen(const char *vncHost, const char *passwdFile)
+{
+    SockStream *strm = sock_tryConnectVNCHost(vncHost);
+
+    if( strm == NULL )
+        return NULL;
+    CliConn *conn = createConn(strm);
+    conn->host = strdup(vncHost);
+    return tryHandshake(conn, passwdFile);
+}
+
+CliConn *cliconn_tryReopen(const CliConn *oldConn)
+{
+    SockStream *strm = sock_tryConnectVNCHost(oldConn->host);
+
+    if( strm == NULL )
+        return NULL;
+    CliConn *conn = createConn(strm);
+    conn->host = strdup(oldConn->host);
+    memcpy(conn->passwd, oldConn->passwd, 8);
+    conn->hasPasswd = oldConn->hasPasswd;
+    return tryHandshake(conn, NULL);
+}
+
+void cliconn_setErrorJump(CliConn *conn, jmp_buf *errorJump)
+{
+    sock_setErrorJump(conn->strm, errorJump);
+}
+
+/* Recording header: desktop size and pixel format, as 32-bit numbers
+ * in network byte order
+ */
+enum { RECORDING_HEADER_LEN = 12 };
+
+void cliconn_startRecording(CliConn *conn, const char *fileName)
+{
+    uint32_t header[RECORDING_HEADER_LEN];
+    const PixelFormat *pf = &conn->pixelFormat;
+
+    header[0] = htonl(conn->width);
+    header[1] = htonl(conn->height);
+    header[2] = htonl(pf->bitsPerPixel);
+    header[3] = htonl(pf->depth);
+    header[4] = htonl(pf->bigEndian);
+    header[5] = htonl(pf->trueColor);
+    header[6] = htonl(pf->maxRed);
+    header[7] = htonl(pf->maxGreen);
+    header[8] = htonl(pf->maxBlue);
+    header[9] = htonl(pf->shiftRed);
+    header[10] = htonl(pf->shiftGreen);
+    header[11] = htonl(pf->shiftBlue);
+    sock_startRecording(conn->strm, fileName, header, sizeof(header));
+    log_info("recording session to %s", fileName);
+}
+
+CliConn *cliconn_openReplay(const char *fileName, int isRealTime)
+{
+    uint32_t header[RECORDING_HEADER_LEN];
+
+    CliConn *conn = createConn(sock_openReplay(fileName, header,
+                sizeof(header), isRealTime));
+    PixelFormat *pf = &conn->pixelFormat;
+    conn->width = ntohl(header[0]);
+    conn->height = ntohl(header[1]);
+    pf->bitsPerPixel = ntohl(header[2]);
+    pf->depth = ntohl(header[3]);
+    pf->bigEndian = ntohl(header[4]);
+    pf->trueColor = ntohl(header[5]);
+    pf->maxRed = ntohl(header[6]);
+    pf->maxGreen = ntohl(header[7]);
+    pf->maxBlue = ntohl(header[8]);
+    pf->shiftRed = ntohl(header[9]);
+    pf->shiftGreen = ntohl(header[10]);
+    pf->shiftBlue = ntohl(header[11]);
+    conn->bytespp = (pf->bitsPerPixel + 7) / 8;
+    conn->name = strdup(fileName);
+    log_info("replaying %s: desktop size %dx%dx%d", fileName, conn->width,
+            conn->height, pf->bitsPerPixel);
     return conn;
 }
 
+CliConn *cliconn_openStream(SockStream *strm, int width, int height,
+        const PixelFormat *pixelFormat)
+{
+    CliConn *conn = createConn(strm);
+
+    conn->width = width;
+    conn->height = height;
+    conn->pixelFormat = *pixelFormat;
+    conn->bytespp = (pixelFormat->bitsPerPixel + 7) / 8;
+    conn->name = strdup("stream");
+    return conn;
+}
+
+int cliconn_isReplayDone(CliConn *conn)
+{
+    return ! sock_isDataAvail(conn->strm);
+}
+
+int cliconn_getFd(const CliConn *conn)
+{
+    return sock_fd(conn->strm);
+}
+
+int cliconn_isDataQueued(const CliConn *conn)
+{
+    return sock_isDataQueued(conn->strm);
+}
+
+int cliconn_isReadReady(const CliConn *conn)
+{
+    return sock_isReadReady(conn->strm);
+}
+
 int cliconn_getWidth(const CliConn *conn)
 {
     return conn->width;
@@ -192,28 +541,86 @@ const char *cliconn_getName(const CliConn *conn)
     return conn->name;
 }
 
-void cliconn_setEncodings(CliConn *conn, int enableHextile,
-        int enableZRLE)
+void cliconn_getPixelFormat(const CliConn *conn, PixelFormat *pixelFormat)
+{
+    *pixelFormat = conn->pixelFormat;
+}
+
+void cliconn_setRefreshRate(CliConn *conn, int refreshRate)
+{
+    conn->refreshIntervalUs = 1000000 / refreshRate;
+}
+
+static void sendEncodings(CliConn *conn)
 {
-    int encodingCount = 3;
+    static const int adaptiveEncodings[] = {
+        0,      // Raw encoding
+        5,      // Hextile encoding
+        16      // ZRLE encoding
+    };
+    int encodings[16], encodingCount = 0, i;
 
-    if( enableHextile )
-        ++encodingCount;
-    if( enableZRLE )
-        ++encodingCount;
+    if( conn->encsel != NULL ) {
+        int preferred = encsel_getPreferred(conn->encsel);
+        encodings[encodingCount++] = preferred;
+        encodings[encodingCount++] = 1;     // CopyRect encoding
+        for(i = 0; i < sizeof(adaptiveEncodings) / sizeof(int); ++i) {
+            int enc = adaptiveEncodings[i];
+            if( enc != preferred && (enc == 0 ||
+                        (enc == 5 && conn->enableHextile) ||
+                        (enc == 16 && conn->enableZRLE)) )
+                encodings[encodingCount++] = enc;
+        }
+        encodings[encodingCount++] = 2;     // RRE encoding
+        // CompressLevel pseudo-encoding
+        encodings[encodingCount++] =
+            -256 + encsel_getCompressLevel(conn->encsel);
+    }else{
+        encodings[encodingCount++] = 0;     // Raw encoding
+        encodings[encodingCount++] = 1;     // CopyRect encoding
+        encodings[encodingCount++] = 2;     // RRE encoding
+        if( conn->enableHextile )
+            encodings[encodingCount++] = 5;     // Hextile encoding
+        if( conn->enableZRLE )
+            encodings[encodingCount++] = 16;    // ZRLE encoding
+    }
+    if( conn->enableLocalCursor ) {
+        encodings[encodingCount++] = -239;  // Cursor pseudo-encoding
+        encodings[encodingCount++] = -240;  // XCursor pseudo-encoding
+    }
+    encodings[encodingCount++] = -223;  // DesktopSize pseudo-encoding
+    encodings[encodingCount++] = -308;  // ExtendedDesktopSize pseudo-encoding
     sock_writeU8(conn->strm, 2);    // message type
     sock_writeU8(conn->strm, 0);    // padding
     sock_writeU16(conn->strm, encodingCount);   // number of encodings
-    sock_writeU32(conn->strm, 0);   // Raw encoding
-    sock_writeU32(conn->strm, 1);   // CopyRect encoding
-    sock_writeU32(conn->strm, 2);   // RRE encoding
-    if( enableHextile )
-        sock_writeU32(conn->strm, 5);   // Hextile encoding
-    if( enableZRLE )
-        sock_writeU32(conn->strm, 16);   // ZRLE encoding
+    for(i = 0; i < encodingCount; ++i)
+        sock_writeU32(conn->strm, encodings[i]);
     sock_flush(conn->strm);
 }
 
+void cliconn_setEncodings(CliConn *conn, int enableHextile,
+        int enableZRLE, int enableLocalCursor)
+{
+    conn->enableHextile = enableHextile;
+    conn->enableZRLE = enableZRLE;
+    conn->enableLocalCursor = enableLocalCursor;
+    if( conn->encsel != NULL )
+        cliconn_setAdaptiveEncoding(conn);     // for the new encoding set
+    else
+        sendEncodings(conn);
+}
+
+void cliconn_setAdaptiveEncoding(CliConn *conn)
+{
+    int initial = conn->enableZRLE ? 16 : conn->enableHextile ? 5 : 0;
+
+    encsel_free(conn->encsel);
+    conn->encsel = encsel_create(initial, conn->enableHextile,
+            conn->enableZRLE);
+    encsel_setBytesPerPixel(conn->encsel, conn->bytespp);
+    sendEncodings(conn);
+}
+
 void cliconn_setPixelFormat(CliConn *conn, const PixelFormat *pixelFormat)
 {
     char padding[3] = "";
@@ -232,10 +639,18 @@ void cliconn_setPixelFormat(CliConn *conn, const PixelFormat *pixelFormat)
     sock_writeU8(conn->strm, pixelFormat->shiftBlue);
     sock_write(conn->strm, padding, 3);
     sock_flush(conn->strm);
+    conn->pixelFormat = *pixelFormat;
+    conn->bytespp = (pixelFormat->bitsPerPixel + 7) / 8;
+    if( conn->encsel != NULL )
+        encsel_setBytesPerPixel(conn->encsel, conn->bytespp);
 }
 
 void cliconn_sendFramebufferUpdateRequest(CliConn *conn, int incremental)
 {
+    if( conn->isFullUpdateNeeded ) {
+        incremental = 0;
+        conn->isFullUpdateNeeded = 0;
+    }
     sock_writeU8(conn->strm, 3);
     sock_writeU8(conn->strm, incremental);
     sock_writeU16(conn->strm, 0);
@@ -245,8 +660,38 @@ void cliconn_sendFramebufferUpdateRequest(CliConn *conn, int incremental)
     sock_flush(conn->strm);
 }
 
+void cliconn_sendSetDesktopSize(CliConn *conn, int width, int height)
+{
+    conn->wantWidth = width;
+    conn->wantHeight = height;
+    if( ! conn->isSetDesktopSizeSupported ) {
+        // the request is sent when server reports the extension support
+        log_debug("remote resize is not supported by server (yet)");
+        return;
+    }
+    if( width == conn->reqWidth && height == conn->reqHeight )
+        return;
+    log_debug("request desktop size %dx%d", width, height);
+    sock_writeU8(conn->strm, 251);
+    sock_writeU8(conn->strm, 0);    // padding
+    sock_writeU16(conn->strm, width);
+    sock_writeU16(conn->strm, height);
+    sock_writeU8(conn->strm, 1);    // number of screens
+    sock_writeU8(conn->strm, 0);    // padding
+    sock_writeU32(conn->strm, conn->screenId);
+    sock_writeU16(conn->strm, 0);   // x position
+    sock_writeU16(conn->strm, 0);   // y position
+    sock_writeU16(conn->strm, width);
+    sock_writeU16(conn->strm, height);
+    sock_writeU32(conn->strm, conn->screenFlags);
+    sock_flush(conn->strm);
+    conn->reqWidth = width;
+    conn->reqHeight = height;
+}
+
 void cliconn_sendKeyEvent(CliConn *conn, const VncKeyEvent *ev)
 {
+    trace_instant("keyEvent", "keysym", ev->keysym);
     sock_writeU8(conn->strm, 4);
     sock_writeU8(conn->strm, ev->isDown ? 1 : 0);
     sock_writeU16(conn->strm, 0);
@@ -256,6 +701,7 @@ void cliconn_sendKeyEvent(CliConn *conn, const VncKeyEvent *ev)
 
 void cliconn_sendPointerEvent(CliConn *conn, const VncPointerEvent *ev)
 {
+    trace_instant("pointerEvent", "buttons", ev->buttonMask);
     sock_writeU8(conn->strm, 5);
     sock_writeU8(conn->strm, ev->buttonMask);
     sock_writeU16(conn->strm, ev->x);
@@ -263,24 +709,180 @@ void cliconn_sendPointerEvent(CliConn *conn, const VncPointerEvent *ev)
     sock_flush(conn->strm);
 }
 
+/* Returns the buffer grown to at least given size
+ */
+static unsigned char *reserveBuf(unsigned char **buf, unsigned *bufSize,
+        unsigned size)
+{
+    if( size > *bufSize ) {
+        free(*buf);
+        *buf = malloc(size);
+        *bufSize = size;
+    }
+    return *buf;
+}
+
+static void decodeRichCursor(DisplayConnection *dispConn, CliConn *conn,
+        int hotX, int hotY, int width, int height)
+{
+    SockStream *strm = conn->strm;
+    int pixelsLen, maskLen;
+    char *buf;
+
+    if( width > CURSOR_SIZE_MAX || height > CURSOR_SIZE_MAX )
+        sock_fail(strm, "cursor too large: %dx%d", width, height);
+    pixelsLen = width * height * conn->bytespp;
+    maskLen = (width + 7) / 8 * height;
+    buf = (char*)reserveBuf(&conn->cursorBuf, &conn->cursorBufSize,
+            pixelsLen + maskLen);
+    sock_read(strm, buf, pixelsLen + maskLen);
+    clidisp_setCursor(dispConn, hotX, hotY, width, height, buf,
+            (unsigned char*)buf + pixelsLen);
+}
+
+static void decodeXCursor(DisplayConnection *dispConn, CliConn *conn,
+        int hotX, int hotY, int width, int height)
+{
+    SockStream *strm = conn->strm;
+    unsigned char colors[6], *buf = NULL;
+    int maskLen;
+
+    if( width > CURSOR_SIZE_MAX || height > CURSOR_SIZE_MAX )
+        sock_fail(strm, "cursor too large: %dx%d", width, height);
+    maskLen = (width + 7) / 8 * height;
+    if( width > 0 && height > 0 ) {
+        sock_read(strm, colors, 6);     // foreground and background RGB
+        buf = reserveBuf(&conn->cursorBuf, &conn->cursorBufSize,
+                2 * maskLen);
+        sock_read(strm, buf, 2 * maskLen);  // bitmap and mask
+    }
+    clidisp_setMonoCursor(dispConn, hotX, hotY, width, height, colors,
+            colors + 3, buf, buf + maskLen);
+}
+
+static void resizeDesktop(CliConn *conn, DisplayConnection *dispConn,
+        int width, int height)
+{
+    if( width != conn->width || height != conn->height ) {
+        conn->width = width;
+        conn->height = height;
+        clidisp_resize(dispConn, width, height);
+        // new areas are not covered by incremental updates
+        conn->isFullUpdateNeeded = 1;
+    }
+}
+
+static void decodeExtendedDesktopSize(CliConn *conn,
+        DisplayConnection *dispConn, int reason, int status,
+        int width, int height)
+{
+    int i, screenCount = sock_readU8(conn->strm);
+
+    sock_discard(conn->strm, 3);    // padding
+    for(i = 0; i < screenCount; ++i) {
+        unsigned id = sock_readU32(conn->strm);
+        sock_discard(conn->strm, 8);    // position and size
+        unsigned flags = sock_readU32(conn->strm);
+        if( i == 0 ) {
+            conn->screenId = id;
+            conn->screenFlags = flags;
+        }
+    }
+    if( reason == 1 && status != 0 ) {  // our request failed
+        log_warn("desktop resize to %dx%d failed, status=%d",
+                conn->reqWidth, conn->reqHeight, status);
+        return;
+    }
+    resizeDesktop(conn, dispConn, width, height);
+    if( ! conn->isSetDesktopSizeSupported ) {
+        conn->isSetDesktopSizeSupported = 1;
+        if( conn->wantWidth > 0 && (conn->wantWidth != width ||
+                    conn->wantHeight != height) )
+            cliconn_sendSetDesktopSize(conn, conn->wantWidth,
+                    conn->wantHeight);
+    }
+}
+
+/* Returns non-zero when display damage should be presented now: at least
+ * one refresh period elapsed since last present and the viewer is not
+ * behind the server. When more data is already queued on the socket,
+ * the present is deferred up to PRESENT_DELAY_MAX_US to catch up.
+ */
+static int isPresentDue(CliConn *conn, unsigned long long curTm)
+{
+    unsigned long long elapsed = curTm - conn->lastPresentTm;
+
+    if( elapsed < conn->refreshIntervalUs )
+        return 0;
+    return elapsed >= PRESENT_DELAY_MAX_US || !sock_isDataQueued(conn->strm);
+}
+
+static void presentDamage(CliConn *conn, DisplayConnection *dispConn,
+        unsigned long long curTm)
+{
+    unsigned long long begNs = monoTimeNs();
+
+    clidisp_flush(dispConn);
+    if( conn->probe != NULL )
+        latprobe_presented(conn->probe);
+    conn->lastPresentTm = curTm;
+    STAT_ADD(conn->stats.presents, 1);
+    STAT_ADD(conn->stats.presentNs, monoTimeNs() - begNs);
+}
+
 int cliconn_nextEvent(CliConn *conn, DisplayConnection *dispConn,
         DisplayEvent *displayEvent, int wait)
 {
-    int cliMsg = -1;
-    if( clidisp_nextEvent(dispConn, sock_isDataAvail(conn->strm),
-            sock_fd(conn->strm), displayEvent, wait) )
-    {
+    int cliMsg = -1, timeoutUs = wait ? -1 : 0;
+
+    if( clidisp_isDamaged(dispConn) ) {
+        unsigned long long curTm = curTimeUs();
+        if( isPresentDue(conn, curTm) ) {
+            presentDamage(conn, dispConn, curTm);
+        }else if( wait ) {
+            // wake up when the deferred present is due
+            unsigned long long elapsed = curTm - conn->lastPresentTm;
+            timeoutUs = (elapsed < conn->refreshIntervalUs ?
+                conn->refreshIntervalUs : PRESENT_DELAY_MAX_US) - elapsed;
+        }
+    }
+    if( conn->probe != NULL ) {
+        DisplayEvent probeEv;
+        while( latprobe_nextInput(conn->probe, dispConn, &probeEv) ) {
+            if( probeEv.evType == VET_KEY )
+                cliconn_sendKeyEvent(conn, &probeEv.kev);
+            else
+                cliconn_sendPointerEvent(conn, &probeEv.pev);
+        }
+        int probeTimeoutUs = latprobe_getTimeoutUs(conn->probe);
+        if( probeTimeoutUs >= 0 && (timeoutUs < 0 ||
+                    probeTimeoutUs < timeoutUs) )
+            timeoutUs = probeTimeoutUs;
+    }
+    int isCliDataAvail = sock_isDataAvail(conn->strm);
+    if( ! isCliDataAvail && timeoutUs != 0 )
+        isCliDataAvail = sock_spin(conn->strm);
+    trace_begin("wait");
+    int isCliData = clidisp_nextEvent(dispConn, isCliDataAvail,
+            sock_fd(conn->strm), displayEvent, timeoutUs);
+    trace_end("wait");
+    // io_uring descriptor is readable also after send completions
+    if( isCliData && ! isCliDataAvail && ! sock_isReadReady(conn->strm) )
+        isCliData = 0;
+    if( isCliData ) {
         cliMsg = sock_readU8(conn->strm);
+        trace_instant("message", "type", cliMsg);
     }
     return cliMsg;
 }
 
-static void decodeRRE(DisplayConnection *dispConn, SockStream *strm,
+static void decodeRRE(DisplayConnection *dispConn, CliConn *conn,
         int x, int y, int width, int height)
 {
     char buf[16];
+    SockStream *strm = conn->strm;
     int i, cnt = sock_readU32(strm); // number of subrectangles
-    int bytespp = clidisp_getBytesPerPixel(dispConn);
+    int bytespp = conn->bytespp;
 
     sock_read(strm, buf, bytespp);
     clidisp_fillRect(dispConn, buf, x, y, width, height);
@@ -294,12 +896,13 @@ static void decodeRRE(DisplayConnection *dispConn, SockStream *strm,
     }
 }
 
-static void decodeHextile(DisplayConnection *dispConn, SockStream *strm,
+static void decodeHextile(DisplayConnection *dispConn, CliConn *conn,
         int x, int y, int width, int height)
 {
     int i, j;
     char bg[16], fg[16], *subfg, subfg_buf[16];
-    int bytespp = clidisp_getBytesPerPixel(dispConn);
+    SockStream *strm = conn->strm;
+    int bytespp = conn->bytespp;
 
     for(i = 0; i < height; i += 16) {
         int th = height - i > 16 ? 16 : height - i;
@@ -338,51 +941,72 @@ static void decodeZRLE(DisplayConnection *dispConn, CliConn *conn,
         int x, int y, int width, int height)
 {
     unsigned char *bufcompr, *bufdest;
-    int comprlen, resInfl, outlen;
+    int comprlen, resInfl, outlen, usedLen;
 
     comprlen = sock_readU32(conn->strm);
-    bufcompr = malloc(comprlen);
+    bufcompr = reserveBuf(&conn->comprBuf, &conn->comprBufSize, comprlen);
 
     sock_read(conn->strm, bufcompr, comprlen);
     conn->zstrm.next_in = (Bytef*)bufcompr;
     conn->zstrm.avail_in = comprlen;
-    // assume that encoding produces less output than "raw" one
-    outlen = width * height * clidisp_getBytesPerPixel(dispConn);
+    // worst case output size: raw pixels with a run length byte each
+    // and full palette in every 64x64 tile
+    outlen = width * height * (conn->bytespp + 1) +
+        (width + 63) / 64 * ((height + 63) / 64) * (1 + 127 * conn->bytespp);
     bufdest = malloc(outlen);
     conn->zstrm.next_out = (Bytef*)bufdest;
     conn->zstrm.avail_out = outlen;
+    trace_beginArgs("inflate", "bytes", comprlen, 0, 0);
     resInfl = inflate(&conn->zstrm, Z_SYNC_FLUSH);
-    if( resInfl != Z_OK )
-        log_fatal("inflate returned %d", resInfl);
-    if( conn->zstrm.avail_in != 0 )
-        log_fatal("non-zero inflate avail_in: %d", conn->zstrm.avail_in);
+    trace_end("inflate");
+    if( resInfl != Z_OK || conn->zstrm.avail_in != 0 ) {
+        free(bufdest);
+        sock_fail(conn->strm, "inflate returned %d, avail_in: %d", resInfl,
+                conn->zstrm.avail_in);
+    }
     outlen -= conn->zstrm.avail_out;
-    clidisp_decodeTRLE(dispConn, bufdest, outlen, x, y, width, height, 64);
-    free(bufcompr);
+    STAT_ADD(conn->stats.inflateIn, comprlen);
+    STAT_ADD(conn->stats.inflateOut, outlen);
+    trace_beginArgs("decodeTRLE", "bytes", outlen, 0, 0);
+    usedLen = clidisp_decodeTRLE(dispConn, bufdest, outlen, x, y, width,
+            height, 64);
+    trace_end("decodeTRLE");
     free(bufdest);
-}
-
-static unsigned long long curTimeMs(void)
-{
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return tv.tv_sec * 1000LL + tv.tv_usec / 1000LL;
+    if( usedLen != outlen )
+        sock_fail(conn->strm, "ZRLE data length mismatch: got %d bytes, "
+                "used %d bytes", outlen, usedLen);
 }
 
 void cliconn_recvFramebufferUpdate(CliConn *conn, DisplayConnection *dispConn)
 {
-    int srcX, srcY, cnt;
+    int srcX, srcY, cnt, isPseudo;
     SockStream *strm = conn->strm;
 
     sock_readU8(strm); // padding
-    unsigned long long updBegTm = curTimeMs();
+    STAT_ADD(conn->stats.updates, 1);
+    unsigned long long updBegTm = curTimeUs();
+    unsigned long long updBegCount = sock_getReadCount(strm);
+    unsigned long long updCpuNs = conn->encsel ? cpuTimeNs() : 0;
     cnt = sock_readU16(strm); // number of rectangles
+    trace_beginArgs("FramebufferUpdate", "rects", cnt, 0, 0);
+    conn->isUpdateTraced = 1;
+    if( conn->probe != NULL )
+        latprobe_updateBegin(conn->probe);
     while( cnt-- > 0 ) {
         int x = sock_readU16(strm);
         int y = sock_readU16(strm);
         int width = sock_readU16(strm);
         int height = sock_readU16(strm);
         int encType = sock_readU32(strm);
+        unsigned long long rectBegCount = sock_getReadCount(strm);
+        unsigned long long rectBegNs = monoTimeNs();
+        int isCpuSampled = conn->encsel != NULL &&
+            encsel_isCpuSampled(conn->encsel, encType);
+        unsigned long long rectCpuNs = isCpuSampled ? cpuTimeNs() : 0;
+        isPseudo = 0;
+        trace_beginArgs("rect", "encoding,width,height", encType,
+                width, height);
+        conn->isRectTraced = 1;
         switch( encType ) {
         case 0: // Raw encoding
             clidisp_putRectFromSocket(dispConn, strm, x, y, width, height);
@@ -393,25 +1017,70 @@ void cliconn_recvFramebufferUpdate(CliConn *conn, DisplayConnection *dispConn)
             clidisp_copyRect(dispConn, srcX, srcY, x, y, width, height);
             break;
         case 2: // RRE encoding
-            decodeRRE(dispConn, strm, x, y, width, height);
+            decodeRRE(dispConn, conn, x, y, width, height);
             break;
         case 5: // Hextile encoding
-            decodeHextile(dispConn, strm, x, y, width, height);
+            decodeHextile(dispConn, conn, x, y, width, height);
             break;
         case 16:
             decodeZRLE(dispConn, conn, x, y, width, height);
             break;
+        case -239:  // Cursor pseudo-encoding
+            decodeRichCursor(dispConn, conn, x, y, width, height);
+            isPseudo = 1;   // not a framebuffer change
+            break;
+        case -240:  // XCursor pseudo-encoding
+            decodeXCursor(dispConn, conn, x, y, width, height);
+            isPseudo = 1;
+            break;
+        case -223:  // DesktopSize pseudo-encoding
+            resizeDesktop(conn, dispConn, width, height);
+            isPseudo = 1;   // damage is set on resize
+            break;
+        case -308:  // ExtendedDesktopSize pseudo-encoding
+            decodeExtendedDesktopSize(conn, dispConn, x, y, width, height);
+            isPseudo = 1;
+            break;
         default:
-            log_fatal("unsupported encoding %d", encType);
+            sock_fail(conn->strm, "unsupported encoding %d", encType);
             break;
         }
-        unsigned long long curTm = curTimeMs();
-        if( cnt > 0 && curTm - updBegTm > 500 ) {
-            clidisp_flush(dispConn);
-            updBegTm = curTm;
+        stats_addRect(&conn->stats, encType, isPseudo ? 0 : width * height,
+                sock_getReadCount(strm) - rectBegCount,
+                monoTimeNs() - rectBegNs);
+        trace_end("rect");
+        conn->isRectTraced = 0;
+        if( isPseudo )
+            continue;
+        if( conn->encsel != NULL ) {
+            rectCpuNs = isCpuSampled ? cpuTimeNs() - rectCpuNs :
+                ENCSEL_NO_CPU;
+            encsel_addRect(conn->encsel, encType, width * height,
+                    sock_getReadCount(strm) - rectBegCount, rectCpuNs);
+        }
+        clidisp_addDamage(dispConn, x, y, width, height);
+        if( conn->probe != NULL )
+            latprobe_rectDecoded(conn->probe, dispConn, x, y, width, height);
+        // present progressively during long updates
+        if( cnt > 0 ) {
+            unsigned long long curTm = curTimeUs();
+            if( isPresentDue(conn, curTm) )
+                presentDamage(conn, dispConn, curTm);
         }
     }
-    clidisp_flush(dispConn);
+    // when the present is not due yet, it is deferred to cliconn_nextEvent
+    unsigned long long curTm = curTimeUs();
+    if( conn->encsel != NULL ) {
+        encsel_addUpdate(conn->encsel,
+                sock_getReadCount(strm) - updBegCount,
+                (curTm - updBegTm) * 1000, cpuTimeNs() - updCpuNs);
+        if( encsel_evaluate(conn->encsel) )
+            sendEncodings(conn);
+    }
+    if( isPresentDue(conn, curTm) )
+        presentDamage(conn, dispConn, curTm);
+    trace_end("FramebufferUpdate");
+    conn->isUpdateTraced = 0;
 }
 
 void cliconn_recvCutTextMsg(CliConn *conn)
@@ -423,10 +1092,31 @@ void cliconn_recvCutTextMsg(CliConn *conn)
     sock_discard(conn->strm, toRd);
 }
 
+void cliconn_setLatencyProbe(CliConn *conn, LatencyProbe *probe)
+{
+    conn->probe = probe;
+}
+
+void cliconn_getStats(CliConn *conn, VncStats *stats)
+{
+    stats_copy(stats, &conn->stats);
+    sock_getStats(conn->strm, &stats->sock);
+}
+
 void cliconn_close(CliConn *conn)
 {
+    // the update was interrupted by an error
+    if( conn->isRectTraced )
+        trace_end("rect");
+    if( conn->isUpdateTraced )
+        trace_end("FramebufferUpdate");
     sock_close(conn->strm);
     inflateEnd(&conn->zstrm);
+    encsel_free(conn->encsel);
+    free(conn->name);
+    free(conn->host);
+    free(conn->comprBuf);
+    free(conn->cursorBuf);
     free(conn);
 }
 
@@ -3,18 +3,136 @@
 
 #include "vnccommon.h"
 #include "clidisplay.h"
+#include "stats.h"
+#include "latprobe.h"
 
 typedef struct ClientConnection CliConn;
 
 CliConn *cliconn_open(const char *vncHost, const char *passwdFile);
 
+
+/* Like cliconn_open, but returns NULL when the connection or the handshake
+ * fails
+ */
+CliConn *cliconn_tryOpen(const char *vncHost, const char *passwdFile);
+
+
+/* Sets TLS for all connections opened later. VeNCrypt security with TLS
+ * is chosen whenever server offers it; when isRequired is set, connecting
+ * to server without VeNCrypt fails, and so does anonymous TLS unless
+ * isAnonAllowed is set. CA certificates verifying the server are read
+ * from caFile, the system ones are used when NULL; a server failing the
+ * verification is refused only when isRequired is set.
+ */
+void cliconn_setTLS(int isRequired, int isAnonAllowed, const char *caFile);
+
+
+/* Sets I/O backend of connections opened later, used after the handshake
+ */
+void cliconn_setIOBackend(SockIOBackend);
+
+
+/* Sets receive timeout of connections opened later, handshake included;
+ * see sock_setRecvTimeout
+ */
+void cliconn_setRecvTimeout(int timeoutMs);
+
+
+/* Enables low latency socket mode (see sock_setLowLatency) on connections
+ * opened later; spinUs is the time to busy wait for data before blocking.
+ * Negative spinUs disables the mode.
+ */
+void cliconn_setLowLatency(int spinUs);
+
+
+/* Enables asking for the password on the terminal, when the server wants
+ * one and no password file is given. Enabled by default.
+ */
+void cliconn_setPasswordPrompt(int isEnabled);
+
+
+/* Connects again to the host of given connection and performs the
+ * handshake, with the password used before. Returns NULL when the
+ * connection or the handshake fails, e.g. on failed authentication.
+ */
+CliConn *cliconn_tryReopen(const CliConn*);
+
+
+/* Makes connection errors jump to the buffer, see sock_setErrorJump
+ */
+void cliconn_setErrorJump(CliConn*, jmp_buf*);
+
+
+/* Starts recording of data received from server, see sock_startRecording.
+ * Should be called after the pixel format is set and before the first
+ * update request.
+ */
+void cliconn_startRecording(CliConn*, const char *fileName);
+
+
+/* Opens the session recording for replay. Messages sent to server are
+ * discarded.
+ */
+CliConn *cliconn_openReplay(const char *fileName, int isRealTime);
+
+
+/* Creates connection reading server messages from the stream, e.g. memory
+ * one, without the handshake. Used by benchmarks.
+ */
+CliConn *cliconn_openStream(SockStream*, int width, int height,
+        const PixelFormat*);
+
+
+/* Returns non-zero when the whole recording is replayed
+ */
+int cliconn_isReplayDone(CliConn*);
+
+/* Returns the socket descriptor, -1 when replaying
+ */
+int cliconn_getFd(const CliConn*);
+
+
+/* Returns non-zero when some data from server is buffered or queued on the
+ * socket. Unlike socket readiness, it is zero at end of stream, except
+ * with io_uring, where the next read reports it.
+ */
+int cliconn_isDataQueued(const CliConn*);
+
+
+/* Returns zero when the descriptor from cliconn_getFd polled readable,
+ * but read would wait anyway
+ */
+int cliconn_isReadReady(const CliConn*);
+
 int cliconn_getWidth(const CliConn*);
 int cliconn_getHeight(const CliConn*);
 const char *cliconn_getName(const CliConn*);
 
-void cliconn_setEncodings(CliConn*, int enableHextile, int enableZRLE);
+/* Returns the pixel format used by server: the one sent in ServerInit or
+ * set by cliconn_setPixelFormat
+ */
+void cliconn_getPixelFormat(const CliConn*, PixelFormat*);
+
+/* Sets the display refresh rate. Updates are presented on display not more
+ * often than once per refresh period.
+ */
+void cliconn_setRefreshRate(CliConn*, int refreshRate);
+
+void cliconn_setEncodings(CliConn*, int enableHextile, int enableZRLE,
+        int enableLocalCursor);
+
+/* Turns on adaptive choice of the preferred encoding among Raw, Hextile and
+ * ZRLE, driven by measurements of decoding time and link throughput.
+ * Encodings set by cliconn_setEncodings determine the initial choice.
+ */
+void cliconn_setAdaptiveEncoding(CliConn*);
 void cliconn_setPixelFormat(CliConn*, const PixelFormat*);
 void cliconn_sendFramebufferUpdateRequest(CliConn*, int incremental);
+
+/* Requests the server to change the desktop size. Ignored when the server
+ * does not support the ExtendedDesktopSize extension.
+ */
+void cliconn_sendSetDesktopSize(CliConn*, int width, int height);
 void cliconn_sendKeyEvent(CliConn*, const VncKeyEvent*);
 void cliconn_sendPointerEvent(CliConn*, const VncPointerEvent*);
 
@@ -22,6 +140,15 @@ int cliconn_nextEvent(CliConn*, DisplayConnection*, DisplayEvent*, int wait);
 void cliconn_recvFramebufferUpdate(CliConn*, DisplayConnection*);
 void cliconn_recvCutTextMsg(CliConn*);
 
+/* Attaches the input-to-pixel latency probe. Probe inputs are sent from
+ * cliconn_nextEvent.
+ */
+void cliconn_setLatencyProbe(CliConn*, LatencyProbe*);
+
+/* Retrieves the connection statistics
+ */
+void cliconn_getStats(CliConn*, VncStats*);
+
 void cliconn_close(CliConn*);
 
 #endif /* CLICONN_H */
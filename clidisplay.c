@@ -1,125 +1,31 @@
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
-#include <X11/extensions/XShm.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/shm.h>
-#include <sys/uio.h>
 #include <string.h>
-#include <sys/select.h>
-#include <zlib.h>
-#include "clidisplay.h"
+#include "dispbackend.h"
+#include "imgfile.h"
+#include "trace.h"
 #include "vnclog.h"
 
 
-struct DisplayConnection {
-    Display *d;
-    XShmSegmentInfo shmInfo;
-    Window win;
-    XImage *img;
-    GC gc;
-    fd_set fds;
-    KeySym lastKeysymDown;
-};
-
-DisplayConnection *clidisp_open(int width, int height, const char *title,
-        int argc, char *argv[], int fullScreen)
-{
-    Display *d;
-
-    if( (d = XOpenDisplay(NULL)) == NULL )
-        log_fatal("unable to open display");
-    DisplayConnection *conn = malloc(sizeof(DisplayConnection));
-    conn->d = d;
-    int defScreenNum = XDefaultScreen(d);
-    Visual *defVis = XDefaultVisual(d, defScreenNum);
-    int defDepth = XDefaultDepth(d, defScreenNum);
-    memset(&conn->shmInfo, 0, sizeof(conn->shmInfo));
-    if( XShmQueryExtension(d) ) {
-        conn->img = XShmCreateImage(d, defVis, defDepth, ZPixmap, NULL,
-                &conn->shmInfo, width, height);
-        conn->shmInfo.shmid = shmget(IPC_PRIVATE,
-                conn->img->bytes_per_line * conn->img->height, IPC_CREAT|0777);
-        log_debug("shm id: %d", conn->shmInfo.shmid);
-        conn->shmInfo.shmaddr =
-            conn->img->data = shmat (conn->shmInfo.shmid, 0, 0);
-        conn->shmInfo.readOnly = False;
-        Status st = XShmAttach(d, &conn->shmInfo);
-        shmctl(conn->shmInfo.shmid, IPC_RMID, NULL);
-        if( st == 0 )
-            log_fatal("XShmAttach failed");
-    }else{
-        log_info("shm extension is not available");
-        conn->img = XCreateImage(d, defVis, defDepth, ZPixmap, 0, NULL,
-                width, height, 32, 0);
-        conn->img->data = malloc(conn->img->bytes_per_line * height);
-    }
-    XSetWindowAttributes attrs;
-    attrs.background_pixel = 0x204060;
-    attrs.event_mask = KeyPressMask | KeyReleaseMask |
-        ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
-        FocusChangeMask | ExposureMask;
-    attrs.override_redirect = fullScreen;
-    // create dummy cursor
-    Pixmap pixmap = XCreatePixmap(d, XDefaultRootWindow(d), 1, 1, 1);
-    XColor color;
-    memset(&color, 0, sizeof(color));
-    attrs.cursor = XCreatePixmapCursor(d, pixmap, pixmap, &color, &color, 0, 0);
-    XFreePixmap(d, pixmap);
-    Screen *defScreen = XDefaultScreenOfDisplay(d);
-    conn->win = XCreateWindow(d, XDefaultRootWindow(d), 0, 0,
-            fullScreen ? XWidthOfScreen(defScreen) : width,
-            fullScreen ? XHeightOfScreen(defScreen) : height,
-            0, CopyFromParent, InputOutput, CopyFromParent,
-            CWBackPixel | CWEventMask | CWCursor | CWOverrideRedirect, &attrs);
-    Atom WM_DELETE_WINDOW = XInternAtom(d, "WM_DELETE_WINDOW", False); 
-    XSetWMProtocols(d, conn->win, &WM_DELETE_WINDOW, 1);
-    char titlebuf[256];
-    sprintf(titlebuf, "%.240s - Wilq VNC", title);
-    XClassHint classHint;
-    classHint.res_name = "wilqvnc";
-    classHint.res_class = "WilqVNC";
-    XmbSetWMProperties(d, conn->win, titlebuf, NULL, argv,
-            argc, NULL, NULL, &classHint);
-    XMapWindow(d, conn->win);
-    if( fullScreen )
-        XGrabKeyboard(d, conn->win, True, GrabModeAsync,
-                GrabModeAsync, CurrentTime);
-    XFlush(d);
-    conn->gc = XCreateGC(conn->d, conn->win, 0, NULL);
-    FD_ZERO(&conn->fds);
-    conn->lastKeysymDown = NoSymbol;
-    return conn;
-}
-
-static void extractShiftMaxFromMask(unsigned long mask,
-        unsigned *resMax, unsigned *resShift)
+void clidisp_init(DisplayConnection *conn, const DisplayBackend *backend,
+        int width, int height)
 {
-    unsigned shift = 0;
-
-    if( mask == 0 )
-        log_fatal("your display is not true-color one");
-    while( (mask & 1) == 0 ) {
-        mask >>= 1;
-        ++shift;
-    } 
-    *resMax = mask;
-    *resShift = shift;
+    conn->backend = backend;
+    conn->fbExport = NULL;
+    backend->createFramebuffer(conn, &conn->fb, width, height);
+    conn->damageCount = 0;
+    clidisp_getPixelFormat(conn, &conn->srcFormat);
+    conn->conv = NULL;
+    conn->srcBytespp = clidisp_getBytesPerPixel(conn);
+    conn->cpixelSize = 3;
+    conn->cpixelShift = 0;
+    conn->lineBuf = NULL;
+    conn->lineBufSize = 0;
 }
 
 void clidisp_getPixelFormat(DisplayConnection *conn, PixelFormat *pixelFormat)
 {
-    pixelFormat->bitsPerPixel = conn->img->bits_per_pixel;
-    int defScreenNum = XDefaultScreen(conn->d);
-    pixelFormat->depth = XDefaultDepth(conn->d, defScreenNum);
-    pixelFormat->bigEndian = conn->img->byte_order == MSBFirst;
-    pixelFormat->trueColor = True;
-    extractShiftMaxFromMask(conn->img->red_mask, &pixelFormat->maxRed,
-            &pixelFormat->shiftRed);
-    extractShiftMaxFromMask(conn->img->green_mask, &pixelFormat->maxGreen,
-            &pixelFormat->shiftGreen);
-    extractShiftMaxFromMask(conn->img->blue_mask, &pixelFormat->maxBlue,
-            &pixelFormat->shiftBlue);
+    conn->backend->getPixelFormat(conn, pixelFormat);
     log_debug("display pixel format:");
     log_debug("  bitsPerPixel: %d", pixelFormat->bitsPerPixel);
     log_debug("  depth:        %d", pixelFormat->depth);
@@ -137,192 +43,260 @@ void clidisp_getPixelFormat(DisplayConnection *conn, PixelFormat *pixelFormat)
 
 unsigned clidisp_getBytesPerPixel(DisplayConnection *conn)
 {
-    return (conn->img->bits_per_pixel + 7) / 8;
+    return (conn->fb.bitsPerPixel + 7) / 8;
 }
 
-void clidisp_flush(DisplayConnection *conn)
+void clidisp_setServerPixelFormat(DisplayConnection *conn,
+        const PixelFormat *pixelFormat)
 {
-    if( conn->shmInfo.shmaddr != NULL ) {
-        XShmPutImage(conn->d, conn->win, conn->gc, conn->img, 0, 0, 0, 0,
-                conn->img->width, conn->img->height, False);
-    }else{
-        XPutImage(conn->d, conn->win, conn->gc, conn->img, 0, 0, 0, 0,
-                conn->img->width, conn->img->height);
+    PixelFormat dispFormat;
+    unsigned long colorMask;
+
+    clidisp_getPixelFormat(conn, &dispFormat);
+    pixconv_free(conn->conv);
+    conn->conv = pixconv_create(pixelFormat, &dispFormat);
+    conn->srcFormat = *pixelFormat;
+    conn->srcBytespp = (pixelFormat->bitsPerPixel + 7) / 8;
+    conn->cpixelSize = conn->srcBytespp;
+    conn->cpixelShift = 0;
+    colorMask = pixelFormat->maxRed << pixelFormat->shiftRed |
+        pixelFormat->maxGreen << pixelFormat->shiftGreen |
+        pixelFormat->maxBlue << pixelFormat->shiftBlue;
+    if( pixelFormat->bitsPerPixel == 32 && pixelFormat->depth <= 24 ) {
+        if( (colorMask & 0xff000000) == 0 ) {
+            conn->cpixelSize = 3;
+        }else if( (colorMask & 0xff) == 0 ) {
+            conn->cpixelSize = 3;
+            conn->cpixelShift = 8;
+        }
     }
-    XFlush(conn->d);
 }
 
-static unsigned convertMouseButtonState(unsigned state)
+int clidisp_getWidth(DisplayConnection *conn)
 {
-    return (state & Button1Mask ? 1 : 0) | (state & Button2Mask ? 2 : 0) |
-            (state & Button3Mask ? 4 : 0) | (state & Button4Mask ? 8 : 0) |
-            (state & Button5Mask ? 16 : 0);
+    return conn->fb.width;
 }
 
-static void processPendingEvents(DisplayConnection *conn,
-        DisplayEvent *displayEvent, Bool assumeFirstIsPending)
+int clidisp_getHeight(DisplayConnection *conn)
 {
-    XEvent xev;
-    KeySym keysym;
-
-    while( displayEvent->evType == VET_NONE &&
-            (assumeFirstIsPending || XPending(conn->d) != 0) )
-    {
-        XNextEvent(conn->d, &xev);
-        assumeFirstIsPending = False;
-        switch( xev.type ) {
-        case KeyPress:
-            XLookupString(&xev.xkey, NULL, 0, &keysym, NULL);
-            if( keysym != NoSymbol ) {
-                displayEvent->evType = VET_KEY;
-                displayEvent->kev.isDown = 1;
-                displayEvent->kev.keysym = keysym;
-                conn->lastKeysymDown = keysym;
-            }
-            break;
-        case KeyRelease:
-            XLookupString(&xev.xkey, NULL, 0, &keysym, NULL);
-            if( keysym != NoSymbol ) {
-                conn->lastKeysymDown = NoSymbol;
-                displayEvent->evType = VET_KEY;
-                displayEvent->kev.isDown = 0;
-                displayEvent->kev.keysym = keysym;
-            }
-            break;
-        case FocusIn:
-            break;
-        case FocusOut:
-#if 0
-            if( conn->isFullScreen ) {
-                // XXX: why focus goes nowhere when xscreensaver turns "on"
-                Window win;
-                int d;
-                XGetInputFocus(conn->d, &win, &d);
-                if( win == None && d == 0 ) {
-                    log_debug("set input focus to mine");
-                    XSetInputFocus(conn->d, conn->win,
-                            RevertToPointerRoot, CurrentTime);
-                }
-            }
-#endif
-            if( conn->lastKeysymDown != NoSymbol ) {
-                log_debug("send key %lu UP on leave",
-                        conn->lastKeysymDown);
-                // mimic keyup
-                displayEvent->evType = VET_KEY;
-                displayEvent->kev.isDown = 0;
-                displayEvent->kev.keysym = conn->lastKeysymDown;
-                conn->lastKeysymDown = NoSymbol;
-            }
-            break;
-        case ButtonPress:
-            displayEvent->evType = VET_MOUSE;
-            displayEvent->pev.x = xev.xbutton.x;
-            displayEvent->pev.y = xev.xbutton.y;
-            displayEvent->pev.buttonMask =
-                convertMouseButtonState(xev.xbutton.state |
-                (xev.xbutton.button == Button1 ? Button1Mask : 0) |
-                (xev.xbutton.button == Button2 ? Button2Mask : 0) |
-                (xev.xbutton.button == Button3 ? Button3Mask : 0) |
-                (xev.xbutton.button == Button4 ? Button4Mask : 0) |
-                (xev.xbutton.button == Button5 ? Button5Mask : 0));
-            break;
-        case ButtonRelease:
-            displayEvent->evType = VET_MOUSE;
-            displayEvent->pev.x = xev.xbutton.x;
-            displayEvent->pev.y = xev.xbutton.y;
-            displayEvent->pev.buttonMask =
-                convertMouseButtonState(xev.xbutton.state &
-                ~(xev.xbutton.button == Button1 ? Button1Mask : 0) &
-                ~(xev.xbutton.button == Button2 ? Button2Mask : 0) &
-                ~(xev.xbutton.button == Button3 ? Button3Mask : 0) &
-                ~(xev.xbutton.button == Button4 ? Button4Mask : 0) &
-                ~(xev.xbutton.button == Button5 ? Button5Mask : 0));
-            break;
-        case MotionNotify:
-            displayEvent->evType = VET_MOUSE;
-            displayEvent->pev.x = xev.xbutton.x;
-            displayEvent->pev.y = xev.xbutton.y;
-            displayEvent->pev.buttonMask =
-                convertMouseButtonState(xev.xbutton.state);
-            break;
-        case Expose:
-            clidisp_flush(conn);
-            break;
-        case ClientMessage:
-            // assume WM_DELETE_WINDOW
-            displayEvent->evType = VET_CLOSE;
-            break;
-        default:
-            log_info("unhandled event: %d", xev.type);
-            break;
+    return conn->fb.height;
+}
+
+/* Replaces the framebuffer by a new one of given size, preserving the
+ * common part of the image
+ */
+static void replaceFramebuffer(DisplayConnection *conn, int width, int height)
+{
+    Framebuffer fb;
+    PixelFormat pixelFormat;
+    int i;
+
+    conn->backend->createFramebuffer(conn, &fb, width, height);
+    int copyWidth = width < conn->fb.width ? width : conn->fb.width;
+    int copyHeight = height < conn->fb.height ? height : conn->fb.height;
+    int bytespp = clidisp_getBytesPerPixel(conn);
+    for(i = 0; i < copyHeight; ++i) {
+        memcpy(fb.data + i * fb.bytesPerLine,
+                conn->fb.data + i * conn->fb.bytesPerLine,
+                copyWidth * bytespp);
+    }
+    for(i = 0; i < height; ++i) {
+        int fillFrom = i < copyHeight ? copyWidth : 0;
+        memset(fb.data + i * fb.bytesPerLine + fillFrom * bytespp,
+                0, (width - fillFrom) * bytespp);
+    }
+    conn->backend->destroyFramebuffer(conn, &conn->fb);
+    conn->fb = fb;
+    conn->backend->resized(conn);
+    if( conn->fb.shared != NULL ) {
+        conn->backend->getPixelFormat(conn, &pixelFormat);
+        fbexport_setSegment(conn->fbExport, conn->fb.shared, &pixelFormat);
+    }
+}
+
+void clidisp_resize(DisplayConnection *conn, int width, int height)
+{
+    if( width == conn->fb.width && height == conn->fb.height )
+        return;
+    log_info("desktop resized to %dx%d", width, height);
+    replaceFramebuffer(conn, width, height);
+    conn->damageCount = 0;
+    clidisp_addDamage(conn, 0, 0, width, height);
+}
+
+void clidisp_startExport(DisplayConnection *conn, const char *socketPath)
+{
+    conn->fbExport = fbexport_create(socketPath);
+    replaceFramebuffer(conn, conn->fb.width, conn->fb.height);
+    // the new image is not presented yet
+    clidisp_addDamage(conn, 0, 0, conn->fb.width, conn->fb.height);
+}
+
+void clidisp_setCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const char *pixels, const unsigned char *mask)
+{
+    char *converted = NULL;
+
+    if( conn->conv != NULL && width > 0 && height > 0 ) {
+        converted = malloc(width * height * clidisp_getBytesPerPixel(conn));
+        pixconv_convertLine(conn->conv, converted, pixels, width * height);
+        pixels = converted;
+    }
+    conn->backend->setCursor(conn, hotX, hotY, width, height, pixels, mask);
+    free(converted);
+}
+
+void clidisp_setMonoCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const unsigned char *fgRGB,
+        const unsigned char *bgRGB, const unsigned char *bitmap,
+        const unsigned char *mask)
+{
+    conn->backend->setMonoCursor(conn, hotX, hotY, width, height, fgRGB,
+            bgRGB, bitmap, mask);
+}
+
+void clidisp_addDamage(DisplayConnection *conn, int x, int y,
+        int width, int height)
+{
+    int i, best = -1;
+    long long bestWaste = 0;
+
+    if( width <= 0 || height <= 0 )
+        return;
+    // find the damaged area which grows least when merged with the new one
+    for(i = 0; i < conn->damageCount; ++i) {
+        const RectangleArea *dmg = conn->damage + i;
+        int x1 = dmg->x < x ? dmg->x : x;
+        int y1 = dmg->y < y ? dmg->y : y;
+        int x2 = dmg->x + dmg->width > x + width ?
+            dmg->x + dmg->width : x + width;
+        int y2 = dmg->y + dmg->height > y + height ?
+            dmg->y + dmg->height : y + height;
+        long long waste = (long long)(x2 - x1) * (y2 - y1) -
+            (long long)dmg->width * dmg->height - (long long)width * height;
+        if( best < 0 || waste < bestWaste ) {
+            best = i;
+            bestWaste = waste;
         }
     }
+    if( best >= 0 && (bestWaste <= 0 || conn->damageCount == DAMAGE_MAX) ) {
+        RectangleArea *dmg = conn->damage + best;
+        int x2 = dmg->x + dmg->width > x + width ?
+            dmg->x + dmg->width : x + width;
+        int y2 = dmg->y + dmg->height > y + height ?
+            dmg->y + dmg->height : y + height;
+        if( x < dmg->x )
+            dmg->x = x;
+        if( y < dmg->y )
+            dmg->y = y;
+        dmg->width = x2 - dmg->x;
+        dmg->height = y2 - dmg->y;
+    }else{
+        RectangleArea *dmg = conn->damage + conn->damageCount++;
+        dmg->x = x;
+        dmg->y = y;
+        dmg->width = width;
+        dmg->height = height;
+    }
+}
+
+int clidisp_isDamaged(DisplayConnection *conn)
+{
+    return conn->damageCount > 0;
+}
+
+void clidisp_flush(DisplayConnection *conn)
+{
+    if( conn->damageCount > 0 ) {
+        trace_beginArgs("flush", "rects", conn->damageCount, 0, 0);
+        conn->backend->present(conn);
+        if( conn->fbExport != NULL )
+            fbexport_addDamage(conn->fbExport, conn->damage,
+                    conn->damageCount);
+        conn->damageCount = 0;
+        trace_end("flush");
+    }
+}
+
+void clidisp_sync(DisplayConnection *conn)
+{
+    if( conn->backend->sync != NULL )
+        conn->backend->sync(conn);
 }
 
 int clidisp_nextEvent(DisplayConnection *conn, int isCliDataAvail, int cliFd,
-        DisplayEvent *displayEvent, int wait)
+        DisplayEvent *displayEvent, int timeoutUs)
 {
-    Bool isEvFd = isCliDataAvail;
-    struct timeval tmout;
-
-    tmout.tv_sec = 0;
-    tmout.tv_usec = 0;
-    displayEvent->evType = VET_NONE;
-    processPendingEvents(conn, displayEvent, False);
-    while( displayEvent->evType == VET_NONE && !isEvFd ) {
-        int dispFd = XConnectionNumber(conn->d);
-        int sockFd = cliFd;
-        FD_SET(dispFd, &conn->fds);
-        FD_SET(sockFd, &conn->fds);
-        int selCnt = select((dispFd > sockFd ? dispFd : sockFd)+1,
-                &conn->fds, NULL, NULL, wait ? NULL : &tmout);
-        if( selCnt < 0 )
-            log_fatal_errno("select");
-        if( selCnt == 0 )
-            break;  // no wait, no data pending
-        if( FD_ISSET(dispFd, &conn->fds) ) {
-            FD_CLR(dispFd, &conn->fds);
-            processPendingEvents(conn, displayEvent, True);
+    return conn->backend->nextEvent(conn, isCliDataAvail, cliFd,
+            displayEvent, timeoutUs);
+}
+
+void clidisp_putRectFromSocket(DisplayConnection *conn, SockStream *strm,
+        int x, int y, int width, int height)
+{
+    int i, bytesPerLine = conn->fb.bytesPerLine;
+    int bytespp = (conn->fb.bitsPerPixel + 7) / 8;
+    char *dest = conn->fb.data + y * bytesPerLine + x * bytespp;
+
+    if( conn->conv == NULL ) {
+        sock_readRect(strm, dest, bytesPerLine, width * bytespp, height);
+    }else{
+        // kept in the connection, not leaked when a read fails
+        if( width * conn->srcBytespp > conn->lineBufSize ) {
+            free(conn->lineBuf);
+            conn->lineBufSize = width * conn->srcBytespp;
+            conn->lineBuf = malloc(conn->lineBufSize);
         }
-        if( FD_ISSET(sockFd, &conn->fds) ) {
-            FD_CLR(sockFd, &conn->fds);
-            isEvFd = True;
+        for(i = 0; i < height; ++i) {
+            sock_read(strm, conn->lineBuf, width * conn->srcBytespp);
+            pixconv_convertLine(conn->conv, dest, conn->lineBuf, width);
+            dest += bytesPerLine;
         }
     }
-    return isEvFd;
 }
 
-void clidisp_putRectFromSocket(DisplayConnection *conn, SockStream *strm,
-        int x, int y, int width, int height)
+void clidisp_putRect(DisplayConnection *conn, const char *pixels,
+        int bytesPerLine, int x, int y, int width, int height)
 {
-    int bytesPerLine = conn->img->bytes_per_line;
-    int bytespp = (conn->img->bits_per_pixel + 7) / 8;
+    int i, bytespp = (conn->fb.bitsPerPixel + 7) / 8;
+    char *dest = conn->fb.data + y * conn->fb.bytesPerLine + x * bytespp;
+
+    for(i = 0; i < height; ++i) {
+        if( conn->conv == NULL )
+            memcpy(dest, pixels, width * bytespp);
+        else
+            pixconv_convertLine(conn->conv, dest, pixels, width);
+        dest += conn->fb.bytesPerLine;
+        pixels += bytesPerLine;
+    }
+}
 
-    sock_readRect(strm, conn->img->data + y * bytesPerLine + x * bytespp,
-            bytesPerLine, width * bytespp, height);
+const char *clidisp_getFramebuffer(DisplayConnection *conn, int *bytesPerLine)
+{
+    *bytesPerLine = conn->fb.bytesPerLine;
+    return conn->fb.data;
 }
 
 void clidisp_copyRect(DisplayConnection *conn, int srcX, int srcY,
         int destX, int destY, int width, int height)
 {
-    int i, bytespp = (conn->img->bits_per_pixel + 7) / 8;
+    int i, bytespp = (conn->fb.bitsPerPixel + 7) / 8;
 
     if( srcY >= destY ) {
         for(i = 0; i < height; ++i) {
-            memmove(conn->img->data +
-                    (destY+i) * conn->img->bytes_per_line +
+            memmove(conn->fb.data +
+                    (destY+i) * conn->fb.bytesPerLine +
                     destX * bytespp,
-                    conn->img->data +
-                    (srcY+i) * conn->img->bytes_per_line +
+                    conn->fb.data +
+                    (srcY+i) * conn->fb.bytesPerLine +
                     srcX * bytespp, width * bytespp);
         }
     }else{
         for(i = height-1; i >= 0; --i) {
-            memmove(conn->img->data + (destY+i) *
-                    conn->img->bytes_per_line + destX * bytespp,
-                    conn->img->data + (srcY+i) *
-                    conn->img->bytes_per_line + srcX * bytespp,
+            memmove(conn->fb.data + (destY+i) *
+                    conn->fb.bytesPerLine + destX * bytespp,
+                    conn->fb.data + (srcY+i) *
+                    conn->fb.bytesPerLine + srcX * bytespp,
                     width * bytespp);
         }
     }
@@ -331,29 +305,94 @@ void clidisp_copyRect(DisplayConnection *conn, int srcX, int srcY,
 void clidisp_fillRect(DisplayConnection *conn, const char *pixel, int x, int y,
         int width, int height)
 {
-    int i, bytespp = (conn->img->bits_per_pixel + 7) / 8;
+    int i, bytespp = (conn->fb.bitsPerPixel + 7) / 8;
+    char converted[4];
+
+    if( conn->conv != NULL ) {
+        pixconv_writePixel(conn->conv, converted, pixconv_convert(conn->conv,
+                    pixconv_readPixel(conn->conv, pixel)));
+        pixel = converted;
+    }
 
     for(i = 0; i < width; ++i) {
-        memcpy(conn->img->data + y * conn->img->bytes_per_line +
+        memcpy(conn->fb.data + y * conn->fb.bytesPerLine +
                 (x+i) * bytespp, pixel, bytespp);
     }
     for(i = 1; i < height; ++i) {
-        memcpy(conn->img->data + (y+i) * conn->img->bytes_per_line +
+        memcpy(conn->fb.data + (y+i) * conn->fb.bytesPerLine +
                 x * bytespp,
-                conn->img->data + y * conn->img->bytes_per_line + x * bytespp,
+                conn->fb.data + y * conn->fb.bytesPerLine + x * bytespp,
                 width * bytespp);
     }
 }
 
-void clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
+unsigned clidisp_getAreaHash(DisplayConnection *conn, int x, int y,
+        int width, int height)
+{
+    int i, j, bytespp = (conn->fb.bitsPerPixel + 7) / 8;
+    unsigned hash = 2166136261u;    // FNV-1a
+
+    if( x < 0 ) {
+        width += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        height += y;
+        y = 0;
+    }
+    if( x + width > conn->fb.width )
+        width = conn->fb.width - x;
+    if( y + height > conn->fb.height )
+        height = conn->fb.height - y;
+    for(i = 0; i < height; ++i) {
+        const unsigned char *line = (unsigned char*)conn->fb.data +
+            (y + i) * conn->fb.bytesPerLine + x * bytespp;
+        for(j = 0; j < width * bytespp; ++j)
+            hash = (hash ^ line[j]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Reads ZRLE compressed pixel and converts it to display format
+ */
+static inline unsigned readCPixel(const DisplayConnection *conn,
+        const unsigned char **dpp)
+{
+    const unsigned char *dp = *dpp;
+    unsigned color;
+
+    switch( conn->cpixelSize ) {
+    case 1:
+        color = dp[0];
+        break;
+    case 2:
+        color = conn->srcFormat.bigEndian ? dp[0] << 8 | dp[1] :
+            dp[1] << 8 | dp[0];
+        break;
+    case 3:
+        color = conn->srcFormat.bigEndian ? dp[0] << 16 | dp[1] << 8 | dp[2] :
+            dp[2] << 16 | dp[1] << 8 | dp[0];
+        color <<= conn->cpixelShift;
+        break;
+    default:
+        color = conn->srcFormat.bigEndian ?
+            (unsigned)dp[0] << 24 | dp[1] << 16 | dp[2] << 8 | dp[3] :
+            (unsigned)dp[3] << 24 | dp[2] << 16 | dp[1] << 8 | dp[0];
+        break;
+    }
+    *dpp = dp + conn->cpixelSize;
+    return conn->conv == NULL ? color : pixconv_convert(conn->conv, color);
+}
+
+int clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
         int x, int y, int width, int height, unsigned squareWidth)
 {
     const unsigned char *dp = data;
     int sx, sy, i, j;
-    int bytespp = (conn->img->bits_per_pixel + 7) / 8;
-    int itemsPerLine = conn->img->bytes_per_line / bytespp;
+    int bytespp = (conn->fb.bitsPerPixel + 7) / 8;
+    int itemsPerLine = conn->fb.bytesPerLine / bytespp;
     unsigned imgOff = y * itemsPerLine + x;
-    unsigned *img = (unsigned*)conn->img->data;
+    unsigned *img = (unsigned*)conn->fb.data;
     unsigned colors[128], ncolorsLast = 0;
 
     for(sy = 0; sy < height; sy += squareWidth) {
@@ -366,13 +405,8 @@ void clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
             unsigned ncolors = *dp++;
             if( ncolors == 0 ) {
                 for(i = 0; i < tileHeight; ++i) {
-                    for(j = 0; j < tileWidth; ++j) {
-                        // TODO: this depends on endianess
-                        unsigned color = *dp++;
-                        color |= *dp++ << 8;
-                        color |= *dp++ << 16;
-                        img[tileOff + j] = color;
-                    }
+                    for(j = 0; j < tileWidth; ++j)
+                        img[tileOff + j] = readCPixel(conn, &dp);
                     tileOff += itemsPerLine;
                 }
             }else if( ncolors == 128 ) {
@@ -380,11 +414,7 @@ void clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
                 for(i = 0; i < tileHeight; ++i) {
                     for(j = 0; j < tileWidth; ++j) {
                         if( run == 0 ) {
-                            // TODO: this depends on endianess
-                            color = *dp++;
-                            color |= *dp++ << 8;
-                            color |= *dp++ << 16;
-
+                            color = readCPixel(conn, &dp);
                             run = 1;
                             while( (r = *dp++) == 255 )
                                 run += 255;
@@ -400,13 +430,8 @@ void clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
                     ncolors = ncolorsLast | (ncolors & 0x80);
                 }else{
                     ncolorsLast = ncolors & 0x7f;
-                    for(i = 0; i < ncolorsLast; ++i) {
-                        // TODO: this depends on endianess
-                        unsigned color = *dp++;
-                        color |= *dp++ << 8;
-                        color |= *dp++ << 16;
-                        colors[i] = color;
-                    }
+                    for(i = 0; i < ncolorsLast; ++i)
+                        colors[i] = readCPixel(conn, &dp);
                 }
                 if( ncolors < 128 ) {
                     unsigned shift, mask;
@@ -458,22 +483,49 @@ void clidisp_decodeTRLE(DisplayConnection *conn, const void *data, int datalen,
         }
         imgOff += squareWidth * itemsPerLine;
     }
-    if( dp - (const unsigned char*)data != datalen )
-        log_fatal("ZRLE data length mismatch: got %d bytes, used %d bytes",
-                datalen, dp - (const unsigned char*)data);
+    return dp - (const unsigned char*)data;
+}
+
+int clidisp_dumpFrame(DisplayConnection *conn, const char *fileName)
+{
+    // little-endian 32 bits per pixel, blue in the first byte
+    static const PixelFormat rgbFormat = {
+        32, 24, 0, 1, 255, 255, 255, 16, 8, 0
+    };
+    PixelFormat dispFormat;
+    int i, j, width = conn->fb.width, height = conn->fb.height;
+    unsigned char *line = malloc(width * 4);
+    unsigned char *rgb = malloc(width * height * 3), *dp = rgb;
+
+    clidisp_getPixelFormat(conn, &dispFormat);
+    PixelConverter *conv = pixconv_create(&dispFormat, &rgbFormat);
+    for(i = 0; i < height; ++i) {
+        const char *src = conn->fb.data + i * conn->fb.bytesPerLine;
+        if( conv != NULL )
+            pixconv_convertLine(conv, line, src, width);
+        else
+            memcpy(line, src, width * 4);
+        for(j = 0; j < width; ++j) {
+            *dp++ = line[4 * j + 2];
+            *dp++ = line[4 * j + 1];
+            *dp++ = line[4 * j];
+        }
+    }
+    pixconv_free(conv);
+    free(line);
+    int res = imgfile_write(fileName, rgb, width, height);
+    free(rgb);
+    return res;
 }
 
 void clidisp_close(DisplayConnection *conn)
 {
     if( conn != NULL ) {
-        if( conn->shmInfo.shmaddr != NULL ) {
-            XShmDetach(conn->d, &conn->shmInfo);
-            shmdt(conn->shmInfo.shmaddr);
-        }
-        XDestroyImage(conn->img);
-        XDestroyWindow(conn->d, conn->win);
-        XCloseDisplay(conn->d);
+        conn->backend->destroyFramebuffer(conn, &conn->fb);
+        conn->backend->close(conn);
+        pixconv_free(conn->conv);
+        fbexport_free(conn->fbExport);
+        free(conn->lineBuf);
     }
     free(conn);
 }
-
@@ -6,10 +6,17 @@
 
 typedef struct DisplayConnection DisplayConnection;
 
+typedef enum {
+    PRESENT_SHM,            // XShmPutImage, XPutImage when SHM not available
+    PRESENT_PUTIMAGE,       // XPutImage
+    PRESENT_PIXMAP          // upload to server pixmap, XCopyArea to window
+} PresentMode;
+
 typedef enum {
     VET_NONE,               // no event
     VET_MOUSE,              // change mouse buttons state, mouse movement
     VET_KEY,                // keydown, keyup
+    VET_RESIZE,             // window size change
     VET_CLOSE               // close connection
 } VncEventType;
 
@@ -18,27 +25,62 @@ typedef struct {
     union {
         VncKeyEvent kev;
         VncPointerEvent pev;
+        RectangleArea area;
     };
 } DisplayEvent;
 
 
+/* Starts connecting to X server in background, so that the connection
+ * setup overlaps with the VNC handshake. The next clidisp_open uses the
+ * prepared connection. The thread inherits the signal mask of the caller.
+ */
+void clidisp_preopen(PresentMode);
+
+
 /* Connects to X server and opens a window to display the remote desktop.
+ * The presentMode selects how the framebuffer is copied to the window.
  */
 DisplayConnection *clidisp_open(int width, int height, const char *title,
-        int argc, char *argv[], int fullScreen);
+        int argc, char *argv[], int fullScreen, PresentMode);
+
+
+/* Opens headless display keeping the remote desktop in memory only. When
+ * framePattern is not NULL, every presented frame is written to file named
+ * by the printf-like pattern given the frame number, e.g. "fr%05u.png".
+ */
+DisplayConnection *clidisp_openHeadless(int width, int height,
+        const char *framePattern);
 
 
 void clidisp_getPixelFormat(DisplayConnection*, PixelFormat*);
 unsigned clidisp_getBytesPerPixel(DisplayConnection*);
 
 
+/* Sets the pixel format of data received from server. Pixels are converted
+ * to display format when it is different.
+ */
+void clidisp_setServerPixelFormat(DisplayConnection*, const PixelFormat*);
+
+int clidisp_getWidth(DisplayConnection*);
+int clidisp_getHeight(DisplayConnection*);
+
+
+/* Changes the remote desktop size. The image part common to the old and the
+ * new size is preserved. The window is resized accordingly unless in full
+ * screen mode.
+ */
+void clidisp_resize(DisplayConnection*, int width, int height);
+
+
 /* Waits until next window event appears in event queue or some data is
- * available for read in socket.
+ * available for read in socket, at most timeoutUs microseconds. Negative
+ * timeout means wait infinitely. The cliFd may be -1 to wait for window
+ * events only.
  * Window event is stored in DisplayEvent structure.
  * Returns True when some data is aveilable on socket, False otherwise.
  */
 int clidisp_nextEvent(DisplayConnection*, int isCliDataAvail, int cliFd,
-        DisplayEvent*, int wait);
+        DisplayEvent*, int timeoutUs);
 
 
 /* Stores rectangle image on remote desktop display.
@@ -47,6 +89,19 @@ void clidisp_putRectFromSocket(DisplayConnection*, SockStream*, int x, int y,
         int width, int height);
 
 
+/* Stores rectangle image given in server pixel format. The bytesPerLine
+ * is the distance between the image lines.
+ */
+void clidisp_putRect(DisplayConnection*, const char *pixels, int bytesPerLine,
+        int x, int y, int width, int height);
+
+
+/* Returns the framebuffer memory; pixels are in display pixel format, lines
+ * are bytesPerLine apart. The memory is replaced on resize.
+ */
+const char *clidisp_getFramebuffer(DisplayConnection*, int *bytesPerLine);
+
+
 /* Copies rectangle area from one region of remote desktop display to
  * another one
  */
@@ -58,14 +113,69 @@ void clidisp_fillRect(DisplayConnection*, const char *pixel,
         int x, int y, int width, int height);
 
 
-void clidisp_decodeTRLE(DisplayConnection*, const void *data, int datalen,
+/* Decodes TRLE (or ZRLE inflated) data of the rectangle. Returns number of
+ * bytes used, which differs from datalen on malformed data.
+ */
+int clidisp_decodeTRLE(DisplayConnection*, const void *data, int datalen,
         int x, int y, int width, int height, unsigned squareWidth);
 
+/* Returns hash of the image contents in the area, clipped to the display
+ */
+unsigned clidisp_getAreaHash(DisplayConnection*, int x, int y,
+        int width, int height);
+
+
+/* Sets the local mouse cursor to the image given in server pixel format.
+ * The mask has one bit per pixel, most significant bit first, each row
+ * padded to a whole byte. Zero-sized cursor makes the cursor invisible.
+ */
+void clidisp_setCursor(DisplayConnection*, int hotX, int hotY,
+        int width, int height, const char *pixels, const unsigned char *mask);
+
+
+/* Sets the local mouse cursor to a two-color one. Colors are given as
+ * red, green and blue bytes. Bitmap selects foreground color, mask the
+ * visible pixels; both have the same layout as in clidisp_setCursor.
+ */
+void clidisp_setMonoCursor(DisplayConnection*, int hotX, int hotY,
+        int width, int height, const unsigned char *fgRGB,
+        const unsigned char *bgRGB, const unsigned char *bitmap,
+        const unsigned char *mask);
+
+
+/* Marks the area as modified, to be presented on next flush
+ */
+void clidisp_addDamage(DisplayConnection*, int x, int y,
+        int width, int height);
+
+
+/* Returns non-zero when there are some modifications not flushed yet
+ */
+int clidisp_isDamaged(DisplayConnection*);
+
+
 /* Flush updates made on display
  */
 void clidisp_flush(DisplayConnection*);
 
 
+/* Waits until the flushed updates are displayed
+ */
+void clidisp_sync(DisplayConnection*);
+
+
+/* Writes the display contents to PNG or PPM file, depending on the file
+ * name extension. Returns 0 on success, -1 on error.
+ */
+int clidisp_dumpFrame(DisplayConnection*, const char *fileName);
+
+
+/* Moves the framebuffer to shared memory exported to local consumers
+ * connecting to UNIX socket at given path, see fbexport.h.
+ */
+void clidisp_startExport(DisplayConnection*, const char *socketPath);
+
+
 /* Closes the window with remote desktop and disconnect from X server.
  */
 void clidisp_close(DisplayConnection*);
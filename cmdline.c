@@ -8,14 +8,81 @@ static void usage(void)
 {
     printf("\n"
         "usage: wilqvnc [parameters] host[:display]\n"
+        "       wilqvnc [parameters] -rp|-replay <file>\n"
+        "       wilqvnc [parameters] -wl|-wall host[:display] ...\n"
+        "       wilqvnc [parameters] -sn|-snapshot <pattern> "
+        "host[:display] ...\n"
+        "\n"
+        "IPv6 host address is given in brackets, e.g. [::1]:1; server on\n"
+        "UNIX socket as unix:<path>\n"
         "\n"
         "parameters:\n"
         "  -fs|-fullscreen         - full screen mode\n"
         "  -p |-passwd     <fname> - password file for authentication\n"
+        "  -tl|-tls                - require encrypted connection (VeNCrypt\n"
+        "                            TLS), used whenever offered by server\n"
+        "  -ta|-tlsanon            - with -tls accept also anonymous TLS,\n"
+        "                            not verifying the server identity\n"
+        "  -ca|-cafile     <file>  - CA certificates verifying the server,\n"
+        "                            the system ones by default\n"
         "  -v |-verbose            - print some debug info\n"
         "  -x |-hextile            - enable Hextile encoding\n"
         "  -Z |-zrle               - enable ZRLE encoding\n"
+        "  -a |-adaptive           - choose encoding by measured performance\n"
+        "  -lc|-localcursor        - draw mouse cursor locally\n"
+        "  -rs|-remoteresize       - resize remote desktop to window size\n"
+        "  -pf|-pixelformat <fmt>  - pixel format sent by server, one of:\n"
+        "                              native - the display one (default)\n"
+        "                              server - proposed by server\n"
+        "                              bgr233 - 8 bits per pixel\n"
+        "                              rgb565 - 16 bits per pixel\n"
         "  -fp|-freqperiod         - print refresh frequency periodically\n"
+        "  -rr|-refreshrate  <hz>  - display refresh rate, 60 by default\n"
+        "  -st|-stats      <path>  - serve statistics on UNIX socket and\n"
+        "                            print them at exit\n"
+        "  -tr|-trace      <file>  - write Chrome trace of events to file\n"
+        "  -lp|-latencyprobe <mode> - measure input-to-pixel latency by\n"
+        "                            sending pointer or key probes\n"
+        "  -ln|-latencycount  <n>  - number of latency probes, 100 by default\n"
+        "  -la|-latencyarea <WxH+X+Y> - area watched for probe response\n"
+        "  -rec|-record    <file>  - record data received from server\n"
+        "  -rp|-replay     <file>  - replay recorded session as fast as\n"
+        "                            possible and print throughput\n"
+        "  -rt|-realtime           - replay with recorded timing\n"
+        "  -hl|-headless           - keep the desktop in memory only,\n"
+        "                            without X display\n"
+        "  -df|-dumpframes <pattern> - in headless mode write presented\n"
+        "                            frames to PNG or PPM files named by\n"
+        "                            printf pattern, e.g. fr%%05u.png\n"
+        "  -pm|-presentmode <mode> - copying of image to window, one of:\n"
+        "                              shm      - XShmPutImage (default)\n"
+        "                              putimage - XPutImage\n"
+        "                              pixmap   - upload to pixmap and\n"
+        "                                         XCopyArea\n"
+        "  -io|-iobackend <backend> - socket I/O, one of:\n"
+        "                              readv - readv/writev (default)\n"
+        "                              uring - io_uring, falls back to\n"
+        "                                      readv when not available\n"
+        "  -ll|-lowlatency <us>    - low latency socket mode: busy polling,\n"
+        "                            quick ACKs, buffers sized by measured\n"
+        "                            bandwidth-delay product; spin given\n"
+        "                            microseconds for data before blocking\n"
+        "  -rc|-reconnect          - reconnect when connection is lost,\n"
+        "                            keeping the window\n"
+        "  -nc|-nocache            - do not show the last image of the\n"
+        "                            desktop cached on disk at startup\n"
+        "  -ex|-export     <path>  - share the framebuffer with local\n"
+        "                            consumers connecting to UNIX socket\n"
+        "  -wl|-wall               - view all the hosts downscaled in one\n"
+        "                            window\n"
+        "  -ws|-wallsize    <WxH>  - wall window size, 1600x900 by default\n"
+        "  -sn|-snapshot <pattern> - write screenshot of every host to file\n"
+        "                            named by printf pattern given the\n"
+        "                            host, e.g. shots/%%s.png, and exit;\n"
+        "                            with more hosts the password is not\n"
+        "                            asked for, see -passwd\n"
+        "  -sj|-snapjobs     <n>   - hosts snapshotted concurrently, 16 by\n"
+        "                            default\n"
         "  -h |-help               - print this help\n"
         "\n");
     exit(0);
@@ -31,7 +98,38 @@ void cmdline_parse(int argc, char *argv[], CmdLineParams *params)
     params->logLevel = 0;
     params->enableHextile = 0;
     params->enableZRLE = 0;
+    params->adaptiveEncoding = 0;
+    params->localCursor = 0;
+    params->remoteResize = 0;
+    params->pixelFormat = PIXFMT_NATIVE;
     params->showFrameRate = 0;
+    params->refreshRate = 60;
+    params->statsSocket = NULL;
+    params->traceFile = NULL;
+    params->latencyProbe = LATPROBE_NONE;
+    params->latencyProbeCount = 100;
+    params->latencyArea.width = 0;
+    params->recordFile = NULL;
+    params->replayFile = NULL;
+    params->replayRealTime = 0;
+    params->headless = 0;
+    params->framePattern = NULL;
+    params->presentMode = PRESENT_SHM;
+    params->exportSocket = NULL;
+    params->reconnect = 0;
+    params->requireTLS = 0;
+    params->allowAnonTLS = 0;
+    params->caFile = NULL;
+    params->ioBackend = SOCK_IO_READV;
+    params->lowLatencySpinUs = -1;
+    params->fbCache = 1;
+    params->wall = 0;
+    params->hosts = malloc(argc * sizeof(const char*));
+    params->hostCount = 0;
+    params->wallWidth = 1600;
+    params->wallHeight = 900;
+    params->snapshotPattern = NULL;
+    params->snapshotJobs = 16;
     while( i < argc ) {
         if( !strcmp(argv[i], "-fs") || !strcmp(argv[i], "-fullscreen") )
             params->fullScreen = 1;
@@ -43,18 +141,160 @@ void cmdline_parse(int argc, char *argv[], CmdLineParams *params)
             params->enableHextile = 1;
         else if( !strcmp(argv[i], "-Z") || !strcmp(argv[i], "-zrle") )
             params->enableZRLE = 1;
+        else if( !strcmp(argv[i], "-a") || !strcmp(argv[i], "-adaptive") )
+            params->adaptiveEncoding = 1;
+        else if( !strcmp(argv[i], "-lc") || !strcmp(argv[i], "-localcursor") )
+            params->localCursor = 1;
+        else if( !strcmp(argv[i], "-rs") || !strcmp(argv[i], "-remoteresize") )
+            params->remoteResize = 1;
+        else if( !strcmp(argv[i], "-pf") || !strcmp(argv[i], "-pixelformat") ) {
+            const char *fmt = ++i < argc ? argv[i] : "";
+            if( !strcmp(fmt, "native") )
+                params->pixelFormat = PIXFMT_NATIVE;
+            else if( !strcmp(fmt, "server") )
+                params->pixelFormat = PIXFMT_SERVER;
+            else if( !strcmp(fmt, "bgr233") )
+                params->pixelFormat = PIXFMT_BGR233;
+            else if( !strcmp(fmt, "rgb565") )
+                params->pixelFormat = PIXFMT_RGB565;
+            else{
+                fprintf(stderr, "error: bad pixel format\n\n");
+                exit(1);
+            }
+        }
         else if( !strcmp(argv[i], "-fp") || !strcmp(argv[i], "-freqperiod") )
             params->showFrameRate = 1;
+        else if( !strcmp(argv[i], "-st") || !strcmp(argv[i], "-stats") )
+            params->statsSocket = argv[++i];
+        else if( !strcmp(argv[i], "-tr") || !strcmp(argv[i], "-trace") )
+            params->traceFile = argv[++i];
+        else if( !strcmp(argv[i], "-lp") ||
+                !strcmp(argv[i], "-latencyprobe") )
+        {
+            const char *mode = ++i < argc ? argv[i] : "";
+            if( !strcmp(mode, "pointer") )
+                params->latencyProbe = LATPROBE_POINTER;
+            else if( !strcmp(mode, "key") )
+                params->latencyProbe = LATPROBE_KEY;
+            else{
+                fprintf(stderr, "error: bad latency probe mode\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-ln") ||
+                !strcmp(argv[i], "-latencycount") )
+        {
+            if( ++i == argc ||
+                    (params->latencyProbeCount = atoi(argv[i])) <= 0 )
+            {
+                fprintf(stderr, "error: bad latency probe count\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-la") ||
+                !strcmp(argv[i], "-latencyarea") )
+        {
+            RectangleArea *area = &params->latencyArea;
+            if( ++i == argc || sscanf(argv[i], "%dx%d+%d+%d", &area->width,
+                        &area->height, &area->x, &area->y) != 4 ||
+                    area->width <= 0 || area->height <= 0 )
+            {
+                fprintf(stderr, "error: bad latency area\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-rr") || !strcmp(argv[i], "-refreshrate") ) {
+            if( ++i == argc || (params->refreshRate = atoi(argv[i])) <= 0 ) {
+                fprintf(stderr, "error: bad refresh rate\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-rec") || !strcmp(argv[i], "-record") )
+            params->recordFile = argv[++i];
+        else if( !strcmp(argv[i], "-rp") || !strcmp(argv[i], "-replay") )
+            params->replayFile = argv[++i];
+        else if( !strcmp(argv[i], "-rt") || !strcmp(argv[i], "-realtime") )
+            params->replayRealTime = 1;
+        else if( !strcmp(argv[i], "-hl") || !strcmp(argv[i], "-headless") )
+            params->headless = 1;
+        else if( !strcmp(argv[i], "-df") || !strcmp(argv[i], "-dumpframes") )
+            params->framePattern = argv[++i];
+        else if( !strcmp(argv[i], "-pm") ||
+                !strcmp(argv[i], "-presentmode") )
+        {
+            const char *mode = ++i < argc ? argv[i] : "";
+            if( !strcmp(mode, "shm") )
+                params->presentMode = PRESENT_SHM;
+            else if( !strcmp(mode, "putimage") )
+                params->presentMode = PRESENT_PUTIMAGE;
+            else if( !strcmp(mode, "pixmap") )
+                params->presentMode = PRESENT_PIXMAP;
+            else{
+                fprintf(stderr, "error: bad present mode\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-tl") || !strcmp(argv[i], "-tls") )
+            params->requireTLS = 1;
+        else if( !strcmp(argv[i], "-ta") || !strcmp(argv[i], "-tlsanon") )
+            params->allowAnonTLS = 1;
+        else if( !strcmp(argv[i], "-ca") || !strcmp(argv[i], "-cafile") )
+            params->caFile = argv[++i];
+        else if( !strcmp(argv[i], "-io") || !strcmp(argv[i], "-iobackend") ) {
+            const char *backend = ++i < argc ? argv[i] : "";
+            if( !strcmp(backend, "readv") )
+                params->ioBackend = SOCK_IO_READV;
+            else if( !strcmp(backend, "uring") )
+                params->ioBackend = SOCK_IO_URING;
+            else{
+                fprintf(stderr, "error: bad I/O backend\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-ll") || !strcmp(argv[i], "-lowlatency") ) {
+            if( ++i == argc ||
+                    (params->lowLatencySpinUs = atoi(argv[i])) < 0 ) {
+                fprintf(stderr, "error: bad spin time\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-rc") || !strcmp(argv[i], "-reconnect") )
+            params->reconnect = 1;
+        else if( !strcmp(argv[i], "-nc") || !strcmp(argv[i], "-nocache") )
+            params->fbCache = 0;
+        else if( !strcmp(argv[i], "-ex") || !strcmp(argv[i], "-export") )
+            params->exportSocket = argv[++i];
+        else if( !strcmp(argv[i], "-wl") || !strcmp(argv[i], "-wall") )
+            params->wall = 1;
+        else if( !strcmp(argv[i], "-ws") || !strcmp(argv[i], "-wallsize") ) {
+            if( ++i == argc || sscanf(argv[i], "%dx%d", &params->wallWidth,
+                        &params->wallHeight) != 2 ||
+                    params->wallWidth <= 0 || params->wallHeight <= 0 )
+            {
+                fprintf(stderr, "error: bad wall size\n\n");
+                exit(1);
+            }
+        }
+        else if( !strcmp(argv[i], "-sn") || !strcmp(argv[i], "-snapshot") )
+            params->snapshotPattern = argv[++i];
+        else if( !strcmp(argv[i], "-sj") || !strcmp(argv[i], "-snapjobs") ) {
+            if( ++i == argc || (params->snapshotJobs = atoi(argv[i])) <= 0 ) {
+                fprintf(stderr, "error: bad number of snapshot jobs\n\n");
+                exit(1);
+            }
+        }
         else if( !strcmp(argv[i], "-h") ||  !strcmp(argv[i], "-help") )
             usage();
         else if( argv[i][0] == '-' ) {
             fprintf(stderr, "error: unrecognized option -- %s\n\n", argv[i]);
             exit(1);
-        }else
+        }else{
             params->host = argv[i];
+            params->hosts[params->hostCount++] = argv[i];
+        }
         ++i;
     }
-    if( params->host == NULL ) {
+    if( params->host == NULL && params->replayFile == NULL ) {
         if( argc > 1 )
             fprintf(stderr, "\nerror: host name not provided\n");
         usage();
@@ -1,14 +1,54 @@
 #ifndef CLICMDLINE_H
 #define CLICMDLINE_H
 
+#include "vnccommon.h"
+#include "latprobe.h"
+
+typedef enum {
+    PIXFMT_NATIVE,          // display pixel format
+    PIXFMT_SERVER,          // pixel format proposed by server
+    PIXFMT_BGR233,
+    PIXFMT_RGB565
+} PixelFormatChoice;
+
 typedef struct {
     const char *host;
     const char *passwdFile;
+    int requireTLS;
+    int allowAnonTLS;
+    const char *caFile;
+    SockIOBackend ioBackend;
+    int lowLatencySpinUs;           // -1 when low latency mode is off
     int fullScreen;
     int logLevel;
     int enableHextile;
     int enableZRLE;
+    int adaptiveEncoding;
+    int localCursor;
+    int remoteResize;
+    PixelFormatChoice pixelFormat;
     int showFrameRate;
+    int refreshRate;
+    const char *statsSocket;
+    const char *traceFile;
+    LatencyProbeMode latencyProbe;
+    int latencyProbeCount;
+    RectangleArea latencyArea;      // width is 0 when not set
+    const char *recordFile;
+    const char *replayFile;
+    int replayRealTime;
+    int headless;
+    const char *framePattern;
+    PresentMode presentMode;
+    const char *exportSocket;
+    int reconnect;
+    int fbCache;                    // show cached desktop image at start
+    int wall;
+    const char **hosts;             // all hosts given, for wall
+    int hostCount;
+    int wallWidth, wallHeight;
+    const char *snapshotPattern;
+    int snapshotJobs;
 } CmdLineParams;
 
 void cmdline_parse(int argc, char *argv[], CmdLineParams*);
@@ -0,0 +1,567 @@
+/* Microbenchmarks of the decoding kernels. Inputs are generated before
+ * measurement and decoded into the headless display; messages are read
+ * from memory stream. Reports time per pixel and, when hardware counters
+ * are available through perf_event_open, cycles and instructions per
+ * pixel. Each figure is the median of the measured runs.
+ */
+#include "clidisplay.h"
+#include "cliconn.h"
+#include "rfbenc.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+
+enum { TILE_SIZE = 64, MAX_RUNS = 100 };
+
+enum { CNT_NS, CNT_CYCLES, CNT_INSTRUCTIONS, CNT_COUNT };
+
+typedef struct {
+    int width, height;
+    PixelFormat pixelFormat;
+    unsigned bytespp, cpixelSize;
+    int runCount;
+    const char *filter;         // substring of benchmark names to run
+    DisplayConnection *dispConn;
+    int perfFd;                 // group leader counting cycles, -1 if none
+    unsigned long long begNs;
+    int sampleCount;
+    double samples[CNT_COUNT][MAX_RUNS + 1];
+    unsigned rnd;
+} Bench;
+
+typedef struct {
+    unsigned char *data;
+    unsigned len, cap;
+} Buf;
+
+typedef struct {
+    int x, y, width, height;
+    char pixel[4];
+} FillOp;
+
+static const PixelFormat gPixelFormatRGB565 = {
+    16, 16, 0, 1, 31, 63, 31, 11, 5, 0
+};
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned nextRandom(Bench *b)
+{
+    // xorshift32
+    b->rnd ^= b->rnd << 13;
+    b->rnd ^= b->rnd >> 17;
+    b->rnd ^= b->rnd << 5;
+    return b->rnd;
+}
+
+static void bufPut(Buf *buf, const void *data, unsigned len)
+{
+    if( buf->len + len > buf->cap ) {
+        buf->cap = 2 * buf->cap > buf->len + len ?
+            2 * buf->cap : buf->len + len;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void bufPutU8(Buf *buf, unsigned val)
+{
+    unsigned char c = val;
+
+    bufPut(buf, &c, 1);
+}
+
+/* Stores pixel value in size bytes, in the byte order of the pixel format
+ */
+static void storeValue(const Bench *b, char *dp, unsigned val,
+        unsigned size)
+{
+    unsigned i;
+
+    for(i = 0; i < size; ++i)
+        dp[b->pixelFormat.bigEndian ? size - 1 - i : i] = val >> 8 * i;
+}
+
+static void bufPutValue(Bench *b, Buf *buf, unsigned val, unsigned size)
+{
+    char bytes[4];
+
+    storeValue(b, bytes, val, size);
+    bufPut(buf, bytes, size);
+}
+
+static unsigned randomPixel(Bench *b)
+{
+    const PixelFormat *pf = &b->pixelFormat;
+
+    return (nextRandom(b) % (pf->maxRed + 1)) << pf->shiftRed |
+        (nextRandom(b) % (pf->maxGreen + 1)) << pf->shiftGreen |
+        (nextRandom(b) % (pf->maxBlue + 1)) << pf->shiftBlue;
+}
+
+static int openPerfCounter(unsigned long long config, int groupFd)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = groupFd < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+
+static void openPerfCounters(Bench *b)
+{
+    b->perfFd = openPerfCounter(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if( b->perfFd < 0 ) {
+        log_warn("cycle counters not available");
+        return;
+    }
+    if( openPerfCounter(PERF_COUNT_HW_INSTRUCTIONS, b->perfFd) < 0 ) {
+        log_warn("instruction counter not available");
+        close(b->perfFd);
+        b->perfFd = -1;
+    }
+}
+
+static void measureBegin(Bench *b)
+{
+    if( b->perfFd >= 0 ) {
+        ioctl(b->perfFd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(b->perfFd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    b->begNs = monoTimeNs();
+}
+
+static void measureEnd(Bench *b)
+{
+    // number of counters followed by the values
+    unsigned long long values[3] = { 0, 0, 0 };
+    unsigned long long endNs = monoTimeNs();
+    int n = b->sampleCount++;
+
+    if( b->perfFd >= 0 ) {
+        ioctl(b->perfFd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if( read(b->perfFd, values, sizeof(values)) != sizeof(values) )
+            log_fatal_errno("read counters");
+    }
+    b->samples[CNT_NS][n] = endNs - b->begNs;
+    b->samples[CNT_CYCLES][n] = values[1];
+    b->samples[CNT_INSTRUCTIONS][n] = values[2];
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    double sa = *(const double*)a, sb = *(const double*)b;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/* Prints medians of the samples divided by the pixel count. The first run
+ * warms up caches and is not counted.
+ */
+static void report(Bench *b, const char *name, unsigned long long pixels)
+{
+    double medians[CNT_COUNT];
+    int i, n = b->sampleCount - 1;
+
+    for(i = 0; i < CNT_COUNT; ++i) {
+        double *samples = b->samples[i] + 1;
+        qsort(samples, n, sizeof(double), compareSamples);
+        medians[i] = samples[n / 2] / pixels;
+    }
+    printf("%-24s %10llu %9.3f", name, pixels, medians[CNT_NS]);
+    if( b->perfFd >= 0 )
+        printf(" %9.3f %9.3f\n", medians[CNT_CYCLES],
+                medians[CNT_INSTRUCTIONS]);
+    else
+        printf(" %9s %9s\n", "-", "-");
+    b->sampleCount = 0;
+}
+
+static int isSelected(const Bench *b, const char *name)
+{
+    return b->filter == NULL || strstr(name, b->filter) != NULL;
+}
+
+/* Generates TRLE data of the whole display, all tiles use the same
+ * subencoding. Runs have random length from 1 to maxRun.
+ */
+static void genTRLE(Bench *b, Buf *buf, int subenc, int maxRun)
+{
+    int i, j, k, tx, ty;
+    int paletteSize = subenc >= 130 ? subenc - 128 :
+        subenc == 128 ? 0 : subenc;
+    int bits = paletteSize == 2 ? 1 : paletteSize <= 4 ? 2 : 4;
+
+    buf->len = 0;
+    for(ty = 0; ty < b->height; ty += TILE_SIZE) {
+        int th = b->height - ty < TILE_SIZE ? b->height - ty : TILE_SIZE;
+        for(tx = 0; tx < b->width; tx += TILE_SIZE) {
+            int tw = b->width - tx < TILE_SIZE ? b->width - tx : TILE_SIZE;
+            bufPutU8(buf, subenc);
+            if( subenc == 0 ) {
+                for(i = 0; i < tw * th; ++i)
+                    bufPutValue(b, buf, randomPixel(b), b->cpixelSize);
+            }else if( subenc == 1 ) {
+                bufPutValue(b, buf, randomPixel(b), b->cpixelSize);
+            }else if( subenc == 128 || subenc >= 130 ) {
+                for(k = 0; k < paletteSize; ++k)
+                    bufPutValue(b, buf, randomPixel(b), b->cpixelSize);
+                for(i = tw * th; i > 0; i -= k) {
+                    k = 1 + nextRandom(b) % maxRun;
+                    k = k < i ? k : i;
+                    if( subenc == 128 )
+                        bufPutValue(b, buf, randomPixel(b), b->cpixelSize);
+                    else
+                        bufPutU8(buf, nextRandom(b) % paletteSize |
+                                (k > 1 ? 128 : 0));
+                    if( subenc == 128 || k > 1 ) {
+                        for(j = k - 1; j >= 255; j -= 255)
+                            bufPutU8(buf, 255);
+                        bufPutU8(buf, j);
+                    }
+                }
+            }else{
+                for(k = 0; k < paletteSize; ++k)
+                    bufPutValue(b, buf, randomPixel(b), b->cpixelSize);
+                for(i = 0; i < th; ++i) {
+                    for(j = 0; j < (tw * bits + 7) / 8; ++j)
+                        bufPutU8(buf, nextRandom(b));
+                }
+            }
+        }
+    }
+}
+
+static void benchTRLE(Bench *b)
+{
+    static const struct {
+        const char *name;
+        int subenc, maxRun;
+    } cases[] = {
+        { "trle raw",          0,   0 },
+        { "trle solid",        1,   0 },
+        { "trle packed 2",     2,   0 },
+        { "trle packed 4",     4,   0 },
+        { "trle packed 16",    16,  0 },
+        { "trle rle short",    128, 4 },
+        { "trle rle long",     128, 64 },
+        { "trle prle 16 short", 144, 4 },
+        { "trle prle 16 long", 144, 64 },
+        { "trle prle 127",     255, 16 }
+    };
+    Buf buf = { NULL, 0, 0 };
+    int i, run;
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if( ! isSelected(b, cases[i].name) )
+            continue;
+        genTRLE(b, &buf, cases[i].subenc, cases[i].maxRun);
+        for(run = 0; run <= b->runCount; ++run) {
+            measureBegin(b);
+            if( clidisp_decodeTRLE(b->dispConn, buf.data, buf.len, 0, 0,
+                        b->width, b->height, TILE_SIZE) != buf.len )
+                log_fatal("TRLE data length mismatch");
+            measureEnd(b);
+        }
+        report(b, cases[i].name, (unsigned long long)b->width * b->height);
+    }
+    free(buf.data);
+}
+
+/* Fills with squares of random size from minSize to maxSize, covering
+ * about the display area
+ */
+static void benchFillRect(Bench *b)
+{
+    static const struct {
+        const char *name;
+        int minSize, maxSize;
+    } cases[] = {
+        { "fillRect 1x1",   1,  1 },
+        { "fillRect 4x4",   4,  4 },
+        { "fillRect 16x16", 16, 16 },
+        { "fillRect 64x64", 64, 64 },
+        { "fillRect mixed", 1,  64 }
+    };
+    int i, k, run, opCount;
+    unsigned long long pixels;
+
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if( ! isSelected(b, cases[i].name) )
+            continue;
+        FillOp *ops = NULL;
+        pixels = opCount = 0;
+        while( pixels < (unsigned long long)b->width * b->height ) {
+            ops = realloc(ops, (opCount + 1) * sizeof(FillOp));
+            FillOp *op = ops + opCount++;
+            op->width = op->height = cases[i].minSize + nextRandom(b) %
+                (cases[i].maxSize - cases[i].minSize + 1);
+            op->x = nextRandom(b) % (b->width - op->width + 1);
+            op->y = nextRandom(b) % (b->height - op->height + 1);
+            storeValue(b, op->pixel, randomPixel(b), b->bytespp);
+            pixels += op->width * op->height;
+        }
+        for(run = 0; run <= b->runCount; ++run) {
+            measureBegin(b);
+            for(k = 0; k < opCount; ++k) {
+                const FillOp *op = ops + k;
+                clidisp_fillRect(b->dispConn, op->pixel, op->x, op->y,
+                        op->width, op->height);
+            }
+            measureEnd(b);
+        }
+        report(b, cases[i].name, pixels);
+        free(ops);
+    }
+}
+
+static void benchCopyRect(Bench *b)
+{
+    int k, run, blockCount = 0;
+    FillOp *blocks;
+
+    if( isSelected(b, "copyRect scroll") ) {
+        for(run = 0; run <= b->runCount; ++run) {
+            measureBegin(b);
+            clidisp_copyRect(b->dispConn, 0, 16, 0, 0, b->width,
+                    b->height - 16);
+            measureEnd(b);
+        }
+        report(b, "copyRect scroll",
+                (unsigned long long)b->width * (b->height - 16));
+    }
+    if( isSelected(b, "copyRect 64x64") ) {
+        blockCount = b->width / 64 * (b->height / 64);
+        blocks = malloc(blockCount * sizeof(FillOp));
+        for(k = 0; k < blockCount; ++k) {
+            blocks[k].x = nextRandom(b) % (b->width - 63);
+            blocks[k].y = nextRandom(b) % (b->height - 63);
+        }
+        for(run = 0; run <= b->runCount; ++run) {
+            measureBegin(b);
+            for(k = 0; k < blockCount; ++k)
+                clidisp_copyRect(b->dispConn, blocks[k].x, blocks[k].y,
+                        blocks[(k + 1) % blockCount].x,
+                        blocks[(k + 1) % blockCount].y, 64, 64);
+            measureEnd(b);
+        }
+        report(b, "copyRect 64x64", blockCount * 64 * 64ULL);
+        free(blocks);
+    }
+}
+
+static void benchReadRect(Bench *b)
+{
+    int run;
+    unsigned len = b->width * b->height * b->bytespp;
+    char *data, *dest;
+
+    if( ! isSelected(b, "sock_readRect") )
+        return;
+    data = malloc(len);
+    dest = malloc(len);
+    memset(data, 0x5a, len);
+    for(run = 0; run <= b->runCount; ++run) {
+        SockStream *strm = sock_openMemory(data, len);
+        measureBegin(b);
+        sock_readRect(strm, dest, b->width * b->bytespp,
+                b->width * b->bytespp, b->height);
+        measureEnd(b);
+        sock_close(strm);
+    }
+    report(b, "sock_readRect", (unsigned long long)b->width * b->height);
+    free(data);
+    free(dest);
+}
+
+/* Generates image of the display size in 32-bit format: text-like glyphs
+ * or 4x4 blocks of random colors
+ */
+static unsigned *genImage(Bench *b, int isText)
+{
+    int i, j;
+    unsigned *img = malloc(b->width * b->height * 4);
+    unsigned color = 0;
+
+    for(i = 0; i < b->height; ++i) {
+        for(j = 0; j < b->width; ++j) {
+            if( isText ) {
+                // glyph cells 8x16 with blank separating lines
+                int isInk = i % 16 >= 3 && i % 16 < 13 && j % 8 < 7 &&
+                    ((i / 16 * 131 + j / 8) * 2654435761u >> (i % 16 + j % 8)
+                     & 1);
+                img[i * b->width + j] = isInk ? 0x202020 : 0xffffff;
+            }else{
+                if( j % 4 == 0 )
+                    color = i % 4 == 0 ? nextRandom(b) & 0xffffff :
+                        img[(i - 1) * b->width + j];
+                img[i * b->width + j] = color;
+            }
+        }
+    }
+    return img;
+}
+
+/* Decodes FramebufferUpdate messages of the whole display with the
+ * connection code, reading from memory stream
+ */
+static void benchMessages(Bench *b)
+{
+    static const struct {
+        const char *name;
+        int encType, isText;
+    } cases[] = {
+        { "msg raw",            0,  0 },
+        { "msg rre text",       2,  1 },
+        { "msg rre blocks",     2,  0 },
+        { "msg hextile text",   5,  1 },
+        { "msg hextile blocks", 5,  0 },
+        { "msg zrle text",      16, 1 },
+        { "msg zrle blocks",    16, 0 }
+    };
+    static const PixelFormat imgFormat = {
+        32, 24, 0, 1, 255, 255, 255, 16, 8, 0
+    };
+    PixelFormat fbFormat = imgFormat;
+    const unsigned one = 1;
+    unsigned *images[2] = { NULL, NULL }, len;
+    int i, run;
+
+    fbFormat.bigEndian = *(const char*)&one == 0;
+    for(i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        if( ! isSelected(b, cases[i].name) )
+            continue;
+        if( images[cases[i].isText] == NULL )
+            images[cases[i].isText] = genImage(b, cases[i].isText);
+        RfbEncoder *enc = rfbenc_create(&fbFormat);
+        rfbenc_setClientFormat(enc, &b->pixelFormat);
+        rfbenc_beginUpdate(enc, 1);
+        rfbenc_putRect(enc, cases[i].encType, images[cases[i].isText],
+                b->width, 0, 0, b->width, b->height);
+        // the message type is read by cliconn_nextEvent, skip it
+        const char *data = rfbenc_getData(enc, &len);
+        for(run = 0; run <= b->runCount; ++run) {
+            CliConn *conn = cliconn_openStream(
+                    sock_openMemory(data + 1, len - 1), b->width,
+                    b->height, &b->pixelFormat);
+            // present once a second at most, i.e. not during measurement
+            cliconn_setRefreshRate(conn, 1);
+            measureBegin(b);
+            cliconn_recvFramebufferUpdate(conn, b->dispConn);
+            measureEnd(b);
+            cliconn_close(conn);
+        }
+        report(b, cases[i].name, (unsigned long long)b->width * b->height);
+        rfbenc_free(enc);
+    }
+    free(images[0]);
+    free(images[1]);
+}
+
+static void usage(void)
+{
+    printf("\n"
+        "usage: decbench [parameters] [name-substring]\n"
+        "\n"
+        "parameters:\n"
+        "  -g |-geometry  <WxH>   - display size, 1920x1080 by default\n"
+        "  -n |-runs      <n>     - measured runs per benchmark, 15 by "
+        "default\n"
+        "  -pf|-pixelformat <fmt> - server pixel format: native (32 bits,\n"
+        "                           default) or rgb565\n"
+        "  -h |-help              - print this help\n"
+        "\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    Bench b;
+    const unsigned one = 1;
+    int i;
+
+    memset(&b, 0, sizeof(b));
+    b.width = 1920;
+    b.height = 1080;
+    b.runCount = 15;
+    b.rnd = 2463534242u;
+    b.pixelFormat.bitsPerPixel = 32;
+    b.pixelFormat.depth = 24;
+    b.pixelFormat.bigEndian = *(const char*)&one == 0;
+    b.pixelFormat.trueColor = 1;
+    b.pixelFormat.maxRed = b.pixelFormat.maxGreen = 255;
+    b.pixelFormat.maxBlue = 255;
+    b.pixelFormat.shiftRed = 16;
+    b.pixelFormat.shiftGreen = 8;
+    b.pixelFormat.shiftBlue = 0;
+    for(i = 1; i < argc; ++i) {
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        if( !strcmp(argv[i], "-g") || !strcmp(argv[i], "-geometry") ) {
+            if( sscanf(val, "%dx%d", &b.width, &b.height) != 2 ||
+                    b.width < 64 || b.height < 64 )
+            {
+                fprintf(stderr, "error: bad geometry\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(argv[i], "-n") || !strcmp(argv[i], "-runs") ) {
+            if( (b.runCount = atoi(val)) <= 0 || b.runCount > MAX_RUNS ) {
+                fprintf(stderr, "error: bad number of runs\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(argv[i], "-pf") ||
+                !strcmp(argv[i], "-pixelformat") )
+        {
+            if( !strcmp(val, "rgb565") )
+                b.pixelFormat = gPixelFormatRGB565;
+            else if( strcmp(val, "native") ) {
+                fprintf(stderr, "error: bad pixel format\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(argv[i], "-h") || !strcmp(argv[i], "-help") )
+            usage();
+        else if( argv[i][0] == '-' ) {
+            fprintf(stderr, "error: unrecognized option -- %s\n\n", argv[i]);
+            exit(1);
+        }else
+            b.filter = argv[i];
+    }
+    b.bytespp = (b.pixelFormat.bitsPerPixel + 7) / 8;
+    b.cpixelSize = b.pixelFormat.bitsPerPixel == 32 &&
+        b.pixelFormat.depth <= 24 ? 3 : b.bytespp;
+    b.dispConn = clidisp_openHeadless(b.width, b.height, NULL);
+    clidisp_setServerPixelFormat(b.dispConn, &b.pixelFormat);
+    openPerfCounters(&b);
+    printf("%dx%d, %u bits per pixel, %d runs\n", b.width, b.height,
+            b.pixelFormat.bitsPerPixel, b.runCount);
+    printf("%-24s %10s %9s %9s %9s\n", "benchmark", "pixels", "ns/pix",
+            "cyc/pix", "ins/pix");
+    benchTRLE(&b);
+    benchFillRect(&b);
+    benchCopyRect(&b);
+    benchReadRect(&b);
+    benchMessages(&b);
+    clidisp_close(b.dispConn);
+    return 0;
+}
@@ -0,0 +1,91 @@
+#ifndef DISPBACKEND_H
+#define DISPBACKEND_H
+
+#include "clidisplay.h"
+#include "pixconv.h"
+#include "fbexport.h"
+
+/* Display backend interface. The framebuffer, damage tracking and
+ * decoding are common; backends provide framebuffer memory, presenting,
+ * cursor and input events. A backend's connection structure starts with
+ * DisplayConnection.
+ */
+
+typedef struct {
+    char *data;
+    int width, height;
+    int bytesPerLine;
+    int bitsPerPixel;
+    void *handle;           // backend data of the framebuffer
+    FbExportSegment *shared;    // exported memory, NULL when not exported
+} Framebuffer;
+
+typedef struct {
+    void (*getPixelFormat)(DisplayConnection*, PixelFormat*);
+
+    /* Allocates framebuffer memory; in exported segment when fbExport
+     * of the connection is set
+     */
+    void (*createFramebuffer)(DisplayConnection*, Framebuffer*,
+            int width, int height);
+    void (*destroyFramebuffer)(DisplayConnection*, Framebuffer*);
+
+    /* Called after the framebuffer size is changed
+     */
+    void (*resized)(DisplayConnection*);
+
+    /* See clidisp_nextEvent
+     */
+    int (*nextEvent)(DisplayConnection*, int isCliDataAvail, int cliFd,
+            DisplayEvent*, int timeoutUs);
+
+    /* Presents the damaged areas
+     */
+    void (*present)(DisplayConnection*);
+
+    /* Waits until the presented images are displayed; NULL when present
+     * is synchronous
+     */
+    void (*sync)(DisplayConnection*);
+
+    /* Sets cursor; the pixels are already in display format
+     */
+    void (*setCursor)(DisplayConnection*, int hotX, int hotY,
+            int width, int height, const char *pixels,
+            const unsigned char *mask);
+    void (*setMonoCursor)(DisplayConnection*, int hotX, int hotY,
+            int width, int height, const unsigned char *fgRGB,
+            const unsigned char *bgRGB, const unsigned char *bitmap,
+            const unsigned char *mask);
+
+    /* Releases backend resources, except the framebuffer and the
+     * connection structure itself
+     */
+    void (*close)(DisplayConnection*);
+} DisplayBackend;
+
+enum { DAMAGE_MAX = 16 };
+
+struct DisplayConnection {
+    const DisplayBackend *backend;
+    Framebuffer fb;
+    RectangleArea damage[DAMAGE_MAX];
+    int damageCount;
+    PixelFormat srcFormat;          // pixel format used by server
+    PixelConverter *conv;           // NULL when server uses display format
+    unsigned srcBytespp;
+    unsigned cpixelSize, cpixelShift;   // ZRLE compressed pixel
+    FbExport *fbExport;             // NULL when not exported
+    char *lineBuf;                  // server pixels of a line
+    unsigned lineBufSize;
+};
+
+
+/* Initializes the common part of the connection and creates the
+ * framebuffer
+ */
+void clidisp_init(DisplayConnection*, const DisplayBackend*,
+        int width, int height);
+
+
+#endif /* DISPBACKEND_H */
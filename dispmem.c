@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include "dispbackend.h"
+#include "vnclog.h"
+
+
+/* Headless display: the remote desktop is kept in memory only
+ */
+typedef struct {
+    DisplayConnection base;
+    char *framePattern;         // NULL when frames are not written
+    unsigned frameNo;
+} MemDisplay;
+
+static void getPixelFormat(DisplayConnection *conn, PixelFormat *pixelFormat)
+{
+    pixelFormat->bitsPerPixel = 32;
+    pixelFormat->depth = 24;
+    pixelFormat->bigEndian = 0;
+    pixelFormat->trueColor = 1;
+    pixelFormat->maxRed = pixelFormat->maxGreen = pixelFormat->maxBlue = 255;
+    pixelFormat->shiftRed = 16;
+    pixelFormat->shiftGreen = 8;
+    pixelFormat->shiftBlue = 0;
+}
+
+static void createFramebuffer(DisplayConnection *conn, Framebuffer *fb,
+        int width, int height)
+{
+    fb->width = width;
+    fb->height = height;
+    fb->bitsPerPixel = 32;
+    fb->bytesPerLine = width * 4;
+    fb->handle = NULL;
+    if( conn->fbExport != NULL ) {
+        fb->shared = fbexport_createSegment(conn->fbExport, width, height,
+                fb->bytesPerLine);
+        fb->data = fbexport_getPixels(fb->shared);
+    }else{
+        fb->shared = NULL;
+        fb->data = calloc(height, fb->bytesPerLine);
+    }
+}
+
+static void destroyFramebuffer(DisplayConnection *conn, Framebuffer *fb)
+{
+    if( fb->shared != NULL )
+        fbexport_destroySegment(conn->fbExport, fb->shared);
+    else
+        free(fb->data);
+}
+
+static void resized(DisplayConnection *conn)
+{
+}
+
+static int nextEvent(DisplayConnection *conn, int isCliDataAvail, int cliFd,
+        DisplayEvent *displayEvent, int timeoutUs)
+{
+    struct pollfd pfd;
+    int res;
+
+    displayEvent->evType = VET_NONE;
+    if( isCliDataAvail )
+        return 1;
+    pfd.fd = cliFd;
+    pfd.events = POLLIN;
+    res = poll(&pfd, 1, timeoutUs < 0 ? -1 : (timeoutUs + 999) / 1000);
+    if( res < 0 )
+        log_fatal_errno("poll");
+    return res > 0;
+}
+
+static void present(DisplayConnection *conn)
+{
+    MemDisplay *mconn = (MemDisplay*)conn;
+    int i;
+
+    for(i = 0; i < conn->damageCount; ++i) {
+        const RectangleArea *dmg = conn->damage + i;
+        log_debug("frame %u: damage %dx%d+%d+%d", mconn->frameNo,
+                dmg->width, dmg->height, dmg->x, dmg->y);
+    }
+    if( mconn->framePattern != NULL ) {
+        char fileName[4096];
+        snprintf(fileName, sizeof(fileName), mconn->framePattern,
+                mconn->frameNo);
+        clidisp_dumpFrame(conn, fileName);
+    }
+    ++mconn->frameNo;
+}
+
+static void setCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const char *pixels, const unsigned char *mask)
+{
+}
+
+static void setMonoCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const unsigned char *fgRGB,
+        const unsigned char *bgRGB, const unsigned char *bitmap,
+        const unsigned char *mask)
+{
+}
+
+static void closeDisplay(DisplayConnection *conn)
+{
+    free(((MemDisplay*)conn)->framePattern);
+}
+
+static const DisplayBackend gMemBackend = {
+    getPixelFormat,
+    createFramebuffer,
+    destroyFramebuffer,
+    resized,
+    nextEvent,
+    present,
+    NULL,
+    setCursor,
+    setMonoCursor,
+    closeDisplay
+};
+
+DisplayConnection *clidisp_openHeadless(int width, int height,
+        const char *framePattern)
+{
+    MemDisplay *conn = malloc(sizeof(MemDisplay));
+
+    conn->framePattern = framePattern ? strdup(framePattern) : NULL;
+    conn->frameNo = 0;
+    clidisp_init(&conn->base, &gMemBackend, width, height);
+    return &conn->base;
+}
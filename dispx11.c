@@ -0,0 +1,620 @@
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/shm.h>
+#include <string.h>
+#include <sys/select.h>
+#include <pthread.h>
+#include "dispbackend.h"
+#include "trace.h"
+#include "vnclog.h"
+
+
+typedef struct {
+    DisplayConnection base;
+    Display *d;
+    Window win;
+    GC gc;
+    Cursor dummyCursor, cursor;
+    fd_set fds;
+    KeySym lastKeysymDown;
+    int isShmAvail;
+    PresentMode presentMode;
+    int isFullScreen;
+    int winWidth, winHeight;
+} X11Display;
+
+typedef struct {
+    XImage *img;
+    XShmSegmentInfo shmInfo;
+    Pixmap pixmap;              // image copy in PRESENT_PIXMAP mode
+} X11Image;
+
+static XImage *getImage(const DisplayConnection *conn)
+{
+    return ((X11Image*)conn->fb.handle)->img;
+}
+
+static void createFramebuffer(DisplayConnection *conn, Framebuffer *fb,
+        int width, int height)
+{
+    X11Display *xconn = (X11Display*)conn;
+    X11Image *ximg = malloc(sizeof(X11Image));
+    XShmSegmentInfo *shmInfo = &ximg->shmInfo;
+    XImage *img;
+    int defScreenNum = XDefaultScreen(xconn->d);
+    Visual *defVis = XDefaultVisual(xconn->d, defScreenNum);
+    int defDepth = XDefaultDepth(xconn->d, defScreenNum);
+
+    memset(shmInfo, 0, sizeof(*shmInfo));
+    fb->shared = NULL;
+    // the SysV shared memory of XShm can not be exported as memfd
+    if( xconn->isShmAvail && conn->fbExport == NULL ) {
+        img = XShmCreateImage(xconn->d, defVis, defDepth, ZPixmap, NULL,
+                shmInfo, width, height);
+        shmInfo->shmid = shmget(IPC_PRIVATE,
+                img->bytes_per_line * img->height, IPC_CREAT|0777);
+        log_debug("shm id: %d", shmInfo->shmid);
+        shmInfo->shmaddr = img->data = shmat (shmInfo->shmid, 0, 0);
+        shmInfo->readOnly = False;
+        Status st = XShmAttach(xconn->d, shmInfo);
+        shmctl(shmInfo->shmid, IPC_RMID, NULL);
+        if( st == 0 )
+            log_fatal("XShmAttach failed");
+    }else{
+        img = XCreateImage(xconn->d, defVis, defDepth, ZPixmap, 0, NULL,
+                width, height, 32, 0);
+        if( conn->fbExport != NULL ) {
+            fb->shared = fbexport_createSegment(conn->fbExport, width,
+                    height, img->bytes_per_line);
+            img->data = fbexport_getPixels(fb->shared);
+        }else
+            img->data = malloc(img->bytes_per_line * height);
+    }
+    ximg->img = img;
+    fb->data = img->data;
+    fb->width = width;
+    fb->height = height;
+    fb->bytesPerLine = img->bytes_per_line;
+    fb->bitsPerPixel = img->bits_per_pixel;
+    fb->handle = ximg;
+    ximg->pixmap = None;
+    if( xconn->presentMode == PRESENT_PIXMAP ) {
+        ximg->pixmap = XCreatePixmap(xconn->d, XDefaultRootWindow(xconn->d),
+                width, height, defDepth);
+        // the pixmap contents are undefined until filled
+        GC gc = XCreateGC(xconn->d, ximg->pixmap, 0, NULL);
+        XFillRectangle(xconn->d, ximg->pixmap, gc, 0, 0, width, height);
+        XFreeGC(xconn->d, gc);
+    }
+}
+
+static void destroyFramebuffer(DisplayConnection *conn, Framebuffer *fb)
+{
+    X11Display *xconn = (X11Display*)conn;
+    X11Image *ximg = fb->handle;
+
+    if( ximg->pixmap != None )
+        XFreePixmap(xconn->d, ximg->pixmap);
+    if( ximg->shmInfo.shmaddr != NULL ) {
+        XShmDetach(xconn->d, &ximg->shmInfo);
+        XDestroyImage(ximg->img);   // does not free the shared memory
+        shmdt(ximg->shmInfo.shmaddr);
+    }else if( fb->shared != NULL ) {
+        ximg->img->data = NULL;     // not to be freed by XDestroyImage
+        XDestroyImage(ximg->img);
+        fbexport_destroySegment(conn->fbExport, fb->shared);
+    }else
+        XDestroyImage(ximg->img);
+    free(ximg);
+}
+
+static void extractShiftMaxFromMask(unsigned long mask,
+        unsigned *resMax, unsigned *resShift)
+{
+    unsigned shift = 0;
+
+    if( mask == 0 )
+        log_fatal("your display is not true-color one");
+    while( (mask & 1) == 0 ) {
+        mask >>= 1;
+        ++shift;
+    }
+    *resMax = mask;
+    *resShift = shift;
+}
+
+static void getPixelFormat(DisplayConnection *conn, PixelFormat *pixelFormat)
+{
+    X11Display *xconn = (X11Display*)conn;
+    XImage *img = getImage(conn);
+
+    pixelFormat->bitsPerPixel = img->bits_per_pixel;
+    int defScreenNum = XDefaultScreen(xconn->d);
+    pixelFormat->depth = XDefaultDepth(xconn->d, defScreenNum);
+    pixelFormat->bigEndian = img->byte_order == MSBFirst;
+    pixelFormat->trueColor = True;
+    extractShiftMaxFromMask(img->red_mask, &pixelFormat->maxRed,
+            &pixelFormat->shiftRed);
+    extractShiftMaxFromMask(img->green_mask, &pixelFormat->maxGreen,
+            &pixelFormat->shiftGreen);
+    extractShiftMaxFromMask(img->blue_mask, &pixelFormat->maxBlue,
+            &pixelFormat->shiftBlue);
+}
+
+static void resized(DisplayConnection *conn)
+{
+    X11Display *xconn = (X11Display*)conn;
+
+    if( ! xconn->isFullScreen )
+        XResizeWindow(xconn->d, xconn->win, conn->fb.width, conn->fb.height);
+    // the old area outside of new image gets window background on expose
+    XClearWindow(xconn->d, xconn->win);
+}
+
+static void replaceCursor(X11Display *xconn, Cursor cursor)
+{
+    XDefineCursor(xconn->d, xconn->win, cursor);
+    if( xconn->cursor != xconn->dummyCursor )
+        XFreeCursor(xconn->d, xconn->cursor);
+    xconn->cursor = cursor;
+    XFlush(xconn->d);
+}
+
+/* Creates bitmap from RFB cursor bit mask. RFB masks are stored with most
+ * significant bit first, X bitmaps - with least significant bit first.
+ */
+static Pixmap createBitmapFromMask(X11Display *xconn,
+        const unsigned char *mask, int width, int height)
+{
+    int i, maskLen = (width + 7) / 8 * height;
+    unsigned char *bits = malloc(maskLen);
+
+    for(i = 0; i < maskLen; ++i) {
+        unsigned c = mask[i];
+        c = (c & 0xf0) >> 4 | (c & 0x0f) << 4;
+        c = (c & 0xcc) >> 2 | (c & 0x33) << 2;
+        bits[i] = (c & 0xaa) >> 1 | (c & 0x55) << 1;
+    }
+    Pixmap res = XCreateBitmapFromData(xconn->d, xconn->win, (char*)bits,
+            width, height);
+    free(bits);
+    return res;
+}
+
+static void setMonoCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const unsigned char *fgRGB,
+        const unsigned char *bgRGB, const unsigned char *bitmap,
+        const unsigned char *mask)
+{
+    X11Display *xconn = (X11Display*)conn;
+    XColor fg, bg;
+
+    if( width == 0 || height == 0 ) {
+        replaceCursor(xconn, xconn->dummyCursor);
+        return;
+    }
+    fg.red = fgRGB[0] * 257;
+    fg.green = fgRGB[1] * 257;
+    fg.blue = fgRGB[2] * 257;
+    bg.red = bgRGB[0] * 257;
+    bg.green = bgRGB[1] * 257;
+    bg.blue = bgRGB[2] * 257;
+    Pixmap source = createBitmapFromMask(xconn, bitmap, width, height);
+    Pixmap maskPixmap = createBitmapFromMask(xconn, mask, width, height);
+    replaceCursor(xconn, XCreatePixmapCursor(xconn->d, source, maskPixmap,
+                &fg, &bg, hotX, hotY));
+    XFreePixmap(xconn->d, source);
+    XFreePixmap(xconn->d, maskPixmap);
+}
+
+static unsigned extractColorComponent(unsigned long pixel, unsigned long mask)
+{
+    unsigned max;
+
+    if( mask == 0 )
+        return 0;
+    while( (mask & 1) == 0 ) {
+        mask >>= 1;
+        pixel >>= 1;
+    }
+    max = mask;
+    return (pixel & mask) * 255 / max;
+}
+
+static void setCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const char *pixels, const unsigned char *mask)
+{
+    X11Display *xconn = (X11Display*)conn;
+    XImage *img = getImage(conn);
+    int i, j, evBase, errBase;
+    int bytesPerMaskLine = (width + 7) / 8;
+
+    if( width == 0 || height == 0 ) {
+        replaceCursor(xconn, xconn->dummyCursor);
+        return;
+    }
+    int defScreenNum = XDefaultScreen(xconn->d);
+    XImage *srcImg = XCreateImage(xconn->d,
+            XDefaultVisual(xconn->d, defScreenNum),
+            XDefaultDepth(xconn->d, defScreenNum), ZPixmap, 0, (char*)pixels,
+            width, height, 8, width * clidisp_getBytesPerPixel(conn));
+    srcImg->byte_order = img->byte_order;
+    if( XRenderQueryExtension(xconn->d, &evBase, &errBase) ) {
+        XRenderPictFormat *fmt = XRenderFindStandardFormat(xconn->d,
+                PictStandardARGB32);
+        XImage *argbImg = XCreateImage(xconn->d, NULL, 32, ZPixmap, 0,
+                malloc(width * height * 4), width, height, 32, 0);
+        for(i = 0; i < height; ++i) {
+            for(j = 0; j < width; ++j) {
+                unsigned long argb = 0;
+                if( mask[i * bytesPerMaskLine + j / 8] & 0x80 >> j % 8 ) {
+                    unsigned long pixel = XGetPixel(srcImg, j, i);
+                    argb = 0xff000000 |
+                        extractColorComponent(pixel, img->red_mask) << 16 |
+                        extractColorComponent(pixel, img->green_mask) << 8 |
+                        extractColorComponent(pixel, img->blue_mask);
+                }
+                XPutPixel(argbImg, j, i, argb);
+            }
+        }
+        Pixmap pixmap = XCreatePixmap(xconn->d, xconn->win, width, height,
+                32);
+        GC gc = XCreateGC(xconn->d, pixmap, 0, NULL);
+        XPutImage(xconn->d, pixmap, gc, argbImg, 0, 0, 0, 0, width, height);
+        Picture pict = XRenderCreatePicture(xconn->d, pixmap, fmt, 0, NULL);
+        replaceCursor(xconn, XRenderCreateCursor(xconn->d, pict, hotX, hotY));
+        XRenderFreePicture(xconn->d, pict);
+        XFreeGC(xconn->d, gc);
+        XFreePixmap(xconn->d, pixmap);
+        XDestroyImage(argbImg);
+    }else{
+        // no ARGB cursors; use two-color one with pixels split by luminance
+        static const unsigned char white[3] = { 255, 255, 255 };
+        static const unsigned char black[3] = { 0, 0, 0 };
+        unsigned char *bitmap = calloc(bytesPerMaskLine * height, 1);
+        for(i = 0; i < height; ++i) {
+            for(j = 0; j < width; ++j) {
+                unsigned long pixel = XGetPixel(srcImg, j, i);
+                if( extractColorComponent(pixel, img->red_mask) * 3 +
+                    extractColorComponent(pixel, img->green_mask) * 6 +
+                    extractColorComponent(pixel, img->blue_mask) >=
+                    128 * 10 )
+                {
+                    bitmap[i * bytesPerMaskLine + j / 8] |= 0x80 >> j % 8;
+                }
+            }
+        }
+        setMonoCursor(conn, hotX, hotY, width, height, white, black,
+                bitmap, mask);
+        free(bitmap);
+    }
+    srcImg->data = NULL;    // not owned by the image
+    XDestroyImage(srcImg);
+}
+
+static void present(DisplayConnection *conn)
+{
+    X11Display *xconn = (X11Display*)conn;
+    X11Image *ximg = conn->fb.handle;
+    int i, isPixmap = ximg->pixmap != None;
+    Drawable dest = isPixmap ? ximg->pixmap : xconn->win;
+
+    for(i = 0; i < conn->damageCount; ++i) {
+        const RectangleArea *dmg = conn->damage + i;
+        if( ximg->shmInfo.shmaddr != NULL ) {
+            XShmPutImage(xconn->d, dest, xconn->gc, ximg->img,
+                    dmg->x, dmg->y, dmg->x, dmg->y,
+                    dmg->width, dmg->height, False);
+        }else{
+            XPutImage(xconn->d, dest, xconn->gc, ximg->img,
+                    dmg->x, dmg->y, dmg->x, dmg->y,
+                    dmg->width, dmg->height);
+        }
+        if( isPixmap )
+            XCopyArea(xconn->d, ximg->pixmap, xconn->win, xconn->gc,
+                    dmg->x, dmg->y, dmg->width, dmg->height, dmg->x, dmg->y);
+    }
+    XFlush(xconn->d);
+}
+
+static void syncDisplay(DisplayConnection *conn)
+{
+    XSync(((X11Display*)conn)->d, False);
+}
+
+static unsigned convertMouseButtonState(unsigned state)
+{
+    return (state & Button1Mask ? 1 : 0) | (state & Button2Mask ? 2 : 0) |
+            (state & Button3Mask ? 4 : 0) | (state & Button4Mask ? 8 : 0) |
+            (state & Button5Mask ? 16 : 0);
+}
+
+static void processPendingEvents(X11Display *conn,
+        DisplayEvent *displayEvent, Bool assumeFirstIsPending)
+{
+    XEvent xev;
+    KeySym keysym;
+
+    while( displayEvent->evType == VET_NONE &&
+            (assumeFirstIsPending || XPending(conn->d) != 0) )
+    {
+        XNextEvent(conn->d, &xev);
+        assumeFirstIsPending = False;
+        trace_instant("xEvent", "type", xev.type);
+        switch( xev.type ) {
+        case KeyPress:
+            XLookupString(&xev.xkey, NULL, 0, &keysym, NULL);
+            if( keysym != NoSymbol ) {
+                displayEvent->evType = VET_KEY;
+                displayEvent->kev.isDown = 1;
+                displayEvent->kev.keysym = keysym;
+                conn->lastKeysymDown = keysym;
+            }
+            break;
+        case KeyRelease:
+            XLookupString(&xev.xkey, NULL, 0, &keysym, NULL);
+            if( keysym != NoSymbol ) {
+                conn->lastKeysymDown = NoSymbol;
+                displayEvent->evType = VET_KEY;
+                displayEvent->kev.isDown = 0;
+                displayEvent->kev.keysym = keysym;
+            }
+            break;
+        case FocusIn:
+            break;
+        case FocusOut:
+#if 0
+            if( conn->isFullScreen ) {
+                // XXX: why focus goes nowhere when xscreensaver turns "on"
+                Window win;
+                int d;
+                XGetInputFocus(conn->d, &win, &d);
+                if( win == None && d == 0 ) {
+                    log_debug("set input focus to mine");
+                    XSetInputFocus(conn->d, conn->win,
+                            RevertToPointerRoot, CurrentTime);
+                }
+            }
+#endif
+            if( conn->lastKeysymDown != NoSymbol ) {
+                log_debug("send key %lu UP on leave",
+                        conn->lastKeysymDown);
+                // mimic keyup
+                displayEvent->evType = VET_KEY;
+                displayEvent->kev.isDown = 0;
+                displayEvent->kev.keysym = conn->lastKeysymDown;
+                conn->lastKeysymDown = NoSymbol;
+            }
+            break;
+        case ButtonPress:
+            displayEvent->evType = VET_MOUSE;
+            displayEvent->pev.x = xev.xbutton.x;
+            displayEvent->pev.y = xev.xbutton.y;
+            displayEvent->pev.buttonMask =
+                convertMouseButtonState(xev.xbutton.state |
+                (xev.xbutton.button == Button1 ? Button1Mask : 0) |
+                (xev.xbutton.button == Button2 ? Button2Mask : 0) |
+                (xev.xbutton.button == Button3 ? Button3Mask : 0) |
+                (xev.xbutton.button == Button4 ? Button4Mask : 0) |
+                (xev.xbutton.button == Button5 ? Button5Mask : 0));
+            break;
+        case ButtonRelease:
+            displayEvent->evType = VET_MOUSE;
+            displayEvent->pev.x = xev.xbutton.x;
+            displayEvent->pev.y = xev.xbutton.y;
+            displayEvent->pev.buttonMask =
+                convertMouseButtonState(xev.xbutton.state &
+                ~(xev.xbutton.button == Button1 ? Button1Mask : 0) &
+                ~(xev.xbutton.button == Button2 ? Button2Mask : 0) &
+                ~(xev.xbutton.button == Button3 ? Button3Mask : 0) &
+                ~(xev.xbutton.button == Button4 ? Button4Mask : 0) &
+                ~(xev.xbutton.button == Button5 ? Button5Mask : 0));
+            break;
+        case MotionNotify:
+            displayEvent->evType = VET_MOUSE;
+            displayEvent->pev.x = xev.xbutton.x;
+            displayEvent->pev.y = xev.xbutton.y;
+            displayEvent->pev.buttonMask =
+                convertMouseButtonState(xev.xbutton.state);
+            break;
+        case ConfigureNotify:
+            if( xev.xconfigure.width != conn->winWidth ||
+                    xev.xconfigure.height != conn->winHeight )
+            {
+                conn->winWidth = xev.xconfigure.width;
+                conn->winHeight = xev.xconfigure.height;
+                displayEvent->evType = VET_RESIZE;
+                displayEvent->area.x = xev.xconfigure.x;
+                displayEvent->area.y = xev.xconfigure.y;
+                displayEvent->area.width = xev.xconfigure.width;
+                displayEvent->area.height = xev.xconfigure.height;
+            }
+            break;
+        case MapNotify:
+        case UnmapNotify:
+        case ReparentNotify:
+            break;
+        case Expose:
+            if( conn->presentMode == PRESENT_PIXMAP ) {
+                // the pixmap is up to date except the pending damage
+                X11Image *ximg = conn->base.fb.handle;
+                XCopyArea(conn->d, ximg->pixmap, conn->win, conn->gc,
+                        xev.xexpose.x, xev.xexpose.y, xev.xexpose.width,
+                        xev.xexpose.height, xev.xexpose.x, xev.xexpose.y);
+                break;
+            }
+            clidisp_addDamage(&conn->base, xev.xexpose.x, xev.xexpose.y,
+                    xev.xexpose.width, xev.xexpose.height);
+            if( xev.xexpose.count == 0 )
+                clidisp_flush(&conn->base);
+            break;
+        case ClientMessage:
+            // assume WM_DELETE_WINDOW
+            displayEvent->evType = VET_CLOSE;
+            break;
+        default:
+            log_info("unhandled event: %d", xev.type);
+            break;
+        }
+    }
+}
+
+static int nextEvent(DisplayConnection *dconn, int isCliDataAvail, int cliFd,
+        DisplayEvent *displayEvent, int timeoutUs)
+{
+    X11Display *conn = (X11Display*)dconn;
+    Bool isEvFd = isCliDataAvail;
+    struct timeval tmout;
+
+    if( timeoutUs > 0 ) {
+        tmout.tv_sec = timeoutUs / 1000000;
+        tmout.tv_usec = timeoutUs % 1000000;
+    }else{
+        tmout.tv_sec = 0;
+        tmout.tv_usec = 0;
+    }
+    displayEvent->evType = VET_NONE;
+    processPendingEvents(conn, displayEvent, False);
+    while( displayEvent->evType == VET_NONE && !isEvFd ) {
+        int dispFd = XConnectionNumber(conn->d);
+        int sockFd = cliFd;
+        FD_SET(dispFd, &conn->fds);
+        if( sockFd >= 0 )
+            FD_SET(sockFd, &conn->fds);
+        int selCnt = select((dispFd > sockFd ? dispFd : sockFd)+1,
+                &conn->fds, NULL, NULL, timeoutUs < 0 ? NULL : &tmout);
+        if( selCnt < 0 )
+            log_fatal_errno("select");
+        if( selCnt == 0 )
+            break;  // timeout, no data pending
+        if( FD_ISSET(dispFd, &conn->fds) ) {
+            FD_CLR(dispFd, &conn->fds);
+            processPendingEvents(conn, displayEvent, True);
+        }
+        if( sockFd >= 0 && FD_ISSET(sockFd, &conn->fds) ) {
+            FD_CLR(sockFd, &conn->fds);
+            isEvFd = True;
+        }
+    }
+    return isEvFd;
+}
+
+static void closeDisplay(DisplayConnection *dconn)
+{
+    X11Display *conn = (X11Display*)dconn;
+
+    XDestroyWindow(conn->d, conn->win);
+    if( conn->cursor != conn->dummyCursor )
+        XFreeCursor(conn->d, conn->cursor);
+    XFreeCursor(conn->d, conn->dummyCursor);
+    XCloseDisplay(conn->d);
+}
+
+static const DisplayBackend gX11Backend = {
+    getPixelFormat,
+    createFramebuffer,
+    destroyFramebuffer,
+    resized,
+    nextEvent,
+    present,
+    syncDisplay,
+    setCursor,
+    setMonoCursor,
+    closeDisplay
+};
+
+/* X server connection prepared by clidisp_preopen
+ */
+static struct {
+    pthread_t thread;
+    int isStarted;
+    PresentMode presentMode;
+    Display *d;
+    int isShmAvail;
+} gPreopen;
+
+static void *preopenThread(void *arg)
+{
+    if( (gPreopen.d = XOpenDisplay(NULL)) != NULL )
+        gPreopen.isShmAvail = gPreopen.presentMode != PRESENT_PUTIMAGE &&
+            XShmQueryExtension(gPreopen.d);
+    return NULL;
+}
+
+void clidisp_preopen(PresentMode presentMode)
+{
+    gPreopen.presentMode = presentMode;
+    gPreopen.isStarted = pthread_create(&gPreopen.thread, NULL,
+            preopenThread, NULL) == 0;
+}
+
+DisplayConnection *clidisp_open(int width, int height, const char *title,
+        int argc, char *argv[], int fullScreen, PresentMode presentMode)
+{
+    Display *d;
+    int isShmAvail;
+
+    if( gPreopen.isStarted && gPreopen.presentMode == presentMode ) {
+        pthread_join(gPreopen.thread, NULL);
+        gPreopen.isStarted = 0;
+        d = gPreopen.d;
+        isShmAvail = gPreopen.isShmAvail;
+    }else{
+        d = XOpenDisplay(NULL);
+        isShmAvail = d != NULL && presentMode != PRESENT_PUTIMAGE &&
+            XShmQueryExtension(d);
+    }
+    if( d == NULL )
+        log_fatal("unable to open display");
+    X11Display *conn = malloc(sizeof(X11Display));
+    conn->d = d;
+    conn->isShmAvail = isShmAvail;
+    if( ! conn->isShmAvail && presentMode != PRESENT_PUTIMAGE )
+        log_info("shm extension is not available");
+    conn->presentMode = presentMode;
+    clidisp_init(&conn->base, &gX11Backend, width, height);
+    XSetWindowAttributes attrs;
+    attrs.background_pixel = 0x204060;
+    attrs.event_mask = KeyPressMask | KeyReleaseMask |
+        ButtonPressMask | ButtonReleaseMask | PointerMotionMask |
+        FocusChangeMask | ExposureMask | StructureNotifyMask;
+    attrs.override_redirect = fullScreen;
+    // create dummy cursor
+    Pixmap pixmap = XCreatePixmap(d, XDefaultRootWindow(d), 1, 1, 1);
+    XColor color;
+    memset(&color, 0, sizeof(color));
+    attrs.cursor = XCreatePixmapCursor(d, pixmap, pixmap, &color, &color, 0, 0);
+    XFreePixmap(d, pixmap);
+    conn->dummyCursor = conn->cursor = attrs.cursor;
+    Screen *defScreen = XDefaultScreenOfDisplay(d);
+    conn->win = XCreateWindow(d, XDefaultRootWindow(d), 0, 0,
+            fullScreen ? XWidthOfScreen(defScreen) : width,
+            fullScreen ? XHeightOfScreen(defScreen) : height,
+            0, CopyFromParent, InputOutput, CopyFromParent,
+            CWBackPixel | CWEventMask | CWCursor | CWOverrideRedirect, &attrs);
+    Atom WM_DELETE_WINDOW = XInternAtom(d, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(d, conn->win, &WM_DELETE_WINDOW, 1);
+    char titlebuf[256];
+    sprintf(titlebuf, "%.240s - Wilq VNC", title);
+    XClassHint classHint;
+    classHint.res_name = "wilqvnc";
+    classHint.res_class = "WilqVNC";
+    XmbSetWMProperties(d, conn->win, titlebuf, NULL, argv,
+            argc, NULL, NULL, &classHint);
+    XMapWindow(d, conn->win);
+    if( fullScreen )
+        XGrabKeyboard(d, conn->win, True, GrabModeAsync,
+                GrabModeAsync, CurrentTime);
+    XFlush(d);
+    conn->gc = XCreateGC(conn->d, conn->win, 0, NULL);
+    FD_ZERO(&conn->fds);
+    conn->lastKeysymDown = NoSymbol;
+    conn->isFullScreen = fullScreen;
+    conn->winWidth = conn->winHeight = 0;
+    return &conn->base;
+}
+
@@ -0,0 +1,317 @@
+#include "encsel.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <sys/time.h>
+
+
+enum {
+    EVAL_INTERVAL_MS = 2000,    // statistics evaluation period
+    MIN_HOLD_MS = 6000,         // minimal time between encoding switches
+    STALE_MS = 60000,           // statistics older than that are re-measured
+    MIN_SAMPLE_PIXELS = 65536,  // pixels needed for a valid sample
+    TRIAL_RECTS = 4,            // rectangles measured by a trial
+    TRIAL_MAX_MS = 1000,        // trial ends then even without rectangles
+    CPU_SAMPLE_RECTS = 8        // CPU time measured for every n-th rectangle
+};
+
+/* Switch only when the estimated gain is at least 15 percent
+ */
+static const double SWITCH_GAIN = 0.85;
+
+/* An encoding is tried only when its estimated cost is less than that
+ * times the cost of the preferred one
+ */
+static const double TRIAL_MAX_COST = 2.0;
+
+typedef struct {
+    int encType;
+    const char *name;
+    int isEnabled;
+    // measurements in current evaluation period
+    unsigned long long rects, pixels, bytes;
+    unsigned long long cpuPixels, cpuNs;    // of rectangles sampled
+    // smoothed results
+    double bytesPerPixel, cpuNsPerPixel;
+    unsigned long long lastSampleTm;    // 0 if never measured
+    unsigned long long lastTryTm;       // last time chosen to measure
+} EncodingState;
+
+enum { ENC_CANDIDATES = 3 };
+
+struct EncodingSelector {
+    EncodingState encodings[ENC_CANDIDATES];
+    int preferred;          // index in encodings
+    int trial;              // encoding being tried, -1 when none
+    unsigned long long trialBegTm;
+    int compressLevel;
+    unsigned rectCount;     // for CPU time sampling
+    double bytesPerNs;      // link throughput, 0 if unknown
+    unsigned long long netBytes, netNs;     // measured in current period
+    unsigned long long lastEvalTm, lastSwitchTm;
+};
+
+static unsigned long long curTimeMs(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000LL + tv.tv_usec / 1000LL;
+}
+
+EncodingSelector *encsel_create(int initialEncoding, int enableHextile,
+        int enableZRLE)
+{
+    static const int encTypes[ENC_CANDIDATES] = { 0, 5, 16 };
+    static const char *const encNames[ENC_CANDIDATES] = {
+        "Raw", "Hextile", "ZRLE"
+    };
+    int i;
+
+    EncodingSelector *sel = malloc(sizeof(EncodingSelector));
+    sel->preferred = 0;
+    sel->trial = -1;
+    sel->trialBegTm = 0;
+    for(i = 0; i < ENC_CANDIDATES; ++i) {
+        EncodingState *enc = sel->encodings + i;
+        enc->encType = encTypes[i];
+        enc->name = encNames[i];
+        enc->isEnabled = encTypes[i] == 0 ||
+            (encTypes[i] == 5 && enableHextile) ||
+            (encTypes[i] == 16 && enableZRLE);
+        enc->rects = enc->pixels = enc->bytes = 0;
+        enc->cpuPixels = enc->cpuNs = 0;
+        enc->bytesPerPixel = enc->cpuNsPerPixel = 0;
+        enc->lastSampleTm = enc->lastTryTm = 0;
+        if( encTypes[i] == initialEncoding && enc->isEnabled )
+            sel->preferred = i;
+    }
+    sel->compressLevel = 6;
+    sel->rectCount = 0;
+    sel->bytesPerNs = 0;
+    sel->netBytes = sel->netNs = 0;
+    sel->lastEvalTm = sel->lastSwitchTm = curTimeMs();
+    return sel;
+}
+
+void encsel_setBytesPerPixel(EncodingSelector *sel, int bytesPerPixel)
+{
+    EncodingState *raw = sel->encodings;
+
+    // known exactly, the measurement only adds decoding time
+    raw->bytesPerPixel = bytesPerPixel;
+}
+
+static EncodingState *findEncoding(EncodingSelector *sel, int encType)
+{
+    int i;
+
+    for(i = 0; i < ENC_CANDIDATES; ++i) {
+        if( sel->encodings[i].encType == encType )
+            return sel->encodings + i;
+    }
+    return NULL;
+}
+
+int encsel_isCpuSampled(EncodingSelector *sel, int encType)
+{
+    EncodingState *enc = findEncoding(sel, encType);
+
+    if( enc == NULL )
+        return 0;
+    if( sel->trial >= 0 && enc == sel->encodings + sel->trial )
+        return 1;
+    return ++sel->rectCount % CPU_SAMPLE_RECTS == 0;
+}
+
+void encsel_addRect(EncodingSelector *sel, int encType, unsigned pixels,
+        unsigned bytes, unsigned long long cpuNs)
+{
+    EncodingState *enc = findEncoding(sel, encType);
+
+    if( enc == NULL )
+        return;
+    ++enc->rects;
+    enc->pixels += pixels;
+    enc->bytes += bytes;
+    if( cpuNs != ENCSEL_NO_CPU ) {
+        enc->cpuPixels += pixels;
+        enc->cpuNs += cpuNs;
+    }
+}
+
+void encsel_addUpdate(EncodingSelector *sel, unsigned bytes,
+        unsigned long long wallNs, unsigned long long cpuNs)
+{
+    // time spent on waiting for data shows the link throughput; small
+    // updates are dominated by latency rather than throughput
+    if( bytes >= 16384 && wallNs > cpuNs ) {
+        sel->netBytes += bytes;
+        sel->netNs += wallNs - cpuNs;
+    }
+}
+
+/* Estimated time to pixel in nanoseconds
+ */
+static double timeToPixel(const EncodingSelector *sel,
+        const EncodingState *enc)
+{
+    double netNsPerPixel = sel->bytesPerNs > 0 ?
+        enc->bytesPerPixel / sel->bytesPerNs : 0;
+
+    return netNsPerPixel + enc->cpuNsPerPixel;
+}
+
+static void updateSmoothed(double *value, double sample, int isFirst)
+{
+    *value = isFirst ? sample : (*value + sample) / 2;
+}
+
+/* Takes the sample of measurements in current period, when it has at
+ * least minPixels pixels
+ */
+static void takeSample(EncodingState *enc, unsigned long long minPixels,
+        unsigned long long curTm)
+{
+    if( enc->pixels > 0 && enc->pixels >= minPixels ) {
+        updateSmoothed(&enc->bytesPerPixel,
+                (double)enc->bytes / enc->pixels, enc->lastSampleTm == 0);
+        if( enc->cpuPixels > 0 )
+            updateSmoothed(&enc->cpuNsPerPixel,
+                    (double)enc->cpuNs / enc->cpuPixels,
+                    enc->lastSampleTm == 0);
+        enc->lastSampleTm = curTm;
+        log_debug("encoding %s: %.3f bytes/pixel, %.2f ns/pixel",
+                enc->name, enc->bytesPerPixel, enc->cpuNsPerPixel);
+    }
+    enc->rects = enc->pixels = enc->bytes = 0;
+    enc->cpuPixels = enc->cpuNs = 0;
+}
+
+/* Ends the trial after a few rectangles. Returns non-zero when ended.
+ */
+static int endTrial(EncodingSelector *sel, unsigned long long curTm)
+{
+    EncodingState *enc = sel->encodings + sel->trial;
+
+    if( enc->rects < TRIAL_RECTS && curTm - sel->trialBegTm < TRIAL_MAX_MS )
+        return 0;
+    log_debug("trial of %s done: %llu rects", enc->name, enc->rects);
+    takeSample(enc, 1, curTm);
+    sel->trial = -1;
+    return 1;
+}
+
+/* Starts the trial of an encoding not measured recently, which might be
+ * better than the preferred one. Such encoding is tried once per STALE_MS,
+ * the server might not support it. Returns non-zero when started.
+ */
+static int startTrial(EncodingSelector *sel, unsigned long long curTm)
+{
+    EncodingState *cur = sel->encodings + sel->preferred;
+    int i;
+
+    for(i = 0; i < ENC_CANDIDATES; ++i) {
+        EncodingState *enc = sel->encodings + i;
+        if( i == sel->preferred || ! enc->isEnabled ||
+                curTm - enc->lastSampleTm < STALE_MS ||
+                curTm - enc->lastTryTm < STALE_MS )
+            continue;
+        if( cur->lastSampleTm != 0 && timeToPixel(sel, enc) >
+                TRIAL_MAX_COST * timeToPixel(sel, cur) )
+            continue;
+        log_debug("trying encoding %s", enc->name);
+        enc->lastTryTm = curTm;
+        enc->rects = enc->pixels = enc->bytes = 0;
+        enc->cpuPixels = enc->cpuNs = 0;
+        sel->trial = i;
+        sel->trialBegTm = curTm;
+        return 1;
+    }
+    return 0;
+}
+
+int encsel_evaluate(EncodingSelector *sel)
+{
+    int i, best, isChanged = 0;
+    unsigned long long curTm = curTimeMs();
+
+    if( sel->trial >= 0 )
+        return endTrial(sel, curTm);
+    if( curTm - sel->lastEvalTm < EVAL_INTERVAL_MS )
+        return 0;
+    sel->lastEvalTm = curTm;
+    for(i = 0; i < ENC_CANDIDATES; ++i)
+        takeSample(sel->encodings + i, MIN_SAMPLE_PIXELS, curTm);
+    if( sel->netNs >= 1000000 ) {
+        updateSmoothed(&sel->bytesPerNs, (double)sel->netBytes / sel->netNs,
+                sel->bytesPerNs == 0);
+        log_debug("link throughput: %.1f MB/s", sel->bytesPerNs * 1000);
+    }
+    sel->netBytes = sel->netNs = 0;
+    EncodingState *cur = sel->encodings + sel->preferred;
+    // the trial compares with the preferred encoding, measured first
+    if( (cur->lastSampleTm != 0 ||
+                curTm - sel->lastSwitchTm >= 3 * MIN_HOLD_MS) &&
+            startTrial(sel, curTm) )
+        return 1;
+    if( curTm - sel->lastSwitchTm < MIN_HOLD_MS )
+        return 0;
+    if( cur->lastSampleTm < sel->lastSwitchTm &&
+            curTm - sel->lastSwitchTm < 3 * MIN_HOLD_MS )
+        return 0;   // wait for measurement of current encoding
+    best = -1;
+    double bestTtp = 0;
+    if( cur->lastSampleTm != 0 ) {
+        best = sel->preferred;
+        bestTtp = timeToPixel(sel, cur) * SWITCH_GAIN;
+    }
+    for(i = 0; i < ENC_CANDIDATES; ++i) {
+        EncodingState *enc = sel->encodings + i;
+        double ttp = timeToPixel(sel, enc);
+        if( i != sel->preferred && enc->isEnabled &&
+                enc->lastSampleTm != 0 && (best < 0 || ttp < bestTtp) )
+        {
+            best = i;
+            bestTtp = ttp;
+        }
+    }
+    if( best >= 0 && best != sel->preferred ) {
+        log_info("switching preferred encoding from %s to %s", cur->name,
+                sel->encodings[best].name);
+        sel->preferred = best;
+        sel->lastSwitchTm = curTm;
+        isChanged = 1;
+        cur = sel->encodings + best;
+    }
+    // compress more when the link is the bottleneck
+    if( cur->lastSampleTm != 0 && sel->bytesPerNs > 0 ) {
+        double ttp = timeToPixel(sel, cur);
+        double netShare = ttp > 0 ? (ttp - cur->cpuNsPerPixel) / ttp : 0;
+        int level = 1 + (int)(netShare * 8 + 0.5);
+        if( level >= sel->compressLevel + 2 ||
+                level <= sel->compressLevel - 2 )
+        {
+            log_info("changing compression level from %d to %d",
+                    sel->compressLevel, level);
+            sel->compressLevel = level;
+            isChanged = 1;
+        }
+    }
+    return isChanged;
+}
+
+int encsel_getPreferred(const EncodingSelector *sel)
+{
+    int i = sel->trial >= 0 ? sel->trial : sel->preferred;
+
+    return sel->encodings[i].encType;
+}
+
+int encsel_getCompressLevel(const EncodingSelector *sel)
+{
+    return sel->compressLevel;
+}
+
+void encsel_free(EncodingSelector *sel)
+{
+    free(sel);
+}
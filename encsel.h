@@ -0,0 +1,67 @@
+#ifndef ENCSEL_H
+#define ENCSEL_H
+
+/* Adaptive selection of the preferred encoding. Decoding statistics are
+ * collected for every encoding in use and the encoding giving minimal
+ * time to pixel on current link and CPU is chosen.
+ */
+typedef struct EncodingSelector EncodingSelector;
+
+
+/* Creates the selector. The initially preferred encoding is one of Raw (0),
+ * Hextile (5) or ZRLE (16). Only Raw and encodings enabled here are chosen.
+ */
+EncodingSelector *encsel_create(int initialEncoding, int enableHextile,
+        int enableZRLE);
+
+
+/* Sets the pixel size, which gives the cost of Raw encoding before it is
+ * measured
+ */
+void encsel_setBytesPerPixel(EncodingSelector*, int bytesPerPixel);
+
+
+/* Returns non-zero when CPU time of decoding the next rectangle of given
+ * encoding should be measured. Reading the thread CPU clock is a system
+ * call, so only some rectangles are measured.
+ */
+int encsel_isCpuSampled(EncodingSelector*, int encType);
+
+
+/* Adds statistics of one decoded rectangle: number of pixels, number of
+ * bytes read and CPU time spent on decoding, ENCSEL_NO_CPU when not
+ * sampled.
+ */
+#define ENCSEL_NO_CPU (~0ULL)
+
+void encsel_addRect(EncodingSelector*, int encType, unsigned pixels,
+        unsigned bytes, unsigned long long cpuNs);
+
+
+/* Adds statistics of whole framebuffer update: number of bytes read,
+ * elapsed time and CPU time spent on decoding.
+ */
+void encsel_addUpdate(EncodingSelector*, unsigned bytes,
+        unsigned long long wallNs, unsigned long long cpuNs);
+
+
+/* Re-evaluates the encoding choice periodically. Encodings not measured
+ * recently are tried for a few rectangles, unless their estimated cost
+ * excludes them. Returns non-zero when the preferred encoding or
+ * compression level has been changed.
+ */
+int encsel_evaluate(EncodingSelector*);
+
+
+int encsel_getPreferred(const EncodingSelector*);
+
+
+/* Returns compression level 0..9 suggested for zlib based encodings
+ */
+int encsel_getCompressLevel(const EncodingSelector*);
+
+
+void encsel_free(EncodingSelector*);
+
+
+#endif /* ENCSEL_H */
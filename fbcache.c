@@ -0,0 +1,224 @@
+#include "fbcache.h"
+#include "dispbackend.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+
+static const char FBCACHE_MAGIC[8] = "WQVNCF01";
+
+/* The file header, followed by zlib stream of framebuffer lines without
+ * padding
+ */
+typedef struct {
+    char magic[8];
+    int width, height;
+    PixelFormat pixelFormat;
+} FbCacheHeader;
+
+/* Returns the cache file name of the host; creates the directory when
+ * isCreateDir is set. Returns NULL when there is no cache directory.
+ */
+static char *getFileName(const char *host, int isCreateDir)
+{
+    const char *cacheDir = getenv("XDG_CACHE_HOME"), *sub = "/wilqvnc";
+    char *fileName, *p;
+
+    if( cacheDir == NULL || cacheDir[0] == '\0' ) {
+        if( (cacheDir = getenv("HOME")) == NULL )
+            return NULL;
+        sub = "/.cache/wilqvnc";
+    }
+    fileName = malloc(strlen(cacheDir) + strlen(sub) + strlen(host) + 8);
+    sprintf(fileName, "%s%s", cacheDir, sub);
+    if( isCreateDir ) {
+        // create also the parent directories when missing
+        p = fileName + 1;
+        while( (p = strchr(p, '/')) != NULL ) {
+            *p = '\0';
+            mkdir(fileName, 0700);
+            *p++ = '/';
+        }
+        mkdir(fileName, 0700);
+    }
+    p = fileName + strlen(fileName);
+    *p++ = '/';
+    // the host name may contain slash only by mistake, but be careful
+    for(; *host; ++host)
+        *p++ = *host == '/' ? '_' : *host;
+    *p = '\0';
+    return fileName;
+}
+
+/* Halves intensity of every color component of the pixels
+ */
+static void dimLine(char *line, int width, const PixelFormat *pf)
+{
+    unsigned pixel, mask = (pf->maxRed >> 1) << pf->shiftRed |
+        (pf->maxGreen >> 1) << pf->shiftGreen |
+        (pf->maxBlue >> 1) << pf->shiftBlue;
+    unsigned char *p;
+    int i;
+
+    switch( pf->bitsPerPixel ) {
+    case 8:
+        for(i = 0; i < width; ++i)
+            ((unsigned char*)line)[i] =
+                ((unsigned char*)line)[i] >> 1 & mask;
+        break;
+    case 16:
+        for(i = 0; i < width; ++i)
+            ((unsigned short*)line)[i] =
+                ((unsigned short*)line)[i] >> 1 & mask;
+        break;
+    case 24:
+        // packed, three bytes in the pixel format byte order
+        for(i = 0; i < width; ++i) {
+            p = (unsigned char*)line + 3 * i;
+            pixel = pf->bigEndian ? p[0] << 16 | p[1] << 8 | p[2] :
+                p[2] << 16 | p[1] << 8 | p[0];
+            pixel = pixel >> 1 & mask;
+            p[pf->bigEndian ? 0 : 2] = pixel >> 16;
+            p[1] = pixel >> 8;
+            p[pf->bigEndian ? 2 : 0] = pixel;
+        }
+        break;
+    case 32:
+        for(i = 0; i < width; ++i)
+            ((unsigned*)line)[i] = ((unsigned*)line)[i] >> 1 & mask;
+        break;
+    }
+}
+
+int fbcache_load(DisplayConnection *conn, const char *host)
+{
+    Framebuffer *fb = &conn->fb;
+    FbCacheHeader hdr;
+    PixelFormat pixelFormat;
+    struct stat st;
+    z_stream zstrm;
+    int i, fd, res = -1;
+
+    char *fileName = getFileName(host, 0);
+    if( fileName == NULL )
+        return -1;
+    fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    free(fileName);
+    if( fd < 0 )
+        return -1;
+    if( fstat(fd, &st) < 0 || st.st_size < sizeof(hdr) ) {
+        close(fd);
+        return -1;
+    }
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( data == MAP_FAILED )
+        return -1;
+    memcpy(&hdr, data, sizeof(hdr));
+    clidisp_getPixelFormat(conn, &pixelFormat);
+    if( memcmp(hdr.magic, FBCACHE_MAGIC, sizeof(hdr.magic)) ||
+            hdr.width != fb->width || hdr.height != fb->height ||
+            memcmp(&hdr.pixelFormat, &pixelFormat, sizeof(PixelFormat)) )
+    {
+        log_debug("cached framebuffer does not match the desktop");
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+    // decompress directly into the framebuffer
+    memset(&zstrm, 0, sizeof(zstrm));
+    zstrm.next_in = (unsigned char*)data + sizeof(hdr);
+    zstrm.avail_in = st.st_size - sizeof(hdr);
+    if( inflateInit(&zstrm) == Z_OK ) {
+        int lineLen = fb->width * ((fb->bitsPerPixel + 7) / 8);
+        int zres = Z_OK;
+        for(i = 0; i < fb->height && zres == Z_OK; ++i) {
+            char *line = fb->data + i * fb->bytesPerLine;
+            zstrm.next_out = (unsigned char*)line;
+            zstrm.avail_out = lineLen;
+            zres = inflate(&zstrm, Z_SYNC_FLUSH);
+            if( zres == Z_STREAM_END && i == fb->height - 1 )
+                zres = Z_OK;
+            if( zstrm.avail_out != 0 )
+                zres = Z_DATA_ERROR;
+            dimLine(line, fb->width, &pixelFormat);
+        }
+        inflateEnd(&zstrm);
+        if( zres == Z_OK ) {
+            clidisp_addDamage(conn, 0, 0, fb->width, fb->height);
+            clidisp_flush(conn);
+            log_debug("cached framebuffer loaded");
+            res = 0;
+        }else{
+            log_warn("cached framebuffer is corrupted");
+            memset(fb->data, 0, fb->height * fb->bytesPerLine);
+        }
+    }
+    munmap((void*)data, st.st_size);
+    return res;
+}
+
+void fbcache_save(DisplayConnection *conn, const char *host)
+{
+    const Framebuffer *fb = &conn->fb;
+    FbCacheHeader hdr;
+    z_stream zstrm;
+    unsigned char outBuf[65536];
+    int i, zres = Z_OK;
+
+    char *fileName = getFileName(host, 1);
+    if( fileName == NULL )
+        return;
+    // written under temporary name so that a reader sees complete file
+    char *tmpName = malloc(strlen(fileName) + 8);
+    sprintf(tmpName, "%s.tmp", fileName);
+    // the image may show private data, readable by the user only; a file
+    // left by an interrupted save might have other permissions
+    unlink(tmpName);
+    int fd = open(tmpName, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    FILE *fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if( fp == NULL ) {
+        log_warn("unable to save framebuffer to %s: %s", tmpName,
+                strerror(errno));
+        if( fd >= 0 )
+            close(fd);
+        free(tmpName);
+        free(fileName);
+        return;
+    }
+    memcpy(hdr.magic, FBCACHE_MAGIC, sizeof(hdr.magic));
+    hdr.width = fb->width;
+    hdr.height = fb->height;
+    clidisp_getPixelFormat(conn, &hdr.pixelFormat);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    memset(&zstrm, 0, sizeof(zstrm));
+    deflateInit(&zstrm, Z_BEST_SPEED);
+    int lineLen = fb->width * ((fb->bitsPerPixel + 7) / 8);
+    for(i = 0; i <= fb->height && zres != Z_STREAM_ERROR; ++i) {
+        int isLast = i == fb->height;
+        zstrm.next_in = isLast ? NULL :
+            (unsigned char*)fb->data + i * fb->bytesPerLine;
+        zstrm.avail_in = isLast ? 0 : lineLen;
+        do {
+            zstrm.next_out = outBuf;
+            zstrm.avail_out = sizeof(outBuf);
+            zres = deflate(&zstrm, isLast ? Z_FINISH : Z_NO_FLUSH);
+            fwrite(outBuf, sizeof(outBuf) - zstrm.avail_out, 1, fp);
+        } while( zstrm.avail_out == 0 );
+    }
+    deflateEnd(&zstrm);
+    int isWriteErr = ferror(fp);
+    if( fclose(fp) != 0 || isWriteErr || zres != Z_STREAM_END ) {
+        log_warn("unable to save framebuffer to %s", tmpName);
+        unlink(tmpName);
+    }else if( rename(tmpName, fileName) < 0 )
+        log_warn("unable to rename %s: %s", tmpName, strerror(errno));
+    free(tmpName);
+    free(fileName);
+}
@@ -0,0 +1,24 @@
+#ifndef FBCACHE_H
+#define FBCACHE_H
+
+#include "clidisplay.h"
+
+/* Cache of the last framebuffer of every host, kept compressed in
+ * $XDG_CACHE_HOME/wilqvnc (~/.cache/wilqvnc by default). Shown dimmed at
+ * startup until the first update from server replaces it.
+ */
+
+
+/* Loads the cached framebuffer of the host into display, when its size and
+ * pixel format match the display ones, and presents it dimmed.
+ * Returns 0 when loaded, -1 otherwise.
+ */
+int fbcache_load(DisplayConnection*, const char *host);
+
+
+/* Saves the current framebuffer as cached one of the host
+ */
+void fbcache_save(DisplayConnection*, const char *host);
+
+
+#endif /* FBCACHE_H */
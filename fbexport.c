@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+#include "fbexport.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+
+
+enum {
+    CLIENTS_MAX = 32
+};
+
+struct FbExportSegment {
+    int fd;
+    FbExportHeader *hdr;
+    size_t size;
+};
+
+struct FbExport {
+    char *socketPath;
+    int listenFd, stopFd;
+    pthread_t thread;
+    // clients and the current segment are shared with the service thread
+    pthread_mutex_t lock;
+    int clientFds[CLIENTS_MAX];
+    int clientCount;
+    FbExportSegment *curSeg;
+};
+
+/* Sends message to client without blocking. Returns -1 when the client
+ * is gone. A full socket buffer is not an error: the consumer finds the
+ * damage in the ring anyway.
+ */
+static int sendMsg(int fd, FbExportMsgType type,
+        const FbExportSegment *seg)
+{
+    FbExportMsg msg;
+    struct iovec iov;
+    struct msghdr mh;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.damageSeq = __atomic_load_n(&seg->hdr->damageSeq, __ATOMIC_RELAXED);
+    iov.iov_base = &msg;
+    iov.iov_len = sizeof(msg);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if( type == FBEXPORT_MSG_SEGMENT ) {
+        memset(&ctl, 0, sizeof(ctl));
+        mh.msg_control = ctl.buf;
+        mh.msg_controllen = sizeof(ctl.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &seg->fd, sizeof(int));
+    }
+    if( sendmsg(fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 ) {
+        if( errno == EAGAIN && type == FBEXPORT_MSG_DAMAGE )
+            return 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Sends the message to all clients, drops the gone ones. Called with the
+ * lock held.
+ */
+static void broadcast(FbExport *exp, FbExportMsgType type)
+{
+    int i = 0;
+
+    while( i < exp->clientCount ) {
+        if( sendMsg(exp->clientFds[i], type, exp->curSeg) < 0 ) {
+            log_info("framebuffer consumer disconnected");
+            close(exp->clientFds[i]);
+            exp->clientFds[i] = exp->clientFds[--exp->clientCount];
+        }else
+            ++i;
+    }
+}
+
+static void *serviceThread(void *arg)
+{
+    FbExport *exp = arg;
+    struct pollfd pfds[2];
+
+    pfds[0].fd = exp->stopFd;
+    pfds[1].fd = exp->listenFd;
+    pfds[0].events = pfds[1].events = POLLIN;
+    while( poll(pfds, 2, -1) >= 0 && ! pfds[0].revents ) {
+        if( ! pfds[1].revents )
+            continue;
+        int fd = accept4(exp->listenFd, NULL, NULL, SOCK_CLOEXEC);
+        if( fd < 0 )
+            continue;
+        pthread_mutex_lock(&exp->lock);
+        if( exp->clientCount == CLIENTS_MAX ) {
+            log_error("too many framebuffer consumers");
+            close(fd);
+        }else if( exp->curSeg != NULL &&
+                sendMsg(fd, FBEXPORT_MSG_SEGMENT, exp->curSeg) < 0 )
+        {
+            close(fd);
+        }else{
+            log_info("framebuffer consumer connected");
+            exp->clientFds[exp->clientCount++] = fd;
+        }
+        pthread_mutex_unlock(&exp->lock);
+    }
+    return NULL;
+}
+
+FbExport *fbexport_create(const char *socketPath)
+{
+    struct sockaddr_un addr;
+    FbExport *exp = calloc(1, sizeof(FbExport));
+
+    if( strlen(socketPath) >= sizeof(addr.sun_path) )
+        log_fatal("export socket path too long");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socketPath);
+    if( (exp->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 )
+        log_fatal_errno("export socket");
+    unlink(socketPath);
+    if( bind(exp->listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(exp->listenFd, 8) < 0 )
+        log_fatal_errno("export socket %s", socketPath);
+    if( (exp->stopFd = eventfd(0, EFD_CLOEXEC)) < 0 )
+        log_fatal_errno("eventfd");
+    exp->socketPath = strdup(socketPath);
+    pthread_mutex_init(&exp->lock, NULL);
+    if( pthread_create(&exp->thread, NULL, serviceThread, exp) != 0 )
+        log_fatal("unable to start export thread");
+    return exp;
+}
+
+FbExportSegment *fbexport_createSegment(FbExport *exp, int width, int height,
+        int bytesPerLine)
+{
+    FbExportSegment *seg = malloc(sizeof(FbExportSegment));
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    size_t headerSize = (sizeof(FbExportHeader) + pageSize - 1) &
+        ~(pageSize - 1);
+
+    seg->size = headerSize + (size_t)height * bytesPerLine;
+    if( (seg->fd = memfd_create("wilqvnc-framebuffer",
+                    MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 )
+        log_fatal_errno("memfd_create");
+    if( ftruncate(seg->fd, seg->size) < 0 )
+        log_fatal_errno("ftruncate");
+    seg->hdr = mmap(NULL, seg->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            seg->fd, 0);
+    if( seg->hdr == MAP_FAILED )
+        log_fatal_errno("mmap");
+    // consumers can neither resize the segment nor map it writable
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+    seals |= F_SEAL_FUTURE_WRITE;
+#endif
+    if( fcntl(seg->fd, F_ADD_SEALS, seals) < 0 )
+        log_warn("unable to seal framebuffer segment: %s", strerror(errno));
+    seg->hdr->magic = FBEXPORT_MAGIC;
+    seg->hdr->headerSize = headerSize;
+    seg->hdr->width = width;
+    seg->hdr->height = height;
+    seg->hdr->bytesPerLine = bytesPerLine;
+    return seg;
+}
+
+char *fbexport_getPixels(FbExportSegment *seg)
+{
+    return (char*)seg->hdr + seg->hdr->headerSize;
+}
+
+void fbexport_setSegment(FbExport *exp, FbExportSegment *seg,
+        const PixelFormat *pixelFormat)
+{
+    seg->hdr->pixelFormat = *pixelFormat;
+    pthread_mutex_lock(&exp->lock);
+    exp->curSeg = seg;
+    broadcast(exp, FBEXPORT_MSG_SEGMENT);
+    pthread_mutex_unlock(&exp->lock);
+}
+
+void fbexport_addDamage(FbExport *exp, const RectangleArea *areas, int count)
+{
+    FbExportHeader *hdr = exp->curSeg->hdr;
+    unsigned long long seq = hdr->damageSeq;
+    int i;
+
+    for(i = 0; i < count; ++i) {
+        FbExportDamage *dmg = hdr->damage + seq % FBEXPORT_RING_SIZE;
+        // invalidate the entry while it is rewritten
+        __atomic_store_n(&dmg->seq, 0, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        dmg->x = areas[i].x;
+        dmg->y = areas[i].y;
+        dmg->width = areas[i].width;
+        dmg->height = areas[i].height;
+        __atomic_store_n(&dmg->seq, ++seq, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&hdr->damageSeq, seq, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&exp->lock);
+    broadcast(exp, FBEXPORT_MSG_DAMAGE);
+    pthread_mutex_unlock(&exp->lock);
+}
+
+void fbexport_destroySegment(FbExport *exp, FbExportSegment *seg)
+{
+    pthread_mutex_lock(&exp->lock);
+    if( exp->curSeg == seg )
+        exp->curSeg = NULL;
+    pthread_mutex_unlock(&exp->lock);
+    munmap(seg->hdr, seg->size);
+    close(seg->fd);
+    free(seg);
+}
+
+void fbexport_free(FbExport *exp)
+{
+    unsigned long long one = 1;
+    int i;
+
+    if( exp == NULL )
+        return;
+    if( write(exp->stopFd, &one, sizeof(one)) < 0 )
+        log_error_errno("eventfd write");
+    pthread_join(exp->thread, NULL);
+    for(i = 0; i < exp->clientCount; ++i)
+        close(exp->clientFds[i]);
+    close(exp->listenFd);
+    close(exp->stopFd);
+    unlink(exp->socketPath);
+    free(exp->socketPath);
+    free(exp);
+}
@@ -0,0 +1,97 @@
+#ifndef FBEXPORT_H
+#define FBEXPORT_H
+
+#include "vnccommon.h"
+
+/* Export of the decoded framebuffer to local consumers. The framebuffer
+ * lives in a memfd segment shared with consumers; the decoder writes the
+ * pixels directly there. Consumers connect to a UNIX socket and receive
+ * messages (FbExportMsg); the segment descriptor is attached to
+ * FBEXPORT_MSG_SEGMENT message, sent on connect and whenever the segment
+ * is replaced, e.g. on desktop resize.
+ *
+ * The segment starts with FbExportHeader followed by pixels at headerSize.
+ * Presented areas are published in the damage ring: damage number n,
+ * counted from 1, is stored in damage[(n - 1) % FBEXPORT_RING_SIZE] and
+ * damageSeq is the last published number. The ring is written without
+ * locks. A consumer reads a ring entry as follows:
+ *      seq1 = atomic load (acquire) of entry seq
+ *      copy the rectangle
+ *      acquire fence
+ *      seq2 = atomic load of entry seq
+ * The copy is valid when seq1 == seq2 == n; otherwise the entry has been
+ * overwritten and the consumer should refresh the whole screen. Pixels are
+ * not locked, so a consumer may observe an area being decoded just now.
+ */
+
+enum {
+    FBEXPORT_MAGIC = 0x58465657,        // "WVFX"
+    FBEXPORT_RING_SIZE = 256
+};
+
+typedef struct {
+    unsigned long long seq;             // damage number, 0 when unused
+    int x, y, width, height;
+} FbExportDamage;
+
+typedef struct {
+    unsigned magic;
+    unsigned headerSize;                // offset of pixels
+    int width, height;
+    int bytesPerLine;
+    PixelFormat pixelFormat;
+    unsigned long long damageSeq;       // last published damage number
+    FbExportDamage damage[FBEXPORT_RING_SIZE];
+} FbExportHeader;
+
+typedef enum {
+    FBEXPORT_MSG_SEGMENT = 1,           // new segment, descriptor attached
+    FBEXPORT_MSG_DAMAGE = 2             // new damage published
+} FbExportMsgType;
+
+typedef struct {
+    unsigned type;                      // FbExportMsgType
+    unsigned reserved;
+    unsigned long long damageSeq;
+} FbExportMsg;
+
+
+typedef struct FbExport FbExport;
+typedef struct FbExportSegment FbExportSegment;
+
+
+/* Starts serving consumers on UNIX socket at given path
+ */
+FbExport *fbexport_create(const char *socketPath);
+
+
+/* Creates shared memory segment for framebuffer of given size
+ */
+FbExportSegment *fbexport_createSegment(FbExport*, int width, int height,
+        int bytesPerLine);
+
+
+/* Returns the pixels memory of the segment
+ */
+char *fbexport_getPixels(FbExportSegment*);
+
+
+/* Makes the segment the one exported to consumers
+ */
+void fbexport_setSegment(FbExport*, FbExportSegment*, const PixelFormat*);
+
+
+/* Publishes presented areas of the current segment and notifies consumers
+ */
+void fbexport_addDamage(FbExport*, const RectangleArea*, int count);
+
+
+void fbexport_destroySegment(FbExport*, FbExportSegment*);
+
+
+/* Disconnects consumers and removes the socket
+ */
+void fbexport_free(FbExport*);
+
+
+#endif /* FBEXPORT_H */
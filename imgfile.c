@@ -0,0 +1,98 @@
+#include "imgfile.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+
+static int writePPM(FILE *fp, const unsigned char *rgb, int width, int height)
+{
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    return fwrite(rgb, width * 3, height, fp) == height ? 0 : -1;
+}
+
+static void putU32(unsigned char *buf, unsigned val)
+{
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+static int writePNGChunk(FILE *fp, const char *type,
+        const unsigned char *data, unsigned len)
+{
+    unsigned char buf[4];
+    unsigned long crc = crc32(0, (const Bytef*)type, 4);
+
+    if( len > 0 )
+        crc = crc32(crc, data, len);
+    putU32(buf, len);
+    if( fwrite(buf, 4, 1, fp) != 1 || fwrite(type, 4, 1, fp) != 1 )
+        return -1;
+    if( len > 0 && fwrite(data, len, 1, fp) != 1 )
+        return -1;
+    putU32(buf, crc);
+    return fwrite(buf, 4, 1, fp) == 1 ? 0 : -1;
+}
+
+/* Writes PNG using zlib only; rows are not filtered
+ */
+static int writePNG(FILE *fp, const unsigned char *rgb, int width, int height)
+{
+    static const unsigned char signature[8] = {
+        137, 'P', 'N', 'G', '\r', '\n', 26, '\n'
+    };
+    unsigned char ihdr[13];
+    int i, res, rowLen = width * 3 + 1;
+    unsigned char *raw = malloc(rowLen * height);
+    uLongf comprLen = compressBound(rowLen * height);
+    unsigned char *compr = malloc(comprLen);
+
+    for(i = 0; i < height; ++i) {
+        raw[i * rowLen] = 0;    // filter type: none
+        memcpy(raw + i * rowLen + 1, rgb + i * width * 3, width * 3);
+    }
+    res = compress2(compr, &comprLen, raw, rowLen * height, 6);
+    free(raw);
+    if( res != Z_OK ) {
+        log_error("PNG compression failed, error=%d", res);
+        free(compr);
+        return -1;
+    }
+    putU32(ihdr, width);
+    putU32(ihdr + 4, height);
+    ihdr[8] = 8;        // bit depth
+    ihdr[9] = 2;        // color type: RGB
+    ihdr[10] = 0;       // compression
+    ihdr[11] = 0;       // filter
+    ihdr[12] = 0;       // interlace
+    res = fwrite(signature, sizeof(signature), 1, fp) == 1 &&
+        writePNGChunk(fp, "IHDR", ihdr, sizeof(ihdr)) == 0 &&
+        writePNGChunk(fp, "IDAT", compr, comprLen) == 0 &&
+        writePNGChunk(fp, "IEND", NULL, 0) == 0 ? 0 : -1;
+    free(compr);
+    return res;
+}
+
+int imgfile_write(const char *fileName, const unsigned char *rgb,
+        int width, int height)
+{
+    int res, nameLen = strlen(fileName);
+    FILE *fp = fopen(fileName, "wb");
+
+    if( fp == NULL ) {
+        log_error_errno("unable to create %s", fileName);
+        return -1;
+    }
+    if( nameLen > 4 && !strcmp(fileName + nameLen - 4, ".png") )
+        res = writePNG(fp, rgb, width, height);
+    else
+        res = writePPM(fp, rgb, width, height);
+    if( fclose(fp) != 0 )
+        res = -1;
+    if( res != 0 )
+        log_error_errno("write %s", fileName);
+    return res;
+}
@@ -0,0 +1,12 @@
+#ifndef IMGFILE_H
+#define IMGFILE_H
+
+/* Writes RGB image, 3 bytes per pixel, into file. The file format is PNG
+ * when the file name ends with ".png", binary PPM otherwise.
+ * Returns 0 on success, -1 on error.
+ */
+int imgfile_write(const char *fileName, const unsigned char *rgb,
+        int width, int height);
+
+
+#endif /* IMGFILE_H */
@@ -0,0 +1,367 @@
+#include "iouring.h"
+#include "vnclog.h"
+#include "sockstream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+
+enum {
+    RING_ENTRIES = 64,
+    RECV_BUF_COUNT = 32,            // power of 2
+    RECV_BUF_SIZE = 65536,
+    RECV_BUF_GROUP = 0,
+    SEND_BUF_SIZE = 65536,
+    SEND_CHUNK_MAX = 8,             // sends linked in one submission
+    TAG_RECV = 1,
+    TAG_SEND = 2
+};
+
+/* Received data waiting for read
+ */
+typedef struct {
+    unsigned bufId;
+    unsigned off, len;
+} RecvChunk;
+
+struct IoUring {
+    int ringFd, sockFd;
+    // submission queue
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned toSubmit;
+    void *sqRing;
+    size_t sqRingSize, sqesSize;
+    // completion queue
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    void *cqRing;
+    size_t cqRingSize;
+    // receive buffers
+    struct io_uring_buf_ring *bufRing;
+    char *recvBufs;
+    RecvChunk chunks[RECV_BUF_COUNT];
+    unsigned chunkFirst, chunkCount;
+    int isRecvArmed;
+    int recvStatus;                 // 0 at end of stream, -errno on error
+    int isRecvDone;                 // recvStatus is set
+    // sends
+    char *sendBuf;
+    unsigned sendOff;               // staging buffer used by pending sends
+    unsigned sendsPending;
+    int sendError;                  // errno of failed send, 0 when none
+    int recvTimeoutMs;              // 0 when waiting without limit
+};
+
+static int sysSetup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+/* Submits the queued requests and waits for minComplete completions
+ */
+static int enter(IoUring *ur, unsigned minComplete,
+        unsigned long long *syscallCnt)
+{
+    int res;
+
+    STAT_ADD(*syscallCnt, 1);
+    res = syscall(__NR_io_uring_enter, ur->ringFd, ur->toSubmit, minComplete,
+            minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if( res >= 0 )
+        ur->toSubmit -= res;
+    return res;
+}
+
+static int sysRegister(int fd, unsigned opcode, void *arg, unsigned nrArgs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static struct io_uring_sqe *getSqe(IoUring *ur)
+{
+    unsigned tail = *ur->sqTail;
+    unsigned idx = tail & *ur->sqMask;
+    struct io_uring_sqe *sqe = ur->sqes + idx;
+
+    memset(sqe, 0, sizeof(*sqe));
+    ur->sqArray[idx] = idx;
+    __atomic_store_n(ur->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ++ur->toSubmit;
+    return sqe;
+}
+
+static void armRecv(IoUring *ur)
+{
+    struct io_uring_sqe *sqe = getSqe(ur);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = ur->sockFd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUF_GROUP;
+    sqe->user_data = TAG_RECV;
+    ur->isRecvArmed = 1;
+}
+
+static void returnRecvBuf(IoUring *ur, unsigned bufId)
+{
+    unsigned short tail = ur->bufRing->tail;
+    struct io_uring_buf *buf = ur->bufRing->bufs +
+        (tail & (RECV_BUF_COUNT - 1));
+
+    buf->addr = (unsigned long)(ur->recvBufs + bufId * RECV_BUF_SIZE);
+    buf->len = RECV_BUF_SIZE;
+    buf->bid = bufId;
+    __atomic_store_n(&ur->bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Moves posted completions into the received chunks
+ */
+static void reapCompletions(IoUring *ur, unsigned long long *syscallCnt)
+{
+    unsigned head = *ur->cqHead;
+    unsigned tail = __atomic_load_n(ur->cqTail, __ATOMIC_ACQUIRE);
+
+    while( head != tail ) {
+        const struct io_uring_cqe *cqe = ur->cqes + (head & *ur->cqMask);
+        if( cqe->user_data == TAG_SEND ) {
+            if( cqe->res < 0 && ur->sendError == 0 )
+                ur->sendError = -cqe->res;
+            if( --ur->sendsPending == 0 )
+                ur->sendOff = 0;
+        }else{
+            if( cqe->res > 0 ) {
+                RecvChunk *chunk = ur->chunks + (ur->chunkFirst +
+                        ur->chunkCount++) % RECV_BUF_COUNT;
+                chunk->bufId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                chunk->off = 0;
+                chunk->len = cqe->res;
+            }else if( cqe->res != -ENOBUFS ) {
+                ur->recvStatus = cqe->res;
+                ur->isRecvDone = 1;
+            }
+            if( ! (cqe->flags & IORING_CQE_F_MORE) )
+                ur->isRecvArmed = 0;
+        }
+        ++head;
+    }
+    __atomic_store_n(ur->cqHead, head, __ATOMIC_RELEASE);
+    // stopped when out of buffers; rearmed when some is returned
+    if( ! ur->isRecvArmed && ! ur->isRecvDone &&
+            ur->chunkCount < RECV_BUF_COUNT )
+    {
+        armRecv(ur);
+        if( enter(ur, 0, syscallCnt) < 0 )
+            log_error_errno("io_uring submit");
+    }
+}
+
+IoUring *iouring_create(int sockFd)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned long long syscallCnt = 0;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    int ringFd = sysSetup(RING_ENTRIES, &p);
+    if( ringFd < 0 ) {
+        log_warn("io_uring not available: %s", strerror(errno));
+        return NULL;
+    }
+    IoUring *ur = calloc(1, sizeof(IoUring));
+    ur->ringFd = ringFd;
+    ur->sockFd = sockFd;
+    ur->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cqRingSize = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if( p.features & IORING_FEAT_SINGLE_MMAP ) {
+        if( ur->cqRingSize > ur->sqRingSize )
+            ur->sqRingSize = ur->cqRingSize;
+        ur->cqRingSize = ur->sqRingSize;
+    }
+    ur->sqRing = mmap(NULL, ur->sqRingSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    ur->cqRing = p.features & IORING_FEAT_SINGLE_MMAP ? ur->sqRing :
+        mmap(NULL, ur->cqRingSize, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+    ur->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(NULL, ur->sqesSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if( ur->sqRing == MAP_FAILED || ur->cqRing == MAP_FAILED ||
+            ur->sqes == MAP_FAILED )
+        log_fatal_errno("io_uring mmap");
+    ur->sqHead = (unsigned*)((char*)ur->sqRing + p.sq_off.head);
+    ur->sqTail = (unsigned*)((char*)ur->sqRing + p.sq_off.tail);
+    ur->sqMask = (unsigned*)((char*)ur->sqRing + p.sq_off.ring_mask);
+    ur->sqArray = (unsigned*)((char*)ur->sqRing + p.sq_off.array);
+    ur->cqHead = (unsigned*)((char*)ur->cqRing + p.cq_off.head);
+    ur->cqTail = (unsigned*)((char*)ur->cqRing + p.cq_off.tail);
+    ur->cqMask = (unsigned*)((char*)ur->cqRing + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe*)((char*)ur->cqRing + p.cq_off.cqes);
+    // receive buffers
+    ur->bufRing = mmap(NULL, RECV_BUF_COUNT * sizeof(struct io_uring_buf),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ur->recvBufs = mmap(NULL, RECV_BUF_COUNT * RECV_BUF_SIZE,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if( ur->bufRing == MAP_FAILED || ur->recvBufs == MAP_FAILED )
+        log_fatal_errno("mmap");
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)ur->bufRing;
+    reg.ring_entries = RECV_BUF_COUNT;
+    reg.bgid = RECV_BUF_GROUP;
+    if( sysRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ) {
+        log_warn("io_uring buffer ring not available: %s", strerror(errno));
+        iouring_free(ur);
+        return NULL;
+    }
+    for(i = 0; i < RECV_BUF_COUNT; ++i)
+        returnRecvBuf(ur, i);
+    ur->sendBuf = malloc(SEND_BUF_SIZE);
+    armRecv(ur);
+    if( enter(ur, 0, &syscallCnt) < 0 ) {
+        log_warn("io_uring submit: %s", strerror(errno));
+        iouring_free(ur);
+        return NULL;
+    }
+    return ur;
+}
+
+int iouring_getFd(const IoUring *ur)
+{
+    return ur->ringFd;
+}
+
+void iouring_setRecvTimeout(IoUring *ur, int timeoutMs)
+{
+    ur->recvTimeoutMs = timeoutMs;
+}
+
+int iouring_readv(IoUring *ur, const struct iovec *iov, int iovcnt,
+        unsigned long long *syscallCnt)
+{
+    struct pollfd pfd;
+    int i, res, rd = 0;
+
+    while( 1 ) {
+        reapCompletions(ur, syscallCnt);
+        if( ur->chunkCount > 0 || ur->isRecvDone )
+            break;
+        if( ur->recvTimeoutMs > 0 ) {
+            // the ring descriptor is readable when a completion is posted
+            pfd.fd = ur->ringFd;
+            pfd.events = POLLIN;
+            STAT_ADD(*syscallCnt, 1);
+            if( (res = poll(&pfd, 1, ur->recvTimeoutMs)) == 0 ) {
+                errno = EAGAIN;
+                return -1;
+            }
+            if( res < 0 && errno != EINTR )
+                return -1;
+        }else if( enter(ur, 1, syscallCnt) < 0 && errno != EINTR )
+            return -1;
+    }
+    for(i = 0; i < iovcnt && ur->chunkCount > 0; ++i) {
+        char *dest = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while( left > 0 && ur->chunkCount > 0 ) {
+            RecvChunk *chunk = ur->chunks + ur->chunkFirst;
+            unsigned len = left < chunk->len ? left : chunk->len;
+            memcpy(dest, ur->recvBufs + chunk->bufId * RECV_BUF_SIZE +
+                    chunk->off, len);
+            dest += len;
+            left -= len;
+            rd += len;
+            chunk->off += len;
+            chunk->len -= len;
+            if( chunk->len == 0 ) {
+                returnRecvBuf(ur, chunk->bufId);
+                ur->chunkFirst = (ur->chunkFirst + 1) % RECV_BUF_COUNT;
+                --ur->chunkCount;
+            }
+        }
+    }
+    if( rd > 0 )
+        return rd;
+    if( ur->recvStatus < 0 ) {
+        errno = -ur->recvStatus;
+        return -1;
+    }
+    return 0;
+}
+
+int iouring_isDataAvail(IoUring *ur, unsigned long long *syscallCnt)
+{
+    // also the send completions, which make the ring descriptor readable
+    reapCompletions(ur, syscallCnt);
+    return ur->chunkCount > 0 || ur->isRecvDone;
+}
+
+int iouring_writev(IoUring *ur, const struct iovec *iov, int iovcnt,
+        unsigned long long *syscallCnt)
+{
+    struct io_uring_sqe *sqe = NULL;
+    int i, wr = 0;
+
+    // sends of the previous submission may not be reordered with new ones
+    reapCompletions(ur, syscallCnt);
+    while( ur->sendsPending > 0 && ur->sendError == 0 ) {
+        if( enter(ur, 1, syscallCnt) < 0 && errno != EINTR )
+            return -1;
+        reapCompletions(ur, syscallCnt);
+    }
+    if( ur->sendError != 0 ) {
+        errno = ur->sendError;
+        return -1;
+    }
+    for(i = 0; i < iovcnt && i < SEND_CHUNK_MAX &&
+            ur->sendOff < SEND_BUF_SIZE; ++i)
+    {
+        unsigned len = SEND_BUF_SIZE - ur->sendOff;
+        if( iov[i].iov_len < len )
+            len = iov[i].iov_len;
+        memcpy(ur->sendBuf + ur->sendOff, iov[i].iov_base, len);
+        if( sqe != NULL )
+            sqe->flags |= IOSQE_IO_LINK;
+        sqe = getSqe(ur);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = ur->sockFd;
+        sqe->addr = (unsigned long)(ur->sendBuf + ur->sendOff);
+        sqe->len = len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = TAG_SEND;
+        ur->sendOff += len;
+        ++ur->sendsPending;
+        wr += len;
+        if( len < iov[i].iov_len )
+            break;
+    }
+    if( enter(ur, 0, syscallCnt) < 0 )
+        return -1;
+    return wr;
+}
+
+void iouring_free(IoUring *ur)
+{
+    close(ur->ringFd);
+    if( ur->sqRing != NULL && ur->sqRing != MAP_FAILED )
+        munmap(ur->sqRing, ur->sqRingSize);
+    if( ur->cqRing != NULL && ur->cqRing != MAP_FAILED &&
+            ur->cqRing != ur->sqRing )
+        munmap(ur->cqRing, ur->cqRingSize);
+    if( ur->sqes != NULL && ur->sqes != MAP_FAILED )
+        munmap(ur->sqes, ur->sqesSize);
+    if( ur->bufRing != NULL && ur->bufRing != MAP_FAILED )
+        munmap(ur->bufRing, RECV_BUF_COUNT * sizeof(struct io_uring_buf));
+    if( ur->recvBufs != NULL && ur->recvBufs != MAP_FAILED )
+        munmap(ur->recvBufs, RECV_BUF_COUNT * RECV_BUF_SIZE);
+    free(ur->sendBuf);
+    free(ur);
+}
@@ -0,0 +1,60 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <sys/uio.h>
+
+/* io_uring I/O of a connected socket. Data is received by a multishot
+ * receive into a ring of buffers registered in kernel, so the completions
+ * are posted while the program works and a read usually needs no system
+ * call; the buffers are returned to kernel by a store to shared memory.
+ * Writes are submitted as linked sends from a staging buffer without
+ * waiting for completion.
+ */
+typedef struct IoUring IoUring;
+
+
+/* Sets up the ring and starts receiving from the socket. Returns NULL when
+ * io_uring is not available.
+ */
+IoUring *iouring_create(int sockFd);
+
+
+/* Returns descriptor of the ring, readable when some completion is posted
+ */
+int iouring_getFd(const IoUring*);
+
+
+/* Reads received data into the buffers, waiting for it when there is none.
+ * Returns like readv. The number of system calls made is added to
+ * *syscallCnt.
+ */
+int iouring_readv(IoUring*, const struct iovec*, int iovcnt,
+        unsigned long long *syscallCnt);
+
+
+/* Limits the time iouring_readv waits for data; it fails with EAGAIN
+ * then. Zero waits without limit.
+ */
+void iouring_setRecvTimeout(IoUring*, int timeoutMs);
+
+
+/* Returns non-zero when read would not wait: some data is received, or end
+ * of stream or error is to be reported. Reaps all completions, so the ring
+ * descriptor is not readable until a new one is posted. Makes a system call
+ * only to restart the receive.
+ */
+int iouring_isDataAvail(IoUring*, unsigned long long *syscallCnt);
+
+
+/* Queues send of the data and submits it. Returns number of bytes queued,
+ * -1 when an earlier send failed. The number of system calls made is added
+ * to *syscallCnt.
+ */
+int iouring_writev(IoUring*, const struct iovec*, int iovcnt,
+        unsigned long long *syscallCnt);
+
+
+void iouring_free(IoUring*);
+
+
+#endif /* IOURING_H */
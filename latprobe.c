@@ -0,0 +1,254 @@
+#include "latprobe.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+enum {
+    PROBE_INTERVAL_US = 250000,     // pause after a probe is presented
+    PROBE_TIMEOUT_US = 2000000,     // probe without screen change is lost
+    POINTER_SHIFT = 16,             // pointer movement distance
+    DEFAULT_AREA_SIZE = 64
+};
+
+enum { XK_x = 0x78, XK_BackSpace = 0xff08 };
+
+typedef enum {
+    PS_IDLE,            // waiting for next probe time
+    PS_SEND,            // input events being sent
+    PS_WAIT_CHANGE,     // waiting for the watched area change
+    PS_WAIT_PRESENT     // change decoded, waiting for present
+} ProbeState;
+
+enum { PH_TOTAL, PH_NETWORK, PH_DECODE, PH_PRESENT, PH_COUNT };
+
+struct LatencyProbe {
+    LatencyProbeMode mode;
+    ProbeState state;
+    int probeCount, sentCount, lostCount, doneCount;
+    int isAreaSet;
+    RectangleArea area;
+    int inputIdx;           // next input event of current probe
+    unsigned areaHash;      // watched area contents when the probe was sent
+    unsigned long long nextTm, sentNs, updBegNs, decodedNs;
+    unsigned long long *samples[PH_COUNT];   // nanoseconds, per phase
+};
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+LatencyProbe *latprobe_create(LatencyProbeMode mode, int probeCount)
+{
+    int i;
+    LatencyProbe *probe = malloc(sizeof(LatencyProbe));
+
+    probe->mode = mode;
+    probe->state = PS_IDLE;
+    probe->probeCount = probeCount;
+    probe->sentCount = probe->lostCount = probe->doneCount = 0;
+    probe->isAreaSet = 0;
+    probe->inputIdx = 0;
+    probe->nextTm = monoTimeNs() + PROBE_INTERVAL_US * 1000LL;
+    for(i = 0; i < PH_COUNT; ++i)
+        probe->samples[i] = malloc(probeCount * sizeof(unsigned long long));
+    return probe;
+}
+
+void latprobe_setArea(LatencyProbe *probe, int x, int y,
+        int width, int height)
+{
+    probe->area.x = x;
+    probe->area.y = y;
+    probe->area.width = width;
+    probe->area.height = height;
+    probe->isAreaSet = 1;
+}
+
+static void setDefaultArea(LatencyProbe *probe, DisplayConnection *dispConn)
+{
+    int width = clidisp_getWidth(dispConn);
+    int height = clidisp_getHeight(dispConn);
+
+    if( probe->mode == LATPROBE_POINTER )
+        latprobe_setArea(probe, (width - DEFAULT_AREA_SIZE) / 2,
+                (height - DEFAULT_AREA_SIZE) / 2, DEFAULT_AREA_SIZE,
+                DEFAULT_AREA_SIZE);
+    else
+        latprobe_setArea(probe, 0, 0, width, height);
+}
+
+/* Fills the input event number idx of the current probe. Returns zero
+ * when there are no more events.
+ */
+static int getProbeInput(LatencyProbe *probe, int idx, DisplayEvent *ev)
+{
+    int isForward = probe->sentCount % 2 == 0;
+
+    if( probe->mode == LATPROBE_POINTER ) {
+        if( idx > 0 )
+            return 0;
+        ev->evType = VET_MOUSE;
+        ev->pev.buttonMask = 0;
+        ev->pev.x = probe->area.x + probe->area.width / 2 +
+            (isForward ? POINTER_SHIFT / 2 : -POINTER_SHIFT / 2);
+        ev->pev.y = probe->area.y + probe->area.height / 2;
+    }else{
+        if( idx > 1 )
+            return 0;
+        ev->evType = VET_KEY;
+        ev->kev.isDown = idx == 0;
+        ev->kev.keysym = isForward ? XK_x : XK_BackSpace;
+    }
+    return 1;
+}
+
+static void addSample(LatencyProbe *probe, unsigned long long presentedNs)
+{
+    unsigned long long changeBegNs = probe->updBegNs > probe->sentNs ?
+        probe->updBegNs : probe->sentNs;
+    int n = probe->doneCount++;
+
+    probe->samples[PH_TOTAL][n] = presentedNs - probe->sentNs;
+    probe->samples[PH_NETWORK][n] = changeBegNs - probe->sentNs;
+    probe->samples[PH_DECODE][n] = probe->decodedNs - changeBegNs;
+    probe->samples[PH_PRESENT][n] = presentedNs - probe->decodedNs;
+    log_debug("probe %d: latency %.3f ms", probe->sentCount,
+            probe->samples[PH_TOTAL][n] / 1e6);
+}
+
+int latprobe_nextInput(LatencyProbe *probe, DisplayConnection *dispConn,
+        DisplayEvent *ev)
+{
+    unsigned long long curTm = monoTimeNs();
+
+    if( ! probe->isAreaSet )
+        setDefaultArea(probe, dispConn);
+    if( probe->state == PS_WAIT_CHANGE &&
+            curTm - probe->sentNs >= PROBE_TIMEOUT_US * 1000LL )
+    {
+        log_warn("latency probe %d: no change of watched area",
+                probe->sentCount);
+        ++probe->lostCount;
+        probe->state = PS_IDLE;
+        probe->nextTm = curTm;
+    }
+    if( probe->state == PS_IDLE && curTm >= probe->nextTm &&
+            probe->sentCount < probe->probeCount )
+    {
+        probe->areaHash = clidisp_getAreaHash(dispConn, probe->area.x,
+                probe->area.y, probe->area.width, probe->area.height);
+        probe->inputIdx = 0;
+        probe->sentNs = curTm;
+        probe->updBegNs = 0;
+        probe->state = PS_SEND;
+    }
+    if( probe->state != PS_SEND )
+        return 0;
+    if( getProbeInput(probe, probe->inputIdx, ev) ) {
+        ++probe->inputIdx;
+        return 1;
+    }
+    ++probe->sentCount;
+    probe->state = PS_WAIT_CHANGE;
+    return 0;
+}
+
+int latprobe_getTimeoutUs(LatencyProbe *probe)
+{
+    unsigned long long curTm = monoTimeNs(), deadline;
+
+    switch( probe->state ) {
+    case PS_IDLE:
+        if( probe->sentCount == probe->probeCount )
+            return -1;
+        deadline = probe->nextTm;
+        break;
+    case PS_WAIT_CHANGE:
+        deadline = probe->sentNs + PROBE_TIMEOUT_US * 1000LL;
+        break;
+    case PS_SEND:
+        return 0;
+    default:
+        return -1;
+    }
+    return deadline > curTm ? (deadline - curTm + 999) / 1000 : 0;
+}
+
+void latprobe_updateBegin(LatencyProbe *probe)
+{
+    if( probe->state == PS_WAIT_CHANGE )
+        probe->updBegNs = monoTimeNs();
+}
+
+void latprobe_rectDecoded(LatencyProbe *probe, DisplayConnection *dispConn,
+        int x, int y, int width, int height)
+{
+    const RectangleArea *area = &probe->area;
+
+    if( probe->state != PS_WAIT_CHANGE || x >= area->x + area->width ||
+            x + width <= area->x || y >= area->y + area->height ||
+            y + height <= area->y )
+        return;
+    if( clidisp_getAreaHash(dispConn, area->x, area->y, area->width,
+                area->height) != probe->areaHash )
+    {
+        probe->decodedNs = monoTimeNs();
+        probe->state = PS_WAIT_PRESENT;
+    }
+}
+
+void latprobe_presented(LatencyProbe *probe)
+{
+    if( probe->state == PS_WAIT_PRESENT ) {
+        unsigned long long curTm = monoTimeNs();
+        addSample(probe, curTm);
+        probe->state = PS_IDLE;
+        probe->nextTm = curTm + PROBE_INTERVAL_US * 1000LL;
+    }
+}
+
+int latprobe_isDone(LatencyProbe *probe)
+{
+    return probe->sentCount == probe->probeCount && probe->state == PS_IDLE;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    unsigned long long sa = *(const unsigned long long*)a;
+    unsigned long long sb = *(const unsigned long long*)b;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+void latprobe_print(LatencyProbe *probe, FILE *fp)
+{
+    static const char *const phaseNames[PH_COUNT] = {
+        "total", "network", "decode", "present"
+    };
+    int i, n = probe->doneCount;
+
+    fprintf(fp, "latency: %d probes, %d lost\n", n, probe->lostCount);
+    if( n == 0 )
+        return;
+    for(i = 0; i < PH_COUNT; ++i) {
+        unsigned long long *samples = probe->samples[i];
+        qsort(samples, n, sizeof(unsigned long long), compareSamples);
+        fprintf(fp, "  %-8s p50 %8.3f ms, p99 %8.3f ms\n", phaseNames[i],
+                samples[(n - 1) / 2] / 1e6, samples[(n - 1) * 99 / 100] / 1e6);
+    }
+}
+
+void latprobe_free(LatencyProbe *probe)
+{
+    int i;
+
+    for(i = 0; i < PH_COUNT; ++i)
+        free(probe->samples[i]);
+    free(probe);
+}
+
@@ -0,0 +1,70 @@
+#ifndef LATPROBE_H
+#define LATPROBE_H
+
+#include <stdio.h>
+#include "clidisplay.h"
+
+/* Input-to-pixel latency measurement. Synthetic pointer movements or key
+ * strokes are sent periodically and the watched display area is checked
+ * for change after every decoded rectangle intersecting it. The latency of
+ * each probe is split into phases:
+ *   network - from sending the input to the start of the framebuffer
+ *             update containing the change
+ *   decode  - from the update start until the change is decoded
+ *   present - from the change decoding until it is flushed to display
+ */
+typedef struct LatencyProbe LatencyProbe;
+
+typedef enum {
+    LATPROBE_NONE,
+    LATPROBE_POINTER,       // move the pointer back and forth
+    LATPROBE_KEY            // type a character, then erase it
+} LatencyProbeMode;
+
+
+/* Creates the probe sending given number of probes. The watched area
+ * defaults to 64x64 square in the middle of the desktop for pointer probes,
+ * to the whole desktop for key probes.
+ */
+LatencyProbe *latprobe_create(LatencyProbeMode, int probeCount);
+
+
+/* Sets the watched area. Pointer is moved in the middle of the area.
+ */
+void latprobe_setArea(LatencyProbe*, int x, int y, int width, int height);
+
+
+/* Retrieves the next input event to send now. Returns zero when there is
+ * nothing to send.
+ */
+int latprobe_nextInput(LatencyProbe*, DisplayConnection*, DisplayEvent*);
+
+
+/* Returns time in microseconds until the probe needs attention, or -1
+ * when it waits for nothing.
+ */
+int latprobe_getTimeoutUs(LatencyProbe*);
+
+
+/* Notifications from the update processing
+ */
+void latprobe_updateBegin(LatencyProbe*);
+void latprobe_rectDecoded(LatencyProbe*, DisplayConnection*, int x, int y,
+        int width, int height);
+void latprobe_presented(LatencyProbe*);
+
+
+/* Returns non-zero when all probes are finished
+ */
+int latprobe_isDone(LatencyProbe*);
+
+
+/* Prints p50 and p99 of total latency and of its phases
+ */
+void latprobe_print(LatencyProbe*, FILE*);
+
+
+void latprobe_free(LatencyProbe*);
+
+
+#endif /* LATPROBE_H */
@@ -0,0 +1,560 @@
+/* Network emulating proxy for performance tests over slow links. Forwards
+ * viewer connections to a VNC server, delaying the data in each direction
+ * to emulate latency, jitter, bandwidth limit and stalls caused by packet
+ * loss, and reports throughput of both directions. The emulation is done
+ * in user space, so neither root privileges nor remote hosts are needed.
+ * Each connection is served by a separate process.
+ */
+#define _GNU_SOURCE
+#include "sockstream.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+
+/* Link parameters. The delay is one way, the same in both directions.
+ * Bandwidth is given in kbit/s, 0 means unlimited.
+ */
+typedef struct {
+    const char *name;
+    double delayMs, jitterMs;
+    unsigned downKbps, upKbps;
+    double lossPercent;
+} LinkProfile;
+
+static const LinkProfile gProfiles[] = {
+    { "lan",        0.2,    0,      1000000,    1000000,    0 },
+    { "wifi",       2,      2,      200000,     200000,     0.1 },
+    { "cable",      10,     2,      100000,     10000,      0.05 },
+    { "dsl",        20,     3,      16000,      1000,       0.1 },
+    { "lte",        35,     10,     30000,      10000,      0.5 },
+    { "wan",        50,     5,      50000,      50000,      0.1 },
+    { "satellite",  300,    20,     20000,      3000,       1 }
+};
+
+enum { PROFILE_COUNT = sizeof(gProfiles) / sizeof(gProfiles[0]) };
+
+typedef struct {
+    int port;
+    int isAnyAddr;
+    int isOnce;
+    const char *target;
+    LinkProfile link;
+    int stallMs;
+    int reportSecs;
+    unsigned seed;
+    int logLevel;
+} ProxyParams;
+
+enum {
+    QUEUE_SIZE = 32 << 20,          // data queued in one direction
+    READ_MAX = 256 << 10,
+    SEG_SIZE = 1448,                // TCP segment payload
+    SEG_COUNT = 1 << 16,
+    BACKLOG_MAX_NS = 50000000       // link queue length, as in a router
+};
+
+/* Part of data arriving at once
+ */
+typedef struct {
+    unsigned long long end;         // stream offset of the segment end
+    unsigned long long arrivalNs;
+} Segment;
+
+/* Data flowing in one direction. Received bytes are queued in a ring
+ * buffer, at stream offset modulo QUEUE_SIZE, and split into segments.
+ * A segment is transmitted over the emulated link, once the link is free,
+ * and is written to the destination when it arrives at the other end.
+ */
+typedef struct {
+    const char *name;
+    int srcFd, dstFd;
+    unsigned long long bitsPerSec;  // 0 when unlimited
+    char *buf;
+    unsigned long long readCount, arrivedCount, writeCount;
+    Segment *segs;
+    int segHead, segCount;
+    unsigned long long linkFreeNs, lastArrivalNs;
+    int isEOF, isBlocked, isDone;
+    unsigned long long stalls;
+    unsigned long long reportCount; // writeCount at the last report
+} Direction;
+
+static unsigned gRandom;
+
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Returns pseudo-random number in range [0, 1)
+ */
+static double nextRandom(void)
+{
+    gRandom ^= gRandom << 13;
+    gRandom ^= gRandom >> 17;
+    gRandom ^= gRandom << 5;
+    return gRandom / 4294967296.0;
+}
+
+static void usage(void)
+{
+    int i;
+
+    printf("\n"
+        "usage: netemvnc [parameters]\n"
+        "\n"
+        "parameters:\n"
+        "  -p |-port      <port>  - TCP port or display number to listen\n"
+        "                           on, display 1 by default\n"
+        "  -a |-anyaddr           - listen on all addresses, not loopback\n"
+        "  -t |-target    <host>  - server to forward to, as host[:display]\n"
+        "                           or unix:<path>, localhost:0 by default\n"
+        "  -1 |-once              - serve one client and exit\n"
+        "  -l |-link      <name>  - link profile, sets the parameters below;\n"
+        "                           may be followed by other parameters\n"
+        "                           changing the profile\n"
+        "  -d |-delay     <ms>    - one way delay, in each direction\n"
+        "  -j |-jitter    <ms>    - random extra delay up to given value;\n"
+        "                           the order of data is kept, as in TCP\n"
+        "  -b |-bandwidth <kbps>  - bandwidth of both directions, in kbit/s;\n"
+        "                           given as down/up, e.g. 16000/1000, sets\n"
+        "                           server to viewer and viewer to server\n"
+        "                           direction; 0 - unlimited (default)\n"
+        "  -ls|-loss      <%%>     - probability of segment loss; the lost\n"
+        "                           segment and following data are stalled\n"
+        "  -st|-stall     <ms>    - stall time on loss, 200 by default,\n"
+        "                           as TCP retransmission timeout\n"
+        "  -r |-report    <secs>  - report throughput periodically\n"
+        "  -s |-seed      <num>   - random generator seed, for jitter and\n"
+        "                           loss; runs with the same seed and data\n"
+        "                           are alike\n"
+        "  -v |-verbose           - print some debug info\n"
+        "  -h |-help              - print this help\n"
+        "\n"
+        "link profiles (delay, jitter, down/up kbit/s, loss):\n");
+    for(i = 0; i < PROFILE_COUNT; ++i) {
+        const LinkProfile *prof = gProfiles + i;
+        printf("  %-10s - %g ms, %g ms, %u/%u, %g%%\n", prof->name,
+                prof->delayMs, prof->jitterMs, prof->downKbps, prof->upKbps,
+                prof->lossPercent);
+    }
+    printf("\n"
+        "Data is delayed in both directions, so round trip time is twice\n"
+        "the delay. Throughput of each direction is reported when the\n"
+        "connection ends.\n"
+        "\n");
+    exit(0);
+}
+
+static void parseCmdLine(int argc, char *argv[], ProxyParams *params)
+{
+    int i = 1, k;
+
+    params->port = 5901;
+    params->isAnyAddr = 0;
+    params->isOnce = 0;
+    params->target = "localhost:0";
+    memset(&params->link, 0, sizeof(params->link));
+    params->link.name = "custom";
+    params->stallMs = 200;
+    params->reportSecs = 0;
+    params->seed = 1;
+    params->logLevel = 0;
+    while( i < argc ) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        if( !strcmp(arg, "-p") || !strcmp(arg, "-port") ) {
+            params->port = atoi(val);
+            if( params->port < 100 )
+                params->port += 5900;
+            ++i;
+        }else if( !strcmp(arg, "-a") || !strcmp(arg, "-anyaddr") )
+            params->isAnyAddr = 1;
+        else if( !strcmp(arg, "-t") || !strcmp(arg, "-target") ) {
+            params->target = val;
+            ++i;
+        }else if( !strcmp(arg, "-1") || !strcmp(arg, "-once") )
+            params->isOnce = 1;
+        else if( !strcmp(arg, "-l") || !strcmp(arg, "-link") ) {
+            for(k = 0; k < PROFILE_COUNT && strcmp(val, gProfiles[k].name);
+                    ++k)
+                ;
+            if( k == PROFILE_COUNT ) {
+                fprintf(stderr, "error: bad link profile\n\n");
+                exit(1);
+            }
+            params->link = gProfiles[k];
+            ++i;
+        }else if( !strcmp(arg, "-d") || !strcmp(arg, "-delay") ) {
+            if( (params->link.delayMs = atof(val)) < 0 ) {
+                fprintf(stderr, "error: bad delay\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-j") || !strcmp(arg, "-jitter") ) {
+            if( (params->link.jitterMs = atof(val)) < 0 ) {
+                fprintf(stderr, "error: bad jitter\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-b") || !strcmp(arg, "-bandwidth") ) {
+            int cnt = sscanf(val, "%u/%u", &params->link.downKbps,
+                    &params->link.upKbps);
+            if( cnt < 1 ) {
+                fprintf(stderr, "error: bad bandwidth\n\n");
+                exit(1);
+            }
+            if( cnt == 1 )
+                params->link.upKbps = params->link.downKbps;
+            ++i;
+        }else if( !strcmp(arg, "-ls") || !strcmp(arg, "-loss") ) {
+            params->link.lossPercent = atof(val);
+            if( params->link.lossPercent < 0 ||
+                    params->link.lossPercent > 100 )
+            {
+                fprintf(stderr, "error: bad loss probability\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-st") || !strcmp(arg, "-stall") ) {
+            if( (params->stallMs = atoi(val)) < 0 ) {
+                fprintf(stderr, "error: bad stall time\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-r") || !strcmp(arg, "-report") ) {
+            if( (params->reportSecs = atoi(val)) <= 0 ) {
+                fprintf(stderr, "error: bad report interval\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-s") || !strcmp(arg, "-seed") ) {
+            params->seed = strtoul(val, NULL, 0);
+            ++i;
+        }else if( !strcmp(arg, "-v") || !strcmp(arg, "-verbose") )
+            ++params->logLevel;
+        else if( !strcmp(arg, "-h") || !strcmp(arg, "-help") )
+            usage();
+        else{
+            fprintf(stderr, "error: unrecognized option -- %s\n\n", arg);
+            exit(1);
+        }
+        ++i;
+    }
+    // xorshift generator never leaves zero
+    if( params->seed == 0 )
+        params->seed = 1;
+}
+
+static void initDirection(Direction *dir, const char *name, int srcFd,
+        int dstFd, unsigned kbps)
+{
+    memset(dir, 0, sizeof(Direction));
+    dir->name = name;
+    dir->srcFd = srcFd;
+    dir->dstFd = dstFd;
+    dir->bitsPerSec = kbps * 1000ULL;
+    if( (dir->buf = malloc(QUEUE_SIZE)) == NULL ||
+            (dir->segs = malloc(SEG_COUNT * sizeof(Segment))) == NULL )
+        log_fatal("out of memory");
+}
+
+/* Transmits the segment over emulated link: computes its arrival time
+ */
+static void addSegment(Direction *dir, const ProxyParams *params,
+        unsigned len, unsigned long long curNs)
+{
+    const LinkProfile *link = &params->link;
+    Segment *seg = dir->segs + (dir->segHead + dir->segCount++) % SEG_COUNT;
+    unsigned long long arrivalNs;
+
+    if( dir->linkFreeNs < curNs )
+        dir->linkFreeNs = curNs;
+    if( dir->bitsPerSec != 0 )
+        dir->linkFreeNs += len * 8000000000ULL / dir->bitsPerSec;
+    arrivalNs = dir->linkFreeNs + (unsigned long long)(link->delayMs * 1e6);
+    if( link->jitterMs > 0 )
+        arrivalNs += (unsigned long long)(nextRandom() * link->jitterMs * 1e6);
+    if( link->lossPercent > 0 && nextRandom() * 100 < link->lossPercent ) {
+        arrivalNs += params->stallMs * 1000000ULL;
+        ++dir->stalls;
+    }
+    // data is delivered in order
+    if( arrivalNs < dir->lastArrivalNs )
+        arrivalNs = dir->lastArrivalNs;
+    dir->lastArrivalNs = arrivalNs;
+    dir->readCount += len;
+    seg->end = dir->readCount;
+    seg->arrivalNs = arrivalNs;
+}
+
+/* Returns non-zero when the direction has room for more data: the queue
+ * is not full and the link is not busy for too long ahead
+ */
+static int canReceive(const Direction *dir, unsigned long long curNs)
+{
+    return ! dir->isEOF &&
+        dir->readCount - dir->writeCount <= QUEUE_SIZE - READ_MAX &&
+        dir->segCount <= SEG_COUNT - (READ_MAX / SEG_SIZE + 1) &&
+        dir->linkFreeNs <= curNs + BACKLOG_MAX_NS;
+}
+
+static void receive(Direction *dir, const ProxyParams *params,
+        unsigned long long curNs)
+{
+    unsigned off = dir->readCount % QUEUE_SIZE;
+    unsigned len = QUEUE_SIZE - off;
+    unsigned long long budget, freeNs;
+    int rd;
+
+    if( len > READ_MAX )
+        len = READ_MAX;
+    // no more than the link transmits within the backlog, so that a slow
+    // link does not take the data far ahead; at least one segment
+    if( dir->bitsPerSec != 0 ) {
+        freeNs = dir->linkFreeNs > curNs ? dir->linkFreeNs : curNs;
+        budget = (curNs + BACKLOG_MAX_NS - freeNs) * dir->bitsPerSec /
+            8000000000ULL;
+        if( budget < SEG_SIZE )
+            budget = SEG_SIZE;
+        if( len > budget )
+            len = budget;
+    }
+    if( (rd = read(dir->srcFd, dir->buf + off, len)) < 0 ) {
+        if( errno == EAGAIN || errno == EINTR )
+            return;
+        log_error_errno("%s read", dir->name);
+    }
+    if( rd <= 0 ) {
+        log_debug("%s: end of stream", dir->name);
+        dir->isEOF = 1;
+        return;
+    }
+    while( rd > 0 ) {
+        len = rd < SEG_SIZE ? rd : SEG_SIZE;
+        addSegment(dir, params, len, curNs);
+        rd -= len;
+    }
+}
+
+/* Writes data arrived so far to the destination. Returns -1 when the
+ * destination is gone.
+ */
+static int deliver(Direction *dir, unsigned long long curNs)
+{
+    while( dir->segCount > 0 && dir->segs[dir->segHead].arrivalNs <= curNs ) {
+        dir->arrivedCount = dir->segs[dir->segHead].end;
+        dir->segHead = (dir->segHead + 1) % SEG_COUNT;
+        --dir->segCount;
+    }
+    dir->isBlocked = 0;
+    while( dir->writeCount < dir->arrivedCount ) {
+        unsigned off = dir->writeCount % QUEUE_SIZE;
+        unsigned long long len = dir->arrivedCount - dir->writeCount;
+        if( len > QUEUE_SIZE - off )
+            len = QUEUE_SIZE - off;
+        int wr = write(dir->dstFd, dir->buf + off, len);
+        if( wr < 0 ) {
+            if( errno == EAGAIN ) {
+                dir->isBlocked = 1;
+                return 0;
+            }
+            if( errno == EINTR )
+                continue;
+            if( errno == EPIPE || errno == ECONNRESET )
+                log_info("%s: connection closed", dir->name);
+            else
+                log_error_errno("%s write", dir->name);
+            return -1;
+        }
+        dir->writeCount += wr;
+    }
+    if( dir->isEOF && dir->segCount == 0 && ! dir->isDone ) {
+        shutdown(dir->dstFd, SHUT_WR);
+        dir->isDone = 1;
+    }
+    return 0;
+}
+
+/* Returns the time the direction needs attention at, without any socket
+ * readiness; ~0 when none
+ */
+static unsigned long long getWakeupNs(const Direction *dir,
+        unsigned long long curNs)
+{
+    unsigned long long wakeNs = ~0ULL;
+
+    if( dir->segCount > 0 && ! dir->isBlocked )
+        wakeNs = dir->segs[dir->segHead].arrivalNs;
+    if( ! dir->isEOF && dir->linkFreeNs > curNs + BACKLOG_MAX_NS &&
+            dir->linkFreeNs - BACKLOG_MAX_NS < wakeNs )
+        wakeNs = dir->linkFreeNs - BACKLOG_MAX_NS;
+    return wakeNs;
+}
+
+static void report(const Direction *dirs, unsigned long long elapsedNs)
+{
+    log_info("%s %.2f Mbit/s, %s %.2f Mbit/s",
+            dirs[0].name, (dirs[0].writeCount - dirs[0].reportCount) * 8e3 /
+            elapsedNs, dirs[1].name,
+            (dirs[1].writeCount - dirs[1].reportCount) * 8e3 / elapsedNs);
+}
+
+static void serveClient(const ProxyParams *params, int cliFd)
+{
+    Direction dirs[2];
+    struct pollfd pfds[2];
+    int i, isError = 0;
+
+    SockStream *strm = sock_tryConnectVNCHost(params->target);
+    if( strm == NULL ) {
+        close(cliFd);
+        return;
+    }
+    int srvFd = dup(sock_fd(strm));
+    sock_close(strm);
+    fcntl(srvFd, F_SETFL, fcntl(srvFd, F_GETFL) | O_NONBLOCK);
+    fcntl(cliFd, F_SETFL, fcntl(cliFd, F_GETFL) | O_NONBLOCK);
+    gRandom = params->seed;
+    initDirection(&dirs[0], "down", srvFd, cliFd, params->link.downKbps);
+    initDirection(&dirs[1], "up", cliFd, srvFd, params->link.upKbps);
+    unsigned long long begNs = monoTimeNs(), reportNs = begNs;
+    while( 1 ) {
+        unsigned long long curNs = monoTimeNs(), wakeNs = ~0ULL;
+        for(i = 0; i < 2; ++i) {
+            if( deliver(dirs + i, curNs) < 0 )
+                isError = 1;
+            unsigned long long dirWakeNs = getWakeupNs(dirs + i, curNs);
+            if( dirWakeNs < wakeNs )
+                wakeNs = dirWakeNs;
+        }
+        if( isError || (dirs[0].isDone && dirs[1].isDone) )
+            break;
+        if( params->reportSecs > 0 ) {
+            unsigned long long intervalNs = params->reportSecs * 1000000000ULL;
+            if( curNs >= reportNs + intervalNs ) {
+                report(dirs, curNs - reportNs);
+                dirs[0].reportCount = dirs[0].writeCount;
+                dirs[1].reportCount = dirs[1].writeCount;
+                reportNs = curNs;
+            }
+            if( reportNs + intervalNs < wakeNs )
+                wakeNs = reportNs + intervalNs;
+        }
+        // socket i is the source of direction i and destination of the other
+        for(i = 0; i < 2; ++i) {
+            pfds[i].events = 0;
+            if( canReceive(dirs + i, curNs) )
+                pfds[i].events |= POLLIN;
+            if( dirs[1 - i].isBlocked )
+                pfds[i].events |= POLLOUT;
+            // closed socket would be reported as hung up continuously
+            pfds[i].fd = pfds[i].events ? dirs[i].srcFd : -1;
+        }
+        struct timespec ts, *timeout = NULL;
+        if( wakeNs != ~0ULL ) {
+            unsigned long long waitNs = wakeNs > curNs ? wakeNs - curNs : 0;
+            ts.tv_sec = waitNs / 1000000000;
+            ts.tv_nsec = waitNs % 1000000000;
+            timeout = &ts;
+        }
+        if( ppoll(pfds, 2, timeout, NULL) < 0 ) {
+            if( errno == EINTR )
+                continue;
+            log_fatal_errno("poll");
+        }
+        curNs = monoTimeNs();
+        for(i = 0; i < 2; ++i) {
+            if( pfds[i].revents & (POLLIN | POLLHUP | POLLERR) &&
+                    canReceive(dirs + i, curNs) )
+                receive(dirs + i, params, curNs);
+        }
+    }
+    double secs = (monoTimeNs() - begNs) / 1e9;
+    for(i = 0; i < 2; ++i) {
+        log_info("%s: %.1f MB in %.1f s, %.2f Mbit/s, %llu stalls",
+                dirs[i].name, dirs[i].writeCount / 1e6, secs,
+                dirs[i].writeCount * 8 / 1e6 / secs, dirs[i].stalls);
+        free(dirs[i].buf);
+        free(dirs[i].segs);
+    }
+    close(srvFd);
+    close(cliFd);
+}
+
+static int listenTCP(const ProxyParams *params)
+{
+    struct sockaddr_in addr;
+    int listenFd, isOn = 1;
+
+    if( (listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+        log_fatal_errno("socket");
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &isOn, sizeof(isOn));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(params->port);
+    addr.sin_addr.s_addr = htonl(params->isAnyAddr ?
+            INADDR_ANY : INADDR_LOOPBACK);
+    if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 )
+        log_fatal_errno("bind port %d", params->port);
+    return listenFd;
+}
+
+int main(int argc, char *argv[])
+{
+    ProxyParams params;
+    int listenFd, sockFd, isOn = 1;
+
+    parseCmdLine(argc, argv, &params);
+    log_setLevel(params.logLevel + 1);
+    listenFd = listenTCP(&params);
+    if( listen(listenFd, 16) < 0 )
+        log_fatal_errno("listen");
+    const LinkProfile *link = &params.link;
+    log_info("port %d -> %s: %s link, delay %g ms, jitter %g ms, "
+            "down %u kbit/s, up %u kbit/s, loss %g%%", params.port,
+            params.target, link->name, link->delayMs, link->jitterMs,
+            link->downKbps, link->upKbps, link->lossPercent);
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    while( 1 ) {
+        if( (sockFd = accept(listenFd, NULL, NULL)) < 0 ) {
+            log_error_errno("accept");
+            continue;
+        }
+        if( setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, &isOn,
+                    sizeof(isOn)) )
+            log_error_errno("set socket TCP_NODELAY failed");
+        if( params.isOnce ) {
+            close(listenFd);
+            serveClient(&params, sockFd);
+            break;
+        }
+        switch( fork() ) {
+        case -1:
+            log_error_errno("fork");
+            break;
+        case 0:
+            close(listenFd);
+            serveClient(&params, sockFd);
+            exit(0);
+        }
+        close(sockFd);
+    }
+    return 0;
+}
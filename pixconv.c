@@ -0,0 +1,190 @@
+#include "pixconv.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+struct PixelConverter {
+    PixelFormat src, dest;
+    unsigned srcBytespp, destBytespp;
+    int isDestHostOrder;
+    unsigned *table;    // for source pixels up to 16 bits
+    unsigned *redTable, *greenTable, *blueTable;    // for wider ones
+};
+
+static int isHostBigEndian(void)
+{
+    unsigned one = 1;
+
+    return *(unsigned char*)&one == 0;
+}
+
+static int isSameFormat(const PixelFormat *pf1, const PixelFormat *pf2)
+{
+    return pf1->bitsPerPixel == pf2->bitsPerPixel &&
+        (pf1->bitsPerPixel == 8 || pf1->bigEndian == pf2->bigEndian) &&
+        pf1->maxRed == pf2->maxRed && pf1->maxGreen == pf2->maxGreen &&
+        pf1->maxBlue == pf2->maxBlue && pf1->shiftRed == pf2->shiftRed &&
+        pf1->shiftGreen == pf2->shiftGreen &&
+        pf1->shiftBlue == pf2->shiftBlue;
+}
+
+/* Creates table converting color component value in range 0..srcMax
+ * into shifted destination component.
+ */
+static unsigned *createComponentTable(unsigned srcMax, unsigned destMax,
+        unsigned destShift)
+{
+    unsigned i, *table = malloc((srcMax + 1) * sizeof(unsigned));
+
+    for(i = 0; i <= srcMax; ++i)
+        table[i] = (i * destMax + srcMax / 2) / srcMax << destShift;
+    return table;
+}
+
+PixelConverter *pixconv_create(const PixelFormat *src,
+        const PixelFormat *dest)
+{
+    unsigned i;
+
+    if( isSameFormat(src, dest) )
+        return NULL;
+    if( ! src->trueColor )
+        log_fatal("color map pixel formats are not supported");
+    if( src->maxRed == 0 || src->maxGreen == 0 || src->maxBlue == 0 )
+        log_fatal("bad pixel format");
+    PixelConverter *conv = malloc(sizeof(PixelConverter));
+    conv->src = *src;
+    conv->dest = *dest;
+    conv->srcBytespp = (src->bitsPerPixel + 7) / 8;
+    conv->destBytespp = (dest->bitsPerPixel + 7) / 8;
+    conv->isDestHostOrder = conv->destBytespp == 1 ||
+        !dest->bigEndian == !isHostBigEndian();
+    conv->redTable = createComponentTable(src->maxRed, dest->maxRed,
+            dest->shiftRed);
+    conv->greenTable = createComponentTable(src->maxGreen, dest->maxGreen,
+            dest->shiftGreen);
+    conv->blueTable = createComponentTable(src->maxBlue, dest->maxBlue,
+            dest->shiftBlue);
+    conv->table = NULL;
+    if( src->bitsPerPixel <= 16 ) {
+        unsigned count = 1 << src->bitsPerPixel;
+        unsigned *table = malloc(count * sizeof(unsigned));
+        for(i = 0; i < count; ++i)
+            table[i] = pixconv_convert(conv, i);
+        conv->table = table;
+    }
+    log_debug("pixel converter: %d bpp to %d bpp%s", src->bitsPerPixel,
+            dest->bitsPerPixel, conv->table ? " using lookup table" : "");
+    return conv;
+}
+
+unsigned pixconv_readPixel(const PixelConverter *conv, const void *src)
+{
+    const unsigned char *p = src;
+
+    switch( conv->srcBytespp ) {
+    case 1:
+        return p[0];
+    case 2:
+        return conv->src.bigEndian ? p[0] << 8 | p[1] : p[1] << 8 | p[0];
+    }
+    return conv->src.bigEndian ?
+        (unsigned)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3] :
+        (unsigned)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+}
+
+unsigned pixconv_convert(const PixelConverter *conv, unsigned srcPixel)
+{
+    if( conv->table != NULL )
+        return conv->table[srcPixel];
+    return conv->redTable[srcPixel >> conv->src.shiftRed & conv->src.maxRed] |
+        conv->greenTable[srcPixel >> conv->src.shiftGreen &
+            conv->src.maxGreen] |
+        conv->blueTable[srcPixel >> conv->src.shiftBlue & conv->src.maxBlue];
+}
+
+const unsigned *pixconv_getTable(const PixelConverter *conv)
+{
+    return conv->table;
+}
+
+void pixconv_writePixel(const PixelConverter *conv, void *dest,
+        unsigned pixel)
+{
+    unsigned char *p = dest;
+
+    switch( conv->destBytespp ) {
+    case 1:
+        p[0] = pixel;
+        break;
+    case 2:
+        if( conv->dest.bigEndian ) {
+            p[0] = pixel >> 8;
+            p[1] = pixel;
+        }else{
+            p[0] = pixel;
+            p[1] = pixel >> 8;
+        }
+        break;
+    default:
+        if( conv->dest.bigEndian ) {
+            p[0] = pixel >> 24;
+            p[1] = pixel >> 16;
+            p[2] = pixel >> 8;
+            p[3] = pixel;
+        }else{
+            p[0] = pixel;
+            p[1] = pixel >> 8;
+            p[2] = pixel >> 16;
+            p[3] = pixel >> 24;
+        }
+        break;
+    }
+}
+
+void pixconv_convertLine(const PixelConverter *conv, void *dest,
+        const void *src, int count)
+{
+    int i;
+
+    if( conv->destBytespp == 4 && conv->isDestHostOrder ) {
+        unsigned *d = dest;
+        // the most common cases: low color source on true color display
+        if( conv->srcBytespp == 1 ) {
+            const unsigned char *s = src;
+            for(i = 0; i < count; ++i)
+                d[i] = conv->table[s[i]];
+            return;
+        }
+        if( conv->srcBytespp == 2 && !conv->src.bigEndian ) {
+            const unsigned char *s = src;
+            for(i = 0; i < count; ++i, s += 2)
+                d[i] = conv->table[s[1] << 8 | s[0]];
+            return;
+        }
+        for(i = 0; i < count; ++i) {
+            d[i] = pixconv_convert(conv, pixconv_readPixel(conv, src));
+            src = (const char*)src + conv->srcBytespp;
+        }
+        return;
+    }
+    for(i = 0; i < count; ++i) {
+        pixconv_writePixel(conv, dest,
+                pixconv_convert(conv, pixconv_readPixel(conv, src)));
+        src = (const char*)src + conv->srcBytespp;
+        dest = (char*)dest + conv->destBytespp;
+    }
+}
+
+void pixconv_free(PixelConverter *conv)
+{
+    if( conv != NULL ) {
+        free(conv->table);
+        free(conv->redTable);
+        free(conv->greenTable);
+        free(conv->blueTable);
+    }
+    free(conv);
+}
+
@@ -0,0 +1,48 @@
+#ifndef PIXCONV_H
+#define PIXCONV_H
+
+#include "vnccommon.h"
+
+typedef struct PixelConverter PixelConverter;
+
+
+/* Creates converter of pixels in "src" true-color format into "dest" one.
+ * Returns NULL when no conversion is needed, i.e. both formats are the
+ * same.
+ */
+PixelConverter *pixconv_create(const PixelFormat *src,
+        const PixelFormat *dest);
+
+
+/* Reads pixel value stored in source pixel format.
+ */
+unsigned pixconv_readPixel(const PixelConverter*, const void *src);
+
+
+/* Converts pixel value in source format into destination format value.
+ */
+unsigned pixconv_convert(const PixelConverter*, unsigned srcPixel);
+
+
+/* Returns lookup table indexed by source pixel value which gives the
+ * destination pixel value. The table is available for source formats
+ * up to 16 bits per pixel, otherwise NULL is returned.
+ */
+const unsigned *pixconv_getTable(const PixelConverter*);
+
+
+/* Converts "count" pixels from source to destination buffer.
+ */
+void pixconv_convertLine(const PixelConverter*, void *dest, const void *src,
+        int count);
+
+
+/* Stores pixel value in destination format.
+ */
+void pixconv_writePixel(const PixelConverter*, void *dest, unsigned pixel);
+
+
+void pixconv_free(PixelConverter*);
+
+
+#endif /* PIXCONV_H */
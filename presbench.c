@@ -0,0 +1,281 @@
+/* Benchmark of presenting the framebuffer in X window. Runs synthetic
+ * damage patterns with each present mode and window size and reports the
+ * throughput, when frames are presented without waiting, and the latency
+ * of a single present followed by XSync. The resize pattern changes the
+ * desktop size on every frame. The depth is the one of the X
+ * server default visual, e.g. Xvfb -screen 0 1920x1080x16.
+ */
+#include "clidisplay.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+
+enum {
+    SIZE_MAX_COUNT = 8,
+    SCATTER_RECTS = 16, SCATTER_SIZE = 32,
+    SCROLL_STEP = 16
+};
+
+typedef enum {
+    PAT_FULL, PAT_SCATTER, PAT_SCROLL, PAT_RESIZE, PAT_COUNT
+} DamagePattern;
+
+static const char *const gPatternNames[PAT_COUNT] = {
+    "full", "scatter", "scroll", "resize"
+};
+
+static const char *const gModeNames[] = { "shm", "putimage", "pixmap" };
+
+typedef struct {
+    int frameCount;
+    int sizeCount;
+    int widths[SIZE_MAX_COUNT], heights[SIZE_MAX_COUNT];
+    const char *modeName;           // NULL - all modes
+    const char *patternName;        // NULL - all patterns
+    int width, height;              // of the window being measured
+    int argc;
+    char **argv;
+    int eventFd;                    // never readable
+    unsigned rnd;
+} Bench;
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned nextRandom(Bench *b)
+{
+    // xorshift32
+    b->rnd ^= b->rnd << 13;
+    b->rnd ^= b->rnd >> 17;
+    b->rnd ^= b->rnd << 5;
+    return b->rnd;
+}
+
+/* Handles window events, e.g. map and expose, for the given time
+ */
+static void settle(Bench *b, DisplayConnection *dispConn, int timeoutUs)
+{
+    DisplayEvent ev;
+    unsigned long long endTm = monoTimeNs() + timeoutUs * 1000LL;
+
+    clidisp_sync(dispConn);
+    while( monoTimeNs() < endTm )
+        clidisp_nextEvent(dispConn, 0, b->eventFd, &ev, 10000);
+}
+
+/* Changes the framebuffer and marks damage for next frame. Returns the
+ * number of damaged pixels.
+ */
+static unsigned long long drawFrame(Bench *b, DisplayConnection *dispConn,
+        DamagePattern pattern, int frameNo)
+{
+    unsigned pixel = nextRandom(b);
+    int i, width = clidisp_getWidth(dispConn);
+    int height = clidisp_getHeight(dispConn);
+    int bandY = frameNo * SCROLL_STEP % (height - SCROLL_STEP);
+
+    switch( pattern ) {
+    case PAT_FULL:
+        clidisp_fillRect(dispConn, (char*)&pixel, 0, bandY, width,
+                SCROLL_STEP);
+        clidisp_addDamage(dispConn, 0, 0, width, height);
+        return (unsigned long long)width * height;
+    case PAT_SCATTER:
+        for(i = 0; i < SCATTER_RECTS; ++i) {
+            int x = nextRandom(b) % (width - SCATTER_SIZE);
+            int y = nextRandom(b) % (height - SCATTER_SIZE);
+            clidisp_fillRect(dispConn, (char*)&pixel, x, y, SCATTER_SIZE,
+                    SCATTER_SIZE);
+            clidisp_addDamage(dispConn, x, y, SCATTER_SIZE, SCATTER_SIZE);
+        }
+        return SCATTER_RECTS * SCATTER_SIZE * SCATTER_SIZE;
+    case PAT_RESIZE:
+        // shrinks on odd frames, replaces the framebuffer on each
+        width = b->width - frameNo % 2 * SCROLL_STEP;
+        height = b->height - frameNo % 2 * SCROLL_STEP;
+        clidisp_resize(dispConn, width, height);
+        clidisp_fillRect(dispConn, (char*)&pixel, 0, 0, width, SCROLL_STEP);
+        return (unsigned long long)width * height;
+    default:
+        clidisp_copyRect(dispConn, 0, SCROLL_STEP, 0, 0, width,
+                height - SCROLL_STEP);
+        clidisp_fillRect(dispConn, (char*)&pixel, 0, height - SCROLL_STEP,
+                width, SCROLL_STEP);
+        clidisp_addDamage(dispConn, 0, 0, width, height);
+        return (unsigned long long)width * height;
+    }
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+    unsigned long long sa = *(const unsigned long long*)a;
+    unsigned long long sb = *(const unsigned long long*)b;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+static void runPattern(Bench *b, DisplayConnection *dispConn,
+        const char *modeName, DamagePattern pattern)
+{
+    unsigned long long pixels = 0, begTm, *samples;
+    int i, n = b->frameCount;
+
+    // throughput: presents are queued without waiting
+    begTm = monoTimeNs();
+    for(i = 0; i < n; ++i) {
+        pixels += drawFrame(b, dispConn, pattern, i);
+        clidisp_flush(dispConn);
+    }
+    clidisp_sync(dispConn);
+    double secs = (monoTimeNs() - begTm) / 1e9;
+    // latency: each present waits for completion
+    samples = malloc(n * sizeof(unsigned long long));
+    for(i = 0; i < n; ++i) {
+        drawFrame(b, dispConn, pattern, i);
+        begTm = monoTimeNs();
+        clidisp_flush(dispConn);
+        clidisp_sync(dispConn);
+        samples[i] = monoTimeNs() - begTm;
+    }
+    qsort(samples, n, sizeof(unsigned long long), compareSamples);
+    printf("%-8s %5dx%-5d %-8s %9.1f %9.1f %9.3f %9.3f\n", modeName,
+            clidisp_getWidth(dispConn), clidisp_getHeight(dispConn),
+            gPatternNames[pattern], n / secs, pixels / secs / 1e6,
+            samples[(n - 1) / 2] / 1e6, samples[(n - 1) * 99 / 100] / 1e6);
+    free(samples);
+}
+
+static void runMode(Bench *b, PresentMode mode, int width, int height)
+{
+    PixelFormat pixelFormat;
+    int pattern;
+
+    DisplayConnection *dispConn = clidisp_open(width, height, "presbench",
+            b->argc, b->argv, 0, mode);
+    // no pixel conversion on decoding
+    clidisp_getPixelFormat(dispConn, &pixelFormat);
+    clidisp_setServerPixelFormat(dispConn, &pixelFormat);
+    b->width = width;
+    b->height = height;
+    settle(b, dispConn, 300000);
+    for(pattern = 0; pattern < PAT_COUNT; ++pattern) {
+        if( b->patternName == NULL ||
+                !strcmp(b->patternName, gPatternNames[pattern]) )
+        {
+            runPattern(b, dispConn, gModeNames[mode], pattern);
+            settle(b, dispConn, 50000);
+        }
+    }
+    clidisp_close(dispConn);
+}
+
+static void usage(void)
+{
+    printf("\n"
+        "usage: presbench [parameters] [full|scatter|scroll|resize]\n"
+        "\n"
+        "parameters:\n"
+        "  -g |-geometry  <WxH>   - window size, may be repeated; by "
+        "default\n"
+        "                           640x480, 1280x720 and 1920x1080\n"
+        "  -m |-mode      <mode>  - present mode: shm, putimage or pixmap;\n"
+        "                           all by default\n"
+        "  -n |-frames    <n>     - frames per measurement, 200 by default\n"
+        "  -h |-help              - print this help\n"
+        "\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int defaultSizes[][2] = {
+        { 640, 480 }, { 1280, 720 }, { 1920, 1080 }
+    };
+    Bench b;
+    PixelFormat pixelFormat;
+    int i, fds[2];
+
+    memset(&b, 0, sizeof(b));
+    b.frameCount = 200;
+    b.rnd = 2463534242u;
+    b.argc = argc;
+    b.argv = argv;
+    for(i = 1; i < argc; ++i) {
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        if( !strcmp(argv[i], "-g") || !strcmp(argv[i], "-geometry") ) {
+            if( b.sizeCount == SIZE_MAX_COUNT ||
+                    sscanf(val, "%dx%d", b.widths + b.sizeCount,
+                        b.heights + b.sizeCount) != 2 ||
+                    b.widths[b.sizeCount] < 2 * SCATTER_SIZE ||
+                    b.heights[b.sizeCount] < 2 * SCATTER_SIZE )
+            {
+                fprintf(stderr, "error: bad geometry\n\n");
+                exit(1);
+            }
+            ++b.sizeCount;
+            ++i;
+        }else if( !strcmp(argv[i], "-m") || !strcmp(argv[i], "-mode") ) {
+            if( strcmp(val, "shm") && strcmp(val, "putimage") &&
+                    strcmp(val, "pixmap") )
+            {
+                fprintf(stderr, "error: bad present mode\n\n");
+                exit(1);
+            }
+            b.modeName = val;
+            ++i;
+        }else if( !strcmp(argv[i], "-n") || !strcmp(argv[i], "-frames") ) {
+            if( (b.frameCount = atoi(val)) <= 0 ) {
+                fprintf(stderr, "error: bad number of frames\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(argv[i], "-h") || !strcmp(argv[i], "-help") )
+            usage();
+        else if( argv[i][0] == '-' ) {
+            fprintf(stderr, "error: unrecognized option -- %s\n\n", argv[i]);
+            exit(1);
+        }else if( strcmp(argv[i], "full") && strcmp(argv[i], "scatter") &&
+                strcmp(argv[i], "scroll") && strcmp(argv[i], "resize") )
+        {
+            fprintf(stderr, "error: bad damage pattern\n\n");
+            exit(1);
+        }else
+            b.patternName = argv[i];
+    }
+    if( b.sizeCount == 0 ) {
+        for(i = 0; i < 3; ++i) {
+            b.widths[i] = defaultSizes[i][0];
+            b.heights[i] = defaultSizes[i][1];
+        }
+        b.sizeCount = 3;
+    }
+    if( pipe(fds) < 0 )
+        log_fatal_errno("pipe");
+    b.eventFd = fds[0];
+    // print the display depth
+    DisplayConnection *dispConn = clidisp_open(64, 64, "presbench", argc,
+            argv, 0, PRESENT_PUTIMAGE);
+    clidisp_getPixelFormat(dispConn, &pixelFormat);
+    clidisp_close(dispConn);
+    printf("depth %u, %u bits per pixel, %d frames\n", pixelFormat.depth,
+            pixelFormat.bitsPerPixel, b.frameCount);
+    printf("%-8s %-11s %-8s %9s %9s %9s %9s\n", "mode", "size", "pattern",
+            "frames/s", "MPix/s", "p50 ms", "p99 ms");
+    for(i = 0; i < b.sizeCount; ++i) {
+        if( b.modeName == NULL || !strcmp(b.modeName, "shm") )
+            runMode(&b, PRESENT_SHM, b.widths[i], b.heights[i]);
+        if( b.modeName == NULL || !strcmp(b.modeName, "putimage") )
+            runMode(&b, PRESENT_PUTIMAGE, b.widths[i], b.heights[i]);
+        if( b.modeName == NULL || !strcmp(b.modeName, "pixmap") )
+            runMode(&b, PRESENT_PIXMAP, b.widths[i], b.heights[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,478 @@
+#include "rfbenc.h"
+#include "pixconv.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+
+struct RfbEncoder {
+    PixelFormat fbFormat, clientFormat;
+    PixelConverter *conv;       // NULL when client uses framebuffer format
+    unsigned bytespp;           // client bytes per pixel
+    unsigned cpixelSize, cpixelShift;   // ZRLE compressed pixel
+    unsigned char *data;
+    unsigned len, cap;
+    unsigned char *zrleBuf;     // ZRLE data before compression
+    unsigned zrleLen, zrleCap;
+    z_stream zstrm;
+    int compressLevel, wantCompressLevel;
+};
+
+static void reserve(unsigned char **data, unsigned *cap, unsigned need)
+{
+    if( need > *cap ) {
+        *cap = need > 2 * *cap ? need : 2 * *cap;
+        *data = realloc(*data, *cap);
+    }
+}
+
+static unsigned char *append(RfbEncoder *enc, unsigned count)
+{
+    reserve(&enc->data, &enc->cap, enc->len + count);
+    enc->len += count;
+    return enc->data + enc->len - count;
+}
+
+static void putU8(RfbEncoder *enc, unsigned val)
+{
+    *append(enc, 1) = val;
+}
+
+static void putU16(RfbEncoder *enc, unsigned val)
+{
+    unsigned char *dp = append(enc, 2);
+
+    dp[0] = val >> 8;
+    dp[1] = val;
+}
+
+static void putU32(RfbEncoder *enc, unsigned val)
+{
+    unsigned char *dp = append(enc, 4);
+
+    dp[0] = val >> 24;
+    dp[1] = val >> 16;
+    dp[2] = val >> 8;
+    dp[3] = val;
+}
+
+static void putRectHeader(RfbEncoder *enc, int x, int y,
+        int width, int height, int encType)
+{
+    putU16(enc, x);
+    putU16(enc, y);
+    putU16(enc, width);
+    putU16(enc, height);
+    putU32(enc, encType);
+}
+
+static void storeValue(unsigned char *dp, unsigned val, unsigned size,
+        int bigEndian)
+{
+    unsigned i;
+
+    for(i = 0; i < size; ++i)
+        dp[bigEndian ? size - 1 - i : i] = val >> 8 * i;
+}
+
+/* Converts framebuffer pixel into client pixel value
+ */
+static inline unsigned clientPixel(const RfbEncoder *enc, unsigned pixel)
+{
+    return enc->conv == NULL ? pixel : pixconv_convert(enc->conv, pixel);
+}
+
+static void putPixel(RfbEncoder *enc, unsigned pixel)
+{
+    storeValue(append(enc, enc->bytespp), clientPixel(enc, pixel),
+            enc->bytespp, enc->clientFormat.bigEndian);
+}
+
+RfbEncoder *rfbenc_create(const PixelFormat *fbFormat)
+{
+    int initRes;
+    RfbEncoder *enc = malloc(sizeof(RfbEncoder));
+
+    enc->fbFormat = *fbFormat;
+    enc->conv = NULL;
+    enc->data = enc->zrleBuf = NULL;
+    enc->len = enc->cap = enc->zrleLen = enc->zrleCap = 0;
+    enc->zstrm.zalloc = NULL;
+    enc->zstrm.zfree = NULL;
+    enc->zstrm.opaque = NULL;
+    enc->compressLevel = enc->wantCompressLevel = 6;
+    if( (initRes = deflateInit(&enc->zstrm, enc->compressLevel)) != Z_OK )
+        log_fatal("deflateInit error=%d", initRes);
+    rfbenc_setClientFormat(enc, fbFormat);
+    return enc;
+}
+
+void rfbenc_setClientFormat(RfbEncoder *enc, const PixelFormat *pixelFormat)
+{
+    unsigned long colorMask;
+
+    pixconv_free(enc->conv);
+    enc->conv = pixconv_create(&enc->fbFormat, pixelFormat);
+    enc->clientFormat = *pixelFormat;
+    enc->bytespp = (pixelFormat->bitsPerPixel + 7) / 8;
+    enc->cpixelSize = enc->bytespp;
+    enc->cpixelShift = 0;
+    colorMask = pixelFormat->maxRed << pixelFormat->shiftRed |
+        pixelFormat->maxGreen << pixelFormat->shiftGreen |
+        pixelFormat->maxBlue << pixelFormat->shiftBlue;
+    if( pixelFormat->bitsPerPixel == 32 && pixelFormat->depth <= 24 ) {
+        if( (colorMask & 0xff000000) == 0 ) {
+            enc->cpixelSize = 3;
+        }else if( (colorMask & 0xff) == 0 ) {
+            enc->cpixelSize = 3;
+            enc->cpixelShift = 8;
+        }
+    }
+}
+
+void rfbenc_setCompressLevel(RfbEncoder *enc, int level)
+{
+    // deflateParams may produce output, so it is called before deflate
+    enc->wantCompressLevel = level;
+}
+
+void rfbenc_beginUpdate(RfbEncoder *enc, int rectCount)
+{
+    putU8(enc, 0);      // FramebufferUpdate
+    putU8(enc, 0);      // padding
+    putU16(enc, rectCount);
+}
+
+static void putRaw(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    int i, j;
+
+    for(i = 0; i < height; ++i) {
+        const unsigned *line = fb + (y + i) * fbStride + x;
+        if( enc->conv == NULL ) {
+            memcpy(append(enc, width * 4), line, width * 4);
+        }else{
+            unsigned char *dp = append(enc, width * enc->bytespp);
+            for(j = 0; j < width; ++j) {
+                storeValue(dp, pixconv_convert(enc->conv, line[j]),
+                        enc->bytespp, enc->clientFormat.bigEndian);
+                dp += enc->bytespp;
+            }
+        }
+    }
+}
+
+/* Subrectangles are horizontal runs of pixels different from the
+ * background; runs of the same color and position in consecutive lines
+ * are merged. Returns -1 when there are more than maxCount subrectangles.
+ */
+typedef struct {
+    unsigned color;
+    int x, y, width, height;
+} Subrect;
+
+static int findSubrects(const unsigned *fb, int fbStride, int x, int y,
+        int width, int height, unsigned bg, Subrect **subrects, int *cap,
+        int maxCount)
+{
+    int i, j, count = 0;
+    int lastAt[width];      // last subrectangle starting at the column
+
+    for(j = 0; j < width; ++j)
+        lastAt[j] = -1;
+    for(i = 0; i < height; ++i) {
+        const unsigned *line = fb + (y + i) * fbStride + x;
+        for(j = 0; j < width; ) {
+            if( line[j] == bg ) {
+                ++j;
+                continue;
+            }
+            int runBeg = j;
+            while( j < width && line[j] == line[runBeg] )
+                ++j;
+            if( lastAt[runBeg] >= 0 ) {
+                Subrect *sr = *subrects + lastAt[runBeg];
+                if( sr->width == j - runBeg && sr->color == line[runBeg] &&
+                        sr->y + sr->height == i )
+                {
+                    ++sr->height;
+                    continue;
+                }
+            }
+            if( count == *cap ) {
+                if( count == maxCount )
+                    return -1;
+                *cap = 2 * *cap < maxCount ? 2 * *cap : maxCount;
+                *subrects = realloc(*subrects, *cap * sizeof(Subrect));
+            }
+            Subrect *sr = *subrects + count;
+            sr->color = line[runBeg];
+            sr->x = runBeg;
+            sr->y = i;
+            sr->width = j - runBeg;
+            sr->height = 1;
+            lastAt[runBeg] = count++;
+        }
+    }
+    return count;
+}
+
+static void putRRE(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    int i, cap = 1024;
+    unsigned bg = fb[y * fbStride + x];
+    Subrect *subrects = malloc(cap * sizeof(Subrect));
+
+    int count = findSubrects(fb, fbStride, x, y, width, height, bg,
+            &subrects, &cap, width * height);
+    putU32(enc, count);
+    putPixel(enc, bg);
+    for(i = 0; i < count; ++i) {
+        putPixel(enc, subrects[i].color);
+        putU16(enc, subrects[i].x);
+        putU16(enc, subrects[i].y);
+        putU16(enc, subrects[i].width);
+        putU16(enc, subrects[i].height);
+    }
+    free(subrects);
+}
+
+static void putHextileTile(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    Subrect subrectsBuf[255], *subrects = subrectsBuf;
+    int i, cap = 255, isOneColor = 1;
+    unsigned bg = fb[y * fbStride + x];
+
+    int count = findSubrects(fb, fbStride, x, y, width, height, bg,
+            &subrects, &cap, 255);
+    if( count == 0 ) {
+        putU8(enc, 2);      // BackgroundSpecified
+        putPixel(enc, bg);
+        return;
+    }
+    for(i = 1; i < count && isOneColor; ++i)
+        isOneColor = subrects[i].color == subrects[0].color;
+    int encodedLen = count * (isOneColor ? 2 : 2 + enc->bytespp);
+    if( count < 0 || encodedLen >= width * height * enc->bytespp ) {
+        putU8(enc, 1);      // Raw
+        putRaw(enc, fb, fbStride, x, y, width, height);
+        return;
+    }
+    // BackgroundSpecified, AnySubrects and either ForegroundSpecified or
+    // SubrectsColoured
+    putU8(enc, isOneColor ? 2 | 4 | 8 : 2 | 8 | 16);
+    putPixel(enc, bg);
+    if( isOneColor )
+        putPixel(enc, subrects[0].color);
+    putU8(enc, count);
+    for(i = 0; i < count; ++i) {
+        const Subrect *sr = subrects + i;
+        if( ! isOneColor )
+            putPixel(enc, sr->color);
+        putU8(enc, sr->x << 4 | sr->y);
+        putU8(enc, (sr->width - 1) << 4 | (sr->height - 1));
+    }
+}
+
+static void putHextile(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    int i, j;
+
+    for(i = 0; i < height; i += 16) {
+        int th = height - i > 16 ? 16 : height - i;
+        for(j = 0; j < width; j += 16) {
+            int tw = width - j > 16 ? 16 : width - j;
+            putHextileTile(enc, fb, fbStride, x + j, y + i, tw, th);
+        }
+    }
+}
+
+static unsigned char *zrleAppend(RfbEncoder *enc, unsigned count)
+{
+    reserve(&enc->zrleBuf, &enc->zrleCap, enc->zrleLen + count);
+    enc->zrleLen += count;
+    return enc->zrleBuf + enc->zrleLen - count;
+}
+
+static void zrlePutCPixel(RfbEncoder *enc, unsigned pixel)
+{
+    storeValue(zrleAppend(enc, enc->cpixelSize),
+            clientPixel(enc, pixel) >> enc->cpixelShift, enc->cpixelSize,
+            enc->clientFormat.bigEndian);
+}
+
+static void zrlePutRunLength(RfbEncoder *enc, unsigned run)
+{
+    --run;
+    while( run >= 255 ) {
+        *zrleAppend(enc, 1) = 255;
+        run -= 255;
+    }
+    *zrleAppend(enc, 1) = run;
+}
+
+static void putZRLETile(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    unsigned palette[16];
+    int i, j, k, paletteSize = 0, runCount = 0;
+    unsigned prev = fb[y * fbStride + x];
+
+    for(i = 0; i < height; ++i) {
+        const unsigned *line = fb + (y + i) * fbStride + x;
+        for(j = 0; j < width; ++j) {
+            if( i + j == 0 || line[j] != prev )
+                ++runCount;
+            prev = line[j];
+            if( paletteSize <= 16 ) {
+                for(k = 0; k < paletteSize && palette[k] != line[j]; ++k)
+                    ;
+                if( k == paletteSize && paletteSize++ < 16 )
+                    palette[k] = line[j];
+            }
+        }
+    }
+    if( paletteSize == 1 ) {
+        *zrleAppend(enc, 1) = 1;
+        zrlePutCPixel(enc, palette[0]);
+    }else if( paletteSize <= 16 ) {
+        int bits = paletteSize == 2 ? 1 : paletteSize <= 4 ? 2 : 4;
+        *zrleAppend(enc, 1) = paletteSize;
+        for(k = 0; k < paletteSize; ++k)
+            zrlePutCPixel(enc, palette[k]);
+        for(i = 0; i < height; ++i) {
+            const unsigned *line = fb + (y + i) * fbStride + x;
+            unsigned b = 0, nbits = 0;
+            for(j = 0; j < width; ++j) {
+                for(k = 0; palette[k] != line[j]; ++k)
+                    ;
+                b = b << bits | k;
+                nbits += bits;
+                if( nbits == 8 ) {
+                    *zrleAppend(enc, 1) = b;
+                    b = nbits = 0;
+                }
+            }
+            if( nbits > 0 )
+                *zrleAppend(enc, 1) = b << (8 - nbits);
+        }
+    }else if( runCount * (enc->cpixelSize + 1) <
+            width * height * enc->cpixelSize )
+    {
+        unsigned run = 0;
+        *zrleAppend(enc, 1) = 128;  // plain RLE
+        for(i = 0; i < height; ++i) {
+            const unsigned *line = fb + (y + i) * fbStride + x;
+            for(j = 0; j < width; ++j) {
+                if( run > 0 && line[j] != prev ) {
+                    zrlePutCPixel(enc, prev);
+                    zrlePutRunLength(enc, run);
+                    run = 0;
+                }
+                prev = line[j];
+                ++run;
+            }
+        }
+        zrlePutCPixel(enc, prev);
+        zrlePutRunLength(enc, run);
+    }else{
+        *zrleAppend(enc, 1) = 0;    // raw
+        for(i = 0; i < height; ++i) {
+            const unsigned *line = fb + (y + i) * fbStride + x;
+            for(j = 0; j < width; ++j)
+                zrlePutCPixel(enc, line[j]);
+        }
+    }
+}
+
+static void putZRLE(RfbEncoder *enc, const unsigned *fb, int fbStride,
+        int x, int y, int width, int height)
+{
+    int i, j, res;
+
+    enc->zrleLen = 0;
+    for(i = 0; i < height; i += 64) {
+        int th = height - i > 64 ? 64 : height - i;
+        for(j = 0; j < width; j += 64) {
+            int tw = width - j > 64 ? 64 : width - j;
+            putZRLETile(enc, fb, fbStride, x + j, y + i, tw, th);
+        }
+    }
+    unsigned lenOff = enc->len;
+    unsigned bound = deflateBound(&enc->zstrm, enc->zrleLen) + 64;
+    append(enc, 4 + bound);
+    enc->zstrm.next_in = enc->zrleBuf;
+    enc->zstrm.avail_in = enc->zrleLen;
+    enc->zstrm.next_out = enc->data + lenOff + 4;
+    enc->zstrm.avail_out = bound;
+    if( enc->wantCompressLevel != enc->compressLevel ) {
+        enc->compressLevel = enc->wantCompressLevel;
+        deflateParams(&enc->zstrm, enc->compressLevel, Z_DEFAULT_STRATEGY);
+    }
+    if( (res = deflate(&enc->zstrm, Z_SYNC_FLUSH)) != Z_OK )
+        log_fatal("deflate returned %d", res);
+    if( enc->zstrm.avail_in != 0 )
+        log_fatal("deflate output buffer too small");
+    unsigned comprLen = bound - enc->zstrm.avail_out;
+    enc->len = lenOff;
+    putU32(enc, comprLen);
+    enc->len += comprLen;
+}
+
+void rfbenc_putRect(RfbEncoder *enc, int encType, const unsigned *fb,
+        int fbStride, int x, int y, int width, int height)
+{
+    putRectHeader(enc, x, y, width, height, encType);
+    switch( encType ) {
+    case 0:
+        putRaw(enc, fb, fbStride, x, y, width, height);
+        break;
+    case 2:
+        putRRE(enc, fb, fbStride, x, y, width, height);
+        break;
+    case 5:
+        putHextile(enc, fb, fbStride, x, y, width, height);
+        break;
+    case 16:
+        putZRLE(enc, fb, fbStride, x, y, width, height);
+        break;
+    default:
+        log_fatal("unsupported encoding %d", encType);
+        break;
+    }
+}
+
+void rfbenc_putCopyRect(RfbEncoder *enc, int srcX, int srcY,
+        int x, int y, int width, int height)
+{
+    putRectHeader(enc, x, y, width, height, 1);
+    putU16(enc, srcX);
+    putU16(enc, srcY);
+}
+
+const void *rfbenc_getData(RfbEncoder *enc, unsigned *len)
+{
+    *len = enc->len;
+    return enc->data;
+}
+
+void rfbenc_clear(RfbEncoder *enc)
+{
+    enc->len = 0;
+}
+
+void rfbenc_free(RfbEncoder *enc)
+{
+    if( enc != NULL ) {
+        pixconv_free(enc->conv);
+        deflateEnd(&enc->zstrm);
+        free(enc->data);
+        free(enc->zrleBuf);
+        free(enc);
+    }
+}
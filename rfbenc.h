@@ -0,0 +1,56 @@
+#ifndef RFBENC_H
+#define RFBENC_H
+
+#include "vnccommon.h"
+
+/* Server side encoding of framebuffer updates. Messages are built in
+ * a memory buffer. The framebuffer has 32-bit pixels in the format given
+ * on creation; pixels are translated to the client format when it is
+ * different.
+ */
+typedef struct RfbEncoder RfbEncoder;
+
+RfbEncoder *rfbenc_create(const PixelFormat *fbFormat);
+
+
+void rfbenc_setClientFormat(RfbEncoder*, const PixelFormat*);
+
+
+/* Sets zlib compression level 0..9 used by ZRLE
+ */
+void rfbenc_setCompressLevel(RfbEncoder*, int level);
+
+
+/* Starts FramebufferUpdate message with given number of rectangles
+ */
+void rfbenc_beginUpdate(RfbEncoder*, int rectCount);
+
+
+/* Appends a rectangle encoded as Raw (0), RRE (2), Hextile (5) or
+ * ZRLE (16). The fbStride is the number of pixels between framebuffer
+ * lines.
+ */
+void rfbenc_putRect(RfbEncoder*, int encType, const unsigned *fb,
+        int fbStride, int x, int y, int width, int height);
+
+
+/* Appends CopyRect rectangle
+ */
+void rfbenc_putCopyRect(RfbEncoder*, int srcX, int srcY,
+        int x, int y, int width, int height);
+
+
+/* Returns the data built so far
+ */
+const void *rfbenc_getData(RfbEncoder*, unsigned *len);
+
+
+/* Discards the data built so far
+ */
+void rfbenc_clear(RfbEncoder*);
+
+
+void rfbenc_free(RfbEncoder*);
+
+
+#endif /* RFBENC_H */
@@ -0,0 +1,202 @@
+#define _GNU_SOURCE
+#include "shmring.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+enum {
+    SHMRING_MAGIC = 0x52515657,         // "WVQR"
+    SHMRING_DATA_OFF = 4096,
+    SHMRING_SIZE_MAX = 1 << 30,
+    // the size is fixed, so the peer cannot make the mapping fault
+    SHMRING_SEALS = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL
+};
+
+/* The positions count bytes written and read since the ring creation;
+ * each one is kept in its own cache line.
+ */
+typedef struct {
+    unsigned magic;
+    unsigned size;
+    char pad1[56];
+    unsigned long long head;            // written by the writer
+    char pad2[56];
+    unsigned long long tail;            // written by the reader
+    unsigned tailSeq;                   // futex incremented by the reader
+    unsigned isWriterWaiting;
+} ShmRingHeader;
+
+struct ShmRing {
+    int fd;
+    ShmRingHeader *hdr;
+    char *data;
+    unsigned mask;
+};
+
+static ShmRing *mapRing(int fd, unsigned size)
+{
+    ShmRing *ring = malloc(sizeof(ShmRing));
+
+    ring->hdr = mmap(NULL, SHMRING_DATA_OFF + size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if( ring->hdr == MAP_FAILED ) {
+        log_error_errno("mmap ring");
+        free(ring);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->data = (char*)ring->hdr + SHMRING_DATA_OFF;
+    ring->mask = size - 1;
+    return ring;
+}
+
+ShmRing *shmring_create(unsigned size)
+{
+    unsigned ringSize = 4096;
+    int fd;
+
+    while( ringSize < size && ringSize < SHMRING_SIZE_MAX )
+        ringSize <<= 1;
+    if( (fd = memfd_create("wilqvnc-ring",
+                    MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 )
+        log_fatal_errno("memfd_create");
+    if( ftruncate(fd, SHMRING_DATA_OFF + ringSize) < 0 )
+        log_fatal_errno("ftruncate");
+    if( fcntl(fd, F_ADD_SEALS, SHMRING_SEALS) < 0 )
+        log_fatal_errno("seal ring");
+    ShmRing *ring = mapRing(fd, ringSize);
+    if( ring == NULL )
+        log_fatal("unable to create ring");
+    ring->hdr->magic = SHMRING_MAGIC;
+    ring->hdr->size = ringSize;
+    return ring;
+}
+
+ShmRing *shmring_attach(int fd)
+{
+    ShmRingHeader hdr;
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+
+    if( seals < 0 || (seals & SHMRING_SEALS) != SHMRING_SEALS ) {
+        log_error("shared memory ring is not sealed");
+        return NULL;
+    }
+    if( fstat(fd, &st) < 0 || st.st_size < SHMRING_DATA_OFF ||
+            pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            hdr.magic != SHMRING_MAGIC || hdr.size == 0 ||
+            hdr.size > SHMRING_SIZE_MAX ||
+            (hdr.size & (hdr.size - 1)) != 0 ||
+            st.st_size < SHMRING_DATA_OFF + hdr.size )
+    {
+        log_error("bad shared memory ring");
+        return NULL;
+    }
+    return mapRing(fd, hdr.size);
+}
+
+int shmring_getFd(const ShmRing *ring)
+{
+    return ring->fd;
+}
+
+int shmring_write(ShmRing *ring, const struct iovec *iov, int iovcnt,
+        int *isDrained)
+{
+    unsigned long long head = ring->hdr->head;
+    unsigned long long tail = __atomic_load_n(&ring->hdr->tail,
+            __ATOMIC_ACQUIRE);
+    unsigned avail = ring->mask + 1 - (head - tail);
+    int i, wr = 0;
+
+    for(i = 0; i < iovcnt && avail > 0; ++i) {
+        const char *src = iov[i].iov_base;
+        unsigned len = iov[i].iov_len < avail ? iov[i].iov_len : avail;
+        unsigned off = (head + wr) & ring->mask;
+        unsigned first = len < ring->mask + 1 - off ? len :
+            ring->mask + 1 - off;
+        memcpy(ring->data + off, src, first);
+        memcpy(ring->data, src + first, len - first);
+        wr += len;
+        avail -= len;
+    }
+    __atomic_store_n(&ring->hdr->head, head + wr, __ATOMIC_SEQ_CST);
+    // the reader waits only after it has seen the ring empty
+    *isDrained = wr > 0 &&
+        __atomic_load_n(&ring->hdr->tail, __ATOMIC_SEQ_CST) == head;
+    return wr;
+}
+
+void shmring_waitSpace(ShmRing *ring, int timeoutMs)
+{
+    struct timespec ts;
+    unsigned seq = __atomic_load_n(&ring->hdr->tailSeq, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&ring->hdr->isWriterWaiting, 1, __ATOMIC_SEQ_CST);
+    if( ring->hdr->head - __atomic_load_n(&ring->hdr->tail,
+                __ATOMIC_SEQ_CST) < ring->mask + 1 )
+        return;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = timeoutMs % 1000 * 1000000;
+    if( syscall(SYS_futex, &ring->hdr->tailSeq, FUTEX_WAIT, seq, &ts,
+                NULL, 0) < 0 && errno != EAGAIN && errno != EINTR &&
+            errno != ETIMEDOUT )
+        log_error_errno("futex wait");
+}
+
+int shmring_readv(ShmRing *ring, const struct iovec *iov, int iovcnt)
+{
+    unsigned long long tail = ring->hdr->tail;
+    unsigned long long head = __atomic_load_n(&ring->hdr->head,
+            __ATOMIC_ACQUIRE);
+    unsigned avail = head - tail;
+    int i, rd = 0;
+
+    for(i = 0; i < iovcnt && avail > 0; ++i) {
+        char *dest = iov[i].iov_base;
+        unsigned len = iov[i].iov_len < avail ? iov[i].iov_len : avail;
+        unsigned off = (tail + rd) & ring->mask;
+        unsigned first = len < ring->mask + 1 - off ? len :
+            ring->mask + 1 - off;
+        memcpy(dest, ring->data + off, first);
+        memcpy(dest + first, ring->data, len - first);
+        rd += len;
+        avail -= len;
+    }
+    if( rd == 0 )
+        return 0;
+    __atomic_store_n(&ring->hdr->tail, tail + rd, __ATOMIC_SEQ_CST);
+    if( __atomic_exchange_n(&ring->hdr->isWriterWaiting, 0,
+                __ATOMIC_SEQ_CST) )
+    {
+        __atomic_add_fetch(&ring->hdr->tailSeq, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ring->hdr->tailSeq, FUTEX_WAKE, INT_MAX, NULL,
+                NULL, 0);
+    }
+    return rd;
+}
+
+int shmring_isDataAvail(const ShmRing *ring)
+{
+    return __atomic_load_n(&ring->hdr->head, __ATOMIC_ACQUIRE) !=
+        ring->hdr->tail;
+}
+
+void shmring_free(ShmRing *ring)
+{
+    if( ring == NULL )
+        return;
+    munmap(ring->hdr, SHMRING_DATA_OFF + ring->mask + 1);
+    close(ring->fd);
+    free(ring);
+}
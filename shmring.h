@@ -0,0 +1,58 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <sys/uio.h>
+
+/* Single-producer single-consumer byte ring in memfd shared memory, used
+ * as a transport of server data on the same host. The writer and the reader
+ * run in different processes; the writer waits for free space on futex,
+ * the reader is woken by the caller, e.g. by a byte sent over socket when
+ * shmring_write reports the ring was drained.
+ */
+typedef struct ShmRing ShmRing;
+
+
+/* Creates the ring with data area of given size, rounded up to power of 2.
+ * The memfd is sealed against resizing.
+ */
+ShmRing *shmring_create(unsigned size);
+
+
+/* Maps the ring created by other process. Returns NULL when the descriptor
+ * is not a ring or is not sealed against resizing.
+ */
+ShmRing *shmring_attach(int fd);
+
+
+/* Returns the memfd descriptor of the ring
+ */
+int shmring_getFd(const ShmRing*);
+
+
+/* Writes as much data as fits, without waiting. Returns number of bytes
+ * written. *isDrained is set when the reader has consumed all the data
+ * written before, so it may be waiting for more.
+ */
+int shmring_write(ShmRing*, const struct iovec*, int iovcnt, int *isDrained);
+
+
+/* Waits until some space is free or the timeout expires
+ */
+void shmring_waitSpace(ShmRing*, int timeoutMs);
+
+
+/* Reads available data without waiting. Returns number of bytes read,
+ * 0 when the ring is empty.
+ */
+int shmring_readv(ShmRing*, const struct iovec*, int iovcnt);
+
+
+/* Returns non-zero when there is data to read
+ */
+int shmring_isDataAvail(const ShmRing*);
+
+
+void shmring_free(ShmRing*);
+
+
+#endif /* SHMRING_H */
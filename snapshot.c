@@ -0,0 +1,136 @@
+#include "snapshot.h"
+#include "clidisplay.h"
+#include "cliconn.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+
+enum {
+    SNAPSHOT_TIMEOUT_S = 30         // per host
+};
+
+typedef struct {
+    pid_t pid;
+    const char *host;
+} SnapJob;
+
+static double curTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Runs in child process. Errors are fatal, so they end the child only.
+ */
+static void snapshotHost(const CmdLineParams *params, const char *host)
+{
+    char fileName[4096];
+    PixelFormat pixelFormat;
+    DisplayEvent ev;
+    int msg;
+
+    alarm(SNAPSHOT_TIMEOUT_S);
+    double begTm = curTimeMs();
+    CliConn *conn = cliconn_open(host, params->passwdFile);
+    double connectTm = curTimeMs();
+    DisplayConnection *disp = clidisp_openHeadless(cliconn_getWidth(conn),
+            cliconn_getHeight(conn), NULL);
+    clidisp_getPixelFormat(disp, &pixelFormat);
+    cliconn_setPixelFormat(conn, &pixelFormat);
+    clidisp_setServerPixelFormat(disp, &pixelFormat);
+    // the least data on wire
+    cliconn_setEncodings(conn, 1, 1, 0);
+    cliconn_sendFramebufferUpdateRequest(conn, 0);
+    while( (msg = cliconn_nextEvent(conn, disp, &ev, 1)) != 0 ) {
+        switch( msg ) {
+        case -1:    // no message
+        case 2:     // Bell
+            break;
+        case 3:     // ServerCutText
+            cliconn_recvCutTextMsg(conn);
+            break;
+        default:
+            log_fatal("unsupported message %d", msg);
+            break;
+        }
+    }
+    cliconn_recvFramebufferUpdate(conn, disp);
+    double updateTm = curTimeMs();
+    snprintf(fileName, sizeof(fileName), params->snapshotPattern, host);
+    if( clidisp_dumpFrame(disp, fileName) )
+        exit(1);
+    double endTm = curTimeMs();
+    printf("%-24s %5dx%-5d %9.1f %9.1f %9.1f %9.1f  %s\n", host,
+            clidisp_getWidth(disp), clidisp_getHeight(disp),
+            connectTm - begTm, updateTm - connectTm, endTm - updateTm,
+            endTm - begTm, fileName);
+    fflush(stdout);
+    clidisp_close(disp);
+    cliconn_close(conn);
+    exit(0);
+}
+
+/* Waits for one of running jobs to finish. Returns non-zero when the job
+ * failed.
+ */
+static int waitJob(SnapJob *jobs, int *jobCount)
+{
+    int i, status;
+    pid_t pid;
+
+    while( (pid = wait(&status)) < 0 )
+        log_fatal_errno("wait");
+    for(i = 0; i < *jobCount && jobs[i].pid != pid; ++i)
+        ;
+    if( i == *jobCount )
+        return 0;
+    const char *host = jobs[i].host;
+    jobs[i] = jobs[--*jobCount];
+    if( WIFEXITED(status) && WEXITSTATUS(status) == 0 )
+        return 0;
+    if( WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM )
+        printf("%-24s timed out\n", host);
+    else
+        printf("%-24s failed\n", host);
+    fflush(stdout);
+    return 1;
+}
+
+int snapshot_run(const CmdLineParams *params)
+{
+    int i, jobCount = 0, failCount = 0;
+    SnapJob *jobs = malloc(params->snapshotJobs * sizeof(SnapJob));
+
+    printf("%-24s %-11s %9s %9s %9s %9s  %s\n", "host", "size",
+            "conn ms", "update ms", "write ms", "total ms", "file");
+    fflush(stdout);
+    // parallel jobs cannot share the terminal
+    if( params->hostCount > 1 )
+        cliconn_setPasswordPrompt(0);
+    double begTm = curTimeMs();
+    for(i = 0; i < params->hostCount; ++i) {
+        if( jobCount == params->snapshotJobs )
+            failCount += waitJob(jobs, &jobCount);
+        pid_t pid = fork();
+        if( pid < 0 )
+            log_fatal_errno("fork");
+        if( pid == 0 )
+            snapshotHost(params, params->hosts[i]);
+        jobs[jobCount].pid = pid;
+        jobs[jobCount].host = params->hosts[i];
+        ++jobCount;
+    }
+    while( jobCount > 0 )
+        failCount += waitJob(jobs, &jobCount);
+    printf("%d hosts, %d failed, %.1f ms\n", params->hostCount, failCount,
+            curTimeMs() - begTm);
+    free(jobs);
+    return failCount > 0;
+}
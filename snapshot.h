@@ -0,0 +1,15 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "cmdline.h"
+
+/* Takes a screenshot of every host: connects, receives one full
+ * framebuffer update and writes it to image file named by the printf-like
+ * pattern given the host name, e.g. "shots/%s.png". Hosts are served by
+ * concurrent child processes, so a failing host does not affect others.
+ * Prints timings of each host.
+ * Returns the process exit code, non-zero when some host failed.
+ */
+int snapshot_run(const CmdLineParams*);
+
+#endif /* SNAPSHOT_H */
@@ -1,67 +1,977 @@
 #include "sockstream.h"
 #include "vnclog.h"
+#include "trace.h"
+#include "shmring.h"
+#include "iouring.h"
 #include <stdio.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
+#include <arpa/inet.h>
 #include <netdb.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
 
 
+static const char RECORDING_MAGIC[8] = "WQVNCR01";
+
+/* Connecting: delay between parallel attempts to subsequent addresses and
+ * the overall timeout
+ */
+enum {
+    CONNECT_ATTEMPT_DELAY_MS = 250,
+    CONNECT_TIMEOUT_MS = 10000
+};
+
+/* Low latency mode: device queue busy polling time, the interval of socket
+ * buffers tuning and the buffer size limit
+ */
+enum {
+    LOWLAT_BUSY_POLL_US = 50,
+    BUF_TUNE_INTERVAL_NS = 1000000000,
+    SOCK_BUF_MAX = 16 << 20
+};
+
+/* Negotiation of shared memory ring transport, see sock_offerRing
+ */
+typedef enum {
+    RING_NONE,
+    RING_WANTED,                // client: accepts ring offered by server
+    RING_OFFERING,              // server: ring to be sent with next write
+    RING_OFFERED,               // server: waits for client response
+    RING_ACCEPTING,             // client: ring to be sent back
+    RING_READ,                  // client: server data is read from ring
+    RING_WRITE                  // server: data is written to ring
+} RingState;
+
 struct SockStream {
-    int sockFd;
+    int sockFd;                 // -1 when replaying
     char readBuf[64];
     char writeBuf[64];
     int readOff, readSize, writeOff;
+    unsigned long long readCount;
+    SockStats stats;
+    int recordFd;               // -1 when not recording
+    unsigned long long recordBegNs;
+    const char *replayData;     // mapped recording, NULL when not replaying
+    int isReplayMapped;         // zero for memory stream
+    size_t replaySize, replayOff;
+    unsigned replayChunkLeft;   // bytes left in current chunk
+    int isReplayRealTime;
+    unsigned long long replayBegNs;
+    jmp_buf *errorJump;         // NULL when errors are fatal
+    char *hostName;             // the host connected to, NULL when unknown
+    SSL *ssl;                   // NULL when not encrypted
+    int isKTLS;                 // encrypted by kernel in both directions
+    ShmRing *ring;              // NULL when not negotiated
+    RingState ringState;
+    IoUring *uring;             // NULL when readv/writev is used
+    int recvTimeoutMs;          // 0 when reads wait without limit
+    // low latency mode: byte counts at the last buffers tuning
+    unsigned long long tuneBegNs, tuneBytesRead, tuneBytesWritten;
+    int rcvAutoTuneMax, sndAutoTuneMax;     // 0 when unknown
 };
 
-SockStream *sock_connectVNCHost(const char *hostVNC)
+static unsigned long long monoTimeNs(void)
 {
-    struct addrinfo hints, *result, *rp;
-    int sockFd;
-    char *host = strdup(hostVNC);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static SockStream *createStream(int sockFd)
+{
+    SockStream *strm = malloc(sizeof(SockStream));
+
+    strm->sockFd = sockFd;
+    strm->readOff = strm->readSize = strm->writeOff = 0;
+    strm->readCount = 0;
+    memset(&strm->stats, 0, sizeof(strm->stats));
+    strm->recordFd = -1;
+    strm->replayData = NULL;
+    strm->isReplayMapped = 0;
+    strm->errorJump = NULL;
+    strm->hostName = NULL;
+    strm->ssl = NULL;
+    strm->isKTLS = 0;
+    strm->ring = NULL;
+    strm->ringState = RING_NONE;
+    strm->uring = NULL;
+    strm->recvTimeoutMs = 0;
+    strm->tuneBegNs = strm->tuneBytesRead = strm->tuneBytesWritten = 0;
+    strm->rcvAutoTuneMax = strm->sndAutoTuneMax = 0;
+    return strm;
+}
+
+/* Splits host[:display] into host name and port. The host may be IPv6
+ * address in brackets, e.g. [::1]:1, or without brackets and display.
+ */
+static char *parseVNCHost(const char *hostVNC, char *portStr)
+{
+    char *host, *disp = NULL;
     unsigned port = 5900;
-    char portStr[20];
 
-    char *disp = strchr(host, ':');
-    if( disp != NULL ) {
-        *disp++ = '\0';
-        port += atoi(disp);
+    if( hostVNC[0] == '[' ) {
+        host = strdup(hostVNC + 1);
+        char *end = strchr(host, ']');
+        if( end != NULL ) {
+            *end = '\0';
+            if( end[1] == ':' )
+                disp = end + 2;
+        }
+    }else{
+        host = strdup(hostVNC);
+        disp = strchr(host, ':');
+        if( disp != NULL && strchr(disp + 1, ':') != NULL )
+            disp = NULL;    // bare IPv6 address
+        else if( disp != NULL )
+            *disp++ = '\0';
     }
+    if( disp != NULL )
+        port += atoi(disp);
     sprintf(portStr, "%u", port);
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = 0;
-    hints.ai_protocol = 0;
-    int s = getaddrinfo(host, portStr, &hints, &result);
-    if(s != 0)
-        log_fatal("connect: %s", gai_strerror(s));
-    free(host);
+    return host;
+}
+
+/* Orders addresses alternating address families, starting with the first
+ * one returned by resolver (RFC 8305). Returns number of addresses.
+ */
+static int orderAddresses(struct addrinfo *result, struct addrinfo ***addrs)
+{
+    struct addrinfo *rp, *first = result, *other = result;
+    int count = 0, i = 0;
 
-    for( rp = result; rp != NULL; rp = rp->ai_next ) {
-        sockFd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sockFd == -1)
+    for(rp = result; rp != NULL; rp = rp->ai_next)
+        ++count;
+    *addrs = malloc(count * sizeof(struct addrinfo*));
+    while( i < count ) {
+        while( first != NULL && first->ai_family != result->ai_family )
+            first = first->ai_next;
+        while( other != NULL && other->ai_family == result->ai_family )
+            other = other->ai_next;
+        if( first != NULL ) {
+            (*addrs)[i++] = first;
+            first = first->ai_next;
+        }
+        if( other != NULL ) {
+            (*addrs)[i++] = other;
+            other = other->ai_next;
+        }
+    }
+    return count;
+}
+
+static unsigned long long monoTimeMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* Connects to the addresses with "happy eyeballs": attempts are started
+ * CONNECT_ATTEMPT_DELAY_MS apart (or as soon as the previous one fails)
+ * and run in parallel; the first connected socket wins. Returns -1 when
+ * none succeeded.
+ */
+static int connectParallel(struct addrinfo **addrs, int addrCount)
+{
+    struct pollfd pfds[addrCount];
+    int i, pendingCount = 0, next = 0, sockFd = -1, err = ETIMEDOUT;
+    unsigned long long curTm = monoTimeMs();
+    unsigned long long endTm = curTm + CONNECT_TIMEOUT_MS;
+    unsigned long long nextAttemptTm = curTm;
+
+    while( sockFd < 0 && (curTm = monoTimeMs()) < endTm ) {
+        if( next < addrCount && (curTm >= nextAttemptTm ||
+                    pendingCount == 0) )
+        {
+            struct addrinfo *ai = addrs[next++];
+            int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+                    ai->ai_protocol);
+            if( fd < 0 ) {
+                err = errno;
+                continue;
+            }
+            if( connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ) {
+                sockFd = fd;
+                break;
+            }
+            if( errno != EINPROGRESS ) {
+                err = errno;
+                close(fd);
+                continue;
+            }
+            pfds[pendingCount].fd = fd;
+            pfds[pendingCount].events = POLLOUT;
+            ++pendingCount;
+            nextAttemptTm = curTm + CONNECT_ATTEMPT_DELAY_MS;
             continue;
-        if( connect(sockFd, rp->ai_addr, rp->ai_addrlen) != -1 )
+        }
+        if( pendingCount == 0 )
+            break;
+        unsigned long long waitEndTm = next < addrCount &&
+            nextAttemptTm < endTm ? nextAttemptTm : endTm;
+        if( poll(pfds, pendingCount, waitEndTm - curTm) < 0 &&
+                errno != EINTR )
+        {
+            err = errno;
             break;
+        }
+        i = 0;
+        while( i < pendingCount && sockFd < 0 ) {
+            int soErr = 0;
+            socklen_t len = sizeof(soErr);
+            if( pfds[i].revents == 0 ) {
+                ++i;
+                continue;
+            }
+            if( getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &soErr,
+                        &len) < 0 )
+                soErr = errno;
+            if( soErr == 0 ) {
+                sockFd = pfds[i].fd;
+                pfds[i] = pfds[--pendingCount];
+            }else{
+                err = soErr;
+                close(pfds[i].fd);
+                pfds[i] = pfds[--pendingCount];
+                nextAttemptTm = curTm;  // start the next one now
+            }
+        }
+    }
+    for(i = 0; i < pendingCount; ++i)
+        close(pfds[i].fd);
+    if( sockFd < 0 ) {
+        errno = err;
+        return -1;
+    }
+    // the stream does blocking reads
+    fcntl(sockFd, F_SETFL, fcntl(sockFd, F_GETFL) & ~O_NONBLOCK);
+    return sockFd;
+}
+
+/* Connects to server listening on UNIX socket
+ */
+static SockStream *connectUnix(const char *path)
+{
+    struct sockaddr_un addr;
+    int sockFd;
+
+    if( strlen(path) >= sizeof(addr.sun_path) ) {
+        log_error("socket path too long: %s", path);
+        return NULL;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if( (sockFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ) {
+        log_error_errno("socket");
+        return NULL;
+    }
+    if( connect(sockFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+        log_error_errno("connect %s", path);
         close(sockFd);
+        return NULL;
     }
-    if (rp == NULL)
-        log_fatal_errno("connect");
+    SockStream *strm = createStream(sockFd);
+    strm->ringState = RING_WANTED;
+    return strm;
+}
+
+SockStream *sock_tryConnectVNCHost(const char *hostVNC)
+{
+    struct addrinfo hints, *result, **addrs;
+    char portStr[20];
+    int sockFd;
+
+    if( ! strncmp(hostVNC, "unix:", 5) )
+        return connectUnix(hostVNC + 5);
+    char *host = parseVNCHost(hostVNC, portStr);
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    hints.ai_protocol = 0;
+    int s = getaddrinfo(host, portStr, &hints, &result);
+    if(s != 0) {
+        log_error("connect: %s", gai_strerror(s));
+        free(host);
+        return NULL;
+    }
+    int addrCount = orderAddresses(result, &addrs);
+    sockFd = connectParallel(addrs, addrCount);
+    if( sockFd < 0 )
+        log_error_errno("connect");
+    free(addrs);
     freeaddrinfo(result);
+    if( sockFd < 0 ) {
+        free(host);
+        return NULL;
+    }
     int isOn = 1;
     if( setsockopt(sockFd, IPPROTO_TCP, TCP_NODELAY, &isOn, sizeof(isOn)) )
         log_error_errno("set socket TCP_NODELAY failed");
-    SockStream *strm = malloc(sizeof(SockStream));
-    strm->sockFd = sockFd;
-    strm->readOff = strm->readSize = strm->writeOff = 0;
+    SockStream *strm = createStream(sockFd);
+    strm->hostName = host;
     return strm;
 }
 
+SockStream *sock_connectVNCHost(const char *hostVNC)
+{
+    SockStream *strm = sock_tryConnectVNCHost(hostVNC);
+
+    if( strm == NULL )
+        exit(1);
+    return strm;
+}
+
+void sock_setErrorJump(SockStream *strm, jmp_buf *errorJump)
+{
+    strm->errorJump = errorJump;
+}
+
+/* Handles connection failure: exits or jumps to the error handler
+ */
+static void connectionError(SockStream *strm, const char *msg, int isErrno)
+{
+    if( strm->errorJump == NULL ) {
+        if( isErrno )
+            log_fatal_errno("%s", msg);
+        else
+            log_fatal("%s", msg);
+    }
+    if( isErrno )
+        log_error_errno("%s", msg);
+    else
+        log_error("%s", msg);
+    longjmp(*strm->errorJump, 1);
+}
+
+void sock_fail(SockStream *strm, const char *fmt, ...)
+{
+    va_list args;
+    char msg[1024];
+
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    connectionError(strm, msg, 0);
+}
+
+SockStream *sock_fromFd(int sockFd)
+{
+    return createStream(sockFd);
+}
+
+/* Logs errors queued by OpenSSL
+ */
+static void logTLSErrors(void)
+{
+    char buf[256];
+    unsigned long err;
+
+    while( (err = ERR_get_error()) != 0 ) {
+        ERR_error_string_n(err, buf, sizeof(buf));
+        log_error("%s", buf);
+    }
+}
+
+void sock_startTLS(SockStream *strm, int isAnonymous, int isVerifyRequired,
+        const char *caFile)
+{
+    SSL_CTX *ctx;
+    long verifyRes;
+
+    sock_flush(strm);
+    if( strm->readOff < strm->readSize )
+        connectionError(strm, "unexpected data before TLS handshake", 0);
+    if( strm->ring != NULL )
+        log_fatal("TLS over shared memory transport is not supported");
+    if( (ctx = SSL_CTX_new(TLS_client_method())) == NULL ) {
+        logTLSErrors();
+        log_fatal("unable to create TLS context");
+    }
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    if( isAnonymous ) {
+        // anonymous Diffie-Hellman exists in TLS 1.2 only
+        SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(ctx, "aNULL:!eNULL@SECLEVEL=0");
+    }else{
+        // the verification runs either way; its result is checked below
+        SSL_CTX_set_verify(ctx, isVerifyRequired ? SSL_VERIFY_PEER :
+                SSL_VERIFY_NONE, NULL);
+        if( caFile != NULL ? ! SSL_CTX_load_verify_locations(ctx, caFile,
+                    NULL) : ! SSL_CTX_set_default_verify_paths(ctx) )
+        {
+            logTLSErrors();
+            log_fatal("unable to load CA certificates");
+        }
+    }
+    strm->ssl = SSL_new(ctx);
+    SSL_CTX_free(ctx);
+    SSL_set_fd(strm->ssl, strm->sockFd);
+    if( ! isAnonymous && strm->hostName != NULL ) {
+        unsigned char addr[sizeof(struct in6_addr)];
+        // an address is matched against IP entries of the certificate and
+        // is not sent as server name
+        if( inet_pton(AF_INET, strm->hostName, addr) == 1 ||
+                inet_pton(AF_INET6, strm->hostName, addr) == 1 )
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(strm->ssl),
+                    strm->hostName);
+        else{
+            SSL_set_tlsext_host_name(strm->ssl, strm->hostName);
+            SSL_set1_host(strm->ssl, strm->hostName);
+        }
+    }
+    if( SSL_connect(strm->ssl) != 1 ) {
+        verifyRes = SSL_get_verify_result(strm->ssl);
+        logTLSErrors();
+        if( verifyRes != X509_V_OK )
+            log_error("certificate verification: %s",
+                    X509_verify_cert_error_string(verifyRes));
+        connectionError(strm, "TLS handshake failed", 0);
+    }
+    if( ! isAnonymous &&
+            (verifyRes = SSL_get_verify_result(strm->ssl)) != X509_V_OK )
+        log_warn("server identity not verified: %s",
+                X509_verify_cert_error_string(verifyRes));
+    // with encryption in kernel the socket is read and written directly
+    strm->isKTLS = BIO_get_ktls_send(SSL_get_wbio(strm->ssl)) &&
+        BIO_get_ktls_recv(SSL_get_rbio(strm->ssl));
+    log_info("%s, %s, %s", SSL_get_version(strm->ssl),
+            SSL_get_cipher_name(strm->ssl),
+            strm->isKTLS ? "kernel TLS" : "user-space TLS");
+}
+
+/* Reads decrypted data by OpenSSL. The first buffer waits for data, the
+ * next ones get only data already decrypted. Returns like readv.
+ */
+static int tlsReadv(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    int i, res, rd = 0;
+
+    for(i = 0; i < iovcnt && (i == 0 || SSL_pending(strm->ssl)); ++i) {
+        if( iov[i].iov_len == 0 )
+            continue;
+        res = SSL_read(strm->ssl, iov[i].iov_base, iov[i].iov_len);
+        if( res <= 0 ) {
+            if( rd > 0 )
+                break;
+            switch( SSL_get_error(strm->ssl, res) ) {
+            case SSL_ERROR_ZERO_RETURN:
+                return 0;
+            case SSL_ERROR_WANT_READ:   // receive timed out
+                errno = EAGAIN;
+                return -1;
+            case SSL_ERROR_SYSCALL:
+                // unexpected end of stream when errno is not set
+                return errno != 0 ? -1 : 0;
+            default:
+                logTLSErrors();
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        rd += res;
+        if( res < iov[i].iov_len )
+            break;
+    }
+    return rd;
+}
+
+static int tlsWritev(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    int i, wr = 0;
+
+    for(i = 0; i < iovcnt; ++i) {
+        if( iov[i].iov_len > 0 &&
+                SSL_write(strm->ssl, iov[i].iov_base, iov[i].iov_len) <= 0 )
+        {
+            logTLSErrors();
+            if( errno == 0 )
+                errno = EPROTO;
+            return -1;
+        }
+        wr += iov[i].iov_len;
+    }
+    return wr;
+}
+
+/* Writes data chunk to the recording file
+ */
+static void recordChunk(SockStream *strm, const struct iovec *iov,
+        int iovcnt, unsigned len)
+{
+    struct iovec recIov[iovcnt + 2];
+    unsigned long long tm = monoTimeNs() - strm->recordBegNs;
+    unsigned left = len;
+    int recIovCnt = 2;
+    ssize_t toWrite = sizeof(tm) + sizeof(len) + len;
+
+    recIov[0].iov_base = &tm;
+    recIov[0].iov_len = sizeof(tm);
+    recIov[1].iov_base = &len;
+    recIov[1].iov_len = sizeof(len);
+    while( left > 0 ) {
+        recIov[recIovCnt].iov_base = iov->iov_base;
+        recIov[recIovCnt].iov_len = left < iov->iov_len ? left : iov->iov_len;
+        left -= recIov[recIovCnt++].iov_len;
+        ++iov;
+    }
+    // the file is written unbuffered, to keep the recording complete when
+    // the session ends with a fatal error
+    if( writev(strm->recordFd, recIov, recIovCnt) != toWrite ) {
+        log_error_errno("recording write, recording stopped");
+        close(strm->recordFd);
+        strm->recordFd = -1;
+    }
+}
+
+void sock_startRecording(SockStream *strm, const char *fileName,
+        const void *header, unsigned headerLen)
+{
+    struct iovec iov[3];
+
+    strm->recordFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+            0644);
+    if( strm->recordFd < 0 )
+        log_fatal_errno("unable to create recording %s", fileName);
+    iov[0].iov_base = (void*)RECORDING_MAGIC;
+    iov[0].iov_len = sizeof(RECORDING_MAGIC);
+    iov[1].iov_base = &headerLen;
+    iov[1].iov_len = sizeof(headerLen);
+    iov[2].iov_base = (void*)header;
+    iov[2].iov_len = headerLen;
+    if( writev(strm->recordFd, iov, 3) !=
+            sizeof(RECORDING_MAGIC) + sizeof(headerLen) + headerLen )
+        log_fatal_errno("recording write");
+    strm->recordBegNs = monoTimeNs();
+    if( strm->readOff < strm->readSize ) {
+        iov[0].iov_base = strm->readBuf + strm->readOff;
+        iov[0].iov_len = strm->readSize - strm->readOff;
+        recordChunk(strm, iov, 1, iov[0].iov_len);
+    }
+}
+
+SockStream *sock_openReplay(const char *fileName, void *header,
+        unsigned headerLen, int isRealTime)
+{
+    struct stat st;
+    unsigned fileHeaderLen;
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+
+    if( fd < 0 || fstat(fd, &st) < 0 )
+        log_fatal_errno("unable to open recording %s", fileName);
+    const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if( data == MAP_FAILED )
+        log_fatal_errno("mmap %s", fileName);
+    close(fd);
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+    if( st.st_size < sizeof(RECORDING_MAGIC) + sizeof(fileHeaderLen) ||
+            memcmp(data, RECORDING_MAGIC, sizeof(RECORDING_MAGIC)) )
+        log_fatal("%s: not a recording", fileName);
+    memcpy(&fileHeaderLen, data + sizeof(RECORDING_MAGIC),
+            sizeof(fileHeaderLen));
+    size_t dataOff = sizeof(RECORDING_MAGIC) + sizeof(fileHeaderLen);
+    if( fileHeaderLen != headerLen || st.st_size < dataOff + headerLen )
+        log_fatal("%s: bad recording header", fileName);
+    memcpy(header, data + dataOff, headerLen);
+    SockStream *strm = createStream(-1);
+    strm->replayData = data;
+    strm->isReplayMapped = 1;
+    strm->replaySize = st.st_size;
+    strm->replayOff = dataOff + headerLen;
+    strm->replayChunkLeft = 0;
+    strm->isReplayRealTime = isRealTime;
+    strm->replayBegNs = monoTimeNs();
+    return strm;
+}
+
+SockStream *sock_openMemory(const void *data, unsigned len)
+{
+    SockStream *strm = createStream(-1);
+
+    // the whole data is a single chunk
+    strm->replayData = data;
+    strm->replaySize = len;
+    strm->replayOff = 0;
+    strm->replayChunkLeft = len;
+    strm->isReplayRealTime = 0;
+    return strm;
+}
+
+/* Reads data of the replayed recording. Returns 0 at the end.
+ */
+static int replayReadv(SockStream *strm, const struct iovec *iov,
+        int iovcnt)
+{
+    unsigned long long tm;
+    int i, rd = 0;
+
+    if( strm->replayChunkLeft == 0 ) {
+        if( strm->replaySize - strm->replayOff <
+                sizeof(tm) + sizeof(strm->replayChunkLeft) )
+            return 0;
+        memcpy(&tm, strm->replayData + strm->replayOff, sizeof(tm));
+        strm->replayOff += sizeof(tm);
+        memcpy(&strm->replayChunkLeft, strm->replayData + strm->replayOff,
+                sizeof(strm->replayChunkLeft));
+        strm->replayOff += sizeof(strm->replayChunkLeft);
+        if( strm->replayChunkLeft > strm->replaySize - strm->replayOff )
+            strm->replayChunkLeft = strm->replaySize - strm->replayOff;
+        if( strm->isReplayRealTime ) {
+            unsigned long long curTm = monoTimeNs() - strm->replayBegNs;
+            if( tm > curTm ) {
+                struct timespec ts;
+                ts.tv_sec = (tm - curTm) / 1000000000;
+                ts.tv_nsec = (tm - curTm) % 1000000000;
+                nanosleep(&ts, NULL);
+            }
+        }
+    }
+    for(i = 0; i < iovcnt && strm->replayChunkLeft > 0; ++i) {
+        unsigned len = iov[i].iov_len < strm->replayChunkLeft ?
+            iov[i].iov_len : strm->replayChunkLeft;
+        memcpy(iov[i].iov_base, strm->replayData + strm->replayOff, len);
+        strm->replayOff += len;
+        strm->replayChunkLeft -= len;
+        rd += len;
+    }
+    return rd;
+}
+
+void sock_offerRing(SockStream *strm, unsigned size)
+{
+    strm->ring = shmring_create(size);
+    strm->ringState = RING_OFFERING;
+}
+
+/* Reads from socket catching the ring descriptor attached by peer; used
+ * for the first read in ring negotiation
+ */
+static int recvWithRing(SockStream *strm, const struct iovec *iov,
+        int iovcnt)
+{
+    struct msghdr mh;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    int ringFd = -1;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = (struct iovec*)iov;
+    mh.msg_iovlen = iovcnt;
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    int rd = recvmsg(strm->sockFd, &mh, MSG_CMSG_CLOEXEC);
+    if( rd <= 0 )
+        return rd;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    if( cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS )
+        memcpy(&ringFd, CMSG_DATA(cmsg), sizeof(int));
+    if( strm->ringState == RING_WANTED ) {
+        // server offers the ring with its first data
+        if( ringFd >= 0 && (strm->ring = shmring_attach(ringFd)) != NULL ) {
+            strm->ringState = RING_ACCEPTING;
+        }else{
+            if( ringFd >= 0 )
+                close(ringFd);
+            strm->ringState = RING_NONE;
+        }
+    }else{
+        // client accepts the ring by sending it back
+        if( ringFd >= 0 ) {
+            log_info("shared memory transport enabled");
+            close(ringFd);
+            strm->ringState = RING_WRITE;
+        }else{
+            shmring_free(strm->ring);
+            strm->ring = NULL;
+            strm->ringState = RING_NONE;
+        }
+    }
+    return rd;
+}
+
+/* Writes to socket attaching the ring descriptor; used for the first write
+ * in ring negotiation
+ */
+static int sendWithRing(SockStream *strm, const struct iovec *iov,
+        int iovcnt)
+{
+    struct msghdr mh;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    int ringFd = shmring_getFd(strm->ring);
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = (struct iovec*)iov;
+    mh.msg_iovlen = iovcnt;
+    memset(&ctl, 0, sizeof(ctl));
+    mh.msg_control = ctl.buf;
+    mh.msg_controllen = sizeof(ctl.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &ringFd, sizeof(int));
+    int wr = sendmsg(strm->sockFd, &mh, MSG_NOSIGNAL);
+    if( wr > 0 ) {
+        if( strm->ringState == RING_ACCEPTING ) {
+            log_info("shared memory transport enabled");
+            strm->ringState = RING_READ;
+        }else
+            strm->ringState = RING_OFFERED;
+    }
+    return wr;
+}
+
+/* Discards wakeup bytes sent by the ring writer. Returns 0 at end of
+ * stream, -1 on error, positive otherwise.
+ */
+static int drainRingWakeups(SockStream *strm, int isWait)
+{
+    char buf[64];
+    int rd = recv(strm->sockFd, buf, sizeof(buf), isWait ? 0 : MSG_DONTWAIT);
+
+    // when waiting, the receive timed out
+    if( rd < 0 && errno == EAGAIN && ! isWait )
+        return 1;
+    return rd;
+}
+
+/* Reads server data from the ring, waiting for it when there is none.
+ * Returns like readv.
+ */
+static int ringReadv(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    int rd, res;
+
+    while( (rd = shmring_readv(strm->ring, iov, iovcnt)) == 0 ) {
+        if( (res = drainRingWakeups(strm, 1)) <= 0 ) {
+            // the data may be written just before the socket is closed
+            rd = shmring_readv(strm->ring, iov, iovcnt);
+            return rd > 0 ? rd : res;
+        }
+    }
+    return rd;
+}
+
+/* Writes data to the ring, waiting for free space; wakes the reader by
+ * a byte sent over socket. Returns like writev.
+ */
+static int ringWritev(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    struct pollfd pfd;
+    int wr, isDrained;
+
+    while( (wr = shmring_write(strm->ring, iov, iovcnt, &isDrained)) == 0 ) {
+        // the reader is gone when the socket is closed
+        pfd.fd = strm->sockFd;
+        pfd.events = 0;
+        if( poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)) )
+        {
+            errno = EPIPE;
+            return -1;
+        }
+        shmring_waitSpace(strm->ring, 100);
+    }
+    if( isDrained && send(strm->sockFd, "", 1, MSG_DONTWAIT |
+                MSG_NOSIGNAL) < 0 && errno != EAGAIN )
+        return -1;
+    return wr;
+}
+
+/* Returns maximal buffer size the kernel autotuning grows to, the third
+ * value of tcp_rmem or tcp_wmem; 0 when unknown
+ */
+static int readAutoTuneMax(const char *fname)
+{
+    FILE *fp;
+    int minSize, defSize, maxSize;
+
+    if( (fp = fopen(fname, "r")) == NULL )
+        return 0;
+    if( fscanf(fp, "%d %d %d", &minSize, &defSize, &maxSize) != 3 )
+        maxSize = 0;
+    fclose(fp);
+    return maxSize;
+}
+
+/* Grows the socket buffer to twice the bandwidth-delay product of given
+ * transfer rate. A size set explicitly disables the kernel autotuning, so
+ * it is set only when autotuning cannot reach it.
+ */
+static void growBuffer(SockStream *strm, int optName, unsigned long long rate,
+        int autoTuneMax, int *curSize)
+{
+    SockLowLatency *ll = &strm->stats.lowLat;
+    unsigned long long size = 2 * rate * ll->rttUs / 1000000;
+    socklen_t len = sizeof(*curSize);
+    int val;
+
+    // autotuning changes the size meanwhile
+    if( getsockopt(strm->sockFd, SOL_SOCKET, optName, &val, &len) == 0 )
+        STAT_SET(*curSize, val);
+    if( size <= *curSize || autoTuneMax <= 0 || size <= autoTuneMax ||
+            *curSize >= SOCK_BUF_MAX )
+        return;
+    val = size < SOCK_BUF_MAX ? size : SOCK_BUF_MAX;
+    if( setsockopt(strm->sockFd, SOL_SOCKET, optName, &val, sizeof(val)) ) {
+        log_warn("socket buffer resize refused: %s", strerror(errno));
+        STAT_SET(ll->bufSize, errno == EPERM || errno == EACCES ?
+                SOCK_OPT_REFUSED : SOCK_OPT_UNSUPPORTED);
+        return;
+    }
+    len = sizeof(val);
+    getsockopt(strm->sockFd, SOL_SOCKET, optName, &val, &len);
+    STAT_SET(*curSize, val);
+}
+
+/* Measures transfer rates and round trip time, sizes the socket buffers
+ */
+static void tuneBuffers(SockStream *strm)
+{
+    SockLowLatency *ll = &strm->stats.lowLat;
+    unsigned long long curNs = monoTimeNs();
+    unsigned long long elapsedNs = curNs - strm->tuneBegNs;
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if( elapsedNs < BUF_TUNE_INTERVAL_NS )
+        return;
+    STAT_SET(ll->rcvRate, (strm->stats.bytesRead - strm->tuneBytesRead) *
+        1000000000ULL / elapsedNs);
+    STAT_SET(ll->sndRate, (strm->stats.bytesWritten -
+                strm->tuneBytesWritten) * 1000000000ULL / elapsedNs);
+    strm->tuneBegNs = curNs;
+    strm->tuneBytesRead = strm->stats.bytesRead;
+    strm->tuneBytesWritten = strm->stats.bytesWritten;
+    if( getsockopt(strm->sockFd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 )
+        return;
+    STAT_SET(ll->rttUs, ti.tcpi_rtt);
+    growBuffer(strm, SO_RCVBUF, ll->rcvRate, strm->rcvAutoTuneMax,
+            &ll->rcvBuf);
+    if( ll->bufSize == SOCK_OPT_ON )
+        growBuffer(strm, SO_SNDBUF, ll->sndRate, strm->sndAutoTuneMax,
+                &ll->sndBuf);
+}
+
+static void afterLowLatencyRead(SockStream *strm)
+{
+    SockLowLatency *ll = &strm->stats.lowLat;
+    int isOn = 1;
+
+    // the kernel drops back to delayed acknowledgements after a while
+    if( ll->quickAck == SOCK_OPT_ON && strm->uring == NULL )
+        setsockopt(strm->sockFd, IPPROTO_TCP, TCP_QUICKACK, &isOn,
+                sizeof(isOn));
+    if( ll->bufSize == SOCK_OPT_ON )
+        tuneBuffers(strm);
+}
+
+/* Reads data from socket into the buffers. Returns number of bytes read,
+ * which is always positive.
+ */
+static int sockReadv(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    int rd;
+
+    trace_begin("read");
+    if( strm->replayData != NULL )
+        rd = replayReadv(strm, iov, iovcnt);
+    else if( strm->uring != NULL )
+        rd = iouring_readv(strm->uring, iov, iovcnt, &strm->stats.readCalls);
+    else if( strm->ringState == RING_READ )
+        rd = ringReadv(strm, iov, iovcnt);
+    else if( strm->ringState == RING_WANTED ||
+            strm->ringState == RING_OFFERED )
+        rd = recvWithRing(strm, iov, iovcnt);
+    else if( strm->ssl == NULL )
+        rd = readv(strm->sockFd, iov, iovcnt);
+    else if( strm->isKTLS ) {
+        rd = readv(strm->sockFd, iov, iovcnt);
+        // other than application data record, e.g. session ticket
+        if( rd < 0 && errno == EIO ) {
+            errno = 0;
+            rd = tlsReadv(strm, iov, iovcnt);
+        }
+    }else{
+        errno = 0;
+        rd = tlsReadv(strm, iov, iovcnt);
+    }
+    trace_end("read");
+
+    if( rd <= 0 ) {
+        if( rd == 0 )
+            connectionError(strm, "end of stream", 0);
+        else if( errno == EAGAIN )
+            connectionError(strm, "receive timed out", 0);
+        else
+            connectionError(strm, "socket read", 1);
+    }
+    // io_uring counts the system calls it makes, reads mostly need none
+    if( strm->uring == NULL )
+        STAT_ADD(strm->stats.readCalls, 1);
+    STAT_ADD(strm->stats.bytesRead, rd);
+    if( strm->recordFd >= 0 )
+        recordChunk(strm, iov, iovcnt, rd);
+    if( strm->stats.lowLat.isEnabled )
+        afterLowLatencyRead(strm);
+    return rd;
+}
+
+static int sockWritev(SockStream *strm, const struct iovec *iov, int iovcnt)
+{
+    int i, wr = 0;
+
+    if( strm->replayData != NULL ) {
+        for(i = 0; i < iovcnt; ++i)
+            wr += iov[i].iov_len;
+    }else if( strm->uring != NULL )
+        wr = iouring_writev(strm->uring, iov, iovcnt,
+                &strm->stats.writeCalls);
+    else if( strm->ringState == RING_WRITE )
+        wr = ringWritev(strm, iov, iovcnt);
+    else if( strm->ringState == RING_OFFERING ||
+            strm->ringState == RING_ACCEPTING )
+        wr = sendWithRing(strm, iov, iovcnt);
+    else if( strm->ssl == NULL || strm->isKTLS )
+        wr = writev(strm->sockFd, iov, iovcnt);
+    else{
+        errno = 0;
+        wr = tlsWritev(strm, iov, iovcnt);
+    }
+    if( wr < 0 )
+        connectionError(strm, "socket write", 1);
+    if( strm->uring == NULL )
+        STAT_ADD(strm->stats.writeCalls, 1);
+    STAT_ADD(strm->stats.bytesWritten, wr);
+    return wr;
+}
+
 void sock_read(SockStream *strm, void *buf, int toRead)
 {
+    strm->readCount += toRead;
     if( strm->readOff < strm->readSize ) {
         int toCopy = strm->readSize - strm->readOff;
         if( toRead < toCopy )
@@ -78,13 +988,7 @@ void sock_read(SockStream *strm, void *buf, int toRead)
         while( 1 ) {
             iov[0].iov_base = buf;
             iov[0].iov_len = toRead;
-            int rd = readv(strm->sockFd, iov, 2);
-            if( rd <= 0 ) {
-                if( rd == 0 )
-                    log_fatal("end of stream");
-                else
-                    log_fatal_errno("socket read");
-            }
+            int rd = sockReadv(strm, iov, 2);
             toRead -= rd;
             if( toRead <= 0 )
                 break;
@@ -128,6 +1032,7 @@ void sock_readRect(SockStream *strm, char *buf, int bytesPerLine,
 
     if( width == 0 || height == 0 )
         return;
+    strm->readCount += (unsigned long long)width * height;
     while( strm->readSize - strm->readOff >= width ) {
         memcpy(buf, strm->readBuf + strm->readOff, width);
         strm->readOff += width;
@@ -146,13 +1051,7 @@ void sock_readRect(SockStream *strm, char *buf, int bytesPerLine,
             int lineOff = off - lineNo * width;
             iov[lineNo].iov_base = buf + lineNo * bytesPerLine + lineOff;
             iov[lineNo].iov_len = width - lineOff;
-            int rd = readv(strm->sockFd, iov + lineNo, IOV_SIZE - lineNo);
-            if( rd <= 0 ) {
-                if( rd == 0 )
-                    log_fatal("end of stream");
-                else
-                    log_fatal_errno("socket read");
-            }
+            int rd = sockReadv(strm, iov + lineNo, IOV_SIZE - lineNo);
             off += rd;
         }
         height -= IOV_SIZE;
@@ -173,14 +1072,7 @@ void sock_readRect(SockStream *strm, char *buf, int bytesPerLine,
         int lineOff = off - lineNo * width;
         iov[lineNo].iov_base = buf + lineNo * bytesPerLine + lineOff;
         iov[lineNo].iov_len = width - lineOff;
-        int rd = readv(strm->sockFd, iov + lineNo,
-                height - lineNo + 1);
-        if( rd <= 0 ) {
-            if( rd == 0 )
-                log_fatal("end of stream");
-            else
-                log_fatal_errno("socket read");
-        }
+        int rd = sockReadv(strm, iov + lineNo, height - lineNo + 1);
         off += rd;
     }
     strm->readSize = off - height * width;
@@ -214,9 +1106,7 @@ void sock_write(SockStream *strm, const void *buf, int count)
         iov[iovEnd].iov_len = count;
         ++iovEnd;
         while( 1 ) {
-            int wr = writev(strm->sockFd, iov + iovBeg, iovEnd - iovBeg);
-            if( wr < 0 )
-                log_fatal_errno("writev beg=%d, end=%d", iovBeg, iovEnd);
+            int wr = sockWritev(strm, iov + iovBeg, iovEnd - iovBeg);
             while( iovBeg < iovEnd && iov[iovBeg].iov_len <= wr ) {
                 wr -= iov[iovBeg].iov_len;
                 ++iovBeg;
@@ -256,30 +1146,222 @@ void sock_writeU32(SockStream *strm, unsigned val)
 
 void sock_flush(SockStream *strm)
 {
+    struct iovec iov;
     int off = 0;
+
     while( off < strm->writeOff ) {
-        int wr = write(strm->sockFd, strm->writeBuf + off,
-                strm->writeOff - off);
-        if( off < 0 )
-            log_fatal_errno("socket write");
-        off += wr;
+        iov.iov_base = strm->writeBuf + off;
+        iov.iov_len = strm->writeOff - off;
+        off += sockWritev(strm, &iov, 1);
     }
     strm->writeOff = 0;
 }
 
 int sock_isDataAvail(SockStream *strm)
 {
-    return strm->readOff < strm->readSize;
+    if( strm->uring != NULL )
+        return strm->readOff < strm->readSize ||
+            iouring_isDataAvail(strm->uring, &strm->stats.queryCalls);
+    if( strm->ringState == RING_READ ) {
+        if( strm->readOff < strm->readSize ||
+                shmring_isDataAvail(strm->ring) )
+            return 1;
+        // so that the socket becomes readable on the next wakeup only
+        drainRingWakeups(strm, 0);
+        return shmring_isDataAvail(strm->ring);
+    }
+    if( strm->ssl != NULL && ! strm->isKTLS && SSL_pending(strm->ssl) > 0 )
+        return 1;
+    return strm->readOff < strm->readSize || (strm->replayData != NULL &&
+            (strm->replayChunkLeft > 0 || strm->replaySize - strm->replayOff >
+             sizeof(unsigned long long) + sizeof(strm->replayChunkLeft)));
+}
+
+int sock_isDataQueued(SockStream *strm)
+{
+    int queued;
+
+    if( sock_isDataAvail(strm) )
+        return 1;
+    if( strm->replayData != NULL || strm->uring != NULL )
+        return 0;
+    STAT_ADD(strm->stats.queryCalls, 1);
+    if( ioctl(strm->sockFd, FIONREAD, &queued) < 0 ) {
+        log_error_errno("FIONREAD");
+        return 0;
+    }
+    return queued > 0;
+}
+
+unsigned long long sock_getReadCount(SockStream *strm)
+{
+    return strm->readCount;
+}
+
+void sock_getStats(SockStream *strm, SockStats *stats)
+{
+    const SockLowLatency *ll = &strm->stats.lowLat;
+    SockLowLatency *llDst = &stats->lowLat;
+
+    stats->bytesRead = STAT_GET(strm->stats.bytesRead);
+    stats->bytesWritten = STAT_GET(strm->stats.bytesWritten);
+    stats->readCalls = STAT_GET(strm->stats.readCalls);
+    stats->writeCalls = STAT_GET(strm->stats.writeCalls);
+    stats->queryCalls = STAT_GET(strm->stats.queryCalls);
+    llDst->isEnabled = STAT_GET(ll->isEnabled);
+    llDst->busyPoll = STAT_GET(ll->busyPoll);
+    llDst->preferBusyPoll = STAT_GET(ll->preferBusyPoll);
+    llDst->quickAck = STAT_GET(ll->quickAck);
+    llDst->bufSize = STAT_GET(ll->bufSize);
+    llDst->busyPollUs = STAT_GET(ll->busyPollUs);
+    llDst->spinUs = STAT_GET(ll->spinUs);
+    llDst->rcvBuf = STAT_GET(ll->rcvBuf);
+    llDst->sndBuf = STAT_GET(ll->sndBuf);
+    llDst->rttUs = STAT_GET(ll->rttUs);
+    llDst->rcvRate = STAT_GET(ll->rcvRate);
+    llDst->sndRate = STAT_GET(ll->sndRate);
+    llDst->spinHits = STAT_GET(ll->spinHits);
+    llDst->spinMisses = STAT_GET(ll->spinMisses);
+}
+
+void sock_setRecvTimeout(SockStream *strm, int timeoutMs)
+{
+    struct timeval tv;
+
+    if( strm->replayData != NULL || strm->sockFd < 0 )
+        return;
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = timeoutMs % 1000 * 1000;
+    if( setsockopt(strm->sockFd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) )
+        log_error_errno("SO_RCVTIMEO");
+    strm->recvTimeoutMs = timeoutMs;
+    if( strm->uring != NULL )
+        iouring_setRecvTimeout(strm->uring, timeoutMs);
+}
+
+int sock_isReadReady(SockStream *strm)
+{
+    return strm->uring == NULL || sock_isDataAvail(strm);
 }
 
 int sock_fd(SockStream *strm)
 {
-    return strm->sockFd;
+    return strm->uring != NULL ? iouring_getFd(strm->uring) : strm->sockFd;
+}
+
+void sock_setIOBackend(SockStream *strm, SockIOBackend backend)
+{
+    if( backend != SOCK_IO_URING || strm->uring != NULL ||
+            strm->replayData != NULL )
+        return;
+    if( strm->ssl != NULL || strm->ring != NULL ) {
+        log_info("io_uring is not used with TLS or shared memory transport");
+        return;
+    }
+    sock_flush(strm);
+    if( (strm->uring = iouring_create(strm->sockFd)) == NULL )
+        log_warn("falling back to readv/writev");
+    else{
+        log_info("io_uring I/O");
+        iouring_setRecvTimeout(strm->uring, strm->recvTimeoutMs);
+    }
+}
+
+/* Sets integer socket option, logs a refusal
+ */
+static SockOptState setLowLatencyOpt(SockStream *strm, int level,
+        int optName, const char *name, int val)
+{
+    if( ! setsockopt(strm->sockFd, level, optName, &val, sizeof(val)) )
+        return SOCK_OPT_ON;
+    log_warn("%s refused: %s", name, strerror(errno));
+    return errno == EPERM || errno == EACCES ? SOCK_OPT_REFUSED :
+        SOCK_OPT_UNSUPPORTED;
+}
+
+void sock_setLowLatency(SockStream *strm, int spinUs)
+{
+    SockLowLatency *ll = &strm->stats.lowLat;
+    int proto = 0, size;
+    socklen_t len = sizeof(proto);
+
+    if( strm->replayData != NULL )
+        return;
+    STAT_SET(ll->spinUs, spinUs);
+    getsockopt(strm->sockFd, SOL_SOCKET, SO_PROTOCOL, &proto, &len);
+    if( proto != IPPROTO_TCP || strm->ring != NULL ) {
+        STAT_SET(ll->busyPoll, SOCK_OPT_UNSUPPORTED);
+        STAT_SET(ll->preferBusyPoll, SOCK_OPT_UNSUPPORTED);
+        STAT_SET(ll->quickAck, SOCK_OPT_UNSUPPORTED);
+        STAT_SET(ll->bufSize, SOCK_OPT_UNSUPPORTED);
+        STAT_SET(ll->isEnabled, 1);
+        return;
+    }
+    STAT_SET(ll->busyPollUs, LOWLAT_BUSY_POLL_US);
+    STAT_SET(ll->busyPoll, setLowLatencyOpt(strm, SOL_SOCKET, SO_BUSY_POLL,
+                "SO_BUSY_POLL", LOWLAT_BUSY_POLL_US));
+    STAT_SET(ll->preferBusyPoll, setLowLatencyOpt(strm, SOL_SOCKET,
+                SO_PREFER_BUSY_POLL, "SO_PREFER_BUSY_POLL", 1));
+    // with io_uring the kernel reads on its own
+    STAT_SET(ll->quickAck, strm->uring != NULL ? SOCK_OPT_UNSUPPORTED :
+        setLowLatencyOpt(strm, IPPROTO_TCP, TCP_QUICKACK, "TCP_QUICKACK", 1));
+    STAT_SET(ll->bufSize, SOCK_OPT_ON);
+    len = sizeof(size);
+    getsockopt(strm->sockFd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+    STAT_SET(ll->rcvBuf, size);
+    len = sizeof(size);
+    getsockopt(strm->sockFd, SOL_SOCKET, SO_SNDBUF, &size, &len);
+    STAT_SET(ll->sndBuf, size);
+    strm->rcvAutoTuneMax = readAutoTuneMax("/proc/sys/net/ipv4/tcp_rmem");
+    strm->sndAutoTuneMax = readAutoTuneMax("/proc/sys/net/ipv4/tcp_wmem");
+    strm->tuneBegNs = monoTimeNs();
+    strm->tuneBytesRead = strm->stats.bytesRead;
+    strm->tuneBytesWritten = strm->stats.bytesWritten;
+    STAT_SET(ll->isEnabled, 1);
+}
+
+int sock_spin(SockStream *strm)
+{
+    SockLowLatency *ll = &strm->stats.lowLat;
+    unsigned long long endNs;
+    int isData = 0;
+    char c;
+
+    if( ll->spinUs <= 0 )
+        return 0;
+    // peeking the socket goes through busy polling of the device queue
+    int isPeek = strm->uring == NULL && strm->ring == NULL &&
+        (strm->ssl == NULL || strm->isKTLS);
+    endNs = monoTimeNs() + ll->spinUs * 1000ULL;
+    do {
+        if( isPeek ) {
+            STAT_ADD(strm->stats.queryCalls, 1);
+            isData = recv(strm->sockFd, &c, 1, MSG_PEEK | MSG_DONTWAIT) >= 0
+                || (errno != EAGAIN && errno != EWOULDBLOCK);
+        }else
+            isData = sock_isDataQueued(strm);
+    }while( ! isData && monoTimeNs() < endNs );
+    if( isData )
+        STAT_ADD(ll->spinHits, 1);
+    else
+        STAT_ADD(ll->spinMisses, 1);
+    return isData;
 }
 
 void sock_close(SockStream *strm)
 {
-    close(strm->sockFd);
+    if( strm->recordFd >= 0 )
+        close(strm->recordFd);
+    if( strm->ssl != NULL )
+        SSL_free(strm->ssl);
+    shmring_free(strm->ring);
+    if( strm->uring != NULL )
+        iouring_free(strm->uring);
+    free(strm->hostName);
+    if( strm->isReplayMapped )
+        munmap((void*)strm->replayData, strm->replaySize);
+    else if( strm->replayData == NULL )
+        close(strm->sockFd);
     free(strm);
 }
 
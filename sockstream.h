@@ -1,10 +1,126 @@
 #ifndef SOCKSTREAM_H
 #define SOCKSTREAM_H
 
+#include <setjmp.h>
+
 typedef struct SockStream SockStream;
 
+typedef enum {
+    SOCK_IO_READV,          // blocking readv/writev on the socket
+    SOCK_IO_URING           // io_uring, see iouring.h
+} SockIOBackend;
+
+/* Statistics counters are updated by one thread and read at any time by
+ * the statistics service thread. Relaxed atomic accesses keep 64-bit
+ * values from tearing; with a single writer no read-modify-write
+ * instruction is needed.
+ */
+#define STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STAT_SET(counter, val) \
+    __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#define STAT_ADD(counter, n) STAT_SET(counter, STAT_GET(counter) + (n))
+
+/* State of a low latency setting, see sock_setLowLatency
+ */
+typedef enum {
+    SOCK_OPT_OFF,           // not requested
+    SOCK_OPT_ON,
+    SOCK_OPT_REFUSED,       // refused by the system, e.g. lacking privilege
+    SOCK_OPT_UNSUPPORTED    // not applicable to the connection
+} SockOptState;
+
+typedef struct {
+    int isEnabled;
+    SockOptState busyPoll, preferBusyPoll, quickAck, bufSize;
+    int busyPollUs, spinUs;
+    int rcvBuf, sndBuf;             // current buffer sizes
+    unsigned rttUs;                 // last measured round trip time
+    unsigned long long rcvRate, sndRate;    // measured, bytes per second
+    unsigned long long spinHits, spinMisses;
+} SockLowLatency;
+
+typedef struct {
+    unsigned long long bytesRead, bytesWritten;
+    unsigned long long readCalls, writeCalls, queryCalls;
+    SockLowLatency lowLat;
+} SockStats;
+
+/* Connects to host[:display] or unix:<socket path>
+ */
 SockStream *sock_connectVNCHost(const char *hostVNC);
 
+
+/* Like sock_connectVNCHost, but returns NULL when unable to connect
+ */
+SockStream *sock_tryConnectVNCHost(const char *hostVNC);
+
+
+/* Makes connection errors, i.e. end of stream and socket read or write
+ * failure, jump to the buffer instead of exiting the program. NULL turns
+ * back to exiting.
+ */
+void sock_setErrorJump(SockStream*, jmp_buf*);
+
+
+/* Reports protocol error on the connection, like the connection errors
+ * above: exits the program or jumps to the buffer.
+ */
+void sock_fail(SockStream*, const char *fmt, ...);
+
+
+/* Performs TLS handshake on the connection and encrypts further
+ * communication, in kernel when possible (kTLS), so the socket is still
+ * read directly into destination buffers. Anonymous TLS uses Diffie-Hellman
+ * key exchange without certificates; otherwise the server certificate is
+ * verified against CA certificates from caFile, or the system ones when
+ * caFile is NULL, and the host name. A verification failure fails the
+ * handshake when isVerifyRequired is set, otherwise it is only logged.
+ */
+void sock_startTLS(SockStream*, int isAnonymous, int isVerifyRequired,
+        const char *caFile);
+
+
+/* Offers the client connected over UNIX socket shared memory ring
+ * transport of given size. The ring memfd is attached to the next data
+ * written, i.e. the protocol version; the client accepts the offer by
+ * attaching it back to its version. Since then the server data flows
+ * through the ring and the socket carries only wakeup bytes. A client not
+ * aware of the offer just drops the descriptor. Streams connected to
+ * unix:<path> accept the offer.
+ */
+void sock_offerRing(SockStream*, unsigned size);
+
+
+/* Creates the stream on already connected socket
+ */
+SockStream *sock_fromFd(int sockFd);
+
+
+/* Session recording. The file starts with "WQVNCR01" magic, 32-bit header
+ * length and the header given by the caller. Then follow the chunks of data
+ * as read from the socket, each one preceded by 64-bit receive time in
+ * nanoseconds since the recording start and 32-bit data length, both in
+ * host byte order. Data already buffered but not consumed yet is stored as
+ * the first chunk.
+ */
+void sock_startRecording(SockStream*, const char *fileName,
+        const void *header, unsigned headerLen);
+
+
+/* Opens the recording for reading, as the stream of data received from
+ * server. The file header must have headerLen bytes. In real time mode the
+ * data chunks are delivered not earlier than they were recorded, otherwise
+ * as fast as possible. Data written to the stream is discarded.
+ */
+SockStream *sock_openReplay(const char *fileName, void *header,
+        unsigned headerLen, int isRealTime);
+
+/* Opens the stream reading given data, for benchmarks. The data is not
+ * copied and must be kept until the stream is closed. Data written to the
+ * stream is discarded.
+ */
+SockStream *sock_openMemory(const void *data, unsigned len);
+
 void sock_read(SockStream*, void *buf, int toRead);
 void sock_write(SockStream*, const void *buf, int toWrite);
 
@@ -36,15 +152,72 @@ void sock_flush(SockStream*);
 
 
 /* Returns non-zero when there is some data available for read without
- * reading underlying socket descriptor
+ * reading underlying socket descriptor. For a replayed recording returns
+ * zero only at the end.
  */
 int sock_isDataAvail(SockStream*);
 
 
-/* Returns the socket file descriptor
+/* Returns non-zero when there is some data available for read, either
+ * buffered or already queued on the socket. With io_uring also end of
+ * stream or error waiting to be reported.
+ */
+int sock_isDataQueued(SockStream*);
+
+
+/* Returns total number of bytes read from the stream
+ */
+unsigned long long sock_getReadCount(SockStream*);
+
+
+/* Copies counters of socket system calls; may be called from another
+ * thread than the one using the stream
+ */
+void sock_getStats(SockStream*, SockStats*);
+
+
+/* Makes a read that waits longer than timeoutMs milliseconds for data fail
+ * as connection error; zero waits without limit, the default
+ */
+void sock_setRecvTimeout(SockStream*, int timeoutMs);
+
+
+/* Rechecks the stream after the descriptor returned by sock_fd polled
+ * readable. Returns zero when read would wait anyway: io_uring is woken also
+ * by send completions.
+ */
+int sock_isReadReady(SockStream*);
+
+
+/* Returns the socket file descriptor to wait for, -1 for a replayed
+ * recording or memory stream. With io_uring it is the ring descriptor.
  */
 int sock_fd(SockStream*);
 
+
+/* Switches the connected stream to given I/O backend. Falls back to
+ * readv/writev when io_uring is not available; it is not used either with
+ * TLS or shared memory transport. Data already buffered is kept.
+ */
+void sock_setIOBackend(SockStream*, SockIOBackend);
+
+
+/* Trades CPU for latency on TCP connection: the kernel busy polls the
+ * device queue on reads (SO_BUSY_POLL, SO_PREFER_BUSY_POLL), TCP_QUICKACK
+ * is re-armed after every read, and socket buffers are grown to twice the
+ * bandwidth-delay product measured while reading, when the kernel
+ * autotuning limit (tcp_rmem, tcp_wmem) is lower. sock_spin busy waits up
+ * to spinUs microseconds; zero disables spinning. Settings refused by the
+ * system are skipped; the outcome is reported in SockStats.
+ */
+void sock_setLowLatency(SockStream*, int spinUs);
+
+
+/* Busy waits for data up to the spin time set by sock_setLowLatency.
+ * Returns non-zero when data is available, or the connection is closed.
+ */
+int sock_spin(SockStream*);
+
 void sock_close(SockStream*);
 
 #endif /* SOCKSTREAM_H */
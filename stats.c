@@ -0,0 +1,312 @@
+#include "stats.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+
+
+static const struct {
+    int encType;
+    const char *name;
+} gEncodings[STATS_ENC_COUNT] = {
+    { 0, "Raw" },
+    { 1, "CopyRect" },
+    { 2, "RRE" },
+    { 5, "Hextile" },
+    { 16, "ZRLE" },
+    { -239, "Cursor" },
+    { -240, "XCursor" },
+    { -223, "DesktopSize" },
+    { -308, "ExtendedDesktopSize" },
+    { 0x7fffffff, "other" }
+};
+
+/* Names of SockOptState values
+ */
+static const char *const gOptStates[] = {
+    "off", "on", "refused", "unsupported"
+};
+
+void stats_addRect(VncStats *stats, int encType, unsigned pixels,
+        unsigned bytes, unsigned long long decodeNs)
+{
+    int i = 0, bucket = 0;
+    unsigned long long decodeUs = decodeNs / 1000;
+
+    while( i < STATS_ENC_COUNT - 1 && gEncodings[i].encType != encType )
+        ++i;
+    EncodingStats *enc = stats->encodings + i;
+    STAT_ADD(enc->rects, 1);
+    STAT_ADD(enc->bytes, bytes);
+    STAT_ADD(enc->pixels, pixels);
+    STAT_ADD(enc->decodeNs, decodeNs);
+    while( decodeUs > 0 && bucket < STATS_HIST_SIZE - 1 ) {
+        decodeUs >>= 1;
+        ++bucket;
+    }
+    STAT_ADD(enc->decodeHist[bucket], 1);
+}
+
+void stats_copy(VncStats *dst, const VncStats *src)
+{
+    int i, j;
+
+    dst->updates = STAT_GET(src->updates);
+    for(i = 0; i < STATS_ENC_COUNT; ++i) {
+        const EncodingStats *enc = src->encodings + i;
+        EncodingStats *encDst = dst->encodings + i;
+        encDst->rects = STAT_GET(enc->rects);
+        encDst->bytes = STAT_GET(enc->bytes);
+        encDst->pixels = STAT_GET(enc->pixels);
+        encDst->decodeNs = STAT_GET(enc->decodeNs);
+        for(j = 0; j < STATS_HIST_SIZE; ++j)
+            encDst->decodeHist[j] = STAT_GET(enc->decodeHist[j]);
+    }
+    dst->inflateIn = STAT_GET(src->inflateIn);
+    dst->inflateOut = STAT_GET(src->inflateOut);
+    dst->presents = STAT_GET(src->presents);
+    dst->presentNs = STAT_GET(src->presentNs);
+}
+
+static void printText(const VncStats *stats, FILE *fp)
+{
+    int i, j;
+
+    fprintf(fp, "updates: %llu\n", stats->updates);
+    for(i = 0; i < STATS_ENC_COUNT; ++i) {
+        const EncodingStats *enc = stats->encodings + i;
+        if( enc->rects == 0 )
+            continue;
+        fprintf(fp, "%s: rects %llu, bytes %llu, pixels %llu, "
+                "decode %.3f ms", gEncodings[i].name, enc->rects,
+                enc->bytes, enc->pixels, enc->decodeNs / 1e6);
+        if( enc->pixels > 0 )
+            fprintf(fp, " (%.3f bytes/pixel, %.2f ns/pixel)",
+                    (double)enc->bytes / enc->pixels,
+                    (double)enc->decodeNs / enc->pixels);
+        fprintf(fp, "\n  decode time histogram (us):");
+        for(j = 0; j < STATS_HIST_SIZE; ++j) {
+            if( enc->decodeHist[j] != 0 )
+                fprintf(fp, " <%u:%llu", 1u << j, enc->decodeHist[j]);
+        }
+        fprintf(fp, "\n");
+    }
+    fprintf(fp, "inflate: in %llu, out %llu", stats->inflateIn,
+            stats->inflateOut);
+    if( stats->inflateIn > 0 )
+        fprintf(fp, ", ratio %.2f",
+                (double)stats->inflateOut / stats->inflateIn);
+    fprintf(fp, "\npresent: count %llu, time %.3f ms\n", stats->presents,
+            stats->presentNs / 1e6);
+    fprintf(fp, "socket: read %llu bytes in %llu calls, "
+            "written %llu bytes in %llu calls, %llu queries\n",
+            stats->sock.bytesRead, stats->sock.readCalls,
+            stats->sock.bytesWritten, stats->sock.writeCalls,
+            stats->sock.queryCalls);
+    const SockLowLatency *ll = &stats->sock.lowLat;
+    if( ! ll->isEnabled )
+        return;
+    fprintf(fp, "low latency: busy poll %s (%d us), prefer busy poll %s, "
+            "quick ack %s\n", gOptStates[ll->busyPoll], ll->busyPollUs,
+            gOptStates[ll->preferBusyPoll], gOptStates[ll->quickAck]);
+    fprintf(fp, "  buffer sizing %s: receive %d, send %d; rtt %u us, "
+            "receive %llu B/s, send %llu B/s\n", gOptStates[ll->bufSize],
+            ll->rcvBuf, ll->sndBuf, ll->rttUs, ll->rcvRate, ll->sndRate);
+    fprintf(fp, "  spin %d us: %llu hits, %llu misses\n", ll->spinUs,
+            ll->spinHits, ll->spinMisses);
+}
+
+static void printJson(const VncStats *stats, FILE *fp)
+{
+    int i, j, isFirst = 1;
+
+    fprintf(fp, "{\"updates\":%llu,\"encodings\":{", stats->updates);
+    for(i = 0; i < STATS_ENC_COUNT; ++i) {
+        const EncodingStats *enc = stats->encodings + i;
+        if( enc->rects == 0 )
+            continue;
+        fprintf(fp, "%s\"%s\":{\"rects\":%llu,\"bytes\":%llu,"
+                "\"pixels\":%llu,\"decode_ns\":%llu,\"decode_hist_us\":[",
+                isFirst ? "" : ",", gEncodings[i].name, enc->rects,
+                enc->bytes, enc->pixels, enc->decodeNs);
+        for(j = 0; j < STATS_HIST_SIZE; ++j)
+            fprintf(fp, "%s%llu", j ? "," : "", enc->decodeHist[j]);
+        fprintf(fp, "]}");
+        isFirst = 0;
+    }
+    fprintf(fp, "},\"inflate\":{\"in\":%llu,\"out\":%llu},"
+            "\"present\":{\"count\":%llu,\"ns\":%llu},"
+            "\"socket\":{\"bytes_read\":%llu,\"read_calls\":%llu,"
+            "\"bytes_written\":%llu,\"write_calls\":%llu,"
+            "\"query_calls\":%llu}",
+            stats->inflateIn, stats->inflateOut,
+            stats->presents, stats->presentNs,
+            stats->sock.bytesRead, stats->sock.readCalls,
+            stats->sock.bytesWritten, stats->sock.writeCalls,
+            stats->sock.queryCalls);
+    const SockLowLatency *ll = &stats->sock.lowLat;
+    if( ll->isEnabled )
+        fprintf(fp, ",\"low_latency\":{\"busy_poll\":\"%s\","
+                "\"busy_poll_us\":%d,\"prefer_busy_poll\":\"%s\","
+                "\"quick_ack\":\"%s\",\"buffer_sizing\":\"%s\","
+                "\"rcvbuf\":%d,\"sndbuf\":%d,\"rtt_us\":%u,"
+                "\"receive_rate\":%llu,\"send_rate\":%llu,"
+                "\"spin_us\":%d,\"spin_hits\":%llu,\"spin_misses\":%llu}",
+                gOptStates[ll->busyPoll], ll->busyPollUs,
+                gOptStates[ll->preferBusyPoll], gOptStates[ll->quickAck],
+                gOptStates[ll->bufSize], ll->rcvBuf, ll->sndBuf, ll->rttUs,
+                ll->rcvRate, ll->sndRate, ll->spinUs, ll->spinHits,
+                ll->spinMisses);
+    fprintf(fp, "}\n");
+}
+
+void stats_print(const VncStats *stats, FILE *fp, int isJson)
+{
+    if( isJson )
+        printJson(stats, fp);
+    else
+        printText(stats, fp);
+    fflush(fp);
+}
+
+static struct {
+    pthread_t thread;
+    int isRunning;
+    int listenFd, sigFd, stopFd;
+    char *socketPath;
+    StatsCollector collect;
+    void *arg;
+} gService;
+
+static void serveClient(int fd)
+{
+    struct pollfd pfd;
+    char req[64], *resp;
+    int isJson = 0, len = 0, rd;
+    size_t respLen;
+    VncStats stats;
+
+    // wait a moment for request
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while( len < sizeof(req) - 1 && poll(&pfd, 1, 100) > 0 &&
+            (rd = read(fd, req + len, sizeof(req) - 1 - len)) > 0 )
+    {
+        len += rd;
+        if( memchr(req, '\n', len) != NULL )
+            break;
+    }
+    req[len] = '\0';
+    isJson = strstr(req, "json") != NULL;
+    memset(&stats, 0, sizeof(stats));
+    gService.collect(&stats, gService.arg);
+    FILE *fp = open_memstream(&resp, &respLen);
+    stats_print(&stats, fp, isJson);
+    fclose(fp);
+    if( write(fd, resp, respLen) != respLen )
+        log_error_errno("statistics write");
+    free(resp);
+}
+
+static void *serviceThread(void *arg)
+{
+    struct pollfd pfds[3];
+    struct signalfd_siginfo si;
+    VncStats stats;
+
+    pfds[0].fd = gService.stopFd;
+    pfds[1].fd = gService.sigFd;
+    pfds[2].fd = gService.listenFd;
+    pfds[0].events = pfds[1].events = pfds[2].events = POLLIN;
+    while( poll(pfds, gService.listenFd >= 0 ? 3 : 2, -1) >= 0 ) {
+        if( pfds[0].revents )
+            break;
+        if( pfds[1].revents &&
+                read(gService.sigFd, &si, sizeof(si)) == sizeof(si) )
+        {
+            memset(&stats, 0, sizeof(stats));
+            gService.collect(&stats, gService.arg);
+            stats_print(&stats, stdout, 0);
+        }
+        if( gService.listenFd >= 0 && pfds[2].revents ) {
+            int fd = accept(gService.listenFd, NULL, NULL);
+            if( fd >= 0 ) {
+                serveClient(fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+void stats_blockSignal(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void stats_startService(const char *socketPath, StatsCollector collect,
+        void *arg)
+{
+    sigset_t mask;
+    struct sockaddr_un addr;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    if( (gService.sigFd = signalfd(-1, &mask, SFD_CLOEXEC)) < 0 )
+        log_fatal_errno("signalfd");
+    if( (gService.stopFd = eventfd(0, EFD_CLOEXEC)) < 0 )
+        log_fatal_errno("eventfd");
+    gService.listenFd = -1;
+    gService.socketPath = NULL;
+    if( socketPath != NULL ) {
+        if( strlen(socketPath) >= sizeof(addr.sun_path) )
+            log_fatal("statistics socket path too long");
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, socketPath);
+        gService.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if( gService.listenFd < 0 )
+            log_fatal_errno("statistics socket");
+        unlink(socketPath);
+        if( bind(gService.listenFd, (struct sockaddr*)&addr,
+                    sizeof(addr)) < 0 || listen(gService.listenFd, 8) < 0 )
+            log_fatal_errno("statistics socket %s", socketPath);
+        gService.socketPath = strdup(socketPath);
+    }
+    gService.collect = collect;
+    gService.arg = arg;
+    if( pthread_create(&gService.thread, NULL, serviceThread, NULL) != 0 )
+        log_fatal("unable to start statistics thread");
+    gService.isRunning = 1;
+}
+
+void stats_stopService(void)
+{
+    unsigned long long one = 1;
+
+    if( ! gService.isRunning )
+        return;
+    if( write(gService.stopFd, &one, sizeof(one)) != sizeof(one) )
+        log_error_errno("statistics thread stop");
+    pthread_join(gService.thread, NULL);
+    gService.isRunning = 0;
+    close(gService.stopFd);
+    close(gService.sigFd);
+    if( gService.listenFd >= 0 ) {
+        close(gService.listenFd);
+        unlink(gService.socketPath);
+        free(gService.socketPath);
+    }
+}
+
@@ -0,0 +1,71 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include "sockstream.h"
+
+/* Decoding time histogram: bucket i counts rectangles decoded in less than
+ * 2^i microseconds (and not less than 2^(i-1)); the last one counts all
+ * longer.
+ */
+enum { STATS_HIST_SIZE = 16 };
+
+typedef struct {
+    unsigned long long rects, bytes, pixels, decodeNs;
+    unsigned long long decodeHist[STATS_HIST_SIZE];
+} EncodingStats;
+
+enum { STATS_ENC_COUNT = 10 };
+
+typedef struct {
+    unsigned long long updates;
+    EncodingStats encodings[STATS_ENC_COUNT];
+    unsigned long long inflateIn, inflateOut;
+    unsigned long long presents, presentNs;
+    SockStats sock;
+} VncStats;
+
+
+/* Adds one decoded rectangle to statistics
+ */
+void stats_addRect(VncStats*, int encType, unsigned pixels, unsigned bytes,
+        unsigned long long decodeNs);
+
+
+/* Copies statistics being updated by another thread
+ */
+void stats_copy(VncStats *dst, const VncStats *src);
+
+
+/* Prints statistics as text or JSON
+ */
+void stats_print(const VncStats*, FILE*, int isJson);
+
+
+/* Collects current statistics
+ */
+typedef void (*StatsCollector)(VncStats*, void *arg);
+
+
+/* Blocks SIGUSR1 in the calling thread and the threads it starts later,
+ * so that a statistics request sent before the service is started stays
+ * pending instead of terminating the program. Called at program start.
+ */
+void stats_blockSignal(void);
+
+
+/* Starts the statistics service thread. The thread prints statistics on
+ * SIGUSR1, blocked by stats_blockSignal, and when socketPath is not NULL,
+ * serves them on UNIX-domain socket. A client connected to the socket may
+ * send "json" line to get statistics in JSON format, plain text is sent
+ * otherwise.
+ */
+void stats_startService(const char *socketPath, StatsCollector, void *arg);
+
+
+/* Stops the statistics service, removes the socket
+ */
+void stats_stopService(void);
+
+
+#endif /* STATS_H */
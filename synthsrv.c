@@ -0,0 +1,849 @@
+/* Synthetic RFB server for load tests. Generates desktop activity of
+ * chosen kind and sends it using chosen encoding at limited frame rate.
+ * Each client is served by a separate process.
+ */
+#include "rfbenc.h"
+#include "sockstream.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+
+typedef enum {
+    WL_SCROLL,      // scrolling text
+    WL_NOISE,       // full screen video-like noise
+    WL_WIDGETS,     // small widgets changing
+    WL_FILL         // full screen solid fills
+} Workload;
+
+static const char *const gWorkloadNames[] = {
+    "scroll", "noise", "widgets", "fill"
+};
+
+typedef struct {
+    int port;
+    const char *unixPath;       // NULL when listening on TCP port
+    int isRing;                 // offer shared memory ring on UNIX socket
+    int isAnyAddr;
+    int isOnce;
+    int width, height;
+    Workload workload;
+    int encType;
+    int frameRate;
+    int logLevel;
+} ServerParams;
+
+enum {
+    GLYPH_WIDTH = 8, GLYPH_HEIGHT = 16,
+    NOISE_BLOCK = 4,
+    WIDGET_WIDTH = 128, WIDGET_HEIGHT = 24,
+    WIDGET_CELL_WIDTH = 160, WIDGET_CELL_HEIGHT = 48,
+    WIDGET_CHURN = 16,              // widgets changed per frame
+    CURSOR_SIZE = 12,
+    ECHO_X = 8, ECHO_Y = 8, ECHO_MAX = 64,
+    DAMAGE_MAX = 64,
+    RING_SIZE = 8 << 20
+};
+
+enum { XK_BackSpace = 0xff08 };
+
+typedef struct {
+    const ServerParams *params;
+    SockStream *strm;
+    RfbEncoder *enc;
+    int width, height;
+    unsigned *desk;             // workload output
+    unsigned *fb;               // desktop with overlays, as sent to client
+    unsigned rnd;
+    int pixelEnc;               // encoding of pixel data
+    int isCopyRectOn;
+    int isUpdateRequested, isFullUpdateRequested;
+    RectangleArea damage[DAMAGE_MAX];
+    int damageCount;
+    int scrollDy;               // CopyRect scroll of current frame
+    int ptrX, ptrY;
+    char echo[ECHO_MAX];        // characters typed by client
+    int echoLen;
+    unsigned char *widgetLevels;
+    int widgetCols, widgetRows;
+    unsigned frameNo, updateCount;
+    unsigned long long bytesSent;
+} Session;
+
+static unsigned char gGlyphs[96][GLYPH_HEIGHT];
+
+static unsigned long long monoTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned nextRandom(Session *ses)
+{
+    // xorshift32
+    ses->rnd ^= ses->rnd << 13;
+    ses->rnd ^= ses->rnd >> 17;
+    ses->rnd ^= ses->rnd << 5;
+    return ses->rnd;
+}
+
+/* Generates letter-like glyph bitmaps
+ */
+static void initGlyphs(void)
+{
+    int c, row;
+    unsigned h;
+
+    for(c = 1; c < 96; ++c) {
+        h = c * 2654435761u;
+        for(row = 3; row < GLYPH_HEIGHT - 3; ++row) {
+            h ^= h << 13;
+            h ^= h >> 17;
+            h ^= h << 5;
+            gGlyphs[c][row] = row % 3 == 1 ? 0 : h & 0x7e;
+        }
+    }
+}
+
+static void usage(void)
+{
+    printf("\n"
+        "usage: synthvnc [parameters]\n"
+        "\n"
+        "parameters:\n"
+        "  -p |-port      <port>  - TCP port or display number, display 0\n"
+        "                           by default\n"
+        "  -a |-anyaddr           - listen on all addresses, not loopback\n"
+        "  -u |-unix      <path>  - listen on UNIX socket instead of TCP\n"
+        "  -nr|-noring            - do not offer shared memory transport\n"
+        "                           to clients on UNIX socket\n"
+        "  -1 |-once              - serve one client and exit\n"
+        "  -g |-geometry  <WxH>   - desktop size, 1280x720 by default\n"
+        "  -w |-workload  <kind>  - desktop activity, one of:\n"
+        "                             scroll  - scrolling text (default)\n"
+        "                             noise   - full screen noise\n"
+        "                             widgets - small widgets churn\n"
+        "                             fill    - full screen solid fills\n"
+        "  -e |-encoding  <enc>   - raw, copyrect, rre, hextile or zrle;\n"
+        "                           copyrect scrolls using CopyRect and\n"
+        "                           sends other changes as raw\n"
+        "  -r |-rate      <fps>   - frames per second, 30 by default,\n"
+        "                           0 - as fast as the client requests\n"
+        "  -v |-verbose           - print some debug info\n"
+        "  -h |-help              - print this help\n"
+        "\n"
+        "Pointer events move a box cursor, typed keys are echoed in the\n"
+        "top left corner.\n"
+        "\n");
+    exit(0);
+}
+
+static void parseCmdLine(int argc, char *argv[], ServerParams *params)
+{
+    static const char *const encNames[] = {
+        "raw", "copyrect", "rre", "hextile", "zrle"
+    };
+    static const int encTypes[] = { 0, 1, 2, 5, 16 };
+    int i = 1, k;
+
+    params->port = 5900;
+    params->unixPath = NULL;
+    params->isRing = 1;
+    params->isAnyAddr = 0;
+    params->isOnce = 0;
+    params->width = 1280;
+    params->height = 720;
+    params->workload = WL_SCROLL;
+    params->encType = 0;
+    params->frameRate = 30;
+    params->logLevel = 0;
+    while( i < argc ) {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : "";
+        if( !strcmp(arg, "-p") || !strcmp(arg, "-port") ) {
+            params->port = atoi(val);
+            if( params->port < 100 )
+                params->port += 5900;
+            ++i;
+        }else if( !strcmp(arg, "-a") || !strcmp(arg, "-anyaddr") )
+            params->isAnyAddr = 1;
+        else if( !strcmp(arg, "-u") || !strcmp(arg, "-unix") ) {
+            params->unixPath = val;
+            ++i;
+        }else if( !strcmp(arg, "-nr") || !strcmp(arg, "-noring") )
+            params->isRing = 0;
+        else if( !strcmp(arg, "-1") || !strcmp(arg, "-once") )
+            params->isOnce = 1;
+        else if( !strcmp(arg, "-g") || !strcmp(arg, "-geometry") ) {
+            if( sscanf(val, "%dx%d", &params->width, &params->height) != 2 ||
+                    params->width < 16 || params->height < 2 * GLYPH_HEIGHT ||
+                    params->width > 16384 || params->height > 16384 )
+            {
+                fprintf(stderr, "error: bad geometry\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-w") || !strcmp(arg, "-workload") ) {
+            for(k = 0; k < 4 && strcmp(val, gWorkloadNames[k]); ++k)
+                ;
+            if( k == 4 ) {
+                fprintf(stderr, "error: bad workload\n\n");
+                exit(1);
+            }
+            params->workload = k;
+            ++i;
+        }else if( !strcmp(arg, "-e") || !strcmp(arg, "-encoding") ) {
+            for(k = 0; k < 5 && strcmp(val, encNames[k]); ++k)
+                ;
+            if( k == 5 ) {
+                fprintf(stderr, "error: bad encoding\n\n");
+                exit(1);
+            }
+            params->encType = encTypes[k];
+            ++i;
+        }else if( !strcmp(arg, "-r") || !strcmp(arg, "-rate") ) {
+            if( (params->frameRate = atoi(val)) < 0 ) {
+                fprintf(stderr, "error: bad frame rate\n\n");
+                exit(1);
+            }
+            ++i;
+        }else if( !strcmp(arg, "-v") || !strcmp(arg, "-verbose") )
+            ++params->logLevel;
+        else if( !strcmp(arg, "-h") || !strcmp(arg, "-help") )
+            usage();
+        else{
+            fprintf(stderr, "error: unrecognized option -- %s\n\n", arg);
+            exit(1);
+        }
+        ++i;
+    }
+}
+
+static void addDamage(Session *ses, int x, int y, int width, int height)
+{
+    int i;
+
+    if( x < 0 ) {
+        width += x;
+        x = 0;
+    }
+    if( y < 0 ) {
+        height += y;
+        y = 0;
+    }
+    if( x + width > ses->width )
+        width = ses->width - x;
+    if( y + height > ses->height )
+        height = ses->height - y;
+    if( width <= 0 || height <= 0 )
+        return;
+    if( ses->damageCount == DAMAGE_MAX ) {
+        // too many rectangles, use the bounding one
+        for(i = 0; i < ses->damageCount; ++i) {
+            const RectangleArea *d = ses->damage + i;
+            int x2 = x + width > d->x + d->width ? x + width : d->x + d->width;
+            int y2 = y + height > d->y + d->height ?
+                y + height : d->y + d->height;
+            x = x < d->x ? x : d->x;
+            y = y < d->y ? y : d->y;
+            width = x2 - x;
+            height = y2 - y;
+        }
+        ses->damageCount = 0;
+    }
+    RectangleArea *area = ses->damage + ses->damageCount++;
+    area->x = x;
+    area->y = y;
+    area->width = width;
+    area->height = height;
+}
+
+static void fillRect(unsigned *buf, int stride, int x, int y,
+        int width, int height, unsigned color)
+{
+    int i, j;
+
+    for(i = 0; i < height; ++i) {
+        unsigned *line = buf + (y + i) * stride + x;
+        for(j = 0; j < width; ++j)
+            line[j] = color;
+    }
+}
+
+/* Draws a line of random words at given position of the desktop
+ */
+static void drawTextLine(Session *ses, int y)
+{
+    static const unsigned colors[] = { 0x0000c0, 0x008000, 0xa00000 };
+    int x = GLYPH_WIDTH / 2, i, j, row;
+
+    fillRect(ses->desk, ses->width, 0, y, ses->width, GLYPH_HEIGHT,
+            0xffffff);
+    if( nextRandom(ses) % 8 == 0 )
+        return;     // empty line
+    int indent = nextRandom(ses) % 6 * 2 * GLYPH_WIDTH;
+    int lineEnd = ses->width - GLYPH_WIDTH - nextRandom(ses) %
+        (ses->width / 3 + 1);
+    x += indent;
+    while( x + 2 * GLYPH_WIDTH <= lineEnd ) {
+        int wordLen = 2 + nextRandom(ses) % 9;
+        unsigned color = nextRandom(ses) % 6 ? 0x202020 :
+            colors[nextRandom(ses) % 3];
+        for(i = 0; i < wordLen && x + GLYPH_WIDTH <= lineEnd; ++i) {
+            const unsigned char *glyph = gGlyphs[1 + nextRandom(ses) % 95];
+            for(row = 0; row < GLYPH_HEIGHT; ++row) {
+                unsigned *line = ses->desk + (y + row) * ses->width + x;
+                for(j = 0; j < GLYPH_WIDTH; ++j) {
+                    if( glyph[row] & 0x80 >> j )
+                        line[j] = color;
+                }
+            }
+            x += GLYPH_WIDTH;
+        }
+        x += GLYPH_WIDTH;
+    }
+}
+
+static void drawWidget(Session *ses, int idx)
+{
+    static const unsigned colors[] = {
+        0x3070d0, 0x30a040, 0xd08020, 0xc03030
+    };
+    int x = idx % ses->widgetCols * WIDGET_CELL_WIDTH +
+        (WIDGET_CELL_WIDTH - WIDGET_WIDTH) / 2;
+    int y = idx / ses->widgetCols * WIDGET_CELL_HEIGHT +
+        (WIDGET_CELL_HEIGHT - WIDGET_HEIGHT) / 2;
+    int level = ses->widgetLevels[idx];
+
+    fillRect(ses->desk, ses->width, x, y, WIDGET_WIDTH, WIDGET_HEIGHT,
+            0x606060);
+    fillRect(ses->desk, ses->width, x + 1, y + 1, WIDGET_WIDTH - 2,
+            WIDGET_HEIGHT - 2, 0xf0f0f0);
+    fillRect(ses->desk, ses->width, x + 2, y + 2, level, WIDGET_HEIGHT - 4,
+            colors[level * 4 / (WIDGET_WIDTH - 3)]);
+    addDamage(ses, x, y, WIDGET_WIDTH, WIDGET_HEIGHT);
+}
+
+static void initDesktop(Session *ses)
+{
+    int i, widgetCount;
+
+    switch( ses->params->workload ) {
+    case WL_SCROLL:
+        for(i = 0; i + GLYPH_HEIGHT <= ses->height; i += GLYPH_HEIGHT)
+            drawTextLine(ses, i);
+        fillRect(ses->desk, ses->width, 0, i, ses->width, ses->height - i,
+                0xffffff);
+        break;
+    case WL_WIDGETS:
+        fillRect(ses->desk, ses->width, 0, 0, ses->width, ses->height,
+                0xc0c0c0);
+        ses->widgetCols = ses->width / WIDGET_CELL_WIDTH;
+        ses->widgetRows = ses->height / WIDGET_CELL_HEIGHT;
+        widgetCount = ses->widgetCols * ses->widgetRows;
+        ses->widgetLevels = malloc(widgetCount);
+        for(i = 0; i < widgetCount; ++i) {
+            ses->widgetLevels[i] = nextRandom(ses) % (WIDGET_WIDTH - 3);
+            drawWidget(ses, i);
+        }
+        break;
+    default:
+        fillRect(ses->desk, ses->width, 0, 0, ses->width, ses->height, 0);
+        break;
+    }
+    ses->damageCount = 0;
+}
+
+/* Returns area covered by the cursor (isEcho == 0) or typed text
+ */
+static RectangleArea getOverlayArea(const Session *ses, int isEcho)
+{
+    RectangleArea area;
+
+    if( isEcho ) {
+        area.x = ECHO_X;
+        area.y = ECHO_Y;
+        area.width = ses->echoLen * GLYPH_WIDTH;
+        area.height = GLYPH_HEIGHT;
+    }else{
+        area.x = ses->ptrX;
+        area.y = ses->ptrY;
+        area.width = area.height = CURSOR_SIZE;
+    }
+    return area;
+}
+
+static void damageOverlays(Session *ses, int dy)
+{
+    int i;
+
+    for(i = 0; i < 2; ++i) {
+        RectangleArea area = getOverlayArea(ses, i);
+        addDamage(ses, area.x, area.y + dy, area.width, area.height);
+    }
+}
+
+/* Advances the workload by one frame
+ */
+static void stepWorkload(Session *ses)
+{
+    int i, j, damageCount, widgetCount;
+    unsigned color;
+
+    ++ses->frameNo;
+    switch( ses->params->workload ) {
+    case WL_SCROLL:
+        memmove(ses->desk, ses->desk + GLYPH_HEIGHT * ses->width,
+                (ses->height - GLYPH_HEIGHT) * ses->width * 4);
+        drawTextLine(ses, ses->height - GLYPH_HEIGHT);
+        if( ses->isCopyRectOn ) {
+            // the client copies overlays and pending damage as well
+            damageCount = ses->damageCount;
+            for(i = 0; i < damageCount && i < ses->damageCount; ++i) {
+                RectangleArea area = ses->damage[i];
+                addDamage(ses, area.x, area.y - GLYPH_HEIGHT, area.width,
+                        area.height);
+            }
+            memmove(ses->fb, ses->fb + GLYPH_HEIGHT * ses->width,
+                    (ses->height - GLYPH_HEIGHT) * ses->width * 4);
+            ses->scrollDy = GLYPH_HEIGHT;
+            damageOverlays(ses, -GLYPH_HEIGHT);
+            damageOverlays(ses, 0);
+            addDamage(ses, 0, ses->height - GLYPH_HEIGHT, ses->width,
+                    GLYPH_HEIGHT);
+        }else
+            addDamage(ses, 0, 0, ses->width, ses->height);
+        break;
+    case WL_NOISE:
+        for(i = 0; i < ses->height; i += NOISE_BLOCK) {
+            for(j = 0; j < ses->width; j += NOISE_BLOCK) {
+                fillRect(ses->desk, ses->width, j, i,
+                        ses->width - j < NOISE_BLOCK ?
+                        ses->width - j : NOISE_BLOCK,
+                        ses->height - i < NOISE_BLOCK ?
+                        ses->height - i : NOISE_BLOCK,
+                        nextRandom(ses) & 0xffffff);
+            }
+        }
+        addDamage(ses, 0, 0, ses->width, ses->height);
+        break;
+    case WL_WIDGETS:
+        widgetCount = ses->widgetCols * ses->widgetRows;
+        for(i = 0; i < WIDGET_CHURN && widgetCount > 0; ++i) {
+            int idx = nextRandom(ses) % widgetCount;
+            ses->widgetLevels[idx] = nextRandom(ses) % (WIDGET_WIDTH - 3);
+            drawWidget(ses, idx);
+        }
+        break;
+    case WL_FILL:
+        color = (ses->frameNo * 7 & 0xff) << 16 |
+            (ses->frameNo * 13 & 0xff) << 8 | (ses->frameNo * 3 & 0xff);
+        fillRect(ses->desk, ses->width, 0, 0, ses->width, ses->height,
+                color);
+        addDamage(ses, 0, 0, ses->width, ses->height);
+        break;
+    }
+}
+
+static void putOverlayPixel(Session *ses, const RectangleArea *clip,
+        int x, int y, unsigned color)
+{
+    if( x >= clip->x && x < clip->x + clip->width &&
+            y >= clip->y && y < clip->y + clip->height )
+        ses->fb[y * ses->width + x] = color;
+}
+
+/* Composes the desktop with cursor and typed text in the area
+ */
+static void composeArea(Session *ses, const RectangleArea *area)
+{
+    int i, j, k, row;
+
+    for(i = 0; i < area->height; ++i) {
+        int off = (area->y + i) * ses->width + area->x;
+        memcpy(ses->fb + off, ses->desk + off, area->width * 4);
+    }
+    for(k = 0; k < ses->echoLen; ++k) {
+        const unsigned char *glyph = gGlyphs[ses->echo[k] - 0x20];
+        for(row = 0; row < GLYPH_HEIGHT; ++row) {
+            for(j = 0; j < GLYPH_WIDTH; ++j) {
+                putOverlayPixel(ses, area, ECHO_X + k * GLYPH_WIDTH + j,
+                        ECHO_Y + row,
+                        glyph[row] & 0x80 >> j ? 0x000000 : 0xffff80);
+            }
+        }
+    }
+    for(i = 0; i < CURSOR_SIZE; ++i) {
+        for(j = 0; j < CURSOR_SIZE; ++j) {
+            int isBorder = i == 0 || j == 0 || i == CURSOR_SIZE - 1 ||
+                j == CURSOR_SIZE - 1;
+            putOverlayPixel(ses, area, ses->ptrX + j, ses->ptrY + i,
+                    isBorder ? 0x000000 : 0xffffff);
+        }
+    }
+}
+
+static void sendUpdate(Session *ses)
+{
+    int i;
+    unsigned len;
+
+    if( ses->isFullUpdateRequested ) {
+        ses->damageCount = 0;
+        ses->scrollDy = 0;
+        addDamage(ses, 0, 0, ses->width, ses->height);
+    }
+    rfbenc_clear(ses->enc);
+    rfbenc_beginUpdate(ses->enc, ses->damageCount + (ses->scrollDy != 0));
+    if( ses->scrollDy != 0 )
+        rfbenc_putCopyRect(ses->enc, 0, ses->scrollDy, 0, 0, ses->width,
+                ses->height - ses->scrollDy);
+    for(i = 0; i < ses->damageCount; ++i) {
+        const RectangleArea *area = ses->damage + i;
+        composeArea(ses, area);
+        rfbenc_putRect(ses->enc, ses->pixelEnc, ses->fb, ses->width,
+                area->x, area->y, area->width, area->height);
+    }
+    const void *data = rfbenc_getData(ses->enc, &len);
+    sock_write(ses->strm, data, len);
+    sock_flush(ses->strm);
+    log_debug("update %u: %d rectangles, %u bytes", ses->updateCount,
+            ses->damageCount + (ses->scrollDy != 0), len);
+    ses->bytesSent += len;
+    ++ses->updateCount;
+    ses->damageCount = 0;
+    ses->scrollDy = 0;
+    ses->isUpdateRequested = ses->isFullUpdateRequested = 0;
+}
+
+static void readPixelFormat(SockStream *strm, PixelFormat *pixelFormat)
+{
+    pixelFormat->bitsPerPixel = sock_readU8(strm);
+    pixelFormat->depth = sock_readU8(strm);
+    pixelFormat->bigEndian = sock_readU8(strm);
+    pixelFormat->trueColor = sock_readU8(strm);
+    pixelFormat->maxRed = sock_readU16(strm);
+    pixelFormat->maxGreen = sock_readU16(strm);
+    pixelFormat->maxBlue = sock_readU16(strm);
+    pixelFormat->shiftRed = sock_readU8(strm);
+    pixelFormat->shiftGreen = sock_readU8(strm);
+    pixelFormat->shiftBlue = sock_readU8(strm);
+    sock_discard(strm, 3);     // padding
+}
+
+static void writePixelFormat(SockStream *strm, const PixelFormat *pixelFormat)
+{
+    char padding[3] = "";
+
+    sock_writeU8(strm, pixelFormat->bitsPerPixel);
+    sock_writeU8(strm, pixelFormat->depth);
+    sock_writeU8(strm, pixelFormat->bigEndian);
+    sock_writeU8(strm, pixelFormat->trueColor);
+    sock_writeU16(strm, pixelFormat->maxRed);
+    sock_writeU16(strm, pixelFormat->maxGreen);
+    sock_writeU16(strm, pixelFormat->maxBlue);
+    sock_writeU8(strm, pixelFormat->shiftRed);
+    sock_writeU8(strm, pixelFormat->shiftGreen);
+    sock_writeU8(strm, pixelFormat->shiftBlue);
+    sock_write(strm, padding, 3);
+}
+
+static void setEncodings(Session *ses)
+{
+    int i, encType, isSupported = 0, isCopyRectSupported = 0;
+    int wantEnc = ses->params->encType == 1 ? 0 : ses->params->encType;
+
+    sock_discard(ses->strm, 1);     // padding
+    int count = sock_readU16(ses->strm);
+    for(i = 0; i < count; ++i) {
+        encType = (int)sock_readU32(ses->strm);
+        if( encType == wantEnc )
+            isSupported = 1;
+        else if( encType == 1 )
+            isCopyRectSupported = 1;
+        else if( encType >= -256 && encType <= -247 )
+            rfbenc_setCompressLevel(ses->enc, encType + 256);
+    }
+    if( ! isSupported && wantEnc != 0 )
+        log_warn("encoding %d not supported by client, using Raw", wantEnc);
+    ses->pixelEnc = isSupported ? wantEnc : 0;
+    ses->isCopyRectOn = ses->params->encType == 1 && isCopyRectSupported;
+}
+
+static void handleKey(Session *ses, int isDown, unsigned keysym)
+{
+    if( ! isDown )
+        return;
+    if( keysym >= 0x20 && keysym < 0x7f && ses->echoLen < ECHO_MAX ) {
+        ses->echo[ses->echoLen++] = keysym;
+        damageOverlays(ses, 0);
+    }else if( keysym == XK_BackSpace && ses->echoLen > 0 ) {
+        damageOverlays(ses, 0);
+        --ses->echoLen;
+    }
+}
+
+static void handleMessage(Session *ses)
+{
+    PixelFormat pixelFormat;
+    SockStream *strm = ses->strm;
+    unsigned msgType = sock_readU8(strm);
+
+    switch( msgType ) {
+    case 0:     // SetPixelFormat
+        sock_discard(strm, 3);
+        readPixelFormat(strm, &pixelFormat);
+        if( ! pixelFormat.trueColor || (pixelFormat.bitsPerPixel != 8 &&
+                    pixelFormat.bitsPerPixel != 16 &&
+                    pixelFormat.bitsPerPixel != 32) )
+            log_fatal("unsupported client pixel format");
+        rfbenc_setClientFormat(ses->enc, &pixelFormat);
+        break;
+    case 2:     // SetEncodings
+        setEncodings(ses);
+        break;
+    case 3:     // FramebufferUpdateRequest
+        if( ! sock_readU8(strm) )
+            ses->isFullUpdateRequested = 1;
+        ses->isUpdateRequested = 1;
+        sock_discard(strm, 8);  // area; whole damage is sent anyway
+        break;
+    case 4:     // KeyEvent
+        {
+            int isDown = sock_readU8(strm);
+            sock_discard(strm, 2);
+            handleKey(ses, isDown, sock_readU32(strm));
+        }
+        break;
+    case 5:     // PointerEvent
+        sock_discard(strm, 1);  // button mask
+        damageOverlays(ses, 0);
+        ses->ptrX = sock_readU16(strm);
+        ses->ptrY = sock_readU16(strm);
+        damageOverlays(ses, 0);
+        break;
+    case 6:     // ClientCutText
+        sock_discard(strm, 3);
+        sock_discard(strm, sock_readU32(strm));
+        break;
+    default:
+        log_fatal("unsupported client message %u", msgType);
+        break;
+    }
+}
+
+static void handshake(Session *ses)
+{
+    PixelFormat pixelFormat;
+    char buf[12];
+    const unsigned one = 1;
+    SockStream *strm = ses->strm;
+    const char *workloadName = gWorkloadNames[ses->params->workload];
+
+    sock_write(strm, "RFB 003.008\n", 12);
+    sock_flush(strm);
+    sock_read(strm, buf, 12);
+    if( memcmp(buf, "RFB 003.00", 10) )
+        log_fatal("bad client protocol version");
+    if( buf[10] != '3' ) {
+        sock_writeU8(strm, 1);      // number of security types
+        sock_writeU8(strm, 1);      // None
+        sock_flush(strm);
+        if( sock_readU8(strm) != 1 )
+            log_fatal("client chose unsupported security type");
+        if( buf[10] == '8' )
+            sock_writeU32(strm, 0);     // SecurityResult
+    }else
+        sock_writeU32(strm, 1);     // None
+    sock_flush(strm);
+    sock_readU8(strm);      // shared flag
+    // ServerInit
+    pixelFormat.bitsPerPixel = 32;
+    pixelFormat.depth = 24;
+    pixelFormat.bigEndian = *(const char*)&one == 0;
+    pixelFormat.trueColor = 1;
+    pixelFormat.maxRed = pixelFormat.maxGreen = pixelFormat.maxBlue = 255;
+    pixelFormat.shiftRed = 16;
+    pixelFormat.shiftGreen = 8;
+    pixelFormat.shiftBlue = 0;
+    sock_writeU16(strm, ses->width);
+    sock_writeU16(strm, ses->height);
+    writePixelFormat(strm, &pixelFormat);
+    sock_writeU32(strm, 9 + strlen(workloadName));
+    sock_write(strm, "synthvnc ", 9);
+    sock_write(strm, workloadName, strlen(workloadName));
+    sock_flush(strm);
+    ses->enc = rfbenc_create(&pixelFormat);
+}
+
+/* Returns poll timeout in milliseconds until the next update is due
+ */
+static int getTimeoutMs(const Session *ses, unsigned long long nextFrameNs)
+{
+    unsigned long long curTm;
+
+    if( ! ses->isUpdateRequested )
+        return -1;
+    if( ses->isFullUpdateRequested || ses->damageCount > 0 )
+        return 0;
+    curTm = monoTimeNs();
+    return nextFrameNs > curTm ? (nextFrameNs - curTm + 999999) / 1000000 : 0;
+}
+
+static void serveClient(const ServerParams *params, int sockFd)
+{
+    Session ses;
+    struct pollfd pfd;
+    unsigned long long frameIntervalNs = params->frameRate > 0 ?
+        1000000000LL / params->frameRate : 0;
+
+    memset(&ses, 0, sizeof(ses));
+    ses.params = params;
+    ses.strm = sock_fromFd(sockFd);
+    if( params->unixPath != NULL && params->isRing )
+        sock_offerRing(ses.strm, RING_SIZE);
+    ses.width = params->width;
+    ses.height = params->height;
+    ses.desk = malloc(ses.width * ses.height * 4);
+    ses.fb = malloc(ses.width * ses.height * 4);
+    ses.rnd = 2463534242u;
+    ses.pixelEnc = params->encType == 1 ? 0 : params->encType;
+    ses.ptrX = ses.width / 2;
+    ses.ptrY = ses.height / 2;
+    initDesktop(&ses);
+    handshake(&ses);
+    unsigned long long begTm = monoTimeNs(), nextFrameNs = begTm;
+    pfd.fd = sockFd;
+    pfd.events = POLLIN;
+    while( 1 ) {
+        if( sock_isDataAvail(ses.strm) ) {
+            handleMessage(&ses);
+            continue;
+        }
+        if( poll(&pfd, 1, getTimeoutMs(&ses, nextFrameNs)) > 0 ) {
+            if( ! sock_isDataQueued(ses.strm) )
+                break;      // connection closed
+            handleMessage(&ses);
+            continue;
+        }
+        if( ! ses.isUpdateRequested )
+            continue;
+        unsigned long long curTm = monoTimeNs();
+        if( ! ses.isFullUpdateRequested && curTm >= nextFrameNs ) {
+            stepWorkload(&ses);
+            nextFrameNs += frameIntervalNs;
+            if( nextFrameNs < curTm )
+                nextFrameNs = curTm + frameIntervalNs;
+        }
+        if( ses.isFullUpdateRequested || ses.damageCount > 0 )
+            sendUpdate(&ses);
+    }
+    double secs = (monoTimeNs() - begTm) / 1e9;
+    log_info("client done: %u updates, %u frames, %.1f MB in %.1f s, "
+            "%.1f MB/s", ses.updateCount, ses.frameNo, ses.bytesSent / 1e6,
+            secs, ses.bytesSent / 1e6 / secs);
+    rfbenc_free(ses.enc);
+    sock_close(ses.strm);
+    free(ses.desk);
+    free(ses.fb);
+    free(ses.widgetLevels);
+}
+
+static int listenTCP(const ServerParams *params)
+{
+    struct sockaddr_in addr;
+    int listenFd, isOn = 1;
+
+    if( (listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0 )
+        log_fatal_errno("socket");
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &isOn, sizeof(isOn));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(params->port);
+    addr.sin_addr.s_addr = htonl(params->isAnyAddr ?
+            INADDR_ANY : INADDR_LOOPBACK);
+    if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 )
+        log_fatal_errno("bind port %d", params->port);
+    return listenFd;
+}
+
+static int listenUnix(const char *path)
+{
+    struct sockaddr_un addr;
+    int listenFd;
+
+    if( strlen(path) >= sizeof(addr.sun_path) )
+        log_fatal("socket path too long");
+    if( (listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 )
+        log_fatal_errno("socket");
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if( bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0 )
+        log_fatal_errno("bind %s", path);
+    return listenFd;
+}
+
+int main(int argc, char *argv[])
+{
+    ServerParams params;
+    int listenFd, sockFd, isOn = 1;
+
+    parseCmdLine(argc, argv, &params);
+    log_setLevel(params.logLevel + 1);
+    initGlyphs();
+    if( params.unixPath != NULL )
+        listenFd = listenUnix(params.unixPath);
+    else
+        listenFd = listenTCP(&params);
+    if( listen(listenFd, 16) < 0 )
+        log_fatal_errno("listen");
+    char where[128];
+    if( params.unixPath != NULL )
+        snprintf(where, sizeof(where), "%s", params.unixPath);
+    else
+        snprintf(where, sizeof(where), "port %d", params.port);
+    log_info("listening on %s: %dx%d %s, encoding %d, %d fps", where,
+            params.width, params.height,
+            gWorkloadNames[params.workload], params.encType,
+            params.frameRate);
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    while( 1 ) {
+        if( (sockFd = accept(listenFd, NULL, NULL)) < 0 ) {
+            log_error_errno("accept");
+            continue;
+        }
+        if( params.unixPath == NULL && setsockopt(sockFd, IPPROTO_TCP,
+                    TCP_NODELAY, &isOn, sizeof(isOn)) )
+            log_error_errno("set socket TCP_NODELAY failed");
+        if( params.isOnce ) {
+            close(listenFd);
+            serveClient(&params, sockFd);
+            break;
+        }
+        switch( fork() ) {
+        case -1:
+            log_error_errno("fork");
+            break;
+        case 0:
+            close(listenFd);
+            serveClient(&params, sockFd);
+            exit(0);
+        }
+        close(sockFd);
+    }
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include "trace.h"
+#include "vnclog.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+
+enum { RING_SIZE = 1 << 15 };   // events per thread, power of two
+
+typedef struct {
+    unsigned long long ts;      // nanoseconds
+    const char *name;
+    const char *argNames;       // NULL when no arguments
+    int args[3];
+    char phase;                 // 'B', 'E' or 'i'
+} TraceEvent;
+
+typedef struct TraceRing {
+    TraceEvent events[RING_SIZE];
+    unsigned long long count;   // number of events recorded so far
+    int tid;
+    struct TraceRing *next;
+} TraceRing;
+
+static volatile int gIsTracing;
+static char *gFileName;
+static TraceRing *gRings;
+static int gThreadCount;
+static pthread_mutex_t gRingsLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceRing *tRing;
+
+static TraceRing *getRing(void)
+{
+    if( tRing == NULL ) {
+        tRing = malloc(sizeof(TraceRing));
+        tRing->count = 0;
+        pthread_mutex_lock(&gRingsLock);
+        tRing->tid = ++gThreadCount;
+        tRing->next = gRings;
+        gRings = tRing;
+        pthread_mutex_unlock(&gRingsLock);
+    }
+    return tRing;
+}
+
+static void addEvent(char phase, const char *name, const char *argNames,
+        int arg0, int arg1, int arg2)
+{
+    struct timespec ts;
+    TraceRing *ring = getRing();
+    TraceEvent *ev = ring->events + (ring->count & (RING_SIZE - 1));
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ev->ts = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    ev->name = name;
+    ev->argNames = argNames;
+    ev->args[0] = arg0;
+    ev->args[1] = arg1;
+    ev->args[2] = arg2;
+    ev->phase = phase;
+    ++ring->count;
+}
+
+static void writeTraceAtExit(void)
+{
+    trace_finish();
+}
+
+void trace_start(const char *fileName)
+{
+    gFileName = strdup(fileName);
+    gIsTracing = 1;
+    atexit(writeTraceAtExit);
+}
+
+void trace_begin(const char *name)
+{
+    if( gIsTracing )
+        addEvent('B', name, NULL, 0, 0, 0);
+}
+
+void trace_beginArgs(const char *name, const char *argNames,
+        int arg0, int arg1, int arg2)
+{
+    if( gIsTracing )
+        addEvent('B', name, argNames, arg0, arg1, arg2);
+}
+
+void trace_end(const char *name)
+{
+    if( gIsTracing )
+        addEvent('E', name, NULL, 0, 0, 0);
+}
+
+void trace_instant(const char *name, const char *argName, int arg)
+{
+    if( gIsTracing )
+        addEvent('i', name, argName, arg, 0, 0);
+}
+
+static void writeEvent(FILE *fp, const TraceEvent *ev, int tid,
+        unsigned long long tsBase, int isFirst)
+{
+    int i = 0;
+    const char *argName = ev->argNames;
+
+    fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":1,\"tid\":%d,"
+            "\"ts\":%.3f", isFirst ? "" : ",\n", ev->name, ev->phase, tid,
+            (ev->ts - tsBase) / 1000.0);
+    if( ev->phase == 'i' )
+        fprintf(fp, ",\"s\":\"t\"");
+    if( argName != NULL ) {
+        fprintf(fp, ",\"args\":{");
+        while( i < 3 && *argName ) {
+            int len = strcspn(argName, ",");
+            fprintf(fp, "%s\"%.*s\":%d", i ? "," : "", len, argName,
+                    ev->args[i]);
+            argName += len;
+            if( *argName == ',' )
+                ++argName;
+            ++i;
+        }
+        fprintf(fp, "}");
+    }
+    fprintf(fp, "}");
+}
+
+void trace_finish(void)
+{
+    TraceRing *ring;
+    unsigned long long i, first, tsBase = ~0ULL;
+    int isFirst = 1;
+
+    if( ! gIsTracing )
+        return;
+    gIsTracing = 0;
+    FILE *fp = fopen(gFileName, "w");
+    if( fp == NULL ) {
+        log_error_errno("unable to write trace file %s", gFileName);
+        return;
+    }
+    pthread_mutex_lock(&gRingsLock);
+    for(ring = gRings; ring != NULL; ring = ring->next) {
+        first = ring->count > RING_SIZE ? ring->count - RING_SIZE : 0;
+        if( ring->count > first &&
+                ring->events[first & (RING_SIZE - 1)].ts < tsBase )
+            tsBase = ring->events[first & (RING_SIZE - 1)].ts;
+    }
+    fprintf(fp, "{\"traceEvents\":[\n");
+    for(ring = gRings; ring != NULL; ring = ring->next) {
+        first = ring->count > RING_SIZE ? ring->count - RING_SIZE : 0;
+        for(i = first; i < ring->count; ++i) {
+            writeEvent(fp, ring->events + (i & (RING_SIZE - 1)), ring->tid,
+                    tsBase, isFirst);
+            isFirst = 0;
+        }
+    }
+    fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    pthread_mutex_unlock(&gRingsLock);
+    fclose(fp);
+    log_info("trace written to %s", gFileName);
+}
+
@@ -0,0 +1,40 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Tracing of the receive-decode-present pipeline. Events are recorded into
+ * per-thread ring buffers and exported in Chrome trace event format (JSON),
+ * viewable in chrome://tracing or Perfetto UI. Event and argument names
+ * must be static strings. When tracing is not started the event functions
+ * return immediately.
+ */
+
+
+/* Starts recording. The trace is written to the file at exit.
+ */
+void trace_start(const char *fileName);
+
+
+void trace_begin(const char *name);
+
+
+/* Begins event with integer arguments. The argNames contains
+ * comma-separated names of at most three arguments.
+ */
+void trace_beginArgs(const char *name, const char *argNames,
+        int arg0, int arg1, int arg2);
+
+
+void trace_end(const char *name);
+
+
+/* Records instant event with one integer argument
+ */
+void trace_instant(const char *name, const char *argName, int arg);
+
+
+/* Writes the trace file and stops recording
+ */
+void trace_finish(void);
+
+
+#endif /* TRACE_H */
@@ -0,0 +1,522 @@
+#include "wall.h"
+#include "clidisplay.h"
+#include "cliconn.h"
+#include "vnclog.h"
+#include "trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+
+enum {
+    CELL_GAP = 2,               // pixels between cells
+    EPOLL_EVENTS_MAX = 64,
+    RECV_TIMEOUT_MS = 10000     // server stalled within a message
+};
+
+/* Colors as red, green, blue
+ */
+static const unsigned char gBackgroundColor[3] = { 0x20, 0x20, 0x20 };
+static const unsigned char gClosedColor[3] = { 0x60, 0, 0 };
+
+typedef struct {
+    const char *host;
+    CliConn *conn;              // NULL when closed
+    DisplayConnection *disp;    // in memory, NULL when unable to connect
+    int fd;
+    jmp_buf errorJump;          // connection errors close the session
+    pthread_mutex_t lock;
+    int isDirty;                // changed since drawn on wall
+    int isClosed;
+    int cellX, cellY, cellWidth, cellHeight;
+} Session;
+
+typedef struct {
+    Session *sessions;
+    int sessionCount;
+    DisplayConnection *disp;
+    int epollFd;
+    int wakeFd;                 // eventfd signaled by workers
+    int isHeadless;
+    int openCount;              // sessions not closed, atomic
+    // the pixel format of session displays, also used by the wall one
+    PixelFormat pixelFormat;
+    int bytespp;
+    int isByteChannels;         // 8-bit color components, 4 bytes pixel
+    char backgroundPixel[4], closedPixel[4];
+    // queue of sessions ready for read; every session is queued at most
+    // once thanks to EPOLLONESHOT
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueCond;
+    Session **queue;
+    int queueHead, queueCount;
+    char *scaleBuf;
+    int scaleBufSize;
+} Wall;
+
+static unsigned long long curTimeUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void armSession(Wall *wall, Session *ses, int op)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = ses;
+    if( epoll_ctl(wall->epollFd, op, ses->fd, &ev) < 0 )
+        log_fatal_errno("epoll_ctl");
+}
+
+static void pushReady(Wall *wall, Session *ses)
+{
+    pthread_mutex_lock(&wall->queueLock);
+    wall->queue[(wall->queueHead + wall->queueCount) % wall->sessionCount] =
+        ses;
+    ++wall->queueCount;
+    pthread_cond_signal(&wall->queueCond);
+    pthread_mutex_unlock(&wall->queueLock);
+}
+
+static Session *popReady(Wall *wall)
+{
+    Session *ses;
+
+    pthread_mutex_lock(&wall->queueLock);
+    while( wall->queueCount == 0 )
+        pthread_cond_wait(&wall->queueCond, &wall->queueLock);
+    ses = wall->queue[wall->queueHead];
+    wall->queueHead = (wall->queueHead + 1) % wall->sessionCount;
+    --wall->queueCount;
+    pthread_mutex_unlock(&wall->queueLock);
+    return ses;
+}
+
+/* Closes the session connection; the cell is drawn as closed. Called with
+ * the session lock held.
+ */
+static void closeSession(Wall *wall, Session *ses)
+{
+    epoll_ctl(wall->epollFd, EPOLL_CTL_DEL, ses->fd, NULL);
+    cliconn_close(ses->conn);
+    ses->conn = NULL;
+    ses->isClosed = 1;
+    ses->isDirty = 1;
+    __atomic_sub_fetch(&wall->openCount, 1, __ATOMIC_RELAXED);
+}
+
+/* Decodes all messages available on session socket. The end of stream is
+ * left to the epoll loop. Connection errors close the session only.
+ */
+static void serveSession(Wall *wall, Session *ses)
+{
+    DisplayEvent ev;
+    int msg, wasDirty, isClosed;
+
+    pthread_mutex_lock(&ses->lock);
+    wasDirty = ses->isDirty;
+    if( setjmp(ses->errorJump) != 0 ) {
+        log_info("%s: session closed", ses->host);
+        closeSession(wall, ses);
+    }else{
+        while( cliconn_isDataQueued(ses->conn) &&
+                (msg = cliconn_nextEvent(ses->conn, ses->disp, &ev, 0)) >= 0 )
+        {
+            switch( msg ) {
+            case 0:     // FramebufferUpdate
+                cliconn_recvFramebufferUpdate(ses->conn, ses->disp);
+                cliconn_sendFramebufferUpdateRequest(ses->conn, 1);
+                ses->isDirty = 1;
+                break;
+            case 2:     // Bell
+                break;
+            case 3:     // ServerCutText
+                cliconn_recvCutTextMsg(ses->conn);
+                break;
+            default:
+                log_error("%s: unsupported message %d", ses->host, msg);
+                longjmp(ses->errorJump, 1);
+            }
+        }
+    }
+    isClosed = ses->isClosed;
+    pthread_mutex_unlock(&ses->lock);
+    if( ses->isDirty && ! wasDirty ) {
+        unsigned long long one = 1;
+        if( write(wall->wakeFd, &one, sizeof(one)) < 0 )
+            log_fatal_errno("eventfd write");
+    }
+    if( ! isClosed )
+        armSession(wall, ses, EPOLL_CTL_MOD);
+}
+
+static void *workerThread(void *arg)
+{
+    Wall *wall = arg;
+
+    while( 1 ) {
+        Session *ses = popReady(wall);
+        trace_begin("session");
+        serveSession(wall, ses);
+        trace_end("session");
+    }
+    return NULL;
+}
+
+/* Splits the wall into nearly square grid of cells
+ */
+static void layoutCells(Wall *wall)
+{
+    int i, cols, rows;
+    int width = clidisp_getWidth(wall->disp);
+    int height = clidisp_getHeight(wall->disp);
+
+    for(cols = 1; cols * cols < wall->sessionCount; ++cols)
+        ;
+    rows = (wall->sessionCount + cols - 1) / cols;
+    for(i = 0; i < wall->sessionCount; ++i) {
+        Session *ses = wall->sessions + i;
+        int col = i % cols, row = i / cols;
+        ses->cellX = col * width / cols;
+        ses->cellY = row * height / rows;
+        ses->cellWidth = (col + 1) * width / cols - ses->cellX - CELL_GAP;
+        ses->cellHeight = (row + 1) * height / rows - ses->cellY - CELL_GAP;
+        if( ses->cellWidth < 1 )
+            ses->cellWidth = 1;
+        if( ses->cellHeight < 1 )
+            ses->cellHeight = 1;
+        pthread_mutex_lock(&ses->lock);
+        ses->isDirty = 1;
+        pthread_mutex_unlock(&ses->lock);
+    }
+    clidisp_fillRect(wall->disp, wall->backgroundPixel, 0, 0, width, height);
+    clidisp_addDamage(wall->disp, 0, 0, width, height);
+}
+
+static unsigned getPixel(const unsigned char *p, int bytespp)
+{
+    switch( bytespp ) {
+    case 1:
+        return *p;
+    case 2:
+        return *(const unsigned short*)p;
+    default:
+        return *(const unsigned*)p;
+    }
+}
+
+static void putPixel(unsigned char *p, int bytespp, unsigned pixel)
+{
+    switch( bytespp ) {
+    case 1:
+        *p = pixel;
+        break;
+    case 2:
+        *(unsigned short*)p = pixel;
+        break;
+    default:
+        *(unsigned*)p = pixel;
+        break;
+    }
+}
+
+/* Converts the color given as red, green, blue to the wall pixel format
+ */
+static void makePixel(const Wall *wall, const unsigned char *color,
+        char *pixel)
+{
+    const PixelFormat *pf = &wall->pixelFormat;
+
+    putPixel((unsigned char*)pixel, wall->bytespp,
+            color[0] * pf->maxRed / 255 << pf->shiftRed |
+            color[1] * pf->maxGreen / 255 << pf->shiftGreen |
+            color[2] * pf->maxBlue / 255 << pf->shiftBlue);
+}
+
+/* Average of four pixels, computed per color component
+ */
+static unsigned averagePixel(const PixelFormat *pf, unsigned p0, unsigned p1,
+        unsigned p2, unsigned p3)
+{
+    const unsigned shifts[3] = { pf->shiftRed, pf->shiftGreen, pf->shiftBlue };
+    const unsigned maxes[3] = { pf->maxRed, pf->maxGreen, pf->maxBlue };
+    unsigned k, res = 0;
+
+    for(k = 0; k < 3; ++k) {
+        unsigned sh = shifts[k], max = maxes[k];
+        res |= ((p0 >> sh & max) + (p1 >> sh & max) + (p2 >> sh & max) +
+                (p3 >> sh & max) + 2) >> 2 << sh;
+    }
+    return res;
+}
+
+/* Downscales the session desktop into its cell, keeping the aspect ratio.
+ * Each destination pixel is average of 2x2 source pixels at the sample
+ * point, computed per byte when color components are whole bytes.
+ */
+static void drawSession(Wall *wall, Session *ses)
+{
+    int x, y, k, srcBpl, srcWidth, srcHeight, outWidth, outHeight;
+    int bytespp = wall->bytespp;
+
+    clidisp_fillRect(wall->disp, wall->backgroundPixel, ses->cellX,
+            ses->cellY, ses->cellWidth, ses->cellHeight);
+    clidisp_addDamage(wall->disp, ses->cellX, ses->cellY, ses->cellWidth,
+            ses->cellHeight);
+    if( ses->isClosed ) {
+        clidisp_fillRect(wall->disp, wall->closedPixel, ses->cellX,
+                ses->cellY, ses->cellWidth, ses->cellHeight);
+        return;
+    }
+    srcWidth = clidisp_getWidth(ses->disp);
+    srcHeight = clidisp_getHeight(ses->disp);
+    const unsigned char *src = (const unsigned char*)
+        clidisp_getFramebuffer(ses->disp, &srcBpl);
+    outWidth = ses->cellWidth;
+    outHeight = (long long)srcHeight * outWidth / srcWidth;
+    if( outHeight > ses->cellHeight ) {
+        outHeight = ses->cellHeight;
+        outWidth = (long long)srcWidth * outHeight / srcHeight;
+    }
+    if( outWidth > srcWidth || outHeight > srcHeight ) {
+        outWidth = srcWidth;
+        outHeight = srcHeight;
+    }
+    if( outWidth <= 0 || outHeight <= 0 )
+        return;
+    if( outWidth * outHeight * bytespp > wall->scaleBufSize ) {
+        wall->scaleBufSize = outWidth * outHeight * bytespp;
+        wall->scaleBuf = realloc(wall->scaleBuf, wall->scaleBufSize);
+    }
+    unsigned char *dest = (unsigned char*)wall->scaleBuf;
+    for(y = 0; y < outHeight; ++y) {
+        int sy = y * srcHeight / outHeight;
+        const unsigned char *line0 = src + sy * srcBpl;
+        const unsigned char *line1 = sy + 1 < srcHeight ?
+            line0 + srcBpl : line0;
+        for(x = 0; x < outWidth; ++x) {
+            int sx = x * srcWidth / outWidth;
+            int nx = sx + 1 < srcWidth ? bytespp : 0;
+            const unsigned char *p0 = line0 + sx * bytespp;
+            const unsigned char *p1 = line1 + sx * bytespp;
+            if( wall->isByteChannels ) {
+                for(k = 0; k < 4; ++k)
+                    *dest++ = (p0[k] + p0[nx + k] + p1[k] + p1[nx + k] + 2)
+                        >> 2;
+            }else{
+                putPixel(dest, bytespp, averagePixel(&wall->pixelFormat,
+                            getPixel(p0, bytespp), getPixel(p0 + nx, bytespp),
+                            getPixel(p1, bytespp), getPixel(p1 + nx, bytespp)));
+                dest += bytespp;
+            }
+        }
+    }
+    clidisp_putRect(wall->disp, wall->scaleBuf, outWidth * bytespp,
+            ses->cellX + (ses->cellWidth - outWidth) / 2,
+            ses->cellY + (ses->cellHeight - outHeight) / 2,
+            outWidth, outHeight);
+}
+
+/* Draws the sessions changed since last refresh. Sessions being decoded
+ * just now are left for the next refresh. Returns the number of sessions
+ * remaining dirty.
+ */
+static int refreshWall(Wall *wall)
+{
+    int i, dirtyCount = 0;
+
+    trace_begin("refresh");
+    for(i = 0; i < wall->sessionCount; ++i) {
+        Session *ses = wall->sessions + i;
+        if( pthread_mutex_trylock(&ses->lock) != 0 ) {
+            ++dirtyCount;
+            continue;
+        }
+        if( ses->isDirty ) {
+            drawSession(wall, ses);
+            ses->isDirty = 0;
+        }
+        pthread_mutex_unlock(&ses->lock);
+    }
+    clidisp_flush(wall->disp);
+    trace_end("refresh");
+    return dirtyCount;
+}
+
+/* Handles readiness reported by epoll. Session end of stream is detected
+ * here, so workers see only sockets having data.
+ */
+static void dispatchReady(Wall *wall, int *dirtyCount)
+{
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+    unsigned long long cnt;
+    int i, n;
+
+    n = epoll_wait(wall->epollFd, events, EPOLL_EVENTS_MAX, 0);
+    for(i = 0; i < n; ++i) {
+        Session *ses = events[i].data.ptr;
+        if( ses == NULL ) {
+            if( read(wall->wakeFd, &cnt, sizeof(cnt)) < 0 )
+                log_fatal_errno("eventfd read");
+            ++*dirtyCount;
+            continue;
+        }
+        if( ! cliconn_isReadReady(ses->conn) ) {
+            armSession(wall, ses, EPOLL_CTL_MOD);
+            continue;
+        }
+        // readable without data queued means end of stream
+        if( ! cliconn_isDataQueued(ses->conn) ) {
+            log_info("%s: connection closed", ses->host);
+            pthread_mutex_lock(&ses->lock);
+            closeSession(wall, ses);
+            pthread_mutex_unlock(&ses->lock);
+            ++*dirtyCount;
+        }else
+            pushReady(wall, ses);
+    }
+}
+
+static void openSession(Wall *wall, Session *ses,
+        const CmdLineParams *params)
+{
+    PixelFormat pixelFormat;
+
+    pthread_mutex_init(&ses->lock, NULL);
+    if( (ses->conn = cliconn_tryOpen(ses->host, params->passwdFile)) == NULL )
+    {
+        log_error("%s: unable to connect", ses->host);
+        ses->isClosed = 1;
+        return;
+    }
+    ses->disp = clidisp_openHeadless(cliconn_getWidth(ses->conn),
+            cliconn_getHeight(ses->conn), NULL);
+    ses->fd = cliconn_getFd(ses->conn);
+    ++wall->openCount;
+    if( setjmp(ses->errorJump) != 0 ) {
+        closeSession(wall, ses);
+        return;
+    }
+    cliconn_setErrorJump(ses->conn, &ses->errorJump);
+    clidisp_getPixelFormat(ses->disp, &pixelFormat);
+    cliconn_setPixelFormat(ses->conn, &pixelFormat);
+    clidisp_setServerPixelFormat(ses->disp, &pixelFormat);
+    cliconn_setEncodings(ses->conn, params->enableHextile,
+            params->enableZRLE, 0);
+    // the wall refresh paces drawing, so the session display does not
+    // defer presents
+    cliconn_setRefreshRate(ses->conn, 1000);
+    cliconn_sendFramebufferUpdateRequest(ses->conn, 0);
+    armSession(wall, ses, EPOLL_CTL_ADD);
+}
+
+int wall_run(const CmdLineParams *params, int argc, char *argv[])
+{
+    Wall wall;
+    PixelFormat *pf = &wall.pixelFormat;
+    struct epoll_event ev;
+    DisplayEvent dispEv;
+    pthread_t thread;
+    int i, threadCount, dirtyCount = 1;
+    unsigned long long lastRefreshTm = 0;
+    unsigned long long refreshIntervalUs = 1000000 / params->refreshRate;
+
+    memset(&wall, 0, sizeof(wall));
+    wall.sessionCount = params->hostCount;
+    wall.sessions = calloc(wall.sessionCount, sizeof(Session));
+    wall.queue = malloc(wall.sessionCount * sizeof(Session*));
+    wall.isHeadless = params->headless;
+    pthread_mutex_init(&wall.queueLock, NULL);
+    pthread_cond_init(&wall.queueCond, NULL);
+    // a write to closed connection closes the session only
+    signal(SIGPIPE, SIG_IGN);
+    // a worker blocks on reading the rest of a message; a stalled server
+    // would hold it, and with all workers held the whole wall freezes
+    cliconn_setRecvTimeout(RECV_TIMEOUT_MS);
+    if( (wall.epollFd = epoll_create1(EPOLL_CLOEXEC)) < 0 )
+        log_fatal_errno("epoll_create1");
+    if( (wall.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 )
+        log_fatal_errno("eventfd");
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if( epoll_ctl(wall.epollFd, EPOLL_CTL_ADD, wall.wakeFd, &ev) < 0 )
+        log_fatal_errno("epoll_ctl");
+    for(i = 0; i < wall.sessionCount; ++i) {
+        wall.sessions[i].host = params->hosts[i];
+        openSession(&wall, wall.sessions + i, params);
+    }
+    for(i = 0; i < wall.sessionCount && wall.sessions[i].disp == NULL; ++i)
+        ;
+    if( i == wall.sessionCount )
+        log_fatal("unable to connect to any host");
+    clidisp_getPixelFormat(wall.sessions[i].disp, pf);
+    wall.bytespp = clidisp_getBytesPerPixel(wall.sessions[i].disp);
+    wall.isByteChannels = wall.bytespp == 4 && pf->maxRed == 255 &&
+        pf->maxGreen == 255 && pf->maxBlue == 255 && pf->shiftRed % 8 == 0 &&
+        pf->shiftGreen % 8 == 0 && pf->shiftBlue % 8 == 0;
+    makePixel(&wall, gBackgroundColor, wall.backgroundPixel);
+    makePixel(&wall, gClosedColor, wall.closedPixel);
+    if( params->headless )
+        wall.disp = clidisp_openHeadless(params->wallWidth,
+                params->wallHeight, params->framePattern);
+    else
+        wall.disp = clidisp_open(params->wallWidth, params->wallHeight,
+                "wilqvnc wall", argc, argv, params->fullScreen,
+                params->presentMode);
+    clidisp_setServerPixelFormat(wall.disp, pf);
+    layoutCells(&wall);
+    threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+    if( threadCount < 1 )
+        threadCount = 1;
+    if( threadCount > wall.sessionCount )
+        threadCount = wall.sessionCount;
+    log_info("wall of %d sessions, %d worker threads", wall.sessionCount,
+            threadCount);
+    for(i = 0; i < threadCount; ++i) {
+        if( (errno = pthread_create(&thread, NULL, workerThread,
+                        &wall)) != 0 )
+            log_fatal_errno("pthread_create");
+        pthread_detach(thread);
+    }
+    while( 1 ) {
+        int timeoutUs = -1;
+        if( dirtyCount > 0 ) {
+            unsigned long long elapsed = curTimeUs() - lastRefreshTm;
+            timeoutUs = elapsed < refreshIntervalUs ?
+                refreshIntervalUs - elapsed : 0;
+        }
+        int isReady = clidisp_nextEvent(wall.disp, 0, wall.epollFd,
+                &dispEv, timeoutUs);
+        if( dispEv.evType == VET_CLOSE )
+            break;
+        if( dispEv.evType == VET_RESIZE ) {
+            clidisp_resize(wall.disp, dispEv.area.width, dispEv.area.height);
+            layoutCells(&wall);
+            dirtyCount = 1;
+        }
+        if( isReady )
+            dispatchReady(&wall, &dirtyCount);
+        if( dirtyCount > 0 &&
+                curTimeUs() - lastRefreshTm >= refreshIntervalUs )
+        {
+            lastRefreshTm = curTimeUs();
+            dirtyCount = refreshWall(&wall);
+            // in headless mode there is nobody to close the wall
+            if( wall.isHeadless && dirtyCount == 0 &&
+                    __atomic_load_n(&wall.openCount, __ATOMIC_RELAXED) == 0 )
+                break;
+        }
+    }
+    clidisp_close(wall.disp);
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef WALL_H
+#define WALL_H
+
+#include "cmdline.h"
+
+/* Views many remote desktops at once in one window split into cells, each
+ * desktop downscaled to its cell. Connections are served by one epoll loop
+ * and updates are decoded on a pool of worker threads. The sessions are view
+ * only: input is not sent to servers.
+ * Returns the process exit code.
+ */
+int wall_run(const CmdLineParams*, int argc, char *argv[]);
+
+#endif /* WALL_H */
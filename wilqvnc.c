@@ -1,12 +1,44 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include "clidisplay.h"
 #include "cliconn.h"
 #include "vnclog.h"
 #include "cmdline.h"
+#include "trace.h"
+#include "wall.h"
+#include "snapshot.h"
+#include "fbcache.h"
 
 
+static const PixelFormat gPixelFormatBGR233 = {
+    8, 8, 0, 1, 7, 7, 3, 0, 3, 6
+};
+
+static const PixelFormat gPixelFormatRGB565 = {
+    16, 16, 0, 1, 31, 63, 31, 11, 5, 0
+};
+
+/* Reconnect backoff: the first attempt is immediate, then the delay
+ * doubles from the minimum up to the maximum
+ */
+enum {
+    RECONNECT_DELAY_MIN_MS = 10,
+    RECONNECT_DELAY_MAX_MS = 5000
+};
+
+/* The connection read by the statistics service thread. It is replaced
+ * under the lock and the old one is closed after that.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    CliConn *conn;              // NULL when disconnected
+} SharedConn;
+
 static unsigned long long curTimeMs(void)
 {
     struct timeval tv;
@@ -14,23 +46,235 @@ static unsigned long long curTimeMs(void)
     return tv.tv_sec * 1000LL + tv.tv_usec / 1000LL;
 }
 
+static DisplayConnection *openDisplay(const CmdLineParams *params,
+        CliConn *cliConn, int argc, char *argv[])
+{
+    if( params->headless )
+        return clidisp_openHeadless(cliconn_getWidth(cliConn),
+                cliconn_getHeight(cliConn), params->framePattern);
+    return clidisp_open(cliconn_getWidth(cliConn),
+            cliconn_getHeight(cliConn), cliconn_getName(cliConn),
+            argc, argv, params->fullScreen, params->presentMode);
+}
+
+static void collectStats(VncStats *stats, void *arg)
+{
+    SharedConn *shared = arg;
+
+    pthread_mutex_lock(&shared->lock);
+    if( shared->conn != NULL )
+        cliconn_getStats(shared->conn, stats);
+    else
+        memset(stats, 0, sizeof(VncStats));
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/* Makes the statistics service use the new connection and closes the old
+ * one
+ */
+static void replaceConn(SharedConn *shared, CliConn *conn)
+{
+    CliConn *oldConn;
+
+    pthread_mutex_lock(&shared->lock);
+    oldConn = shared->conn;
+    shared->conn = conn;
+    pthread_mutex_unlock(&shared->lock);
+    cliconn_close(oldConn);
+}
+
+/* Replays recorded session and prints the decoding throughput
+ */
+static int replaySession(const CmdLineParams *params, int argc, char *argv[])
+{
+    int i, msg, updates = 0;
+    unsigned long long pixels = 0;
+    PixelFormat pixelFormat;
+    DisplayEvent dispEv;
+    VncStats stats;
+
+    CliConn *cliConn = cliconn_openReplay(params->replayFile,
+            params->replayRealTime);
+    DisplayConnection *dispConn = openDisplay(params, cliConn, argc, argv);
+    cliconn_getPixelFormat(cliConn, &pixelFormat);
+    clidisp_setServerPixelFormat(dispConn, &pixelFormat);
+    cliconn_setRefreshRate(cliConn, params->refreshRate);
+    unsigned long long begTm = curTimeMs();
+    while( ! cliconn_isReplayDone(cliConn) ) {
+        msg = cliconn_nextEvent(cliConn, dispConn, &dispEv, 0);
+        if( dispEv.evType == VET_CLOSE )
+            break;
+        switch( msg ) {
+        case -1:    // no message
+        case 2:     // Bell
+            break;
+        case 0:     // FramebufferUpdate
+            cliconn_recvFramebufferUpdate(cliConn, dispConn);
+            ++updates;
+            break;
+        case 3:     // ServerCutText
+            cliconn_recvCutTextMsg(cliConn);
+            break;
+        default:
+            log_fatal("unsupported message %d", msg);
+            break;
+        }
+    }
+    clidisp_flush(dispConn);
+    unsigned long long elapsed = curTimeMs() - begTm;
+    if( elapsed == 0 )
+        elapsed = 1;
+    cliconn_getStats(cliConn, &stats);
+    for(i = 0; i < STATS_ENC_COUNT; ++i)
+        pixels += stats.encodings[i].pixels;
+    printf("replayed %d updates, %.1f Mpixels in %.3f s: "
+            "%.2f MPix/s, %.2f frames/s\n", updates, pixels / 1e6,
+            elapsed / 1000.0, pixels / 1000.0 / elapsed,
+            updates * 1000.0 / elapsed);
+    if( params->statsSocket != NULL )
+        stats_print(&stats, stdout, 0);
+    clidisp_close(dispConn);
+    cliconn_close(cliConn);
+    return 0;
+}
+
+/* Sets up connection to the display: pixel format, encodings and refresh
+ * rate
+ */
+static void setupConnection(const CmdLineParams *params, CliConn *cliConn,
+        DisplayConnection *dispConn, LatencyProbe *probe)
+{
+    PixelFormat pixelFormat;
+
+    switch( params->pixelFormat ) {
+    case PIXFMT_NATIVE:
+        clidisp_getPixelFormat(dispConn, &pixelFormat);
+        break;
+    case PIXFMT_SERVER:
+        cliconn_getPixelFormat(cliConn, &pixelFormat);
+        break;
+    case PIXFMT_BGR233:
+        pixelFormat = gPixelFormatBGR233;
+        break;
+    case PIXFMT_RGB565:
+        pixelFormat = gPixelFormatRGB565;
+        break;
+    }
+    cliconn_setRefreshRate(cliConn, params->refreshRate);
+    cliconn_setEncodings(cliConn, params->enableHextile, params->enableZRLE,
+            params->localCursor);
+    if( params->adaptiveEncoding )
+        cliconn_setAdaptiveEncoding(cliConn);
+    // with server format SetPixelFormat is not sent, so pixel format
+    // conversion works also with servers which do not obey the message
+    if( params->pixelFormat != PIXFMT_SERVER )
+        cliconn_setPixelFormat(cliConn, &pixelFormat);
+    clidisp_setServerPixelFormat(dispConn, &pixelFormat);
+    if( probe != NULL )
+        cliconn_setLatencyProbe(cliConn, probe);
+}
+
+/* Connects again after the connection is lost, retrying with increasing
+ * delay. The window keeps showing the last image; its events are handled
+ * between the attempts, not during the connect and handshake, which may
+ * block up to the connect timeout. Returns NULL when the window is closed.
+ * The old connection is left open.
+ */
+static CliConn *reconnect(CliConn *oldConn, DisplayConnection *dispConn)
+{
+    int delayMs = 0;
+    unsigned long long begTm = curTimeMs();
+    DisplayEvent dispEv;
+    CliConn *cliConn;
+
+    log_info("connection lost, reconnecting");
+    clidisp_flush(dispConn);
+    while( (cliConn = cliconn_tryReopen(oldConn)) == NULL ) {
+        delayMs = delayMs == 0 ? RECONNECT_DELAY_MIN_MS : 2 * delayMs;
+        if( delayMs > RECONNECT_DELAY_MAX_MS )
+            delayMs = RECONNECT_DELAY_MAX_MS;
+        unsigned long long endTm = curTimeMs() + delayMs;
+        unsigned long long curTm;
+        while( (curTm = curTimeMs()) < endTm ) {
+            clidisp_nextEvent(dispConn, 0, -1, &dispEv,
+                    (endTm - curTm) * 1000);
+            if( dispEv.evType == VET_CLOSE )
+                return NULL;
+        }
+    }
+    log_info("reconnected in %llu ms", curTimeMs() - begTm);
+    return cliConn;
+}
+
 int main(int argc, char *argv[])
 {
-    int msg, frameCnt = 0;
+    int msg, frameCnt;
     unsigned long long lastShowFpTm;
     CmdLineParams params;
-    PixelFormat pixelFormat;
+    LatencyProbe *probe = NULL;
+    jmp_buf connLostJump;
+    volatile int isUpdated = 0, isConnLost = 0;
+    static SharedConn sharedConn = { PTHREAD_MUTEX_INITIALIZER, NULL };
 
     cmdline_parse(argc, argv, &params);
     log_setLevel(params.logLevel);
-    CliConn *cliConn = cliconn_open(params.host, params.passwdFile);
-    DisplayConnection *dispConn = clidisp_open(cliconn_getWidth(cliConn),
-            cliconn_getHeight(cliConn), cliconn_getName(cliConn),
-            argc, argv, params.fullScreen);
-    clidisp_getPixelFormat(dispConn, &pixelFormat);
-    cliconn_setEncodings(cliConn, params.enableHextile, params.enableZRLE);
-    cliconn_setPixelFormat(cliConn, &pixelFormat);
+    if( params.traceFile != NULL )
+        trace_start(params.traceFile);
+    cliconn_setTLS(params.requireTLS, params.allowAnonTLS, params.caFile);
+    cliconn_setIOBackend(params.ioBackend);
+    cliconn_setLowLatency(params.lowLatencySpinUs);
+    if( params.replayFile != NULL )
+        return replaySession(&params, argc, argv);
+    if( params.snapshotPattern != NULL )
+        return snapshot_run(&params);
+    if( params.wall )
+        return wall_run(&params, argc, argv);
+    // before any thread is started, the X connection one included; a
+    // statistics request during the handshake is served once connected
+    stats_blockSignal();
+    if( ! params.headless )
+        clidisp_preopen(params.presentMode);
+    CliConn *volatile cliConn = cliconn_open(params.host, params.passwdFile);
+    sharedConn.conn = cliConn;
+    stats_startService(params.statsSocket, collectStats, &sharedConn);
+    DisplayConnection *dispConn = openDisplay(&params, cliConn, argc, argv);
+    int isFbCache = params.fbCache && ! params.headless;
+    if( isFbCache )
+        fbcache_load(dispConn, params.host);
+    if( params.exportSocket != NULL )
+        clidisp_startExport(dispConn, params.exportSocket);
+    if( params.latencyProbe != LATPROBE_NONE ) {
+        probe = latprobe_create(params.latencyProbe,
+                params.latencyProbeCount);
+        if( params.latencyArea.width > 0 )
+            latprobe_setArea(probe, params.latencyArea.x,
+                    params.latencyArea.y, params.latencyArea.width,
+                    params.latencyArea.height);
+    }
+    setupConnection(&params, cliConn, dispConn, probe);
+    if( params.recordFile != NULL )
+        cliconn_startRecording(cliConn, params.recordFile);
     cliconn_sendFramebufferUpdateRequest(cliConn, 0);
+    // a write to closed connection is reported as error
+    signal(SIGPIPE, SIG_IGN);
+    if( setjmp(connLostJump) != 0 ) {
+        if( ! params.reconnect ) {
+            // ends like window close, e.g. the cached image is saved
+            isConnLost = 1;
+            goto end;
+        }
+        cliConn = reconnect(cliConn, dispConn);
+        replaceConn(&sharedConn, cliConn);
+        if( cliConn == NULL )
+            goto end;
+        clidisp_resize(dispConn, cliconn_getWidth(cliConn),
+                cliconn_getHeight(cliConn));
+        setupConnection(&params, cliConn, dispConn, probe);
+        // the image kept on screen is refreshed by full update
+        cliconn_sendFramebufferUpdateRequest(cliConn, 0);
+    }
+    cliconn_setErrorJump(cliConn, &connLostJump);
+    frameCnt = 0;
     lastShowFpTm = curTimeMs();
     int isPendingUpdReq = 1;
     while( 1 ) {
@@ -50,6 +294,11 @@ int main(int argc, char *argv[])
         case VET_MOUSE:
             cliconn_sendPointerEvent(cliConn, &dispEv.pev);
             break;
+        case VET_RESIZE:
+            if( params.remoteResize )
+                cliconn_sendSetDesktopSize(cliConn, dispEv.area.width,
+                        dispEv.area.height);
+            break;
         case VET_CLOSE:
             goto end;
         }
@@ -69,6 +318,7 @@ int main(int argc, char *argv[])
             }
             cliconn_recvFramebufferUpdate(cliConn, dispConn);
             isPendingUpdReq = 0;
+            isUpdated = 1;
             break;
         case 1:     // SetColorMapEntries
             log_fatal("unexpected SetColorMapEntries message");
@@ -82,10 +332,26 @@ int main(int argc, char *argv[])
             log_fatal("unsupported message %d", msg);
             break;
         }
+        if( probe != NULL && latprobe_isDone(probe) )
+            break;
     }
 end:
+    stats_stopService();
+    if( params.statsSocket != NULL && cliConn != NULL ) {
+        VncStats stats;
+        cliconn_getStats(cliConn, &stats);
+        stats_print(&stats, stdout, 0);
+    }
+    if( probe != NULL ) {
+        latprobe_print(probe, stdout);
+        latprobe_free(probe);
+    }
+    trace_finish();
+    // without update the dimmed cached image would be saved
+    if( isFbCache && isUpdated )
+        fbcache_save(dispConn, params.host);
     clidisp_close(dispConn);
-    cliconn_close(cliConn);
-    return 0;
+    if( cliConn != NULL )
+        cliconn_close(cliConn);
+    return isConnLost;
 }
-
@@ -0,0 +1,289 @@
+#include "wvnc.h"
+#include "cliconn.h"
+#include "dispbackend.h"
+#include "vnclog.h"
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <poll.h>
+
+
+/* Display backend drawing into framebuffer memory of the library caller
+ */
+typedef struct {
+    DisplayConnection base;
+    WvncClient *client;
+} WvncDisplay;
+
+struct WvncClient {
+    CliConn *conn;
+    DisplayConnection *disp;
+    PixelFormat pixelFormat;
+    WvncCallbacks cb;
+    void *arg;
+    jmp_buf errorJump;          // set by every call using the connection
+    int isFailed;               // the connection is unusable
+};
+
+static WvncClient *getClient(DisplayConnection *conn)
+{
+    return ((WvncDisplay*)conn)->client;
+}
+
+static void getPixelFormat(DisplayConnection *conn, PixelFormat *pixelFormat)
+{
+    *pixelFormat = getClient(conn)->pixelFormat;
+}
+
+static void createFramebuffer(DisplayConnection *conn, Framebuffer *fb,
+        int width, int height)
+{
+    WvncClient *client = getClient(conn);
+
+    fb->data = client->cb.getFramebuffer(client->arg, width, height,
+            &fb->bytesPerLine);
+    if( fb->data == NULL ) {
+        log_error("no framebuffer for %dx%d desktop", width, height);
+        longjmp(client->errorJump, 1);
+    }
+    fb->width = width;
+    fb->height = height;
+    fb->bitsPerPixel = client->pixelFormat.bitsPerPixel;
+    fb->handle = NULL;
+    fb->shared = NULL;
+}
+
+static void destroyFramebuffer(DisplayConnection *conn, Framebuffer *fb)
+{
+    WvncClient *client = getClient(conn);
+
+    if( client->cb.freeFramebuffer != NULL )
+        client->cb.freeFramebuffer(client->arg, fb->data);
+}
+
+static void resized(DisplayConnection *conn)
+{
+}
+
+static int nextEvent(DisplayConnection *conn, int isCliDataAvail, int cliFd,
+        DisplayEvent *displayEvent, int timeoutUs)
+{
+    struct pollfd pfd;
+    int res;
+
+    displayEvent->evType = VET_NONE;
+    if( isCliDataAvail )
+        return 1;
+    pfd.fd = cliFd;
+    pfd.events = POLLIN;
+    res = poll(&pfd, 1, timeoutUs < 0 ? -1 : (timeoutUs + 999) / 1000);
+    if( res < 0 )
+        log_fatal_errno("poll");
+    return res > 0;
+}
+
+static void present(DisplayConnection *conn)
+{
+    WvncClient *client = getClient(conn);
+    int i;
+
+    if( client->cb.damage == NULL )
+        return;
+    for(i = 0; i < conn->damageCount; ++i) {
+        const RectangleArea *dmg = conn->damage + i;
+        client->cb.damage(client->arg, dmg->x, dmg->y, dmg->width,
+                dmg->height);
+    }
+}
+
+static void setCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const char *pixels, const unsigned char *mask)
+{
+}
+
+static void setMonoCursor(DisplayConnection *conn, int hotX, int hotY,
+        int width, int height, const unsigned char *fgRGB,
+        const unsigned char *bgRGB, const unsigned char *bitmap,
+        const unsigned char *mask)
+{
+}
+
+static void closeDisplay(DisplayConnection *conn)
+{
+}
+
+static const DisplayBackend gWvncBackend = {
+    getPixelFormat,
+    createFramebuffer,
+    destroyFramebuffer,
+    resized,
+    nextEvent,
+    present,
+    NULL,
+    setCursor,
+    setMonoCursor,
+    closeDisplay
+};
+
+WvncClient *wvnc_open(const char *host, const char *passwdFile,
+        const PixelFormat *pixelFormat, const WvncCallbacks *cb, void *arg)
+{
+    CliConn *conn = cliconn_tryOpen(host, passwdFile);
+
+    if( conn == NULL )
+        return NULL;
+    WvncClient *client = malloc(sizeof(WvncClient));
+    WvncDisplay *disp = malloc(sizeof(WvncDisplay));
+    client->conn = conn;
+    client->disp = NULL;
+    client->cb = *cb;
+    client->arg = arg;
+    client->isFailed = 0;
+    if( setjmp(client->errorJump) != 0 ) {
+        if( client->disp != NULL )
+            clidisp_close(client->disp);
+        else
+            free(disp);
+        cliconn_close(client->conn);
+        free(client);
+        return NULL;
+    }
+    cliconn_setErrorJump(client->conn, &client->errorJump);
+    if( pixelFormat != NULL ) {
+        client->pixelFormat = *pixelFormat;
+        cliconn_setPixelFormat(client->conn, pixelFormat);
+    }else
+        cliconn_getPixelFormat(client->conn, &client->pixelFormat);
+    disp->client = client;
+    clidisp_init(&disp->base, &gWvncBackend, cliconn_getWidth(client->conn),
+            cliconn_getHeight(client->conn));
+    client->disp = &disp->base;
+    clidisp_setServerPixelFormat(client->disp, &client->pixelFormat);
+    cliconn_setEncodings(client->conn, 1, 1, 0);
+    cliconn_sendFramebufferUpdateRequest(client->conn, 0);
+    return client;
+}
+
+int wvnc_getFd(const WvncClient *client)
+{
+    return cliconn_getFd(client->conn);
+}
+
+int wvnc_getWidth(const WvncClient *client)
+{
+    return clidisp_getWidth(client->disp);
+}
+
+int wvnc_getHeight(const WvncClient *client)
+{
+    return clidisp_getHeight(client->disp);
+}
+
+const char *wvnc_getName(const WvncClient *client)
+{
+    return cliconn_getName(client->conn);
+}
+
+void wvnc_setEncodings(WvncClient *client, int enableHextile, int enableZRLE)
+{
+    if( client->isFailed )
+        return;
+    // the error is reported by next wvnc_pump
+    if( setjmp(client->errorJump) != 0 ) {
+        client->isFailed = 1;
+        return;
+    }
+    cliconn_setEncodings(client->conn, enableHextile, enableZRLE, 0);
+}
+
+void wvnc_setRefreshRate(WvncClient *client, int refreshRate)
+{
+    cliconn_setRefreshRate(client->conn, refreshRate);
+}
+
+int wvnc_pump(WvncClient *client)
+{
+    struct pollfd pfd;
+    DisplayEvent ev;
+    int msg;
+
+    if( client->isFailed )
+        return -1;
+    if( setjmp(client->errorJump) != 0 ) {
+        client->isFailed = 1;
+        return -1;
+    }
+    if( ! cliconn_isDataQueued(client->conn) ) {
+        // readable without data queued means end of stream
+        pfd.fd = cliconn_getFd(client->conn);
+        pfd.events = POLLIN;
+        if( poll(&pfd, 1, 0) > 0 && cliconn_isReadReady(client->conn) ) {
+            client->isFailed = 1;
+            return -1;
+        }
+        return 0;
+    }
+    while( cliconn_isDataQueued(client->conn) ) {
+        msg = cliconn_nextEvent(client->conn, client->disp, &ev, 0);
+        switch( msg ) {
+        case -1:    // no message
+            break;
+        case 0:     // FramebufferUpdate
+            cliconn_recvFramebufferUpdate(client->conn, client->disp);
+            cliconn_sendFramebufferUpdateRequest(client->conn, 1);
+            break;
+        case 2:     // Bell
+            if( client->cb.bell != NULL )
+                client->cb.bell(client->arg);
+            break;
+        case 3:     // ServerCutText
+            cliconn_recvCutTextMsg(client->conn);
+            break;
+        default:
+            log_error("unsupported message %d", msg);
+            longjmp(client->errorJump, 1);
+        }
+    }
+    clidisp_flush(client->disp);
+    return 0;
+}
+
+int wvnc_sendPointer(WvncClient *client, int x, int y, unsigned buttonMask)
+{
+    VncPointerEvent pev;
+
+    if( client->isFailed )
+        return -1;
+    if( setjmp(client->errorJump) != 0 ) {
+        client->isFailed = 1;
+        return -1;
+    }
+    pev.buttonMask = buttonMask;
+    pev.x = x;
+    pev.y = y;
+    cliconn_sendPointerEvent(client->conn, &pev);
+    return 0;
+}
+
+int wvnc_sendKey(WvncClient *client, unsigned keysym, int isDown)
+{
+    VncKeyEvent kev;
+
+    if( client->isFailed )
+        return -1;
+    if( setjmp(client->errorJump) != 0 ) {
+        client->isFailed = 1;
+        return -1;
+    }
+    kev.isDown = isDown;
+    kev.keysym = keysym;
+    cliconn_sendKeyEvent(client->conn, &kev);
+    return 0;
+}
+
+void wvnc_close(WvncClient *client)
+{
+    clidisp_close(client->disp);
+    cliconn_close(client->conn);
+    free(client);
+}
@@ -0,0 +1,91 @@
+#ifndef WVNC_H
+#define WVNC_H
+
+#include "vnccommon.h"
+
+/* Embeddable VNC client (libwilqvnc). The caller runs the event loop: it
+ * waits for the descriptor returned by wvnc_getFd to become readable and
+ * calls wvnc_pump, which decodes the received updates into framebuffer
+ * memory provided by the caller and reports changed areas by callback.
+ * Updates are requested continuously, each one after the previous is
+ * received.
+ *
+ * Connection and protocol errors are returned to the caller, the client
+ * is unusable then and should be closed. Only wvnc_* symbols are exported
+ * from the shared library.
+ */
+#define WVNC_API __attribute__((visibility("default")))
+
+typedef struct WvncClient WvncClient;
+
+typedef struct {
+    /* Returns framebuffer memory for desktop of given size, in the pixel
+     * format given to wvnc_open. On desktop resize it is called for the
+     * new size while the old memory is still in use: the common part of
+     * the image is copied, then the old memory is released.
+     */
+    void *(*getFramebuffer)(void *arg, int width, int height,
+            int *bytesPerLine);
+
+    /* Releases framebuffer memory; may be NULL
+     */
+    void (*freeFramebuffer)(void *arg, void *pixels);
+
+    /* The area of framebuffer has been changed; may be NULL
+     */
+    void (*damage)(void *arg, int x, int y, int width, int height);
+
+    /* Bell message received; may be NULL
+     */
+    void (*bell)(void *arg);
+} WvncCallbacks;
+
+
+/* Connects to the host, given as host[:display], and performs the
+ * handshake; blocks until done. When pixelFormat is NULL, the one proposed
+ * by server is used. Callbacks are copied. Returns NULL on failure.
+ */
+WVNC_API WvncClient *wvnc_open(const char *host, const char *passwdFile,
+        const PixelFormat *pixelFormat, const WvncCallbacks*, void *arg);
+
+
+/* Returns the socket descriptor to wait for
+ */
+WVNC_API int wvnc_getFd(const WvncClient*);
+
+WVNC_API int wvnc_getWidth(const WvncClient*);
+WVNC_API int wvnc_getHeight(const WvncClient*);
+WVNC_API const char *wvnc_getName(const WvncClient*);
+
+
+/* Enables Hextile and ZRLE encodings; both are enabled by default
+ */
+WVNC_API void wvnc_setEncodings(WvncClient*, int enableHextile, int enableZRLE);
+
+
+/* Limits the rate of damage callbacks while updates arrive back to back;
+ * changes are reported at least at the end of every wvnc_pump
+ */
+WVNC_API void wvnc_setRefreshRate(WvncClient*, int refreshRate);
+
+
+/* Handles all messages received so far without waiting for more, except
+ * the rest of a message already started. Returns 0 on success, -1 when
+ * the server closed the connection or on error.
+ */
+WVNC_API int wvnc_pump(WvncClient*);
+
+
+/* Send input events. Return 0 on success, -1 on error.
+ */
+WVNC_API int wvnc_sendPointer(WvncClient*, int x, int y,
+        unsigned buttonMask);
+WVNC_API int wvnc_sendKey(WvncClient*, unsigned keysym, int isDown);
+
+
+/* Disconnects; the framebuffer memory is released by freeFramebuffer
+ */
+WVNC_API void wvnc_close(WvncClient*);
+
+
+#endif /* WVNC_H */